@@ -119,7 +119,8 @@ QGraphicsItem *cauv::image_to_scan_item(boost::filesystem::path file,
     load_sonar_image(file, image);
     std::cout << "Range: " << image.rangeEnd << "(" << image.rangeConversion << "m per bin)" << std::endl;
     auto mapping = get_polar_mapping(image);
-    auto map_mat = get_polar_to_cartesian_map(mapping, 10);
+    static PolarRemapCache remap_cache;
+    const cv::Mat &map_mat = remap_cache.floatMap(mapping, 10);
     auto mat = sonar_msg_to_mat(image);
     cv::Mat cartesian_mat(map_mat.rows, map_mat.cols, CV_8UC1);
     cv::remap(mat, cartesian_mat, map_mat, cv::Mat(), CV_INTER_LINEAR);
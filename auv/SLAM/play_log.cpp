@@ -40,6 +40,7 @@ int main(int argc, char **argv) {
         }
     }
     auto files = get_msg_files(image_directory);
+    PolarRemapCache remap_cache;
     int i = 0;
     for (auto &file: files) {
         if (i++ < start_frame) { continue; }
@@ -49,7 +50,7 @@ int main(int argc, char **argv) {
         load_sonar_image(file, image);
         std::cout << "Range: " << image.rangeEnd << "(" << image.rangeConversion << "m per bin)" << std::endl;
         auto polar_mapping = get_polar_mapping(image);
-        auto map_mat = get_polar_to_cartesian_map(polar_mapping, 10);
+        const cv::Mat &map_mat = remap_cache.floatMap(polar_mapping, 10);
         auto mat = sonar_msg_to_mat(image);
         std::cout << map_mat.rows << " " << map_mat.cols << std::endl;
         cv::Mat cartesian_mat(map_mat.rows, map_mat.cols, CV_8UC1);
@@ -8,6 +8,7 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/functional/hash.hpp>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -79,7 +80,7 @@ cauv::PolarMapping cauv::get_polar_mapping(cauv_slam::SonarImage &image) {
 }
 
 static cv::Vec2f get_bearing_range(const float x, const float y,
-                                   PolarMapping &m) {
+                                   const PolarMapping &m) {
 
     static const float pi = boost::math::constants::pi<float>();
     float range = std::sqrt(y*y + x*x);
@@ -88,32 +89,87 @@ static cv::Vec2f get_bearing_range(const float x, const float y,
     }
     size_t n_bearings = m.bearings.size();
     float bearing = (std::atan2(y, x) - pi / 2.0) / 2.0 / pi * 6400.0 * 0x10000;
-    for (size_t i = 0; i < n_bearings; i++) {
-        if (m.bearings[i] > bearing) {
-            if (i == 0) {
-                return cv::Vec2f(-1.0, -1.0);
-            }
-            if (i == n_bearings - 1) {
-                return cv::Vec2f(-1.0, -1.0);
-            }
-            bearing = (float)i + (bearing - m.bearings[i - 1]) / (m.bearings[i] - m.bearings[i - 1]); 
-            return cv::Vec2f(bearing, range - m.rangeStart);
-        }
+    //bearings are monotonically increasing, so find the first one greater
+    //than this bearing by binary search
+    auto it = std::upper_bound(m.bearings.begin(), m.bearings.end(), bearing,
+                               [](float b, int mb) { return b < mb; });
+    size_t i = it - m.bearings.begin();
+    if (i == 0 || i >= n_bearings - 1) {
+        return cv::Vec2f(-1.0, -1.0);
     }
-    return cv::Vec2f(-1.0, -1.0);
+    bearing = (float)i + (bearing - m.bearings[i - 1]) / (m.bearings[i] - m.bearings[i - 1]); 
+    return cv::Vec2f(bearing, range - m.rangeStart);
 }
 
-cv::Mat cauv::get_polar_to_cartesian_map(PolarMapping &m, float scale) {
+static cv::Mat build_polar_to_cartesian_map(const PolarMapping &m, float scale) {
     int width = m.rangeEnd * 2 * scale;
     int height = m.rangeEnd * scale;
     cv::Mat map(height, width, CV_32FC2);
-    for (int ii = 0; ii < width; ii++) {
-        for (int jj = 0; jj < height; jj++) {
+    for (int jj = 0; jj < height; jj++) {
+        cv::Vec2f *row = map.ptr<cv::Vec2f>(jj);
+        for (int ii = 0; ii < width; ii++) {
             auto point = get_bearing_range((ii - width / 2) / scale,
                                            jj / scale, m);
             point[1] /= m.rangeConversion;
-            map.at<cv::Vec2f>(jj, ii) = point;
+            row[ii] = point;
         }
     }
     return map;
 }
+
+cv::Mat cauv::get_polar_to_cartesian_map(PolarMapping &m, float scale) {
+    return build_polar_to_cartesian_map(m, scale);
+}
+
+cauv::PolarRemapCache::PolarRemapCache(size_t max_entries) :
+    max_entries(max_entries) {
+}
+
+cauv::PolarRemapCache::Entry &cauv::PolarRemapCache::lookup(const PolarMapping &m, float scale) {
+    size_t bearings_hash = boost::hash_range(m.bearings.begin(), m.bearings.end());
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->rangeStart == m.rangeStart &&
+            it->rangeEnd == m.rangeEnd &&
+            it->rangeConversion == m.rangeConversion &&
+            it->scale == scale &&
+            it->bearings_hash == bearings_hash &&
+            it->bearings == m.bearings) {
+            entries.splice(entries.begin(), entries, it);
+            return entries.front();
+        }
+    }
+    Entry entry;
+    entry.rangeStart = m.rangeStart;
+    entry.rangeEnd = m.rangeEnd;
+    entry.rangeConversion = m.rangeConversion;
+    entry.scale = scale;
+    entry.bearings_hash = bearings_hash;
+    entry.bearings = m.bearings;
+    entry.float_map = build_polar_to_cartesian_map(m, scale);
+    entries.push_front(entry);
+    while (entries.size() > max_entries) {
+        entries.pop_back();
+    }
+    return entries.front();
+}
+
+const cv::Mat &cauv::PolarRemapCache::floatMap(const PolarMapping &m, float scale) {
+    return lookup(m, scale).float_map;
+}
+
+void cauv::PolarRemapCache::fixedPointMap(const PolarMapping &m, float scale,
+                                          cv::Mat &map1, cv::Mat &map2) {
+    Entry &entry = lookup(m, scale);
+    if (entry.fixed_map1.empty()) {
+        cv::convertMaps(entry.float_map, cv::Mat(), entry.fixed_map1, entry.fixed_map2, CV_16SC2);
+    }
+    map1 = entry.fixed_map1;
+    map2 = entry.fixed_map2;
+}
+
+void cauv::PolarRemapCache::remap(const cv::Mat &polar, cv::Mat &cartesian,
+                                  const PolarMapping &m, float scale, int interpolation) {
+    cv::Mat map1, map2;
+    fixedPointMap(m, scale, map1, map2);
+    cv::remap(polar, cartesian, map1, map2, interpolation);
+}
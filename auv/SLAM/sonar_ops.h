@@ -1,6 +1,8 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <list>
+#include <cstddef>
 
 #include <boost/filesystem.hpp>
 
@@ -54,4 +56,40 @@ cv::Mat sonar_msg_to_mat(cauv_slam::SonarImage& image);
 
 cv::Mat get_polar_to_cartesian_map(PolarMapping &m, float scale);
 
+//Builds and remembers remap tables for get_polar_to_cartesian_map, so that
+//images with the same mapping (the Gemini bearing table is the same every
+//ping) only pay for building the map once.
+class PolarRemapCache {
+    public:
+    PolarRemapCache(size_t max_entries = 4);
+
+    //CV_32FC2 map, as from get_polar_to_cartesian_map
+    const cv::Mat &floatMap(const PolarMapping &m, float scale);
+    //fixed point (CV_16SC2 + CV_16UC1 interpolation weights) version of the
+    //same map, which cv::remap handles considerably faster
+    void fixedPointMap(const PolarMapping &m, float scale, cv::Mat &map1, cv::Mat &map2);
+
+    //remap a polar image to cartesian using the fixed point map
+    void remap(const cv::Mat &polar, cv::Mat &cartesian,
+               const PolarMapping &m, float scale, int interpolation);
+
+    private:
+    struct Entry {
+        float rangeStart;
+        float rangeEnd;
+        float rangeConversion;
+        float scale;
+        size_t bearings_hash;
+        std::vector<int> bearings;
+        cv::Mat float_map;
+        cv::Mat fixed_map1;
+        cv::Mat fixed_map2;
+    };
+    Entry &lookup(const PolarMapping &m, float scale);
+
+    size_t max_entries;
+    //most recently used first
+    std::list<Entry> entries;
+};
+
 }
@@ -13,9 +13,8 @@ std::vector<GlobalCartFeature>
 SURFExtractor::extractFeatures(cv::Mat polarImage, PolarMapping &mapping) {
     auto detector = cv::SURF(300, 4, 2, false, true);
     const float scale = 10;
-    auto map_mat = get_polar_to_cartesian_map(mapping, scale);
-    cv::Mat cartesian_mat(map_mat.rows, map_mat.cols, CV_8UC1);
-    cv::remap(polarImage, cartesian_mat, map_mat, cv::Mat(), CV_INTER_LINEAR);
+    cv::Mat cartesian_mat;
+    remap_cache.remap(polarImage, cartesian_mat, mapping, scale, CV_INTER_LINEAR);
     cv::Mat descriptors;
     std::vector<cv::KeyPoint> points;
     detector(cartesian_mat, cv::noArray(), points, descriptors);
@@ -8,6 +8,7 @@ class SURFExtractor: public GlobalFeatureExtractor {
     public:
     virtual std::vector<GlobalCartFeature> extractFeatures(cv::Mat polarImage, PolarMapping &mapping);
     private:
+    PolarRemapCache remap_cache;
 };
 
 }
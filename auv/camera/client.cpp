@@ -18,6 +18,24 @@
 
 using namespace cauv;
 
+static boost::shared_ptr<boost::asio::ip::tcp::socket> connectToServer(
+    boost::asio::io_service& service, uint32_t port
+){
+    typedef boost::asio::ip::tcp tcp;
+    boost::shared_ptr<tcp::socket> s = boost::make_shared<tcp::socket>(boost::ref(service));
+
+    tcp::resolver r(service);
+    tcp::resolver::query q(tcp::v4(), "localhost", mkStr() << port);
+    tcp::resolver::iterator it = r.resolve(q);
+    boost::system::error_code e;
+    s->connect(*it, e);
+    if(e){
+        error() << "Could not connect socket:" << e;
+        s.reset();
+    }
+    return s;
+}
+
 ImageWrapper::ImageWrapper(SharedImage* s)
     : m_shared_image(s){
 }
@@ -82,20 +100,125 @@ SharedImage* CameraServerConnection::getUnGuardedImage(uint32_t camera_id, uint3
 }
 
 void CameraServerConnection::reInit(){
-    m_socket = boost::make_shared<tcp::socket>(boost::ref(m_service));
-
-    tcp::resolver r(m_service);
-    tcp::resolver::query q(tcp::v4(), "localhost", mkStr() << m_port);
-    tcp::resolver::iterator it = r.resolve(q);
-    boost::system::error_code e;
-    m_socket->connect(*it, e);
-    if(e){
-        error() << "Could not connect socket:" << e;
-        m_socket.reset();
+    m_socket = connectToServer(m_service, m_port);
+    if(!m_socket)
         return;
-    }
     
     m_segment = boost::interprocess::managed_shared_memory(
         boost::interprocess::open_only, SHMEM_SEGMENT_NAME
     );
 }
+
+
+StreamFrame::StreamFrame(SharedImageSlot* s, uint64_t seq, boost::shared_ptr<CameraStream> stream)
+    : m_slot(s), m_seq(seq), m_stream(stream){
+}
+
+StreamFrame::~StreamFrame(){
+    __atomic_sub_fetch(&m_slot->pinned, 1, __ATOMIC_SEQ_CST);
+}
+
+cv::Mat StreamFrame::mat(){
+    return cv::Mat(
+        m_slot->image.height,
+        m_slot->image.width,
+        m_slot->image.type,
+        &(m_slot->image.bytes[0]),
+        m_slot->image.pitch
+    );
+}
+
+uint64_t StreamFrame::seq() const{
+    return m_seq;
+}
+
+int64_t StreamFrame::captureStartNs() const{
+    return m_slot->capture_start_ns;
+}
+
+int64_t StreamFrame::publishedNs() const{
+    return m_slot->published_ns;
+}
+
+
+CameraStream::CameraStream(int32_t camera_id, uint32_t w, uint32_t h)
+    : m_service(),
+      m_socket(connectToServer(m_service, CAMERA_SERVER_PORT)),
+      m_segment(),
+      m_ring(NULL){
+    if(!m_socket)
+        throw std::runtime_error("could not connect to camera server");
+
+    ImageRequest req = {
+        camera_id, w, h, Image_Request_Stream
+    };
+    boost::asio::write(*m_socket, boost::asio::buffer((uint8_t*)&req, sizeof(req)));
+
+    InfoResponse resp;
+    size_t reply_length = boost::asio::read(
+        *m_socket, boost::asio::buffer(&resp, sizeof(resp))
+    );
+    if(reply_length != sizeof(resp) || resp.image_offset == 0)
+        throw std::runtime_error("could not start image stream");
+
+    // the server has created the stream's segment by the time it replies
+    m_segment = boost::interprocess::managed_shared_memory(
+        boost::interprocess::open_only, streamSegmentName(camera_id, w, h).c_str()
+    );
+    m_ring = (SharedImageRing*) m_segment.get_address_from_handle(
+        handle_t(resp.image_offset)
+    );
+    debug(2) << "camera stream" << camera_id << w << "x" << h << ":"
+             << m_ring->num_slots << "slots of" << m_ring->slot_size << "bytes";
+}
+
+boost::shared_ptr<StreamFrame> CameraStream::nextFrame(uint64_t after_seq, int timeout_ms){
+    const int64_t deadline = sharedClockNanoSecs() + int64_t(timeout_ms) * 1000000;
+    for(;;){
+        boost::shared_ptr<StreamFrame> r = _pinLatest(after_seq);
+        if(r || stopped())
+            return r;
+
+        const int64_t remaining_ms = (deadline - sharedClockNanoSecs()) / 1000000;
+        if(remaining_ms <= 0)
+            return r;
+
+        // register as a waiter before checking for a new frame one last
+        // time: the server checks for waiters after publishing
+        __atomic_add_fetch(&m_ring->waiters, 1, __ATOMIC_SEQ_CST);
+        const uint32_t generation = __atomic_load_n(&m_ring->generation, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&m_ring->latest_seq, __ATOMIC_SEQ_CST) <= after_seq)
+            sharedWordWait(&m_ring->generation, generation, remaining_ms);
+        __atomic_sub_fetch(&m_ring->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Pin the slot holding the newest frame. The pin must be made before the
+// slot's seq is checked: see CameraManager::Stream::_claimSlot
+boost::shared_ptr<StreamFrame> CameraStream::_pinLatest(uint64_t after_seq){
+    for(;;){
+        const uint64_t seq = __atomic_load_n(&m_ring->latest_seq, __ATOMIC_ACQUIRE);
+        if(seq == 0 || seq <= after_seq)
+            return boost::shared_ptr<StreamFrame>();
+        SharedImageSlot *s = m_ring->slot(
+            __atomic_load_n(&m_ring->latest_slot, __ATOMIC_ACQUIRE)
+        );
+        __atomic_add_fetch(&s->pinned, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == seq){
+            if(seq > after_seq + 1)
+                debug(6) << "camera stream: skipped" << seq - after_seq - 1 << "frames";
+            return boost::make_shared<StreamFrame>(s, seq, shared_from_this());
+        }
+        // a newer frame has been published since latest_seq was read: try
+        // again
+        __atomic_sub_fetch(&s->pinned, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+uint64_t CameraStream::dropped() const{
+    return __atomic_load_n(&m_ring->dropped, __ATOMIC_RELAXED);
+}
+
+bool CameraStream::stopped() const{
+    return __atomic_load_n(&m_ring->stopped, __ATOMIC_ACQUIRE);
+}
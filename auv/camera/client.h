@@ -11,12 +11,16 @@
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
 
 #include <opencv2/core/core.hpp>
 
 namespace cauv{
 
 struct SharedImage;
+struct SharedImageSlot;
+struct SharedImageRing;
+class CameraStream;
 
 struct ImageWrapper: boost::noncopyable{
     ImageWrapper(SharedImage* s);
@@ -44,6 +48,60 @@ class CameraServerConnection{
         boost::interprocess::managed_shared_memory m_segment;
 };
 
+/* A frame from a CameraStream: the server won't reuse the memory holding it
+ * until this has been destroyed, so don't hold on to it for longer than
+ * necessary.
+ */
+struct StreamFrame: boost::noncopyable{
+    StreamFrame(SharedImageSlot* s, uint64_t seq, boost::shared_ptr<CameraStream> stream);
+    ~StreamFrame();
+    cv::Mat mat();
+
+    // frame numbers increase by one for each frame captured
+    uint64_t seq() const;
+    // CLOCK_MONOTONIC nanoseconds when capture started, and when the frame
+    // was made available to readers
+    int64_t captureStartNs() const;
+    int64_t publishedNs() const;
+
+    SharedImageSlot* m_slot;
+    uint64_t m_seq;
+    boost::shared_ptr<CameraStream> m_stream;
+};
+
+/* Frames captured continuously by the camera server (see server.h): after
+ * the initial request no socket traffic is needed to get a frame.
+ */
+class CameraStream: public boost::enable_shared_from_this<CameraStream>,
+                    boost::noncopyable{
+    typedef boost::asio::ip::tcp tcp;
+    typedef boost::interprocess::managed_shared_memory::handle_t handle_t;
+    public:
+        CameraStream(int32_t camera_id, uint32_t w, uint32_t h);
+
+        /* The newest frame, provided that it is newer than after_seq,
+         * waiting up to timeout_ms for one if necessary. Any frames between
+         * after_seq and the returned one are skipped. Returns NULL if no
+         * frame arrives in time.
+         */
+        boost::shared_ptr<StreamFrame> nextFrame(uint64_t after_seq, int timeout_ms);
+
+        /* frames the server dropped because readers held all of its slots */
+        uint64_t dropped() const;
+
+        /* true if the server has stopped capturing into this stream */
+        bool stopped() const;
+
+    private:
+        boost::shared_ptr<StreamFrame> _pinLatest(uint64_t after_seq);
+
+        boost::asio::io_service m_service;
+        // the server keeps capturing for as long as this is connected
+        boost::shared_ptr<tcp::socket> m_socket;
+        boost::interprocess::managed_shared_memory m_segment;
+        SharedImageRing *m_ring;
+};
+
 
 } // namespace cauv
 
@@ -6,6 +6,10 @@
 
 #include "server.h"
 
+#include <cstring>
+
+#include <unistd.h>
+
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/ref.hpp>
@@ -55,9 +59,14 @@ void CameraClientConnection::handleWrite(bs::error_code const& e){
 
 void CameraClientConnection::handleRead(bs::error_code const& e, size_t s){
     if (!e && s == sizeof(m_temp_image_request)){
-        m_camera_manager.getImage(
-            m_temp_response_data, m_current_images, m_temp_image_request, this
-        );
+        if(m_temp_image_request.flags & Image_Request_Stream)
+            m_camera_manager.getStream(
+                m_temp_response_data, m_temp_image_request, this
+            );
+        else
+            m_camera_manager.getImage(
+                m_temp_response_data, m_current_images, m_temp_image_request, this
+            );
         boost::asio::async_write(
             m_socket,
             boost::asio::buffer((uint8_t*)&m_temp_response_data, sizeof(m_temp_response_data)),
@@ -102,6 +111,8 @@ CameraManager::CameraManager()
     );
 }
 CameraManager::~CameraManager(){
+    // stop the stream threads while the cameras and segment still exist
+    m_streams.clear();
     boost::interprocess::shared_memory_object::remove(SHMEM_SEGMENT_NAME);
 }
 
@@ -109,6 +120,7 @@ void CameraManager::getImage(InfoResponse& resp,
                              std::list<uint64_t>& active_images,
                              ImageRequest const& req,
                              CameraClientConnection *c){
+    boost::lock_guard<boost::mutex> l(m_cameras_mux);
     // check we have the requested camera open:
     if(!m_open_cameras.count(req.camera_id)){
         // !!! TODO: in some circumstances OpenCV has been known to open a
@@ -177,7 +189,44 @@ void CameraManager::getImage(InfoResponse& resp,
     m_camera_users[req.camera_id].insert(c);
 }
 
+void CameraManager::getStream(InfoResponse& resp,
+                              ImageRequest const& req,
+                              CameraClientConnection *c){
+    const stream_key_t key(req.camera_id, std::make_pair(req.w, req.h));
+    if(!m_streams.count(key)){
+        try{
+            m_streams[key] = boost::make_shared<Stream>(boost::ref(*this), boost::cref(req));
+        }catch(boost::interprocess::interprocess_exception &e){
+            error() << "could not allocate image stream!" << e.what();
+            resp.image_offset = 0;
+            return;
+        }
+        std::cout << BashColour::Green << "+" << BashColour::None << std::flush;
+    }
+
+    resp.image_offset = m_streams[key]->handle();
+    m_stream_users[key].insert(c);
+    m_camera_users[req.camera_id].insert(c);
+}
+
 void CameraManager::didClose(CameraClientConnection *c){
+    // stop any streams nobody wants any more first: stream threads capture
+    // with m_cameras_mux held, so they must be stopped before it's locked
+    std::vector< boost::shared_ptr<Stream> > streams_for_closing;
+    std::map<stream_key_t, std::set<CameraClientConnection*> >::iterator j;
+    for(j = m_stream_users.begin(); j != m_stream_users.end();){
+        j->second.erase(c);
+        if(!j->second.size()){
+            streams_for_closing.push_back(m_streams[j->first]);
+            m_streams.erase(j->first);
+            m_stream_users.erase(j++);
+        }else{
+            j++;
+        }
+    }
+    streams_for_closing.clear();
+
+    boost::lock_guard<boost::mutex> l(m_cameras_mux);
     std::vector<uint32_t> cameras_for_closing;
     std::map<uint32_t, std::set<CameraClientConnection*> >::iterator i;
     for(i = m_camera_users.begin(); i != m_camera_users.end(); i++){
@@ -199,6 +248,20 @@ void CameraManager::release(std::list<uint64_t> const& images){
     }
 }
 
+bool CameraManager::capture(ImageRequest const& req, uint8_t *p, uint32_t& pitch, int32_t type){
+    boost::lock_guard<boost::mutex> l(m_cameras_mux);
+    if(!m_open_cameras.count(req.camera_id))
+        m_open_cameras[req.camera_id] = openCam(req);
+
+    boost::shared_ptr<Capture> cap = m_open_cameras[req.camera_id];
+    if(!cap->ok()){
+        m_open_cameras.erase(req.camera_id);
+        return false;
+    }
+    cap->captureToMem(p, pitch, req.w, req.h, type);
+    return true;
+}
+
 boost::shared_ptr<CameraManager::Capture> CameraManager::openCam(ImageRequest const& req){
     #ifdef CAUV_USE_DC1394
     if(req.camera_id < 0)
@@ -207,6 +270,132 @@ boost::shared_ptr<CameraManager::Capture> CameraManager::openCam(ImageRequest co
     return boost::make_shared<CVCapture>(req.camera_id);
 }
 
+// CameraManager::Stream
+CameraManager::Stream::Stream(CameraManager& manager, ImageRequest const& req)
+    : m_manager(manager),
+      m_req(req),
+      m_segment_name(streamSegmentName(req.camera_id, req.w, req.h)),
+      m_segment(),
+      m_ring(NULL),
+      m_stop(false),
+      m_thread(){
+    // slots are cache-line aligned, so that the server writing one frame
+    // doesn't disturb readers of the others
+    uint64_t slot_size = offsetof(SharedImageSlot, image) +
+                         offsetof(SharedImage, bytes) + uint64_t(req.w+4)*req.h*3;
+    slot_size += 63;
+    slot_size -= (slot_size % 64);
+    uint32_t slots_offset = sizeof(SharedImageRing) + 63;
+    slots_offset -= (slots_offset % 64);
+    const uint64_t ring_size = slots_offset + Stream_Slots * slot_size;
+
+    // a segment left behind by a server that didn't exit cleanly would have
+    // the wrong size
+    boost::interprocess::shared_memory_object::remove(m_segment_name.c_str());
+    try{
+        m_segment = boost::interprocess::managed_shared_memory(
+            boost::interprocess::create_only, m_segment_name.c_str(),
+            ring_size + Stream_Segment_Overhead
+        );
+        m_ring = (SharedImageRing*) m_segment.allocate(ring_size);
+    }catch(boost::interprocess::interprocess_exception&){
+        boost::interprocess::shared_memory_object::remove(m_segment_name.c_str());
+        throw;
+    }
+    std::memset(m_ring, 0, ring_size);
+    m_ring->num_slots = Stream_Slots;
+    m_ring->slot_size = slot_size;
+    m_ring->slots_offset = slots_offset;
+
+    m_thread = boost::thread(boost::bind(&Stream::_run, this));
+}
+
+CameraManager::Stream::~Stream(){
+    m_stop = true;
+    m_thread.join();
+    // wake up anyone still waiting, so that they notice the stream stopping
+    __atomic_store_n(&m_ring->stopped, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&m_ring->generation, 1, __ATOMIC_SEQ_CST);
+    sharedWordWakeAll(&m_ring->generation);
+    std::cout << BashColour::Red << "-" << BashColour::None << std::flush;
+    debug() << "stream stopped:" << m_ring->latest_seq << "frames,"
+            << m_ring->dropped << "dropped because all slots were in use";
+    // clients that still have the segment mapped keep it until they unmap
+    // it: this only removes the name
+    boost::interprocess::shared_memory_object::remove(m_segment_name.c_str());
+}
+
+CameraManager::handle_t CameraManager::Stream::handle() const{
+    return m_segment.get_handle_from_address((void*)m_ring);
+}
+
+// Claim the oldest slot that no reader has pinned, and that doesn't hold
+// the newest frame. The slot's seq is cleared before checking that it isn't
+// pinned, and readers pin before checking seq, so either the reader sees
+// the slot being overwritten, or this sees the reader's pin.
+SharedImageSlot* CameraManager::Stream::_claimSlot(uint64_t& previous_seq){
+    const uint32_t latest = __atomic_load_n(&m_ring->latest_slot, __ATOMIC_ACQUIRE);
+    SharedImageSlot *oldest = NULL;
+    for(uint32_t i = 0; i < m_ring->num_slots; i++){
+        if(i == latest)
+            continue;
+        SharedImageSlot *s = m_ring->slot(i);
+        if(__atomic_load_n(&s->pinned, __ATOMIC_ACQUIRE))
+            continue;
+        if(!oldest || s->seq < oldest->seq)
+            oldest = s;
+    }
+    if(!oldest)
+        return NULL;
+
+    previous_seq = oldest->seq;
+    __atomic_store_n(&oldest->seq, 0, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&oldest->pinned, __ATOMIC_SEQ_CST)){
+        // lost the race with a reader: it can keep the old frame
+        __atomic_store_n(&oldest->seq, previous_seq, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+    return oldest;
+}
+
+void CameraManager::Stream::_run(){
+    const int32_t cap_type = CV_8UC3;
+    uint64_t seq = 0;
+    while(!m_stop){
+        uint64_t previous_seq = 0;
+        SharedImageSlot *s = _claimSlot(previous_seq);
+        if(!s){
+            // every slot is in use: readers are holding on to frames for too
+            // long, so drop this one
+            __atomic_add_fetch(&m_ring->dropped, 1, __ATOMIC_RELAXED);
+            usleep(5000);
+            continue;
+        }
+
+        s->capture_start_ns = sharedClockNanoSecs();
+        if(!m_manager.capture(m_req, &(s->image.bytes[0]), s->image.pitch, cap_type)){
+            std::cout << BashColour::Red << "!";
+            debug() << "capture not available!";
+            usleep(100000);
+            continue;
+        }
+        s->image.width = m_req.w;
+        s->image.height = m_req.h;
+        s->image.type = cap_type;
+        s->image.lock = 0;
+        s->published_ns = sharedClockNanoSecs();
+
+        // publish: the frame data must be visible before the new seq is
+        __atomic_store_n(&s->seq, ++seq, __ATOMIC_RELEASE);
+        const uint32_t slot_index = ((uint8_t*)s - (uint8_t*)m_ring->slot(0)) / m_ring->slot_size;
+        __atomic_store_n(&m_ring->latest_slot, slot_index, __ATOMIC_RELEASE);
+        __atomic_store_n(&m_ring->latest_seq, seq, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&m_ring->generation, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&m_ring->waiters, __ATOMIC_SEQ_CST))
+            sharedWordWakeAll(&m_ring->generation);
+    }
+}
+
 // CameraManager::CVCapture
 CameraManager::CVCapture::CVCapture(int32_t cam_id)
     : cv::VideoCapture(cam_id){
@@ -10,10 +10,14 @@
 #include <list>
 #include <map>
 #include <set>
+#include <string>
+#include <atomic>
 
 #include <boost/asio.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/shared_ptr.hpp> 
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <opencv2/highgui/highgui.hpp>
 
@@ -44,6 +48,24 @@
  * It may be advantageous to share images (if two requests are almost
  * coincident), if performance dictates this.
  *
+ * Streaming:
+ *
+ * Each request above costs a round trip through this server, and the camera
+ * is only asked for a frame once the request arrives, so the frame rate a
+ * client sees is limited by the capture latency. Instead, a client can send
+ * a single ImageRequest with the Image_Request_Stream flag set:
+ *  1) the server replies with an InfoResponse, whose image_offset is the
+ *     handle of a SharedImageRing (see server_shared.h), in a segment of
+ *     the stream's own named by streamSegmentName(), which is sized for
+ *     the requested width and height
+ *  2) the server captures continuously from the camera into the ring, on its
+ *     own thread, until every client that requested that stream has closed
+ *     its connection
+ *  3) the client reads the newest frame directly from the ring, waiting on
+ *     the ring's futex for new frames: no further socket traffic is needed.
+ *
+ * Clients requesting the same camera, width and height share a ring.
+ *
  */
 
 namespace cauv{
@@ -84,6 +106,11 @@ class CameraManager{
         typedef boost::interprocess::managed_shared_memory::handle_t handle_t;
         // used to determine the size of shared memory segment to create
         const static uint32_t Max_Concurrent_Images = 10;
+        // frames in each stream's ring: enough for the reader to hold one
+        // or two while the server captures into another
+        const static uint32_t Stream_Slots = 4;
+        // room in each stream's segment for the segment's own bookkeeping
+        const static uint32_t Stream_Segment_Overhead = 64 * 1024;
     public:
         CameraManager();
         ~CameraManager();
@@ -111,8 +138,22 @@ class CameraManager{
                       ImageRequest const& req,
                       CameraClientConnection *c);
         
+        /* getStream:
+         *      resp: (out) set to the handle of the SharedImageRing that
+         *                  frames of the requested size from the requested
+         *                  camera are being captured into, or 0 on failure.
+         *                  The ring is in the stream's own segment (see
+         *                  streamSegmentName()).
+         *      req: (in)   information about what images are desired
+         *      c: (in)     capture continues until every connection that
+         *                  requested the stream has closed.
+         */
+        void getStream(InfoResponse& resp,
+                       ImageRequest const& req,
+                       CameraClientConnection *c);
+
         /* Record that c has closed, and that it should not be regarded as
-         * using any cameras any more.
+         * using any cameras (or streams) any more.
          */
         void didClose(CameraClientConnection *c);
         
@@ -154,12 +195,47 @@ class CameraManager{
         };
         #endif // def CAUV_USE_DC1394
 
+        // captures continuously from one camera into a SharedImageRing, in
+        // a shared memory segment of its own
+        class Stream{
+            public:
+                // throws boost::interprocess::interprocess_exception if the
+                // segment can't be created
+                Stream(CameraManager& manager, ImageRequest const& req);
+                ~Stream();
+
+                // of the ring, in the stream's segment
+                handle_t handle() const;
+
+            private:
+                void _run();
+                SharedImageSlot* _claimSlot(uint64_t& previous_seq);
+
+                CameraManager& m_manager;
+                const ImageRequest m_req;
+                const std::string m_segment_name;
+                boost::interprocess::managed_shared_memory m_segment;
+                SharedImageRing* m_ring;
+                std::atomic<bool> m_stop;
+                boost::thread m_thread;
+        };
+        typedef std::pair<int32_t, std::pair<uint32_t, uint32_t> > stream_key_t;
+
         static boost::shared_ptr<Capture> openCam(ImageRequest const& req);
         
+        /* capture into p from camera req.camera_id, opening it if
+         * necessary: false if the camera isn't available
+         */
+        bool capture(ImageRequest const& req, uint8_t *p, uint32_t& pitch, int32_t type);
 
         boost::interprocess::managed_shared_memory m_segment;
         std::map<uint32_t, boost::shared_ptr<Capture> > m_open_cameras;
         std::map<uint32_t, std::set<CameraClientConnection*> > m_camera_users;
+        std::map<stream_key_t, boost::shared_ptr<Stream> > m_streams;
+        std::map<stream_key_t, std::set<CameraClientConnection*> > m_stream_users;
+        // protects m_open_cameras, and the cameras themselves, which are
+        // used both by stream threads and by the thread handling requests
+        boost::mutex m_cameras_mux;
 };
 
 class CameraServer{
@@ -7,6 +7,19 @@
 #ifndef __CAUV_CAMERA_SERVER_SHARED_H__
 #define __CAUV_CAMERA_SERVER_SHARED_H__
 
+#include <string>
+#include <sstream>
+
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif // def __linux__
+
 #define SHMEM_SEGMENT_NAME "uk.co.cauv.shared.cameras"
 #define CAMERA_SERVER_PORT 16708
 
@@ -14,12 +27,19 @@ namespace cauv{
 
 typedef volatile uint32_t* lock_ptr;
 
+enum ImageRequestFlags{
+    // continuously capture into a SharedImageRing instead of capturing a
+    // single image
+    Image_Request_Stream = 1
+};
+
 // +ve IDs are OpenCV cameras, -ve IDs are libdc1394 cameras (if available)
 // TODO: try to interpret IDs as dc1394 GUIDs first
 struct ImageRequest{
     int32_t camera_id;
     uint32_t w;
     uint32_t h;
+    uint32_t flags;
 };
 
 struct InfoResponse{
@@ -37,6 +57,95 @@ struct SharedImage{
     uint8_t bytes[1];
 };
 
+/* Streaming (see server.h):
+ *
+ * The server captures continuously into a ring of slots, each holding a
+ * SharedImage. Every captured frame gets the next sequence number, and the
+ * ring's latest_seq / latest_slot are updated once the frame is complete.
+ * A reader pins a slot while it is using the image in it, and the server
+ * never writes into a pinned slot: if every slot is pinned the frame is
+ * dropped. Readers that fall behind just take the newest frame, so they
+ * skip frames rather than see old ones.
+ *
+ * All fields are only accessed with the __atomic builtins.
+ */
+struct SharedImageSlot{
+    // sequence number of the frame in this slot: 0 while it is being written
+    uint64_t seq;
+    // number of readers using this slot
+    int32_t pinned;
+    int32_t padding;
+    // CLOCK_MONOTONIC nanoseconds (see sharedClockNanoSecs) when the capture
+    // of this frame started, and when it was published
+    int64_t capture_start_ns;
+    int64_t published_ns;
+    SharedImage image;
+};
+
+struct SharedImageRing{
+    uint32_t num_slots;
+    uint32_t slot_size;
+    // offset in bytes of slot 0 from the start of this structure
+    uint32_t slots_offset;
+    // set by the server when it stops capturing into this ring
+    uint32_t stopped;
+
+    uint64_t latest_seq;
+    uint32_t latest_slot;
+    // futex word: incremented whenever a frame is published
+    uint32_t generation;
+    // readers blocked waiting for generation to change
+    int32_t waiters;
+    int32_t padding;
+    // frames not captured because every slot was pinned
+    uint64_t dropped;
+
+    SharedImageSlot* slot(uint32_t i){
+        return (SharedImageSlot*)((uint8_t*)this + slots_offset + i * slot_size);
+    }
+};
+
+/* Each stream's ring is in a shared memory segment of its own, sized for the
+ * stream's frames, rather than in SHMEM_SEGMENT_NAME
+ */
+inline std::string streamSegmentName(int32_t camera_id, uint32_t w, uint32_t h){
+    std::ostringstream s;
+    s << SHMEM_SEGMENT_NAME << ".stream." << camera_id << "." << w << "x" << h;
+    return s.str();
+}
+
+inline int64_t sharedClockNanoSecs(){
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+/* Wait until *word != expected, or timeout_ms has elapsed. May return
+ * early: callers must check whatever condition they're waiting for again.
+ */
+inline void sharedWordWait(uint32_t* word, uint32_t expected, int timeout_ms){
+    #ifdef __linux__
+    timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+    // the ring is shared between processes, so no FUTEX_PRIVATE_FLAG
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+    #else
+    // no futexes: poll
+    if(__atomic_load_n(word, __ATOMIC_ACQUIRE) == expected){
+        timespec t = {0, 1000000};
+        nanosleep(&t, NULL);
+    }
+    (void) timeout_ms;
+    #endif // def __linux__
+}
+
+inline void sharedWordWakeAll(uint32_t* word){
+    #ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    #else
+    (void) word;
+    #endif // def __linux__
+}
+
 
 } // namespace cauv
 
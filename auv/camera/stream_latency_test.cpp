@@ -0,0 +1,92 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include "client.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+
+#include <debug/cauv_debug.h>
+
+#include "server_shared.h"
+
+using namespace cauv;
+
+// Measures end-to-end latency of streamed camera frames: from the server
+// starting to capture a frame, and from it publishing the frame, to this
+// process having the frame mapped.
+//
+// usage: camera_stream_latency_test [camera id] [width] [height] [frames]
+
+static float percentile(std::vector<float> v, float p){
+    if(v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size()-1, size_t(p * v.size()))];
+}
+
+static void report(std::string const& name, std::vector<float> const& v){
+    float sum = 0;
+    for(float f : v)
+        sum += f;
+    info() << name << "(ms): mean" << (v.size()? sum / v.size() : 0)
+           << "p50" << percentile(v, 0.5)
+           << "p99" << percentile(v, 0.99)
+           << "max" << percentile(v, 1.0);
+}
+
+int main(int argc, char** argv){
+    const int32_t camera_id = argc > 1? std::atoi(argv[1]) : 0;
+    const uint32_t w = argc > 2? std::atoi(argv[2]) : 640;
+    const uint32_t h = argc > 3? std::atoi(argv[3]) : 480;
+    const uint32_t N = argc > 4? std::atoi(argv[4]) : 300;
+    try{
+        boost::shared_ptr<CameraStream> stream = boost::make_shared<CameraStream>(camera_id, w, h);
+
+        std::vector<float> capture_to_consumer;
+        std::vector<float> publish_to_consumer;
+        capture_to_consumer.reserve(N);
+        publish_to_consumer.reserve(N);
+
+        uint64_t seq = 0;
+        uint64_t first_seq = 0;
+        uint64_t skipped = 0;
+        int64_t tstart = 0;
+        while(capture_to_consumer.size() < N){
+            boost::shared_ptr<StreamFrame> f = stream->nextFrame(seq, 1000);
+            const int64_t t = sharedClockNanoSecs();
+            if(!f){
+                if(stream->stopped())
+                    throw std::runtime_error("stream stopped");
+                warning() << "no frame for 1s";
+                continue;
+            }
+            if(!first_seq){
+                first_seq = f->seq();
+                tstart = t;
+            }else{
+                skipped += f->seq() - seq - 1;
+            }
+            seq = f->seq();
+            capture_to_consumer.push_back((t - f->captureStartNs()) / 1e6f);
+            publish_to_consumer.push_back((t - f->publishedNs()) / 1e6f);
+        }
+        const float secs = (sharedClockNanoSecs() - tstart) / 1e9f;
+
+        info() << N << "frames in" << secs << "s:" << (N-1) / secs << "fps,"
+               << skipped << "skipped by this reader,"
+               << stream->dropped() << "dropped by the server";
+        report("capture->consumer", capture_to_consumer);
+        report("publish->consumer", publish_to_consumer);
+    }catch(std::exception& e){
+        error() << e.what();
+        return 1;
+    }
+    return 0;
+}
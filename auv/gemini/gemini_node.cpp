@@ -8,10 +8,14 @@
 
 #include <limits>
 #include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
 
 #include <boost/make_shared.hpp>
 #include <boost/program_options.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -72,18 +76,63 @@ class GeminiObserver{
         virtual void onUnknownData(uint8_t const*){}
 };
 
+// Average whole source rows into each destination row (dst_rows <= src_rows):
+// row r of dst is the mean of source rows [r*src_rows/dst_rows,
+// (r+1)*src_rows/dst_rows). acc is working space for one row.
+static void boxDecimateRows(uint8_t const* src, uint32_t src_rows,
+                            uint8_t* dst, uint32_t dst_rows,
+                            uint32_t cols, std::vector<uint32_t>& acc){
+    acc.resize(cols);
+    for(uint32_t r = 0; r < dst_rows; r++){
+        const uint32_t begin = uint64_t(r) * src_rows / dst_rows;
+        const uint32_t end = uint64_t(r + 1) * src_rows / dst_rows;
+        const uint32_t n = end - begin;
+        std::fill(acc.begin(), acc.end(), 0);
+        for(uint32_t s = begin; s < end; s++){
+            uint8_t const* row = src + s * cols;
+            for(uint32_t c = 0; c < cols; c++)
+                acc[c] += row[c];
+        }
+        uint8_t* out = dst + r * cols;
+        for(uint32_t c = 0; c < cols; c++)
+            out[c] = (acc[c] + n/2) / n;
+    }
+}
+
+// A ping being assembled or sent: the message (whose data is written in
+// place), the full resolution data, and working space are all kept between
+// pings, so nothing is allocated unless the ping dimensions change.
+struct PingBuffer{
+    PingBuffer()
+        : msg(), raw(), row_acc(), num_lines(0), num_beams(0){
+    }
+    boost::shared_ptr<SonarImageMessage> msg;
+    std::vector<uint8_t> raw;
+    std::vector<uint32_t> row_acc;
+    uint32_t num_lines;
+    uint32_t num_beams;
+};
+
 class ReBroadcaster: public GeminiObserver{
     public:
         ReBroadcaster(CauvNode& node)
             : GeminiObserver(),
               m_current_ping_id(0),
-              m_current_msg(),
-              m_current_raw_data(),
+              m_filling(0),
+              m_pending(-1),
+              m_send_lock(),
+              m_send_cond(),
               m_range_lines_start(0),
               m_range_lines_end(0),
               m_range(0),
               m_rangecompression_mult(1),
-              m_node(node){
+              m_node(node),
+              m_send_thread(boost::bind(&ReBroadcaster::sendLoop, this)){
+        }
+
+        ~ReBroadcaster(){
+            m_send_thread.interrupt();
+            m_send_thread.join();
         }
 
         virtual void onCGemPingHead(CGemPingHead const* h, float range){
@@ -119,24 +168,36 @@ class ReBroadcaster: public GeminiObserver{
             m_range_lines_start = h->m_startRange;
             m_range_lines_end = h->m_endRange;
             m_range = range;
-            m_current_msg = boost::make_shared<SonarImageMessage>(
-                SonarID::Gemini,
-                PolarImage(
-                    std::vector<uint8_t>(), // this will be replaced later with downsampled data
-                    ImageEncodingType::RAW_uint8_1,
-                    computeBearingBins(num_beams),
-                    0, // filled in later
-                    0, // filled in later
-                    0, // filled in later
-                    // Check this, (needs converting from whatever the sonar's
-                    // time base is into our unix time):
-                    TimeStamp(
-                        h->m_transmitTimestampL/1e6+h->m_transmitTimestampH*double(100000000)/1e6,
-                        h->m_transmitTimestampL % 1000000
-                    )
-                )
+
+            // Check this, (needs converting from whatever the sonar's
+            // time base is into our unix time):
+            const TimeStamp transmit_time(
+                h->m_transmitTimestampL/1e6+h->m_transmitTimestampH*double(100000000)/1e6,
+                h->m_transmitTimestampL % 1000000
             );
-            m_current_raw_data.resize(num_lines*num_beams);
+            // the buffer that isn't being sent: (pingComplete waits until
+            // the previous ping has been sent before swapping buffers)
+            PingBuffer& b = m_buffers[m_filling];
+            if(!b.msg || !b.msg.unique() || b.num_beams != num_beams){
+                b.msg = boost::make_shared<SonarImageMessage>(
+                    SonarID::Gemini,
+                    PolarImage(
+                        std::vector<uint8_t>(), // filled in by pingComplete
+                        ImageEncodingType::RAW_uint8_1,
+                        computeBearingBins(num_beams),
+                        0, // filled in later
+                        0, // filled in later
+                        0, // filled in later
+                        transmit_time
+                    )
+                );
+            }else{
+                // see pingComplete for why this is okay
+                const_cast<TimeStamp&>(b.msg->image().timeStamp) = transmit_time;
+            }
+            b.num_lines = num_lines;
+            b.num_beams = num_beams;
+            b.raw.resize(num_lines*num_beams);
             debug(3) << "New ping: ID=" << m_current_ping_id << "lines:" << num_lines << "beams:" << num_beams;
 
             // This message also tells us the speed of sound: so broadcast it
@@ -153,17 +214,18 @@ class ReBroadcaster: public GeminiObserver{
                 debug(2) << "bad pingID";
                 return;
             }
-            uint32_t num_beams = m_current_msg->image().bearing_bins.size() - 1;
+            PingBuffer& b = m_buffers[m_filling];
+            uint32_t num_beams = b.num_beams;
             uint32_t offset = line_idx * num_beams;
-            if(offset + num_beams > m_current_raw_data.size()){
+            if(line_idx < 0 || offset + num_beams > b.raw.size()){
                 static uint16_t last_error_ping_id = 0;
                 if(ping_id != last_error_ping_id){
                     error() << "invalid line index (further errors for this ping will be suppressed)";
                     last_error_ping_id = ping_id;
                 }
+                return;
             }
-            for(uint32_t i = 0; i != num_beams; i++)
-                m_current_raw_data[offset+i] = ((uint8_t*)&(l->m_startOfData))[i];
+            std::memcpy(&b.raw[offset], &(l->m_startOfData), num_beams);
         }
 
         virtual void onCGemPingTailExtended(CGemPingTailExtended const*, uint32_t resize_to_rangelines){
@@ -243,27 +305,23 @@ class ReBroadcaster: public GeminiObserver{
         }
 
         void pingComplete(uint32_t resize_to_rangelines){
-            // Use opencv to downsample the data to the number of rangelines
-            // that we were configured to send: The range-compression in the
-            // sonar head has already reduced the number of lines by a factor
-            // of m_mrangecompression_mult
-            uint32_t source_rangelines = (m_range_lines_end - m_range_lines_start) / m_rangecompression_mult;
-            uint32_t bearing_beams = m_current_msg->image().bearing_bins.size() - 1;
-            cv::Mat full_resolution_image(
-                source_rangelines,
-                bearing_beams,
-                CV_8UC1,
-                &m_current_raw_data[0]
-            );
+            PingBuffer& b = m_buffers[m_filling];
+            if(!b.msg || b.raw.empty())
+                return;
+            // The range-compression in the sonar head has already reduced
+            // the number of lines by a factor of m_mrangecompression_mult
+            const uint32_t source_rangelines = b.num_lines;
+            const uint32_t bearing_beams = b.num_beams;
             // !!! sneaky: probably okay, and really the only efficient way to
             // do this without introducing multableX members to messages. This
-            // is okay because we haven't serialised it yet.
+            // is okay because it isn't being serialised: it's either new, or
+            // was sent before the last ping and nothing else holds it.
             std::vector<uint8_t> &resized_data = const_cast<std::vector<uint8_t>&>(
-                m_current_msg->image().data
+                b.msg->image().data
             );
-            float &rangeStart = const_cast<float&>(m_current_msg->image().rangeStart);
-            float &rangeEnd   = const_cast<float&>(m_current_msg->image().rangeEnd);
-            float &rangeConv  = const_cast<float&>(m_current_msg->image().rangeConversion);
+            float &rangeStart = const_cast<float&>(b.msg->image().rangeStart);
+            float &rangeEnd   = const_cast<float&>(b.msg->image().rangeEnd);
+            float &rangeConv  = const_cast<float&>(b.msg->image().rangeConversion);
             // range conversion in full-resolution image
             float full_range_conversion = m_range / m_range_lines_end;
             rangeStart = m_range_lines_start * full_range_conversion;
@@ -273,42 +331,98 @@ class ReBroadcaster: public GeminiObserver{
             // limit the resizing to a power of two to avoid aliasing:
             resize_to_rangelines = nextPowerOfTwo(resize_to_rangelines);
             rangeConv  = m_range / resize_to_rangelines;
-            // This zero-initialises, but that isn't possible to avoid.
-            // Hopefully the compiler is smart enough to realise we're setting
-            // every element anyway... (it's a long shot):
+            // (only zero-initialises if the message is new or the ping has
+            // grown, since the message is reused)
             resized_data.resize(resize_to_rangelines * bearing_beams);
-            cv::Mat downsampled_image(
-                resize_to_rangelines,
-                bearing_beams,
-                CV_8UC1,
-                &resized_data[0]
-            );
-            cv::resize(
-                full_resolution_image,
-                downsampled_image,
-                downsampled_image.size(),
-                0, 0, cv::INTER_LINEAR // !!! INTER_AREA might be better
-            );
+            if(resize_to_rangelines <= source_rangelines){
+                // decimate with a box filter straight into the message
+                boxDecimateRows(
+                    b.raw.data(), source_rangelines,
+                    resized_data.data(), resize_to_rangelines,
+                    bearing_beams, b.row_acc
+                );
+            }else{
+                cv::Mat full_resolution_image(
+                    source_rangelines,
+                    bearing_beams,
+                    CV_8UC1,
+                    &b.raw[0]
+                );
+                cv::Mat upsampled_image(
+                    resize_to_rangelines,
+                    bearing_beams,
+                    CV_8UC1,
+                    &resized_data[0]
+                );
+                cv::resize(
+                    full_resolution_image,
+                    upsampled_image,
+                    upsampled_image.size(),
+                    0, 0, cv::INTER_LINEAR
+                );
+            }
             debug(3) << "sending SonarImageMessage:" << bearing_beams << "x" << resize_to_rangelines;
             #else
             // !!! just rely on range compression, (now I understand how it
             // works...), otherwise all we really do is introduce aliasing:
             rangeConv = m_range / source_rangelines;
-            resized_data = m_current_raw_data;
+            resized_data.assign(b.raw.begin(), b.raw.end());
             debug(3) << "sending SonarImageMessage:" << bearing_beams << "x" << source_rangelines;
             #endif
-            m_node.send(m_current_msg);
+
+            // hand this ping to the send thread, and fill the other buffer
+            // with the next one: it can only be reused once it's been sent,
+            // which is almost always long before this ping is complete
+            lock_t l(m_send_lock);
+            while(m_pending >= 0)
+                m_send_cond.wait(l);
+            m_pending = m_filling;
+            m_filling = 1 - m_filling;
+            m_send_cond.notify_all();
         }
 
+        // serialises and sends each complete ping
+        void sendLoop(){
+            lock_t l(m_send_lock);
+            while(true){
+                while(m_pending < 0)
+                    m_send_cond.wait(l);
+                boost::shared_ptr<SonarImageMessage> msg = m_buffers[m_pending].msg;
+                l.unlock();
+                // a ping that can't be sent is lost, but the buffer must
+                // still be handed back, or assembly would wait for it forever
+                try{
+                    m_node.send(msg);
+                }catch(std::exception& e){
+                    error() << "failed to send sonar image:" << e.what();
+                }
+                msg.reset();
+                l.lock();
+                m_pending = -1;
+                m_send_cond.notify_all();
+            }
+        }
+
+        typedef boost::unique_lock<boost::mutex> lock_t;
+
         uint16_t m_current_ping_id;
         TimeStamp m_current_ping_time;
-        boost::shared_ptr<SonarImageMessage> m_current_msg;
-        std::vector<uint8_t> m_current_raw_data;
+
+        // m_buffers[m_filling] is being assembled, m_buffers[m_pending] (if
+        // m_pending >= 0) is being sent
+        PingBuffer m_buffers[2];
+        int m_filling;
+        int m_pending;
+        boost::mutex m_send_lock;
+        boost::condition_variable m_send_cond;
+
         uint32_t m_range_lines_start;
         uint32_t m_range_lines_end;
         float m_range;
         uint32_t m_rangecompression_mult;
         CauvNode& m_node;
+
+        boost::thread m_send_thread;
 };
 
 class GeminiSonar: public ThreadSafeObservable<GeminiObserver>,
@@ -6,19 +6,25 @@
 
 #include "imageProcessor.h"
 #include "nodeFactory.h"
+#include "pipelineDiff.h"
 #include "nodes/inputNode.h"
 
 #include <boost/make_shared.hpp>
 
 #include <utility/string.h>
+#include <utility/trace.h>
+#include <generated/types/serialise.h>
+#include <generated/types/ParamValue.h>
 #include <map>
 #include <list>
+#include <chrono>
 
+using namespace cauv;
 using namespace cauv::imgproc;
 
 ImageProcessor::ImageProcessor(mb_ptr_t mb, boost::shared_ptr<Scheduler> scheduler)
-    : m_nodes_lock(), m_nodes(), m_nodes_rev(), m_input_nodes(), m_scheduler(scheduler),
-      m_name("---"), m_mailbox_lock(), m_mailbox(mb){
+    : m_nodes_lock(), m_nodes(), m_nodes_rev(), m_subscriptions(), m_routes(), m_scheduler(scheduler),
+      m_name("---"), m_active(true), m_mailbox_lock(), m_mailbox(mb){
 
     m_mailbox->subMessage(AddNodeMessage());
     m_mailbox->subMessage(RemoveNodeMessage());
@@ -29,6 +35,7 @@ ImageProcessor::ImageProcessor(mb_ptr_t mb, boost::shared_ptr<Scheduler> schedul
     m_mailbox->subMessage(GraphRequestMessage());
     m_mailbox->subMessage(ForceExecRequestMessage());
     m_mailbox->subMessage(ClearPipelineMessage());
+    m_mailbox->subMessage(SetPipelineStateMessage());
     m_mailbox->subMessage(PipelineDiscoveryRequestMessage());
 
     m_mailbox->subMessage(GPSLocationMessage());
@@ -43,46 +50,90 @@ void ImageProcessor::start(const std::string& name){
     sendMessage(boost::make_shared<PipelineDiscoveryResponseMessage>(m_name));
 }
 
-void ImageProcessor::onLinesMessage(LinesMessage_ptr m){
+std::string ImageProcessor::name() const{
+    lock_t l(m_name_lock);
+    return m_name;
+}
+
+void ImageProcessor::pause(){
+    if(m_active.exchange(false))
+        info() << "pipeline" << name() << "on standby";
+}
+
+void ImageProcessor::play(){
+    if(m_active.exchange(true))
+        return;
+    info() << "pipeline" << name() << "active";
+    // anything that tried to queue while on standby was refused
+    std::vector<node_ptr_t> nodes;
     lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
-        node->onLinesMessage(m);
+    for(auto const & node : m_nodes)
+        nodes.push_back(node.second);
+    l.unlock();
+    for(node_ptr_t const& n : nodes)
+        n->checkAddSched();
+}
+
+void ImageProcessor::swapWithStandby(ImageProcessor& standby){
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        lock_t l(m_name_lock);
+        lock_t sl(standby.m_name_lock);
+        if(standby.m_active)
+            throw std::runtime_error(standby.m_name + " is not on standby");
+        std::swap(m_name, standby.m_name);
+        m_active = false;
     }
+    standby.play();
+    const float swap_us = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+    info() << "pipeline" << standby.name() << "switched in" << swap_us << "us, previous pipeline on standby as" << name();
+    sendMessage(boost::make_shared<PipelineDiscoveryResponseMessage>(standby.name()));
+}
+
+template<typename message_T>
+void ImageProcessor::_dispatch(boost::shared_ptr<const message_T> const& m, int32_t source,
+                               void (InputNode::*handler)(boost::shared_ptr<const message_T>)) const{
+    if(!m_active)
+        return;
+    RCUPointer<InputRoutes>::Reader routes(m_routes);
+    auto i = routes->inputs.find(m->id());
+    if(i == routes->inputs.end())
+        return;
+    for(InputRoutes::Route const& route : i->second)
+        if(route.source == Any_Source || route.source == source)
+            ((*route.node).*handler)(m);
+}
+
+void ImageProcessor::onLinesMessage(LinesMessage_ptr m){
+    _dispatch(m, Any_Source, &InputNode::onLinesMessage);
 }
 
 void ImageProcessor::onImageMessage(ImageMessage_ptr m){
-    lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
-        node->onImageMessage(m);
-    }
+    _dispatch(m, m->view_source(), &InputNode::onImageMessage);
 }
 
 void ImageProcessor::onSonarDataMessage(SonarDataMessage_ptr m){
-    lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
-        node->onSonarDataMessage(m);
-    }
+    _dispatch(m, Any_Source, &InputNode::onSonarDataMessage);
 }
 
 void ImageProcessor::onSonarImageMessage(SonarImageMessage_ptr m){
-    lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
-        node->onSonarImageMessage(m);
-    }
+    _dispatch(m, m->view_source(), &InputNode::onSonarImageMessage);
 }
 
 void ImageProcessor::onTelemetryMessage(TelemetryMessage_ptr m){
-    lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
+    if(!m_active)
+        return;
+    RCUPointer<InputRoutes>::Reader routes(m_routes);
+    for(node_ptr_t const& node : routes->telemetry)
         node->onTelemetry(m);
-    }
 }
 
 void ImageProcessor::onGPSLocationMessage(GPSLocationMessage_ptr m){
-    lock_t l(m_nodes_lock);
-    for (const auto& node : m_input_nodes) {
+    if(!m_active)
+        return;
+    RCUPointer<InputRoutes>::Reader routes(m_routes);
+    for(node_ptr_t const& node : routes->gps)
         node->onGPSLoc(m);
-    }
 }
 
 void ImageProcessor::onAddNodeMessage(AddNodeMessage_ptr m){
@@ -93,7 +144,7 @@ void ImageProcessor::onAddNodeMessage(AddNodeMessage_ptr m){
     Node::msg_node_input_map_t inputs;
     Node::msg_node_output_map_t outputs;
     try{
-        node_ptr_t node = NodeFactoryRegister::create(*m_scheduler, *this, m_name, m->nodeType());
+        node_ptr_t node = NodeFactoryRegister::create(*m_scheduler, *this, m->nodeType());
 
         for (NodeInputArc const& a : m->parents()){
             node->setInput(a.input, lookup(a.src.node), a.src.output);
@@ -107,9 +158,6 @@ void ImageProcessor::onAddNodeMessage(AddNodeMessage_ptr m){
         new_id = node->id();
         lock_t l(m_nodes_lock);
         _addNode(node, new_id);
-        if(node->isInputNode()){
-            m_input_nodes.insert(boost::dynamic_pointer_cast<InputNode, Node>(node));
-        }
         l.unlock();
 
         params = node->parameters();
@@ -123,7 +171,7 @@ void ImageProcessor::onAddNodeMessage(AddNodeMessage_ptr m){
     }catch(std::exception& e){
         error() << __func__ << ":" << e.what();
     }
-    sendMessage(boost::make_shared<NodeAddedMessage>(m_name, new_id, m->nodeType(), inputs, outputs, params));
+    sendMessage(boost::make_shared<NodeAddedMessage>(name(), new_id, m->nodeType(), inputs, outputs, params));
 }
 
 void ImageProcessor::removeNode(node_id const& id){
@@ -139,7 +187,7 @@ void ImageProcessor::removeNode(node_id const& id){
         in.node = id;
         for (const auto& input_link : il){
             in.input = input_link.first.input;
-            arms.push_back(boost::make_shared<ArcRemovedMessage>(m_name, input_link.second, in));
+            arms.push_back(boost::make_shared<ArcRemovedMessage>(name(), input_link.second, in));
         }
     }
     {
@@ -148,16 +196,12 @@ void ImageProcessor::removeNode(node_id const& id){
         for (const auto& output_link : ol){
             out.output = output_link.first.output;
             for(auto const & in : output_link.second)
-                arms.push_back(boost::make_shared<ArcRemovedMessage>(m_name, out, in));
+                arms.push_back(boost::make_shared<ArcRemovedMessage>(name(), out, in));
         }
     }
     
     _removeNode(id); 
     debug(2) << "Node removed:" << id;
-    
-    if(n->isInputNode()){
-        m_input_nodes.erase(boost::dynamic_pointer_cast<InputNode, Node>(n));
-    }
     l.unlock();
 
     /* since the graph is linked both ways we have to unlink the node from
@@ -173,7 +217,7 @@ void ImageProcessor::removeNode(node_id const& id){
     std::vector<ArcRemovedMessage_ptr>::const_iterator i;
     for(i = arms.begin(); i != arms.end(); i++)
         sendMessage(*i);
-    sendMessage(boost::make_shared<NodeRemovedMessage>(m_name, id));
+    sendMessage(boost::make_shared<NodeRemovedMessage>(name(), id));
 }
 
 void ImageProcessor::onRemoveNodeMessage(RemoveNodeMessage_ptr m){
@@ -238,8 +282,8 @@ void ImageProcessor::onAddArcMessage(AddArcMessage_ptr m){
         debug(2) << "Arc added:" << m->from() << "->" << m->to();
         
         if(old_from.node)
-            sendMessage(boost::make_shared<ArcRemovedMessage>(m_name, old_from, m->to()));
-        sendMessage(boost::make_shared<ArcAddedMessage>(m_name, m->from(), m->to()));
+            sendMessage(boost::make_shared<ArcRemovedMessage>(name(), old_from, m->to()));
+        sendMessage(boost::make_shared<ArcAddedMessage>(name(), m->from(), m->to()));
     }catch(std::exception& e){
         error() << __func__ << ":" << e.what();
     }
@@ -281,107 +325,201 @@ void ImageProcessor::onRemoveArcMessage(RemoveArcMessage_ptr m){
 
         debug(2) << "Arc removed:" << m->from() << "->" << m->to();
         
-        sendMessage(boost::make_shared<ArcRemovedMessage>(m_name, m->from(), m->to()));
+        sendMessage(boost::make_shared<ArcRemovedMessage>(name(), m->from(), m->to()));
     }catch(std::exception& e){
         error() << __func__ << ":" << e.what();
     }
 }
 
+/**
+ * Rather than rebuilding the whole pipeline, nodes that are already running
+ * are kept (with their state, open cameras, etc.) if the new pipeline has a
+ * node of the same type that is connected in the same way, and only the
+ * nodes, arcs and parameters that differ are changed. Parameters of kept
+ * nodes that the new pipeline doesn't set are reset to their defaults, so
+ * the result is the same as building the new pipeline from scratch.
+ *
+ * Nodes are matched in passes, starting from those whose inputs are all
+ * connected to matched nodes in the same way (initially only nodes with no
+ * connected inputs), and failing that, by partial matches of their inputs.
+ * Nodes that are part of a cycle, or only the same type as an existing node,
+ * are rebuilt.
+ */
 void ImageProcessor::onSetPipelineMessage(SetPipelineMessage_ptr m){
     if(!_filterMatches(m))
         return;
+    trace::Scope apply_trace("setPipeline", "pipeline");
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     lock_t l(m_nodes_lock);
-    //translation between ids
-    try{
-        //clear the existing pipeline
-        while(m_nodes.size()){
-            node_id n = m_nodes.rbegin()->first;
-            removeNode(n);
+
+    // the new pipeline, by the ids in the message:
+    graph_t wanted;
+    for(auto const & node_type : m->nodeTypes())
+        wanted[node_type.first].type = node_type.second;
+    for(auto const & node_connection : m->nodeConnections()){
+        auto w = wanted.find(node_connection.first);
+        if(w == wanted.end()){
+            error() << __func__ << ": arcs to unknown node:" << node_connection.first;
+            continue;
+        }
+        for(auto const & connection : node_connection.second)
+            if(connection.second.node != 0)
+                w->second.arcs[connection.first.input] = std::make_pair(
+                    connection.second.node, connection.second.output
+                );
+    }
+    for(auto const & node_param : m->nodeParams()){
+        auto w = wanted.find(node_param.first);
+        if(w == wanted.end()){
+            error() << __func__ << ": parameters for unknown node:" << node_param.first;
+            continue;
         }
+        for(auto const & param : node_param.second)
+            if(!w->second.arcs.count(param.first.input))
+                w->second.params[param.first] = param.second;
     }
-    catch(std::exception& e){
-        error() << __func__ << ":" <<e.what();
+
+    // the existing pipeline:
+    graph_t existing;
+    for(auto const & node : m_nodes){
+        GraphNode& e = existing[node.first];
+        e.type = node.second->type();
+        for(auto const & link : node.second->inputLinks())
+            if(link.second.node != 0)
+                e.arcs[link.first.input] = std::make_pair(link.second.node, link.second.output);
+        e.params = node.second->parameters();
+        e.defaults = node.second->paramDefaults();
     }
-    std::map<node_id, node_id> old_id2new_id;
-    //need to add all nodes first so that arcs can be added
-    for(auto const & node_type : m->nodeTypes()){
+
+    // message id -> id of the node that's kept for it
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    std::set<node_id> used;
+    for(auto const & m : matched)
+        used.insert(m.second);
+    debug(2) << "nodes kept:" << matched;
+
+    int removed = 0;
+    int added = 0;
+    int arcs_changed = 0;
+    int params_changed = 0;
+
+    for(auto const & node : existing){
+        if(used.count(node.first))
+            continue;
         try{
-            node_ptr_t node = NodeFactoryRegister::create(*m_scheduler, *this, m_name, node_type.second);
-            if(node->isInputNode()){
-                m_input_nodes.insert(boost::dynamic_pointer_cast<InputNode, Node>(node));
-            }
-            old_id2new_id[node_type.first] = node->id();
+            removeNode(node.first);
+            removed++;
+        }catch(std::exception& e){
+            error() << __func__ << ":" << e.what();
+        }
+    }
+
+    // message id -> node id, for all nodes
+    std::map<node_id, node_id> msg_id2id = matched;
+    for(auto const & w : wanted){
+        if(matched.count(w.first))
+            continue;
+        try{
+            node_ptr_t node = NodeFactoryRegister::create(*m_scheduler, *this, w.second.type);
+            msg_id2id[w.first] = node->id();
             _addNode(node, node->id());
+            added++;
         }
         catch(std::exception& e){
             error() << __func__ << ":" <<e.what();
         }
     }
-    debug() << old_id2new_id;
-    //params that dont need to be set because they are filled by arcs
-    std::map<node_id, std::list<input_id> > params_with_arcs;
-    //now fill in arcs
-    for(auto const & node_connection : m->nodeConnections()){
+
+    for(auto const & w : wanted){
         try{
-            node_ptr_t to = lookup(old_id2new_id[node_connection.first]);
-            if(!to) throw id_error(MakeString() << "invalid node:" << node_connection.first);
-            std::list<input_id> node_params_set;
-            
-            for(auto const & connection : node_connection.second){
+            auto id = msg_id2id.find(w.first);
+            if(id == msg_id2id.end())
+                continue;
+            node_ptr_t to = lookup(id->second);
+
+            // remove arcs that aren't wanted (any more, or from a different
+            // output):
+            for(auto const & link : to->inputLinks()){
+                if(link.second.node == 0)
+                    continue;
+                const input_id input = link.first.input;
+                auto a = w.second.arcs.find(input);
+                if(a != w.second.arcs.end() && msg_id2id.count(a->second.first) &&
+                   msg_id2id[a->second.first] == link.second.node && a->second.second == link.second.output)
+                    continue;
+                auto from = m_nodes.find(link.second.node);
+                if(from != m_nodes.end())
+                    from->second->clearOutput(link.second.output, to, input);
+                to->clearInput(input);
+                arcs_changed++;
+            }
+
+            // and add the missing ones:
+            const Node::msg_node_input_map_t links = to->inputLinks();
+            for(auto const & a : w.second.arcs){
                 try{
-                    if(connection.second.node == 0){
+                    auto from_id = msg_id2id.find(a.second.first);
+                    if(from_id == msg_id2id.end())
+                        throw id_error(MakeString() << "invalid node:" << a.second.first);
+                    bool linked = false;
+                    for(auto const & link : links)
+                        if(link.first.input == a.first && link.second.node == from_id->second)
+                            linked = true;
+                    if(linked)
                         continue;
-                    }
-                    node_ptr_t from = lookup(old_id2new_id[connection.second.node]);
-                    if(!from) throw id_error(MakeString() << "invalid node:" << connection.second.node);
-                    
-                    output_id output = connection.second.output;
-                    input_id input = connection.first.input;
-                    
-                    from->setOutput(output, to, input);
-                    to->setInput(input, from, output);
-                    
-                    node_params_set.push_back(input);
-                }
-                catch(std::exception& e){
+                    node_ptr_t from = lookup(from_id->second);
+                    from->setOutput(a.second.second, to, a.first);
+                    to->setInput(a.first, from, a.second.second);
+                    arcs_changed++;
+                }catch(std::exception& e){
                     error() << __func__ << ":" <<e.what();
                 }
             }
-            params_with_arcs[node_connection.first] = node_params_set;
-        }
-        catch(std::exception& e){
-            error() << __func__ << ":" <<e.what();
-        }
-    }
-    for(auto const & node_param : m->nodeParams()){
-        try{
-            std::map<node_id, std::list<input_id> >::const_iterator exclude_params_it = params_with_arcs.find(node_param.first);
-            if(exclude_params_it==params_with_arcs.end()){
-                throw id_error(std::string("Unknown node id: ") + toStr(node_param.first));
-            }
-            std::list<input_id> exclude_params = exclude_params_it->second;
-            node_ptr_t n = lookup(old_id2new_id[node_param.first]);
-            for(auto const & param : node_param.second){
-                std::list<input_id>::iterator ep_it;
-                for(ep_it = exclude_params.begin(); ep_it != exclude_params.end(); ep_it++){
-                    if(*ep_it == param.first.input){
-                        break;
-                    }
-                }
-                //found that param was set by inarc
-                if(ep_it != exclude_params.end()){
-                    continue;
+
+            // and set the parameters that have changed
+            const bool kept = matched.count(w.first);
+            for(auto const & param : w.second.params){
+                if(kept){
+                    GraphNode::param_map_t const& current = existing[id->second].params;
+                    auto c = current.find(param.first);
+                    if(c != current.end() && sameParamValue(c->second, param.second))
+                        continue;
                 }
                 try{
-                    n->setParam(param.first.input, param.second);
+                    to->setParam(param.first.input, param.second);
+                    params_changed++;
                 }catch(std::exception& e){
                     error() << __func__ << ":" << e.what();
                 }
             }
+
+            // and reset those of kept nodes that aren't set any more
+            if(kept){
+                GraphNode const& current = existing[id->second];
+                for(auto const & param : current.params){
+                    if(w.second.params.count(param.first) || w.second.arcs.count(param.first.input))
+                        continue;
+                    auto d = current.defaults.find(param.first.input);
+                    if(d == current.defaults.end() || sameParamValue(d->second, param.second))
+                        continue;
+                    try{
+                        to->setParam(param.first.input, d->second);
+                        params_changed++;
+                    }catch(std::exception& e){
+                        error() << __func__ << ":" << e.what();
+                    }
+                }
+            }
         }catch(std::exception& e){
             error() << __func__ << ":" << e.what();
         }
     }
+
+    const float apply_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    info() << "pipeline" << name() << "set in" << apply_ms << "ms:"
+           << matched.size() << "nodes kept," << added << "added," << removed << "removed;"
+           << arcs_changed << "arcs and" << params_changed << "parameters changed";
+
     try{
         std::map<node_id, NodeType::e> node_types;
         std::map<node_id, Node::msg_node_input_map_t > node_inputs;
@@ -397,7 +535,7 @@ void ImageProcessor::onSetPipelineMessage(SetPipelineMessage_ptr m){
         }
 
         sendMessage(boost::make_shared<GraphDescriptionMessage>(
-            m_name, node_types, node_inputs, node_outputs, node_parameters
+            name(), node_types, node_inputs, node_outputs, node_parameters
         ));
     }catch(std::exception& e){
         error() << __func__ << ":" << e.what();
@@ -424,7 +562,7 @@ void ImageProcessor::onGraphRequestMessage(GraphRequestMessage_ptr m){
         }
 
         sendMessage(boost::make_shared<GraphDescriptionMessage>(
-            m_name, node_types, node_inputs, node_outputs, node_parameters
+            name(), node_types, node_inputs, node_outputs, node_parameters
         ));
     }catch(std::exception& e){
         error() << __func__ << ":" << e.what();
@@ -462,17 +600,44 @@ void ImageProcessor::onClearPipelineMessage(ClearPipelineMessage_ptr m){
 }
 
 
+void ImageProcessor::onSetPipelineStateMessage(SetPipelineStateMessage_ptr m){
+    if(!_filterMatches(m))
+        return;
+    switch(m->pipelineState()){
+        case PipelineState::Play: play(); break;
+        case PipelineState::Pause: pause(); break;
+        default:
+            error() << "unknown pipeline state" << m->pipelineState();
+    }
+}
+
 void ImageProcessor::onPipelineDiscoveryRequestMessage(PipelineDiscoveryRequestMessage_ptr){
     debug(2) << "Pipeline discovery request message received";
-    sendMessage(boost::make_shared<PipelineDiscoveryResponseMessage>(m_name));
+    sendMessage(boost::make_shared<PipelineDiscoveryResponseMessage>(name()));
 }
 
 void ImageProcessor::sendMessage(const boost::shared_ptr<const Message> msg, MessageReliability reliability) const{
     m_mailbox->sendMessage(msg, reliability);
 }
 
-void ImageProcessor::subMessage(Message const& msg, node_id const&){
+void ImageProcessor::subMessage(Message const& msg, node_id const& node, int32_t source){
     m_mailbox->subMessage(msg);
+    lock_t l(m_nodes_lock);
+    m_subscriptions[node].insert(std::make_pair(msg.id(), source));
+    _publishRoutes();
+}
+
+void ImageProcessor::unSubMessage(Message const& msg, node_id const& node){
+    // the mailbox subscription is left alone: other nodes (or pipelines)
+    // may still want these messages
+    lock_t l(m_nodes_lock);
+    auto i = m_subscriptions.find(node);
+    if(i == m_subscriptions.end())
+        return;
+    subscriptions_t::iterator j = i->second.lower_bound(std::make_pair(msg.id(), Any_Source));
+    while(j != i->second.end() && j->first == msg.id())
+        i->second.erase(j++);
+    _publishRoutes();
 }
 
 
@@ -502,10 +667,7 @@ void ImageProcessor::_addNode(node_ptr_t const& p, node_id const& id) throw(){
     lock_t l(m_nodes_lock);
     m_nodes[id] = p;
     m_nodes_rev[p] = id;
-    if(p->requiresGPS())
-        m_gps_req_nodes.insert(p);
-    if(p->requiresTelemetry())
-        m_telem_req_nodes.insert(p);
+    _publishRoutes();
 }
 
 void ImageProcessor::_addNode(node_ptr_t const& p) throw(){
@@ -517,9 +679,33 @@ void ImageProcessor::_removeNode(node_id const& id) throw(id_error){
     if(i != m_nodes.end()){
         m_nodes_rev.erase(i->second);
         m_nodes.erase(i);
+        m_subscriptions.erase(id);
+        _publishRoutes();
     }else{
         throw id_error(std::string("Unknown node id: ") + toStr(id));
     }
 }
 
+void ImageProcessor::_publishRoutes(){
+    InputRoutes* routes = new InputRoutes();
+    for(auto const & node : m_nodes){
+        if(node.second->requiresGPS())
+            routes->gps.push_back(node.second);
+        if(node.second->requiresTelemetry())
+            routes->telemetry.push_back(node.second);
+        auto subs = m_subscriptions.find(node.first);
+        if(subs == m_subscriptions.end() || !node.second->isInputNode())
+            continue;
+        input_node_ptr_t input = boost::static_pointer_cast<InputNode>(node.second);
+        for(auto const & sub : subs->second){
+            // an Any_Source subscription covers all the others
+            if(sub.second != Any_Source && subs->second.count(std::make_pair(sub.first, Any_Source)))
+                continue;
+            InputRoutes::Route r = {sub.second, input};
+            routes->inputs[sub.first].push_back(r);
+        }
+    }
+    m_routes.publish(routes);
+}
+
 
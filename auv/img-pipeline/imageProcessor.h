@@ -6,6 +6,7 @@
 #include <stdexcept>
 #include <map>
 #include <set>
+#include <atomic>
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
@@ -13,6 +14,7 @@
 #include <common/msg_classes/image.h>
 #include <common/mailbox.h>
 #include <utility/ratelimit.h>
+#include <utility/rcu.h>
 #include <generated/message_observers.h>
 #include <generated/types/TelemetryMessage.h>
 #include <generated/types/GPSLocationMessage.h>
@@ -39,16 +41,33 @@ class ImageProcessor: public MessageObserver
        
         void start(const std::string& name);
 
-        const std::string& name() const { return m_name; }
+        std::string name() const;
+
+        /**
+         * A standby (paused) pipeline is fully built, but none of its nodes
+         * are scheduled and its input nodes are given no data, until it's
+         * played.
+         */
+        bool active() const { return m_active; }
+        void pause();
+        void play();
+
+        /**
+         * Make standby, which must be paused, take over this pipeline's name
+         * and start running, and pause this pipeline under standby's old
+         * name. Nodes that were queued before the switch still run.
+         */
+        void swapWithStandby(ImageProcessor& standby);
 
         /**
          * override MessageObserver functions to take actions on messages
          */
         
         /**
-         * Notify all input nodes when we receive something that could be their
-         * input. It is up to nodes to filter the source of the image to select
-         * their input from others.
+         * Notify the input nodes subscribed to each message (and source) when
+         * we receive something that could be their input. These are called
+         * for every message from every sensor, so take no locks: they look up
+         * the subscribers in m_routes.
          */
         virtual void onLinesMessage(LinesMessage_ptr m);
         virtual void onImageMessage(ImageMessage_ptr m);
@@ -74,6 +93,7 @@ class ImageProcessor: public MessageObserver
         virtual void onGraphRequestMessage(GraphRequestMessage_ptr m);
         virtual void onForceExecRequestMessage(ForceExecRequestMessage_ptr m);
         virtual void onClearPipelineMessage(ClearPipelineMessage_ptr m);
+        virtual void onSetPipelineStateMessage(SetPipelineStateMessage_ptr m);
 
         /**
          * Pipeline discovery messages - for nodes interested in listing all pipelines
@@ -89,7 +109,8 @@ class ImageProcessor: public MessageObserver
          * Use m_mailbox (set by constructor) to send the specified message
          */
         void sendMessage(const boost::shared_ptr<const Message> msg, MessageReliability = RELIABLE_MSG) const;
-        void subMessage(Message const& msg, node_id const& node);
+        void subMessage(Message const& msg, node_id const& node, int32_t source = Any_Source);
+        void unSubMessage(Message const& msg, node_id const& node);
 
         ~ImageProcessor();
     
@@ -123,23 +144,48 @@ class ImageProcessor: public MessageObserver
             return false;
         }
 
+        template<typename message_T>
+        void _dispatch(boost::shared_ptr<const message_T> const& m, int32_t source,
+                       void (InputNode::*handler)(boost::shared_ptr<const message_T>)) const;
+
         void _addNode(node_ptr_t const& p, node_id const& id) throw();
         void _addNode(node_ptr_t const& p) throw();
         void _removeNode(node_id const& id) throw(id_error);
+
+        // rebuild m_routes from m_nodes and m_subscriptions: call with
+        // m_nodes_lock held after changing either
+        void _publishRoutes();
         
         mutable mutex_t m_nodes_lock;
         std::map<node_id, node_ptr_t> m_nodes;
         std::map<node_ptr_t, node_id> m_nodes_rev;
-        std::set<input_node_ptr_t> m_input_nodes;
 
-        std::set<node_ptr_t> m_gps_req_nodes;
-        std::set<node_ptr_t> m_telem_req_nodes;
+        // node -> (message id, source) it has subscribed to
+        typedef std::set< std::pair<uint32_t, int32_t> > subscriptions_t;
+        std::map<node_id, subscriptions_t> m_subscriptions;
+
+        /* Who to pass each sensor message to: immutable once published, and
+         * replaced (not modified) whenever nodes or subscriptions change.
+         */
+        struct InputRoutes{
+            struct Route{
+                int32_t source;
+                input_node_ptr_t node;
+            };
+            // by message id
+            std::map< uint32_t, std::vector<Route> > inputs;
+            std::vector<node_ptr_t> gps;
+            std::vector<node_ptr_t> telemetry;
+        };
+        RCUPointer<InputRoutes> m_routes;
 
         boost::shared_ptr<Scheduler> m_scheduler;
 
         mutable mutex_t m_name_lock;
         std::string m_name;
 
+        std::atomic<bool> m_active;
+
         mutable mutex_t m_mailbox_lock;
         mb_ptr_t m_mailbox;
 };
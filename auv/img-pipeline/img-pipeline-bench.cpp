@@ -0,0 +1,426 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+// Replays recorded frames through a saved pipeline, in-process (no mailbox,
+// daemon or hardware), and reports per-node execution time, queue wait and
+// allocations.
+//
+// The pipeline is a serialised SetPipelineMessage (see `savepl.py export`).
+// Camera input nodes are replaced by network input nodes, which are fed
+// camera frames (image files); sonar input nodes are fed Gemini frames
+// (8-bit polar image files: one row per range line, one column per beam).
+// Frames are serialised before the run starts, so the input nodes
+// deserialise them just as they would if they'd been received.
+//
+// With --rate 0 each frame is only fed in once the pipeline has finished
+// with the last one, so (with one thread) every run executes the same
+// nodes in the same order.
+
+#include <cstdlib>
+#include <cmath>
+#include <new>
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+
+#include <boost/make_shared.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <debug/cauv_debug.h>
+#include <utility/options.h>
+#include <utility/performance.h>
+#include <utility/string.h>
+#include <utility/trace.h>
+#include <common/mailbox.h>
+#include <common/msg_classes/image.h>
+#include <common/msg_classes/image_pool.h>
+#include <generated/types/SetPipelineMessage.h>
+#include <generated/types/ImageMessage.h>
+#include <generated/types/SonarImageMessage.h>
+
+#include "imageProcessor.h"
+#include "scheduler.h"
+#include "node.h"
+
+using namespace cauv;
+using namespace cauv::imgproc;
+namespace bf = boost::filesystem;
+
+// - heap allocations made by each thread (cv::Mat data is allocated
+// separately, and counted by the image buffer pool statistics)
+static __thread uint64_t t_allocations = 0;
+
+void* operator new(std::size_t n){
+    t_allocations++;
+    void* p = std::malloc(n? n : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw(){
+    std::free(p);
+}
+
+// The pipeline's view of the world: everything sent is dropped
+class NullMailbox: public Mailbox{
+    public:
+        NullMailbox() : m_sent(0){ }
+
+        virtual int sendMessage(boost::shared_ptr<const Message>, MessageReliability){
+            m_sent++;
+            return 0;
+        }
+        virtual int sendMessage(boost::shared_ptr<const Message> m, MessageReliability r, const std::string&){
+            return sendMessage(m, r);
+        }
+        virtual void joinGroup(const std::string&){ }
+        virtual void leaveGroup(const std::string&){ }
+        virtual void subMessage(const Message&){ }
+        virtual void unSubMessage(const Message&){ }
+
+        uint64_t sent() const{ return m_sent; }
+
+    private:
+        std::atomic<uint64_t> m_sent;
+};
+
+struct NodeSamples{
+    NodeSamples() : node(), exec_ms(), wait_ms(), allocations(0){ }
+    node_wkptr_t node;
+    std::vector<float> exec_ms;
+    std::vector<float> wait_ms;
+    uint64_t allocations;
+};
+
+static __thread float t_queue_wait_ms = 0;
+static __thread uint64_t t_allocations_at_start = 0;
+
+class BenchObserver: public SchedulerObserver{
+    public:
+        BenchObserver() : m_lock(), m_samples(){ }
+
+        virtual void onJobStart(node_ptr_t const&, float queue_wait_ms){
+            t_queue_wait_ms = queue_wait_ms;
+            t_allocations_at_start = t_allocations;
+        }
+
+        virtual void onJobEnd(node_ptr_t const& node, float exec_ms){
+            const uint64_t allocations = t_allocations - t_allocations_at_start;
+            boost::lock_guard<boost::mutex> l(m_lock);
+            NodeSamples& s = m_samples[node.get()];
+            s.node = node;
+            s.exec_ms.push_back(exec_ms);
+            s.wait_ms.push_back(t_queue_wait_ms);
+            s.allocations += allocations;
+        }
+
+        void clear(){
+            boost::lock_guard<boost::mutex> l(m_lock);
+            m_samples.clear();
+        }
+
+        std::map<Node const*, NodeSamples> samples() const{
+            boost::lock_guard<boost::mutex> l(m_lock);
+            return m_samples;
+        }
+
+    private:
+        mutable boost::mutex m_lock;
+        std::map<Node const*, NodeSamples> m_samples;
+};
+
+// nearest-rank percentile of unsorted samples
+static float percentile(std::vector<float> v, float p){
+    if(v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    const std::size_t rank = std::ceil(p / 100 * v.size());
+    return v[std::max<std::size_t>(rank, 1) - 1];
+}
+
+static float mean(std::vector<float> const& v){
+    float sum = 0;
+    for(std::size_t i = 0; i < v.size(); i++)
+        sum += v[i];
+    return v.size()? sum / v.size() : 0;
+}
+
+static std::vector<bf::path> imageFiles(std::string const& dir){
+    std::vector<bf::path> r;
+    if(dir.empty())
+        return r;
+    if(!bf::is_directory(dir)){
+        r.push_back(dir);
+        return r;
+    }
+    std::copy(bf::directory_iterator(dir), bf::directory_iterator(), std::back_inserter(r));
+    std::sort(r.begin(), r.end());
+    return r;
+}
+
+static std::vector<const_svec_ptr> cameraFrames(std::string const& dir, CameraID::e camera_id){
+    std::vector<const_svec_ptr> r;
+    std::vector<bf::path> files = imageFiles(dir);
+    for(std::size_t i = 0; i < files.size(); i++){
+        cv::Mat m = cv::imread(files[i].string());
+        if(m.empty())
+            continue;
+        ImageMessage msg(camera_id, boost::make_shared<Image>(m), now());
+        r.push_back(msg.toBytes());
+    }
+    return r;
+}
+
+static std::vector<const_svec_ptr> geminiFrames(std::string const& dir, float range, float fov_degrees){
+    std::vector<const_svec_ptr> r;
+    std::vector<bf::path> files = imageFiles(dir);
+    for(std::size_t i = 0; i < files.size(); i++){
+        cv::Mat m = cv::imread(files[i].string(), 0);
+        if(m.empty() || !m.isContinuous())
+            continue;
+        // bearing bin edges, evenly spaced (in units of 1/6400 of a turn,
+        // * 0x10000)
+        std::vector<int32_t> bearing_bins;
+        for(int b = 0; b <= m.cols; b++){
+            const double degrees = fov_degrees * (double(b) / m.cols - 0.5);
+            bearing_bins.push_back(int32_t(degrees * (6400.0 / 360.0) * 0x10000));
+        }
+        SonarImageMessage msg(SonarID::Gemini, PolarImage(
+            std::vector<uint8_t>(m.data, m.data + m.rows * m.cols),
+            ImageEncodingType::RAW_uint8_1,
+            bearing_bins,
+            0, range, range / m.rows,
+            now()
+        ));
+        r.push_back(msg.toBytes());
+    }
+    return r;
+}
+
+// Replace camera input nodes, which need a camera or shared memory, with
+// network input nodes that will accept the recorded frames
+static SetPipelineMessage_ptr withNetInputs(SetPipelineMessage_ptr m, CameraID::e camera_id){
+    std::map<int32_t, NodeType::e> types = m->nodeTypes();
+    std::map<int32_t, std::map<LocalNodeInput, ParamValue> > params = m->nodeParams();
+    for(std::map<int32_t, NodeType::e>::iterator i = types.begin(); i != types.end(); i++){
+        if(i->second == NodeType::CameraInput || i->second == NodeType::DirectCameraInput){
+            info() << "replacing" << i->second << "node" << i->first << "with NetInput";
+            i->second = NodeType::NetInput;
+            params[i->first].clear();
+        }
+        if(i->second == NodeType::NetInput){
+            LocalNodeInput camera_param("camera id", 0, InputSchedType::Must_Be_New, std::vector<int32_t>());
+            params[i->first][camera_param] = ParamValue(int32_t(camera_id));
+        }
+    }
+    return boost::make_shared<SetPipelineMessage>(m->pipelineName(), types, m->nodeConnections(), params);
+}
+
+static void waitForIdle(Scheduler const& scheduler){
+    // the pipeline is only idle once every worker has gone back to waiting
+    // for work, and not just between jobs, so look twice
+    int idle_count = 0;
+    while(idle_count < 2){
+        boost::this_thread::sleep(boost::posix_time::microseconds(100));
+        idle_count = scheduler.idle()? idle_count + 1 : 0;
+    }
+}
+
+struct NodeReport{
+    node_id id;
+    std::string type;
+    std::size_t execs;
+    float exec_mean, exec_p50, exec_p90, exec_p99, exec_max;
+    float wait_mean, wait_p50, wait_p90, wait_p99;
+    float execs_per_sec;
+    uint64_t allocations;
+    uint64_t pool_misses;
+    uint64_t pool_bytes;
+};
+
+int main(int argc, char** argv){
+    cauv::Options options("Replay recorded frames through a saved image pipeline, and report per-node timings");
+    namespace po = boost::program_options;
+    options.desc.add_options()
+        ("pipeline,p", po::value<std::string>()->required(), "Serialised SetPipelineMessage")
+        ("camera,c", po::value<std::string>()->default_value(""), "Directory of camera frames (image files, in name order), or one image")
+        ("gemini,g", po::value<std::string>()->default_value(""), "Directory of Gemini frames (8-bit polar images, one row per range line)")
+        ("camera-id", po::value<int>()->default_value(CameraID::Forward), "Camera ID of the camera frames")
+        ("sonar-range", po::value<float>()->default_value(30), "Range (m) of the Gemini frames")
+        ("sonar-fov", po::value<float>()->default_value(120), "Field of view (degrees) of the Gemini frames")
+        ("rate,r", po::value<float>()->default_value(0), "Frames per second to feed (0 = each frame as soon as the last has been processed)")
+        ("repeat,n", po::value<int>()->default_value(10), "Number of times to replay the frames")
+        ("warmup,w", po::value<int>()->default_value(5), "Number of frames to feed before measuring")
+        ("threads,j", po::value<int>()->default_value(1), "Number of image processing threads (0 = one per hardware thread)")
+        ("json", po::value<std::string>()->default_value(""), "Also write the results as JSON to this file")
+        ("trace", po::value<std::string>()->default_value(""), "Trace the measured frames, and write the trace (Chrome trace format) to this file")
+      ;
+    options.pos.add("pipeline", 1);
+    try{
+        if(options.parseOptions(argc, argv))
+            return 0;
+    }catch(std::exception& e){
+        std::cerr << e.what() << std::endl << options.desc << std::endl;
+        return 1;
+    }
+
+    const std::string pipeline_fname = options.vm["pipeline"].as<std::string>();
+    const CameraID::e camera_id = CameraID::e(options.vm["camera-id"].as<int>());
+    const float rate = options.vm["rate"].as<float>();
+    const int repeat = options.vm["repeat"].as<int>();
+    const int warmup = options.vm["warmup"].as<int>();
+    const std::string json_fname = options.vm["json"].as<std::string>();
+    const std::string trace_fname = options.vm["trace"].as<std::string>();
+
+    // - load the pipeline and frames
+    std::ifstream pf(pipeline_fname.c_str(), std::ios::in | std::ios::binary);
+    svec_ptr pipeline_bytes = boost::make_shared<svec_t>(
+        (std::istreambuf_iterator<char>(pf)), std::istreambuf_iterator<char>()
+    );
+    if(pipeline_bytes->size() < 8 || *reinterpret_cast<uint32_t const*>(&(*pipeline_bytes)[0]) != SetPipelineMessage().id()){
+        error() << pipeline_fname << "is not a serialised SetPipelineMessage";
+        return 1;
+    }
+    SetPipelineMessage_ptr set_pipeline = withNetInputs(SetPipelineMessage::fromBytes(pipeline_bytes), camera_id);
+
+    const std::vector<const_svec_ptr> camera = cameraFrames(options.vm["camera"].as<std::string>(), camera_id);
+    const std::vector<const_svec_ptr> gemini = geminiFrames(
+        options.vm["gemini"].as<std::string>(),
+        options.vm["sonar-range"].as<float>(), options.vm["sonar-fov"].as<float>()
+    );
+    const std::size_t num_frames = std::max(camera.size(), gemini.size());
+    if(!num_frames){
+        error() << "no frames to replay";
+        return 1;
+    }
+    info() << "replaying" << camera.size() << "camera and" << gemini.size() << "sonar frames"
+           << repeat << "times through" << set_pipeline->pipelineName();
+
+    // - set up the pipeline
+    boost::shared_ptr<NullMailbox> mailbox = boost::make_shared<NullMailbox>();
+    boost::shared_ptr<BenchObserver> observer = boost::make_shared<BenchObserver>();
+    boost::shared_ptr<Scheduler> scheduler = boost::make_shared<Scheduler>(options.vm["threads"].as<int>());
+    scheduler->setObserver(observer);
+    boost::shared_ptr<ImageProcessor> processor = boost::make_shared<ImageProcessor>(mailbox, scheduler);
+    processor->start(set_pipeline->pipelineName());
+    processor->onSetPipelineMessage(set_pipeline);
+    scheduler->start();
+
+    // - replay
+    const int total = warmup + repeat * int(num_frames);
+    Timer run_timer;
+    uint64_t run_us = 0;
+    for(int f = 0; f < total; f++){
+        if(f == warmup){
+            waitForIdle(*scheduler);
+            observer->clear();
+            trace::enable(!trace_fname.empty());
+            run_timer.start();
+        }
+        const std::size_t i = f % num_frames;
+        Timer frame_timer;
+        frame_timer.start();
+        if(i < camera.size())
+            processor->onImageMessage(ImageMessage::fromBytes(camera[i]));
+        if(i < gemini.size())
+            processor->onSonarImageMessage(SonarImageMessage::fromBytes(gemini[i]));
+        if(rate > 0){
+            const int64_t wait_us = int64_t(1e6 / rate) - int64_t(frame_timer.stop());
+            if(wait_us > 0)
+                boost::this_thread::sleep(boost::posix_time::microseconds(wait_us));
+        }else{
+            waitForIdle(*scheduler);
+        }
+    }
+    waitForIdle(*scheduler);
+    run_us = run_timer.stop();
+    trace::enable(false);
+    scheduler->stopWait();
+    if(!trace_fname.empty() && !trace::dump(trace_fname))
+        error() << "failed to write trace to" << trace_fname;
+
+    // - report
+    const float run_s = run_us / 1e6f;
+    const int measured_frames = total - std::min(warmup, total);
+    std::vector<NodeReport> reports;
+    const std::map<Node const*, NodeSamples> samples = observer->samples();
+    for(std::map<Node const*, NodeSamples>::const_iterator i = samples.begin(); i != samples.end(); i++){
+        NodeSamples const& s = i->second;
+        node_ptr_t node = s.node.lock();
+        if(!node)
+            continue;
+        NodeReport r;
+        r.id = node->id();
+        r.type = mkStr() << node->type();
+        r.execs = s.exec_ms.size();
+        r.exec_mean = mean(s.exec_ms);
+        r.exec_p50 = percentile(s.exec_ms, 50);
+        r.exec_p90 = percentile(s.exec_ms, 90);
+        r.exec_p99 = percentile(s.exec_ms, 99);
+        r.exec_max = percentile(s.exec_ms, 100);
+        r.wait_mean = mean(s.wait_ms);
+        r.wait_p50 = percentile(s.wait_ms, 50);
+        r.wait_p90 = percentile(s.wait_ms, 90);
+        r.wait_p99 = percentile(s.wait_ms, 99);
+        r.execs_per_sec = run_s > 0? r.execs / run_s : 0;
+        r.allocations = s.allocations;
+        // (pool statistics include the warmup)
+        r.pool_misses = node->poolStats().misses;
+        r.pool_bytes = node->poolStats().bytes_allocated;
+        reports.push_back(r);
+    }
+
+    std::cout << "frames: " << measured_frames << " in " << run_s << "s (" << (run_s > 0? measured_frames / run_s : 0)
+              << " frames/s), " << mailbox->sent() << " messages sent\n";
+    std::cout << "node\ttype\texecs\texecs/s\texec mean/p50/p90/p99/max (ms)\twait mean/p50/p90/p99 (ms)\tallocs/exec\tpool misses\tpool bytes\n";
+    for(std::size_t i = 0; i < reports.size(); i++){
+        NodeReport const& r = reports[i];
+        std::cout << r.id << "\t" << r.type << "\t" << r.execs << "\t" << r.execs_per_sec << "\t"
+                  << r.exec_mean << "/" << r.exec_p50 << "/" << r.exec_p90 << "/" << r.exec_p99 << "/" << r.exec_max << "\t"
+                  << r.wait_mean << "/" << r.wait_p50 << "/" << r.wait_p90 << "/" << r.wait_p99 << "\t"
+                  << (r.execs? float(r.allocations) / r.execs : 0) << "\t" << r.pool_misses << "\t" << r.pool_bytes << "\n";
+    }
+    std::cout << std::flush;
+
+    if(!json_fname.empty()){
+        std::ofstream js(json_fname.c_str());
+        js << "{\n"
+           << "  \"pipeline\": " << jsonQuote(pipeline_fname) << ",\n"
+           << "  \"threads\": " << scheduler->numThreads() << ",\n"
+           << "  \"rate\": " << rate << ",\n"
+           << "  \"frames\": " << measured_frames << ",\n"
+           << "  \"seconds\": " << run_s << ",\n"
+           << "  \"frames_per_second\": " << (run_s > 0? measured_frames / run_s : 0) << ",\n"
+           << "  \"messages_sent\": " << mailbox->sent() << ",\n"
+           << "  \"nodes\": [";
+        for(std::size_t i = 0; i < reports.size(); i++){
+            NodeReport const& r = reports[i];
+            js << (i? ",\n" : "\n")
+               << "    {\"id\": " << r.id << ", \"type\": " << jsonQuote(r.type) << ", \"execs\": " << r.execs
+               << ", \"execs_per_second\": " << r.execs_per_sec
+               << ", \"exec_ms\": {\"mean\": " << r.exec_mean << ", \"p50\": " << r.exec_p50 << ", \"p90\": " << r.exec_p90
+               << ", \"p99\": " << r.exec_p99 << ", \"max\": " << r.exec_max << "}"
+               << ", \"queue_wait_ms\": {\"mean\": " << r.wait_mean << ", \"p50\": " << r.wait_p50 << ", \"p90\": " << r.wait_p90
+               << ", \"p99\": " << r.wait_p99 << "}"
+               << ", \"allocations\": " << r.allocations
+               << ", \"pool_misses\": " << r.pool_misses << ", \"pool_bytes\": " << r.pool_bytes << "}";
+        }
+        js << "\n  ]\n}\n";
+    }
+
+    processor.reset();
+    return 0;
+}
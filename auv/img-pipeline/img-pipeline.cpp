@@ -9,16 +9,29 @@
 #include <iostream>
 #include <sstream>
 
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include <boost/program_options.hpp>
 #include <boost/ref.hpp>
+#include <boost/thread.hpp>
+
+#include <debug/cauv_debug.h>
+#include <utility/string.h>
+#include <utility/trace.h>
 
 #include <common/mailbox.h>
+#include <common/msg_classes/image_pool.h>
 
 #include <generated/message_observers.h>
 #include <generated/types/MembershipChangedMessage.h>
 #include <generated/types/AddNodeMessage.h>
 #include <generated/types/GraphRequestMessage.h>
 #include <generated/types/SetPipelineMessage.h>
+#include <generated/types/PipelineTraceMessage.h>
+#include <generated/types/SetPipelineStateMessage.h>
+#include <generated/types/ActivatePipelineMessage.h>
 
 #include "imageProcessor.h"
 #include "scheduler.h"
@@ -37,16 +50,21 @@ ImagePipelineNode::ImagePipelineNode()
 {
     mailbox()->subMessage(AddNodeMessage());
     mailbox()->subMessage(GraphRequestMessage());
+    mailbox()->subMessage(PipelineTraceMessage());
+    mailbox()->subMessage(SetPipelineStateMessage());
+    mailbox()->subMessage(ActivatePipelineMessage());
 }
 
-void ImagePipelineNode::spawnNewPipeline(const std::string& with_name)
+void ImagePipelineNode::spawnNewPipeline(const std::string& with_name, bool active)
 {
     if(with_name.find(m_pipeline_name_root) != 0)
         return;
     if(!m_pipelines.count(with_name)){
-        info() << "starting pipeline, name: \"" << with_name << "\"";
+        info() << "starting pipeline, name: \"" << with_name << "\"" << (active? "" : "(on standby)");
         boost::shared_ptr<ImageProcessor> p = boost::make_shared<ImageProcessor>(mailbox(), m_scheduler);
         p->start(with_name);
+        if(!active)
+            p->pause();
         addMessageObserver(p);
         m_pipelines[with_name] = p;
     }
@@ -74,6 +92,45 @@ void ImagePipelineNode::onClearPipelineMessage(ClearPipelineMessage_ptr)
 {
 }
 
+void ImagePipelineNode::onSetPipelineStateMessage(SetPipelineStateMessage_ptr m)
+{
+    spawnNewPipeline(m->pipelineName(), m->pipelineState() == PipelineState::Play);
+}
+
+void ImagePipelineNode::onActivatePipelineMessage(ActivatePipelineMessage_ptr m)
+{
+    if(m->pipelineName().find(m_pipeline_name_root) != 0)
+        return;
+    auto standby = m_pipelines.find(m->standbyName());
+    if(standby == m_pipelines.end()){
+        error() << "no standby pipeline" << m->standbyName() << "to activate";
+        return;
+    }
+    spawnNewPipeline(m->pipelineName());
+    boost::shared_ptr<ImageProcessor> active = m_pipelines[m->pipelineName()];
+    try{
+        active->swapWithStandby(*standby->second);
+        std::swap(m_pipelines[m->pipelineName()], m_pipelines[m->standbyName()]);
+    }catch(std::exception& e){
+        error() << "could not activate" << m->standbyName() << ":" << e.what();
+    }
+}
+
+void ImagePipelineNode::onPipelineTraceMessage(PipelineTraceMessage_ptr m)
+{
+    if(m->pipelineName().find(m_pipeline_name_root) != 0)
+        return;
+    if(m->fileName().size()){
+        if(cauv::trace::dump(m->fileName()))
+            info() << "trace written to" << m->fileName();
+        else
+            error() << "failed to write trace to" << m->fileName();
+    }
+    if(m->enable() != cauv::trace::enabled())
+        info() << (m->enable()? "tracing started" : "tracing stopped");
+    cauv::trace::enable(m->enable());
+}
+
 void ImagePipelineNode::onRun()
 {
     spawnNewPipeline(m_pipeline_name_root);
@@ -94,6 +151,21 @@ void ImagePipelineNode::addOptions(po::options_description& desc,
             "For example, if name is 'ai', 'ai/skynet', 'ai' and 'ai/hal' "
             "would both be valid pipeline names that this process will "
             "respond to.")
+        ("threads,j", po::value<int>()->default_value(0),
+            "Number of image processing threads (0 = one per hardware thread)")
+        ("pin-threads", po::value<bool>()->default_value(false)->zero_tokens(),
+            "Pin each image processing thread to a CPU")
+        ("no-image-pool", po::value<bool>()->default_value(false)->zero_tokens(),
+            "Allocate every image buffer afresh instead of recycling them "
+            "(for comparison)")
+        ("trace", po::value<bool>()->default_value(false)->zero_tokens(),
+            "Start tracing node execution, scheduling and messaging straight "
+            "away (send SIGUSR2 to write the trace to "
+            "img-pipeline-<pid>.trace.json)")
+        ("async-log", po::value<bool>()->default_value(false)->zero_tokens(),
+            "Print log messages from a background thread, so that image "
+            "processing threads never wait for the console (messages are "
+            "dropped if they can't be printed fast enough)")
     ;
 
     pos.add("name", 1);
@@ -106,16 +178,53 @@ int ImagePipelineNode::useOptionsMap(po::variables_map& vm,
     if (ret != 0) return ret;
     
     m_pipeline_name_root = vm["name"].as<std::string>();
+    m_scheduler->setNumThreads(vm["threads"].as<int>());
+    m_scheduler->setPinThreads(vm["pin-threads"].as<bool>());
+    ImageBufferPool::get().setEnabled(!vm["no-image-pool"].as<bool>());
+    cauv::trace::enable(vm["trace"].as<bool>());
+    cauv::debug::setAsync(vm["async-log"].as<bool>());
 
     return 0;
 }
 
+// writes the trace to fname whenever one of sigs is received
+struct TraceDumper{
+    TraceDumper(sigset_t const& sigs, std::string const& fname)
+        : sigs(sigs), fname(fname){
+    }
+    void operator()(){
+        cauv::trace::setThreadName("trace dump");
+        int sig = 0;
+        while(sigwait(&sigs, &sig) == 0){
+            if(cauv::trace::dump(fname))
+                info() << "trace written to" << fname;
+            else
+                error() << "failed to write trace to" << fname;
+        }
+    }
+    sigset_t sigs;
+    std::string fname;
+};
+
+// must be called before any other threads are started: the signal is
+// blocked in this thread, and so in every thread started afterwards, and is
+// waited for by a thread of its own
+static void dumpTraceOnSignal(int sig, std::string const& fname)
+{
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, sig);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    boost::thread(TraceDumper(sigs, fname)).detach();
+}
+
 static boost::shared_ptr<ImagePipelineNode> node;
 
 void cleanup()
 {
     info() << "Cleaning up...";
     node.reset();
+    info() << "image buffer pool:" << cauv::ImageBufferPool::get().stats();
     info() << "Clean up done.";
 }
 
@@ -130,6 +239,8 @@ void interrupt(int sig)
 int main(int argc, char** argv)
 {
     signal(SIGINT, interrupt);
+    // before any other threads are started, so that they don't receive it
+    dumpTraceOnSignal(SIGUSR2, cauv::mkStr() << "img-pipeline-" << getpid() << ".trace.json");
     node = boost::make_shared<ImagePipelineNode>();
 
     // observes it's own mailbox
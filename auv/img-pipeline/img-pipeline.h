@@ -29,7 +29,7 @@ class ImagePipelineNode : public CauvNode,
     public:
         ImagePipelineNode();
 
-        void spawnNewPipeline(const std::string& with_name);
+        void spawnNewPipeline(const std::string& with_name, bool active = true);
         
         // message observer: new pipelines are created based on these messages
         // only:
@@ -38,6 +38,13 @@ class ImagePipelineNode : public CauvNode,
         virtual void onGraphRequestMessage(GraphRequestMessage_ptr m);
         virtual void onClearPipelineMessage(ClearPipelineMessage_ptr m);
         virtual void onSetPipelineMessage(SetPipelineMessage_ptr m);
+
+        // pipelines may also be created on standby, and swapped in later
+        virtual void onSetPipelineStateMessage(SetPipelineStateMessage_ptr m);
+        virtual void onActivatePipelineMessage(ActivatePipelineMessage_ptr m);
+
+        // tracing is process-wide, so applies to all of this node's pipelines
+        virtual void onPipelineTraceMessage(PipelineTraceMessage_ptr m);
     
     protected:
         virtual void onRun();
@@ -9,13 +9,17 @@
 #include <algorithm>
 
 #include <boost/range/adaptor/reversed.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
 
 #include <utility/time.h>
+#include <utility/trace.h>
 #include <utility/streamops/set.h>
 
 #include "imageProcessor.h"
 #include "pipelineTypes.h"
 #include "nodeFactory.h"
+#include "scheduler.h"
 
 using namespace cauv;
 using namespace cauv::imgproc;
@@ -124,7 +128,8 @@ Node::Input::Input(InputSchedType::e s,
       input_type(InType_Image),
       param_value(),
       tip(),
-      isconst(isconst){
+      isconst(isconst),
+      copy_counter(boost::make_shared<ImageCopyCounter>()){
 }
 
 Node::Input::Input(InputSchedType::e s,
@@ -139,7 +144,8 @@ Node::Input::Input(InputSchedType::e s,
       param_value(default_value),
       compatible_subtypes(compatible_subtypes.begin(), compatible_subtypes.end()),
       tip(tip),
-      isconst(Const){
+      isconst(Const),
+      copy_counter(){
 }
 
 Node::input_ptr Node::Input::makeImageInputShared(ConstQualifier isconst, InputSchedType::e const& st){
@@ -292,9 +298,8 @@ const char* Node::Image_Out_Copied_Name = "image out";
 
 Node::ConstructArgs::ConstructArgs(Scheduler& sched,
                                    ImageProcessor& pl,
-                                   const std::string& pl_name,
                                    NodeType::e type
-)   : sched(sched), pl(pl), pl_name(pl_name), type(type){
+)   : sched(sched), pl(pl), type(type){
 }
 
 Node::Node(ConstructArgs const& args)
@@ -303,6 +308,7 @@ Node::Node(ConstructArgs const& args)
       m_node_type(args.type),
       m_id(_newID()),
       m_inputs(),
+      m_param_defaults(),
       m_inputs_lock(),
       m_outputs(),
       m_outputs_lock(),
@@ -315,9 +321,10 @@ Node::Node(ConstructArgs const& args)
       m_allow_queue_lock(),
       m_sched(args.sched),
       m_pl(args.pl),
-      m_pl_name(args.pl_name),
       m_stopped(false),
       m_throughput_counter(0.1),
+      m_thread_utilisation(0),
+      m_pool_stats(),
       m_message_throttle(1, 2000){ // ie, one mesage every two seconds
 }
 
@@ -325,7 +332,8 @@ Node::Node(ConstructArgs const& args)
 Node::~Node(){
     if(!m_stopped)
         stop();
-    debug(2) << "~Node" << *this;
+    debug(2) << "~Node" << *this << m_pool_stats
+             << "copied on write:" << bytesCopiedOnWrite() << "bytes";
 }
 
 void Node::stop(){
@@ -367,8 +375,9 @@ node_id const& Node::id() const{
     return m_id;
 }
 
-const std::string& Node::plName() const{
-    return m_pl_name;
+std::string Node::plName() const{
+    // (the pipeline may be renamed when a standby pipeline is activated)
+    return m_pl.name();
 }
 
 void Node::setInput(input_id const& i_id, node_ptr_t n, output_id const& o_id){
@@ -666,24 +675,17 @@ static NodeStatus::e operator|(NodeStatus::e const& l, NodeStatus::e const& r){
 static NodeIOStatus::e operator|(NodeIOStatus::e const& l, NodeIOStatus::e const& r){
     return NodeIOStatus::e(unsigned(l) | unsigned(r));
 }
-struct isuniquevisitor : boost::static_visitor<bool> {
-    bool operator()(const cv::Mat& m) const { return !m.refcount || *m.refcount <= 1; } 
-    bool operator()(const NonUniformPolarMat& m) const { return operator()(m.mat); }
-    bool operator()(const PyramidMat& m) const {
-        for (const cv::Mat& mat : m.levels)
-            if (!operator()(mat))
-                return false;
-        return true;
-    }
-};
-
 // there must be a nicer way to do this... (yeah, it would involve pointers to
 // member functions)
 #define CallOnDestruct(Type, member) \
 struct _COD{_COD(Type& m):m(m){}~_COD(){m.member();}Type& m;}
 void Node::exec(){
     CallOnDestruct(Node, clearExecQueued) cod(*this);
+    trace::Scope exec_trace("exec", "pipeline", m_id);
+    ImageBufferPool::StatsScope pool_stats_scope(m_pool_stats);
     in_image_map_t inputs;
+    // inputs shared copy-on-write, and the bytes copied on each beforehand
+    std::vector< std::pair<input_ptr, uint64_t> > cow_inputs;
 
     lock_t il(m_inputs_lock);
     
@@ -705,40 +707,26 @@ void Node::exec(){
                         throw bad_input_error(v.first);
                     }
                 }
-                if(inputs[v.first])
+                if(inputs[v.first]){
                     bits += inputs[v.first]->bits();
+                    if(trace::enabled())
+                        exec_trace.frame(trace::frameId(inputs[v.first]->id().seq1, inputs[v.first]->id().seq2));
+                }
             }
-            // Check if we need to make a copy of this input so that we can modify it
-            if (ip->constQualifier() == NonConst) {
+            // If this input might be modified, and we're not the only child
+            // of the parent output, then share the image copy-on-write: the
+            // data is only copied if doWork actually writes to it (through
+            // mat(), augmentedMat() or apply()) while it's still shared.
+            // Potentially, params in the future may be shared ptrs too, will
+            // need their own check. Currently, just use images
+            if (ip->constQualifier() == NonConst && !ip->isParam() && inputs[v.first]) {
                 output_link_list_t siblingLinks = ip->target.node->linksOnOutput(ip->target.id);
-                bool needCopy = false;
-                if (siblingLinks.size() != 1)
-                {
-                    // We're not the only output of the parent
-                    // Check the refcount of the input
-
-                    // Potentially, params in the future may be shared ptrs too, will need their own check
-                    // Currently, just use images
-                    if (!ip->isParam()) {
-                        // If someone other than us and our parent holds this shared_ptr, make a copy
-                        if (inputs[v.first].use_count() >= 2) {
-                            debug(2) << "exec:" << *this << "copying image on" << v.first << "due to shared boost pointer";
-                            needCopy = true;
-                        }
-                        else {
-                            // Only we hold the boost pointer to the image, but there may still be
-                            // cv::Mat instances pointing to the same data.
-                            const image_ptr_t& img = inputs[v.first];
-                            bool isunique = img->apply_visitor(isuniquevisitor());
-                            if (!isunique) {
-                                debug(2) << "exec:" << *this << "copying image on" << v.first << "due to shared image data";
-                                needCopy = true;
-                            }
-                        }
-                    }
+                if (siblingLinks.size() != 1){
+                    inputs[v.first] = boost::make_shared<Image>(
+                        *inputs[v.first], Image::CopyOnWrite(), ip->copy_counter
+                    );
+                    cow_inputs.push_back(std::make_pair(ip, uint64_t(ip->copy_counter->bytes)));
                 }
-                if (needCopy)
-                    inputs[v.first] = boost::make_shared<Image>(*inputs[v.first]); 
             }
         }
     }catch(bad_input_error& e){
@@ -758,8 +746,10 @@ void Node::exec(){
     if(allowQueue()) status |= NodeStatus::AllowQueue;
     _statusMessage(status | NodeStatus::Executing);
     out_map_t outputs(inputs);    
+    m_thread_utilisation = m_sched.currentThreadUtilisation();
     m_throughput_counter.start();
     try{
+        trace::Scope do_work_trace("doWork", "pipeline", m_id);
         if(m_speed == asynchronous){
             // doWork will arrange for demandNewParentInput to be called when
             // appropriate
@@ -793,7 +783,14 @@ void Node::exec(){
         m_throughput_counter.fail();
         status |= NodeStatus::Bad;
     }
-    debug(4) << "finished:" << *this << "time=" << m_throughput_counter.time_taken() << "ms, time ratio=" << m_throughput_counter.time_ratio();
+    for (std::pair<input_ptr, uint64_t> const& c : cow_inputs){
+        const uint64_t copied = c.first->copy_counter->bytes - c.second;
+        if(copied)
+            debug(2) << "exec:" << *this << "copied" << copied << "bytes on write to input from"
+                     << c.first->target << "(total" << c.first->copy_counter->bytes << "bytes in"
+                     << c.first->copy_counter->copies << "copies)";
+    }
+    debug(4) << "finished:" << *this << "time=" << m_throughput_counter.time_taken() << "ms, time ratio=" << m_throughput_counter.time_ratio() << m_pool_stats;
     
     std::vector<output_link_t> children_to_notify;
     children_to_notify.reserve(m_outputs.size());
@@ -962,6 +959,11 @@ std::map<LocalNodeInput, ParamValue> Node::parameters() const{
     return r;
 }
 
+std::map<input_id, ParamValue> Node::paramDefaults() const{
+    lock_t l(m_inputs_lock);
+    return m_param_defaults;
+}
+
 /* set a parameter based on a message
  */
 void Node::setParam(boost::shared_ptr<const SetNodeParameterMessage>  m){
@@ -978,7 +980,7 @@ void Node::registerInputID(input_id const& i, ConstQualifier isconst, InputSched
     m_inputs.insert(
         private_in_map_t::value_type(i, Input::makeImageInputShared(isconst, st))
     );
-    _statusMessage(boost::make_shared<InputStatusMessage>(m_pl_name, m_id, i, NodeIOStatus::None));
+    _statusMessage(boost::make_shared<InputStatusMessage>(plName(), m_id, i, NodeIOStatus::None));
 }
 
 void Node::requireSyncInputs(input_id const& a, input_id const& b){
@@ -1030,6 +1032,12 @@ void Node::checkAddSched(SchedMode m){
         return;
     }
 
+    // nor are nodes of standby pipelines queued, until they're activated
+    if(m != Force && !m_pl.active()){
+        debug(4) << __func__ << "Cannot enqueue" << *this << ", pipeline on standby";
+        return;
+    }
+
     const bool out_demanded = newOutputDemanded();
     //const bool any_new_in = anyInputsAreNew();
     const bool all_required_in = allRequiredInputsAreNew();
@@ -1100,15 +1108,74 @@ void Node::checkAddSched(SchedMode m){
     // still going? then everything is ok for scheduling:
     debug(4) << __func__ << "Queueing node (" << m << "):" << *this;
     setExecQueued();
+    m_throughput_counter.queued();
     m_sched.addJob(shared_from_this(), m_priority);
 }
 
+cv::Mat Node::pooledMat(){
+    return ImageBufferPool::get().mat();
+}
+
+cv::Mat Node::pooledMat(cv::Size const& size, int type){
+    return ImageBufferPool::get().mat(size, type);
+}
+
+cv::Mat Node::pooledClone(cv::Mat const& m){
+    return ImageBufferPool::get().clone(m);
+}
+
+ImageBufferPool::Stats const& Node::poolStats() const{
+    return m_pool_stats;
+}
+
+uint64_t Node::bytesCopiedOnWrite() const{
+    lock_t l(m_inputs_lock);
+    uint64_t r = 0;
+    for (private_in_map_t::value_type const& v : m_inputs)
+        if(v.second->copy_counter)
+            r += v.second->copy_counter->bytes;
+    return r;
+}
+
+static void callRowBand(Node::row_band_fn_t const& fn, int band_index,
+                        int rows, int band_rows, int halo){
+    const cv::Range band(band_index * band_rows,
+                         std::min(rows, (band_index + 1) * band_rows));
+    const cv::Range src(std::max(0, band.start - halo),
+                        std::min(rows, band.end + halo));
+    fn(band, src);
+}
+
+void Node::parallelRows(cv::Mat const& mat, int halo, row_band_fn_t const& fn,
+                        int min_band_rows) const{
+    const int rows = mat.rows;
+    if(rows <= 0)
+        return;
+    // a couple of bands per thread, so that a thread that's busy with some
+    // other node when we start doesn't hold everything up at the end
+    int num_bands = 2 * m_sched.numThreads();
+    num_bands = std::max(1, std::min(num_bands, rows / std::max(1, min_band_rows)));
+    const int band_rows = (rows + num_bands - 1) / num_bands;
+    num_bands = (rows + band_rows - 1) / band_rows;
+    m_sched.parallelFor(num_bands, boost::bind(
+        callRowBand, boost::cref(fn), _1, rows, band_rows, halo
+    ));
+}
+
+void Node::parallelFor(int n, boost::function<void(int)> const& fn) const{
+    m_sched.parallelFor(n, fn);
+}
+
 void Node::sendMessage(boost::shared_ptr<Message const> m, MessageReliability p) const {
     m_pl.sendMessage(m, p);
 }
 
-void Node::subMessage(Message const& m){
-    m_pl.subMessage(m, m_id);
+void Node::subMessage(Message const& m, int32_t source){
+    m_pl.subMessage(m, m_id, source);
+}
+
+void Node::unSubMessage(Message const& m){
+    m_pl.unSubMessage(m, m_id);
 }
 
 
@@ -1125,7 +1192,7 @@ void Node::setNewInput(input_id const& a){
     }else{
         i->second->status = NodeInputStatus::New;
         _statusMessage(boost::make_shared<InputStatusMessage>(
-            m_pl_name, m_id, a, NodeIOStatus::New | NodeIOStatus::Valid
+            plName(), m_id, a, NodeIOStatus::New | NodeIOStatus::Valid
         ));
     }
     l.unlock();
@@ -1140,7 +1207,7 @@ void Node::setNewInput(){
     for (private_in_map_t::value_type& i : m_inputs){
         i.second->status = NodeInputStatus::New;
         _statusMessage(boost::make_shared<InputStatusMessage>(
-            m_pl_name, m_id, i.first, NodeIOStatus::New | NodeIOStatus::Valid
+            plName(), m_id, i.first, NodeIOStatus::New | NodeIOStatus::Valid
         ));
     }
     l.unlock();
@@ -1154,7 +1221,7 @@ void Node::clearNewInput(){
         if(i.second->status != NodeInputStatus::Invalid){
             i.second->status = NodeInputStatus::Old;
             _statusMessage(boost::make_shared<InputStatusMessage>(
-                m_pl_name, m_id, i.first, NodeIOStatus::Valid
+                plName(), m_id, i.first, NodeIOStatus::Valid
             ));
         }
     }
@@ -1199,7 +1266,7 @@ void Node::clearValidInput(input_id const& id){
     }else if(i->second->status != NodeInputStatus::Invalid){
         i->second->status = NodeInputStatus::Invalid;
         _statusMessage(boost::make_shared<InputStatusMessage>(
-            m_pl_name, m_id, id, NodeIOStatus::None
+            plName(), m_id, id, NodeIOStatus::None
         ));
     }
 }
@@ -1240,7 +1307,7 @@ void Node::setNewOutputDemanded(output_id const& o){
     m_output_demanded_on.insert(o);
     if(!output_demanded_already)
         _statusMessage(boost::make_shared<OutputStatusMessage>(
-            m_pl_name, m_id, o, NodeIOStatus::Demanded
+            plName(), m_id, o, NodeIOStatus::Demanded
         ));
     l.unlock();
     checkAddSched();
@@ -1252,7 +1319,7 @@ void Node::clearNewOutputDemanded(output_id const& o){
     m_output_demanded_on.erase(o);
     if(output_demanded_before !=  !!m_output_demanded_on.size())
         _statusMessage(boost::make_shared<OutputStatusMessage>(
-                m_pl_name, m_id, o, NodeIOStatus::e(0)
+                plName(), m_id, o, NodeIOStatus::e(0)
         ));
 }
 
@@ -1325,7 +1392,7 @@ Node::InternalParamValue Node::_getAndNotifyIfChangedInternalParam(input_id cons
         if(did_change){
             // TODO: is this desirable?
             //paramChanged(p);
-            sendMessage(boost::make_shared<NodeParametersMessage>(m_pl_name, id(), parameters()));
+            sendMessage(boost::make_shared<NodeParametersMessage>(plName(), id(), parameters()));
         }
         return r;
     }else{
@@ -1385,9 +1452,10 @@ void Node::_popQueueOutputForSync(output_id const& o_id){
 void Node::_statusMessage(NodeStatus::e const& status){
     if(status & NodeStatus::Bad || m_message_throttle.click())
         m_pl.sendMessage(boost::make_shared<StatusMessage const>(
-            m_pl_name, m_id, status, m_throughput_counter.mBitPerSecond(),
+            plName(), m_id, status, m_throughput_counter.mBitPerSecond(),
             m_throughput_counter.frequency(), m_throughput_counter.time_taken(),
-            m_throughput_counter.time_ratio()
+            m_throughput_counter.time_ratio(), m_throughput_counter.queue_wait(),
+            m_thread_utilisation
         ));
 }
 
@@ -19,12 +19,14 @@
 #include <boost/thread.hpp>
 #include <boost/variant.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
 
 #include <utility/string.h>
 #include <utility/testable.h>
 #include <utility/throughput.h>
 #include <utility/ratelimit.h>
 #include <common/msg_classes/image.h>
+#include <common/msg_classes/image_pool.h>
 #include <common/mailbox.h>
 #include <debug/cauv_debug.h>
 
@@ -296,6 +298,8 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
             std::string tip;
             input_ptr synchronised_with;
             ConstQualifier isconst;
+            // copies made of copy-on-write images passed to a NonConst input
+            image_copy_counter_ptr copy_counter;
 
             Input(InputSchedType::e s,
                   ConstQualifier isconst);
@@ -383,8 +387,8 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
 
     public:
         struct ConstructArgs{
-            Scheduler& sched; ImageProcessor& pl; const std::string& pl_name; NodeType::e type;
-            ConstructArgs(Scheduler& sched, ImageProcessor& pl, const std::string& pl_name, NodeType::e type);
+            Scheduler& sched; ImageProcessor& pl; NodeType::e type;
+            ConstructArgs(Scheduler& sched, ImageProcessor& pl, NodeType::e type);
         };
         Node(ConstructArgs const& args);
 
@@ -404,7 +408,7 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
 
         NodeType::e const& type() const;
         node_id const& id() const;
-        const std::string& plName() const;
+        std::string plName() const;
 
         // TODO: rename this to connectInput
         void setInput(input_id const& i_id, node_ptr_t n, output_id const& o_id);
@@ -444,6 +448,13 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
 
         int numChildren() const;
 
+        /* buffer pool hits and misses while this node was executing */
+        ImageBufferPool::Stats const& poolStats() const;
+
+        /* bytes of image data copied because this node wrote to shared
+         * images on its NonConst inputs, summed over all inputs */
+        uint64_t bytesCopiedOnWrite() const;
+
         void exec();
 
 
@@ -451,6 +462,10 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
          */
         std::map<LocalNodeInput, ParamValue> parameters() const;
 
+        /* the value each parameter was registered with
+         */
+        std::map<input_id, ParamValue> paramDefaults() const;
+
         /* set a parameter based on a message
          */
         void setParam(boost::shared_ptr<const SetNodeParameterMessage>  m);
@@ -471,7 +486,7 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
                         ip->param_value = InternalParamValue(v, mkUID(SensorUIDBase::Network));
                         ip->status = NodeInputStatus::New;
                         sendMessage(boost::make_shared<NodeParametersMessage>(
-                            m_pl_name, id(), parameters()
+                            plName(), id(), parameters()
                         ));
                         // provide notification that parameters have changed: principally
                         // for asynchronous nodes
@@ -604,6 +619,33 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
         enum Speed {slow=0, medium=5, fast=10, asynchronous=0xff};
         Speed m_speed;
 
+        /* Split the rows of mat into bands, and call fn(band, src) for each
+         * band in parallel on the pipeline's threads. band is the range of
+         * rows that fn should produce output for, src is band extended by
+         * halo rows either side (clipped to the image): the rows fn may need
+         * to read. Bands are never less than min_band_rows high.
+         * Returns when all bands are done; exceptions thrown by fn are
+         * rethrown.
+         */
+        typedef boost::function<void(cv::Range const& band, cv::Range const& src)> row_band_fn_t;
+        void parallelRows(cv::Mat const& mat, int halo, row_band_fn_t const& fn,
+                          int min_band_rows = 16) const;
+
+        /* Call fn(0) ... fn(n-1) in parallel on the pipeline's threads, for
+         * work that doesn't split into rows (see Scheduler::parallelFor).
+         */
+        void parallelFor(int n, boost::function<void(int)> const& fn) const;
+
+        /* Image buffers from the pipeline's buffer pool: outputs allocated
+         * like this are recycled once the last image referring to them is
+         * dropped, instead of being reallocated for every frame.
+         * pooledMat() is an empty cv::Mat, which can be passed as the output
+         * argument of OpenCV functions.
+         */
+        static cv::Mat pooledMat();
+        static cv::Mat pooledMat(cv::Size const& size, int type);
+        static cv::Mat pooledClone(cv::Mat const& m);
+
         /* Derived node types should call these functions (probably from their
          * init() method) in order to register valid input output and parameter
          * IDs.
@@ -620,8 +662,9 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
             m_inputs.insert(private_in_map_t::value_type(
                 p, Input::makeParamInputShared(ParamValue(default_value), tip, st)
             ));
+            m_param_defaults[p] = ParamValue(default_value);
             _statusMessage(boost::make_shared<InputStatusMessage>(
-                m_pl_name, m_id, p, NodeIOStatus::None
+                plName(), m_id, p, NodeIOStatus::None
             ));
         }
         
@@ -637,7 +680,7 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
             ));
 
             _statusMessage(boost::make_shared<OutputStatusMessage>(
-                m_pl_name, m_id, o, NodeIOStatus::None
+                plName(), m_id, o, NodeIOStatus::None
             ));
             
         }
@@ -666,8 +709,14 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
         bool unregisterOutputID(output_id const& o, bool warnNonexistent = true);
 
         void sendMessage(boost::shared_ptr<Message const>, MessageReliability reliability = RELIABLE_MSG) const;
-        void subMessage(Message const&);
-        //void unsubMessage(boost::shared_ptr<Message const>); !!! TODO
+        /* Receive messages of this type (through the InputNode handlers)
+         * from source (a CameraID, SonarID...), or from any source. Only
+         * messages that identify their source are filtered by it.
+         * Subscribing again adds another source.
+         */
+        void subMessage(Message const&, int32_t source = Any_Source);
+        // stop receiving messages of this type, from all sources
+        void unSubMessage(Message const&);
 
         /* Keep a record of which inputs are new (have changed since they were
          * last used by this node)
@@ -729,6 +778,8 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
         /* maps an input_id (including parameters) to an output of another node
          */
         private_in_map_t m_inputs;
+        // protected by m_inputs_lock
+        std::map<input_id, ParamValue> m_param_defaults;
         mutable mutex_t  m_inputs_lock;
 
         private_out_map_t m_outputs;
@@ -763,7 +814,7 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
          * This is used by checkAddSched(), which may decide that this node now
          * needs to be executed (this->exec()), so it adds this node to a
          * scheduler queue using:
-         *		m_sched.addToQueue(this, m_priority);
+         *		m_sched.addJob(shared_from_this(), m_priority);
          */
         Scheduler& m_sched;
 
@@ -771,7 +822,6 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
          * Used for sending messages, and node pointer -> node id lookups
          */
         ImageProcessor& m_pl;
-        const std::string m_pl_name;
         
         /* Derived classes may call stop() in their destructors if they have
          * cleanup that requires execution to be halted first.
@@ -784,6 +834,11 @@ class Node: public boost::enable_shared_from_this<Node>, boost::noncopyable{
         
         /* keep track of the amount of data being processed */
         cauv::ThroughputCounter m_throughput_counter;
+
+        /* utilisation of the pipeline thread that last executed this node */
+        float m_thread_utilisation;
+
+        ImageBufferPool::Stats m_pool_stats;
         
         /* don't send status messages too frequently! */
         RateLimiter m_message_throttle;
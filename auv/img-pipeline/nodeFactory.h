@@ -86,11 +86,11 @@ class NodeFactoryRegister{
             nodeRegister()[n] = f;
         }
         
-        static node_ptr_t create(Scheduler& s, ImageProcessor& pl, const std::string& n, NodeType::e const& t){        
+        static node_ptr_t create(Scheduler& s, ImageProcessor& pl, NodeType::e const& t){        
             lock_t l(registerLock());
             nt_creator_map_t::const_iterator i = nodeRegister().find(t);
             if(i != nodeRegister().end()){
-                return i->second->create(Node::ConstructArgs(s, pl, n, t));
+                return i->second->create(Node::ConstructArgs(s, pl, t));
             }else{
                 throw node_type_error("create: Invalid node type");
             }
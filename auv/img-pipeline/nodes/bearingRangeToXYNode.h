@@ -104,7 +104,7 @@ class BearingRangeToXYNode: public Node{
             debug(4) << "BearingRangeToXYNode:" << in_kps.size() << "kps, img:"
                      << img->id() << "output will have uid:" << kps_uid;
             
-            r.internalValue("keypoints") = InternalParamValue(img->apply_visitor(convertKeyPoints(in_kps)), kps_uid);
+            r.internalValue("keypoints") = InternalParamValue(img->constApplyVisitor(convertKeyPoints(in_kps)), kps_uid);
             
         }
     
@@ -57,7 +57,7 @@ class BilateralFilterNode: public Node{
 
             debug(5) << "BilateralFilterNode:" << diameter << sigmaColour << sigmaSpace;
             try{
-                cv::Mat out;
+                cv::Mat out = pooledMat();
                 cv::bilateralFilter(img, out,
                                     diameter, sigmaColour, sigmaSpace); 
                 r["image out"] = boost::make_shared<Image>(out);
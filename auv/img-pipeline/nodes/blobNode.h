@@ -116,7 +116,8 @@ class BlobNode: public Node{
             float width = 1;
             float height = 1;
             try {
-                augmented_mat_t m = inputs["image (not copied)"]->augmentedMat();
+                // blob detection only reads the image, so never copy it
+                augmented_mat_t m = inputs["image (not copied)"]->constAugmentedMat();
                 std::pair<int, int> dimensions = boost::apply_visitor(getDimensions(), m);
                 width = dimensions.first;
                 height = dimensions.second;
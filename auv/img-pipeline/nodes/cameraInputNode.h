@@ -34,6 +34,9 @@ class CameraInputNode: public AsynchronousNode{
         CameraInputNode(ConstructArgs const& args)
             : AsynchronousNode(args),
               m_server_connection(),
+              m_stream(),
+              m_stream_key(),
+              m_stream_seq(0),
               m_seq(0){
             setAllowQueue();
         }
@@ -49,6 +52,9 @@ class CameraInputNode: public AsynchronousNode{
             registerParamID<int>("device id", 0);
             registerParamID<int>("width", 640);
             registerParamID<int>("height", 480);
+            registerParamID<bool>("stream", false,
+                "have the camera server capture continuously, and always use "
+                "the newest frame");
         }
 
     protected:
@@ -71,6 +77,47 @@ class CameraInputNode: public AsynchronousNode{
             boost::shared_ptr<CameraServerConnection> m_connection;
         };
 
+        // keeps a StreamFrame (and so its slot in the ring) alive for as long
+        // as the image referring to it
+        struct StreamFrameDeleter{
+            StreamFrameDeleter(boost::shared_ptr<StreamFrame> f)
+                : m_frame(f){
+            }
+
+            void operator()(Image* img){
+                delete img;
+                m_frame.reset();
+            }
+
+            boost::shared_ptr<StreamFrame> m_frame;
+        };
+
+        void doWorkStreaming(int camera_id, int w, int h, out_map_t& r){
+            const std::vector<int> key = {camera_id, w, h};
+            if(!m_stream || m_stream->stopped() || key != m_stream_key){
+                m_stream.reset();
+                m_stream = boost::make_shared<CameraStream>(camera_id, w, h);
+                m_stream_key = key;
+                m_stream_seq = 0;
+            }
+
+            boost::shared_ptr<StreamFrame> f = m_stream->nextFrame(m_stream_seq, 1000);
+            if(!f){
+                warning() << "CameraInputNode: no frame from stream";
+                return;
+            }
+            m_stream_seq = f->seq();
+
+            r.internalValue("image_out") = boost::shared_ptr<Image>(
+                new Image(
+                    f->mat(),
+                    now(),
+                    mkUID(SensorUIDBase::Camera + camera_id, ++m_seq)
+                ),
+                StreamFrameDeleter(f)
+            );
+        }
+
         void doWork(in_image_map_t&, out_map_t& r){
 
             if(!m_server_connection)
@@ -81,6 +128,12 @@ class CameraInputNode: public AsynchronousNode{
             int h = param<int>("height");
             
             debug(4) << "CameraInputNode::doWork";
+
+            if(param<bool>("stream")){
+                doWorkStreaming(camera_id, w, h, r);
+                return;
+            }
+            m_stream.reset();
             
             SharedImage *s = m_server_connection->getUnGuardedImage(camera_id, w, h);
             
@@ -99,6 +152,9 @@ class CameraInputNode: public AsynchronousNode{
     protected:
 
         boost::shared_ptr<CameraServerConnection> m_server_connection;
+        boost::shared_ptr<CameraStream> m_stream;
+        std::vector<int> m_stream_key;
+        uint64_t m_stream_seq;
         uint64_t m_seq;
 
     // Register this node type
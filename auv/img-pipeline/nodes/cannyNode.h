@@ -54,9 +54,9 @@ class CannyNode: public Node{
             float ap = param<int>("aperture size");
             float g = param<int>("L2 gradient");
 
-            cv::Mat dst;
+            cv::Mat dst = pooledMat();
             try{
-                img->apply(boost::bind(cv::Canny, _1, boost::ref(dst), t1, t2, ap, g));
+                img->constApply(boost::bind(cv::Canny, _1, boost::ref(dst), t1, t2, ap, g));
                 r[Image_Out_Copied_Name] = boost::make_shared<Image>(dst);
             }catch(cv::Exception& e){
                 error() << "CannyNode:\n\t"
@@ -94,7 +94,7 @@ class ColourSimilarityNode: public Node{
             Colour colour = param<Colour>("colour");
             float sigma = param<float>("sigma");
 
-            r["image"] = boost::make_shared<Image>(img->apply(boost::bind(similarity<unsigned char>, _1, colour, sigma)));
+            r["image"] = boost::make_shared<Image>(img->constApply(boost::bind(similarity<unsigned char>, _1, colour, sigma)));
         }
     
     // Register this node type
@@ -56,7 +56,7 @@ class CombineRGBNode: public Node{
             if(r_depth != g_depth || r_depth != b_depth)
                 throw(parameter_error("RGB source channels are not of the same depth"));
             
-            cv::Mat out;
+            cv::Mat out = pooledMat();
             cv::Mat in[] = {B, G, R};
 
             try{
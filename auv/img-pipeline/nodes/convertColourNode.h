@@ -72,7 +72,7 @@ class ConvertColourNode: public Node{
                 throw parameter_error("Invalid output format: " + out_fmt);
             }
             
-            cv::Mat out;
+            cv::Mat out = pooledMat();
             if(conversion_code != 0){
                 try{
                     cv::cvtColor(in, out, conversion_code, 0);
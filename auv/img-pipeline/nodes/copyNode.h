@@ -48,7 +48,7 @@ class CopyNode: public Node{
             image_ptr_t img = inputs["image"];
             
             try{
-                r["image copy"] = boost::make_shared<Image>(*img); 
+                r["image copy"] = boost::make_shared<Image>(*img, ImageBufferPool::get());
             }catch(cv::Exception& e){
                 error() << "CopyNode:\n\t"
                         << e.err << "\n\t"
@@ -95,7 +95,7 @@ class DrawEllipsesNode: public Node{
             const int mode = param< int>("Draw mode");
             
             try{
-                augmented_mat_t out = img->apply(boost::bind(drawEllipses, _1, boost::ref(ellipses), boost::ref(mode)));
+                augmented_mat_t out = img->constApply(boost::bind(drawEllipses, _1, boost::ref(ellipses), boost::ref(mode)));
                 r[Image_Out_Copied_Name] = boost::make_shared<Image>(out);
             }catch(cv::Exception& e){
                 error() << "DrawEllipsesNode:\n\t"
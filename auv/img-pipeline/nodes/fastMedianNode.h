@@ -11,6 +11,9 @@
 #include <vector>
 #include <string>
 
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+
 #include <opencv2/core/core.hpp>
 
 #include "../node.h"
@@ -97,8 +100,111 @@ class FastMedianNode: public Node{
             assert(int(ret.size()) == 2*r+1);
             return ret;
         }
+        /* Median filter rows [band.start, band.end) of imat into output.
+         * The aperture is set up at the start of the band, so bands can be
+         * filtered independently.
+         */
+        static void fastMedianRows(cv::Mat const& imat, cv::Mat& output, int radius,
+                                   std::vector<int> const& ad, cv::Range const& band){
+            const int channels = imat.channels();
+            const int rows = imat.rows;
+            const int cols = imat.cols;
+            const int elem_size = imat.elemSize();
+
+            std::vector< HistAccumulator > accum(3, HistAccumulator());
+
+            /* Move the filter kernel over the band, maintaining per-channel
+             * histograms from which the median can easily be calculated:
+             *
+             *  radius                 ol = cols -1
+             * |======|                   |
+             * o--------------------------> -- row = band.start
+             *        <--------------------
+             *        -------------------->
+             *        <--------------------
+             *        -------------------->
+             *        <--------------------
+             *     -- --------------------> -- row = band.end-1
+             *        |                   |
+             *    col = 0
+             */
+
+            int row, col, ch, krow, kcol;
+            // lead-in: the part of the aperture centred on (band.start, 0)
+            // that lies inside the image
+            for(krow = clamp(0, band.start-radius, rows); krow < clamp(0, band.start+radius+1, rows); krow++){
+                const int aprow = radius+krow-band.start;
+                for(col = 0; col <= ad[aprow] && col < cols; col++)
+                    for(ch = 0; ch < channels; ch++)
+                        accum[ch].add(*(imat.ptr(krow) + col*elem_size + ch));
+            }
+            col = 0;
+            for(row = band.start; row < band.end; row++){
+                if((row - band.start) & 1){
+                    // <--------------
+                    assert(col == cols-1);
+                    for(; col > 0; col--)
+                        for(ch = channels-1; ch >= 0; ch--){
+                            *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
+                            for(krow = clamp(0, row-radius, rows); krow < clamp(0, row+radius+1, rows); krow++){
+                                const int aprow = radius+krow-row;
+                                if(col + ad[aprow] < cols)
+                                    accum[ch].rem(*(imat.ptr(krow) + (col + ad[aprow])*elem_size + ch));
+                                if(col - ad[aprow] - 1 >= 0)
+                                    accum[ch].add(*(imat.ptr(krow) + (col - ad[aprow] - 1)*elem_size + ch));
+                            }
+                        }
+                    for(ch = channels-1; ch >= 0; ch--)
+                        *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
+                    assert(col == 0);
+                    if(row + 1 == band.end)
+                        break;
+                    // move down one row
+                    for(kcol = 0; kcol <= clamp(0, radius, cols-1); kcol++){
+                        const int apcol = radius+kcol-col;
+                        if(row - ad[apcol] >=0)
+                            for(ch = 0; ch < channels; ch++)
+                                accum[ch].rem(*(imat.ptr(row - ad[apcol]) + kcol*elem_size + ch));
+                        if(row + ad[apcol] + 1 < rows)
+                            for(ch = 0; ch < channels; ch++)
+                                accum[ch].add(*(imat.ptr(row + ad[apcol] + 1) + kcol*elem_size + ch));
+                    }
+                }else{
+                    // --------------->
+                    assert(col == 0);
+                    for(; col < cols-1; col++)
+                        for(ch = 0; ch < channels; ch++){
+                            *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
+                            for(krow = clamp(0, row-radius, rows); krow < clamp(0, row+radius+1, rows); krow++){
+                                const int aprow = radius+krow-row;
+                                if(col - ad[aprow] >= 0)
+                                    accum[ch].rem(*(imat.ptr(krow) + (col - ad[aprow])*elem_size + ch));
+                                if(col + ad[aprow] + 1 < cols)
+                                    accum[ch].add(*(imat.ptr(krow) + (col + ad[aprow] + 1)*elem_size + ch));
+                            }
+                        }
+                    for(ch = 0; ch < channels; ch++)
+                        *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
+                    assert(col == cols-1);
+                    if(row + 1 == band.end)
+                        break;
+                    // move down one row
+                    for(kcol = col; kcol >= clamp(0, col-radius, cols); kcol--){
+                        const int apcol = radius+kcol-col;
+                        if(row - ad[apcol] >=0)
+                            for(ch = 0; ch < channels; ch++)
+                                accum[ch].rem(*(imat.ptr(row - ad[apcol]) + kcol*elem_size + ch));
+                        if(row + ad[apcol] + 1 < rows)
+                            for(ch = 0; ch < channels; ch++)
+                                accum[ch].add(*(imat.ptr(row + ad[apcol] + 1) + kcol*elem_size + ch));
+                    }
+                }
+            }
+        }
+
         struct applyFastMedian: boost::static_visitor<augmented_mat_t>{
-            applyFastMedian(float sigma) : m_sigma(sigma){ }
+            applyFastMedian(FastMedianNode const& node, float sigma)
+                : m_node(node), m_sigma(sigma){ }
             augmented_mat_t operator()(cv::Mat a) const{
                 int radius = int(m_sigma+0.5);
                  
@@ -110,99 +216,15 @@ class FastMedianNode: public Node{
                     throw(parameter_error("image must be <= 3-channel"));
                     // TODO: support vector parameters
                 
-                const int channels = a.channels();
-                const int rows = a.rows;
-                const int cols = a.cols;
-                const int elem_size = a.elemSize();
                 const std::vector<int> ad = calcApertureDiff(radius);
-                const cv::Mat& imat = a;
-                
-                std::vector< HistAccumulator > accum(3, HistAccumulator());
-                cv::Mat output(imat.size(), imat.type());
-                
-                /* Move the filter kernel over the image, maintaining per-channel
-                 * histograms from which the median can easily be calculated:
-                 *
-                 *  radius                 ol = cols -1
-                 * |======|                   |
-                 * o--------------------------> -- row = 0
-                 *        <--------------------
-                 *        -------------------->
-                 *        <--------------------
-                 *        -------------------->
-                 *        <--------------------
-                 *     -- --------------------> -- row = rows-1
-                 *        |                   |
-                 *    col = 0
-                 */
-                
-                int row, col, ch, krow, kcol;
-                // lead-in:
-                for(col = -radius; col <= 0; col++)
-                    for(ch = 0; ch < channels; ch++)
-                        for(krow = 0; krow <= radius; krow++){
-                            const int aprow = radius+krow;
-                            if(col + ad[aprow] >= 0)
-                                accum[ch].add(*(imat.ptr(krow) + (col +ad[aprow])*elem_size +ch));
-                        }
-                col = 0;
-                for(row = 0; row < rows; row++){
-                    if(row & 1){
-                        // <--------------
-                        assert(col == cols-1);
-                        for(; col > 0; col--)
-                            for(ch = channels-1; ch >= 0; ch--){
-                                *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
-                                for(krow = clamp(0, row-radius, rows); krow < clamp(0, row+radius+1, rows); krow++){
-                                    const int aprow = radius+krow-row;
-                                    if(col + ad[aprow] < cols)
-                                        accum[ch].rem(*(imat.ptr(krow) + (col + ad[aprow])*elem_size + ch));
-                                    if(col - ad[aprow] - 1 >= 0)
-                                        accum[ch].add(*(imat.ptr(krow) + (col - ad[aprow] - 1)*elem_size + ch));
-                                }
-                            }
-                        for(ch = channels-1; ch >= 0; ch--)
-                            *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
-                        assert(col == 0);
-                        // move down one row
-                        for(kcol = 0; kcol <= clamp(0, radius, cols); kcol++){
-                            const int apcol = radius+kcol-col;
-                            if(row - ad[apcol] >=0)
-                                for(ch = 0; ch < channels; ch++)
-                                    accum[ch].rem(*(imat.ptr(row - ad[apcol]) + kcol*elem_size + ch));
-                            if(row + ad[apcol] + 1 < rows)
-                                for(ch = 0; ch < channels; ch++)
-                                    accum[ch].add(*(imat.ptr(row + ad[apcol] + 1) + kcol*elem_size + ch));
-                        }
-                    }else{
-                        // --------------->
-                        assert(col == 0);
-                        for(; col < cols-1; col++)
-                            for(ch = 0; ch < channels; ch++){
-                                *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
-                                for(krow = clamp(0, row-radius, rows); krow < clamp(0, row+radius+1, rows); krow++){
-                                    const int aprow = radius+krow-row;
-                                    if(col - ad[aprow] >= 0)
-                                        accum[ch].rem(*(imat.ptr(krow) + (col - ad[aprow])*elem_size + ch));
-                                    if(col + ad[aprow] + 1 < cols)
-                                        accum[ch].add(*(imat.ptr(krow) + (col + ad[aprow] + 1)*elem_size + ch));
-                                }
-                            }
-                        for(ch = 0; ch < channels; ch++)
-                            *(output.ptr(row) + col*elem_size + ch) = accum[ch].median();
-                        assert(col == cols-1);
-                        // move down one row
-                        for(kcol = col; kcol >= clamp(0, col-radius, cols); kcol--){
-                            const int apcol = radius+kcol-col;
-                            if(row - ad[apcol] >=0)
-                                for(ch = 0; ch < channels; ch++)
-                                    accum[ch].rem(*(imat.ptr(row - ad[apcol]) + kcol*elem_size + ch));
-                            if(row + ad[apcol] + 1 < rows)
-                                for(ch = 0; ch < channels; ch++)
-                                    accum[ch].add(*(imat.ptr(row + ad[apcol] + 1) + kcol*elem_size + ch));
-                        }
-                    }
-                }
+                cv::Mat output = pooledMat(a.size(), a.type());
+
+                // each band has to fill the aperture before it starts, so
+                // don't bother splitting into bands much smaller than that
+                m_node.parallelRows(a, radius, boost::bind(
+                    fastMedianRows, boost::cref(a), boost::ref(output), radius, boost::cref(ad), _1
+                ), 2*radius+1);
+
                 return output;
             }
             augmented_mat_t operator()(NonUniformPolarMat a) const{
@@ -219,6 +241,7 @@ class FastMedianNode: public Node{
                 error() << "not implemented";
                 return a;
             }
+            FastMedianNode const& m_node;
             const float m_sigma;
         };
 
@@ -227,7 +250,7 @@ class FastMedianNode: public Node{
             float radius = param<float>("radius");
 
             image_ptr_t img = inputs["image"];
-            augmented_mat_t out = img->apply_visitor(applyFastMedian(radius));
+            augmented_mat_t out = img->constApplyVisitor(applyFastMedian(*this, radius));
 
             r["image"] = boost::make_shared<Image>(out);
 
@@ -136,7 +136,7 @@ class FileInputNode: public AsynchronousNode{
             }
             
             if(!image.empty())
-                r.internalValue("image") = boost::make_shared<Image>(image.clone(), now(), mkUID(SensorUIDBase::File + m_instance_num, ++m_seq));
+                r.internalValue("image") = boost::make_shared<Image>(pooledClone(image), now(), mkUID(SensorUIDBase::File + m_instance_num, ++m_seq));
             r["fps"] = (float)m_fps;
         }
 
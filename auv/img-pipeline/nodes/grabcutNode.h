@@ -45,7 +45,7 @@ class GrabCutNode: public Node{
     protected:
         void doWork(in_image_map_t& inputs, out_map_t& r){
 
-            cv::Mat img = inputs["image"]->mat();
+            cv::Mat img = inputs["image"]->constMat();
             cv::Mat mask = inputs["mask"]->mat();
             
             int iterations = param<int>("iterations");
@@ -255,7 +255,7 @@ void cauv::imgproc::HoughLinesNode::doWork(in_image_map_t& inputs, out_map_t& r)
     const int stn = param<int>("stn");
 
     try{
-        r["lines"] = img->apply_visitor(HoughLinesVisitor(probabilistic, rho, theta, threshold, min_ll, max_lg, srn, stn));
+        r["lines"] = img->constApplyVisitor(HoughLinesVisitor(probabilistic, rho, theta, threshold, min_ll, max_lg, srn, stn));
     }catch(cv::Exception& e){
         error() << "HoughLinesNode:\n\t"
                 << e.err << "\n\t"
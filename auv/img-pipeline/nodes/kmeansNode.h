@@ -14,6 +14,9 @@
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_smallint.hpp>
 #include <boost/random/variate_generator.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <opencv2/core/core.hpp>
 
@@ -30,6 +33,7 @@ class KMeansNode: public Node{
         KMeansNode(ConstructArgs const& args) :
                 Node(args),
                 m_channels(-1),
+                m_clusters_mux(),
                 bytedist(0, 255),
                 randbyte(gen, bytedist)
         {
@@ -66,15 +70,88 @@ class KMeansNode: public Node{
 
         std::vector< cluster > m_clusters;
         int m_channels;
+        // protects the cluster sums while pixels are being assigned
+        boost::mutex m_clusters_mux;
         
         boost::mt19937 gen;
         boost::uniform_smallint<> bytedist;
         boost::variate_generator<boost::mt19937&, boost::uniform_smallint<> > randbyte;
 
+        // Label the pixels in band with the nearest cluster, and add them to
+        // the cluster sums
+        void assignRows(cv::Mat const& img, cv::Mat_<unsigned char>& clusteridsMat,
+                        cv::Range const& band){
+            const int cols = img.cols;
+            const int elem_size = img.elemSize();
+            const int row_size = img.step[0];
+            const size_t K = m_clusters.size();
+            const unsigned char *img_rp, *img_cp, *img_bp;
+            int y, x, ch;
+
+            std::vector<unsigned int> sizes(K, 0);
+            std::vector<int> valsums(K * m_channels, 0);
+
+            for(y = band.start, img_rp = img.data + band.start * row_size; y < band.end; y++, img_rp += row_size)
+                for(x = 0, img_cp = img_rp; x < cols; x++, img_cp += elem_size)
+                {
+                    size_t best_cl_i = K;
+                    unsigned int best_cl_sqdiff = UINT_MAX;      
+                    for (size_t i = 0; i < K; i++) {
+                        cluster const& cl = m_clusters[i];
+                        unsigned int sqdiff = 0;
+                        for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
+                        {
+                            sqdiff += (*img_bp - cl.centre[ch]) * (*img_bp - cl.centre[ch]);
+                        }
+
+                        if (sqdiff < best_cl_sqdiff) {
+                            best_cl_i = i;
+                            best_cl_sqdiff = sqdiff;
+                        }
+                    }
+                    assert(best_cl_i < K);
+                    clusteridsMat.at<unsigned char>(y,x) = clamp_cast<unsigned char>((unsigned char)0, best_cl_i, (unsigned char)255);
+                    sizes[best_cl_i]++;
+                    for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
+                    {
+                        valsums[best_cl_i * m_channels + ch] += *img_bp;
+                    }
+                }
+
+            boost::lock_guard<boost::mutex> l(m_clusters_mux);
+            for (size_t i = 0; i < K; i++) {
+                cluster& cl = m_clusters[i];
+                cl.size += sizes[i];
+                for(ch = 0; ch < m_channels; ch++)
+                    cl.valsum[ch] += valsums[i * m_channels + ch];
+            }
+        }
+
+        void coloriseRows(cv::Mat& img, cv::Mat_<unsigned char> const& clusteridsMat,
+                          cv::Range const& band) const{
+            const int cols = img.cols;
+            const int elem_size = img.elemSize();
+            const int row_size = img.step[0];
+            unsigned char *img_rp, *img_cp, *img_bp;
+            int y, x, ch;
+
+            for(y = band.start, img_rp = img.data + band.start * row_size; y < band.end; y++, img_rp += row_size)
+                for(x = 0, img_cp = img_rp; x < cols; x++, img_cp += elem_size)
+                {
+                    cluster const& cl = m_clusters[clusteridsMat.at<unsigned char>(y,x)];
+
+                    for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
+                    {
+                        *img_bp = cl.centre[ch];
+                    }
+                }
+        }
+
         // Don't be surprised, this one does one iteration, but keeps the result between frames
         void doWork(in_image_map_t& inputs, out_map_t& r){
 
-            cv::Mat img = inputs["image"]->mat();
+            // the image is only written to if it's colorised
+            cv::Mat img = inputs["image"]->constMat();
             
             int K = param<int>("K");
             bool colorise = !!param<int>("colorise");
@@ -128,7 +205,7 @@ class KMeansNode: public Node{
             const int row_size = img.step[0];
             unsigned char *img_rp, *img_cp, *img_bp;
 
-            cv::Mat_<unsigned char> clusteridsMat(rows, cols);
+            cv::Mat_<unsigned char> clusteridsMat = pooledMat(cv::Size(cols, rows), CV_8UC1);
 
             // Clear val sums and sizes (val sum for single pass mean calculation)
             for (size_t i = 0; i < m_clusters.size(); i++) {
@@ -141,33 +218,9 @@ class KMeansNode: public Node{
             }
 
             // Assign each pixel to the nearest cluster
-            for(y = 0, img_rp = img.data; y < rows; y++, img_rp += row_size)
-                for(x = 0, img_cp = img_rp; x < cols; x++, img_cp += elem_size)
-                {
-                    size_t best_cl_i = K;
-                    unsigned int best_cl_sqdiff = UINT_MAX;      
-                    for (size_t i = 0; i < m_clusters.size(); i++) {
-                        cluster& cl = m_clusters[i];
-                        unsigned int sqdiff = 0;
-                        for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
-                        {
-                            sqdiff += (*img_bp - cl.centre[ch]) * (*img_bp - cl.centre[ch]);
-                        }
-
-                        if (sqdiff < best_cl_sqdiff) {
-                            best_cl_i = i;
-                            best_cl_sqdiff = sqdiff;
-                        }
-                    }
-                    assert(best_cl_i < (unsigned int)K);
-                    clusteridsMat.at<unsigned char>(y,x) = clamp_cast<unsigned char>((unsigned char)0, best_cl_i, (unsigned char)255);
-                    cluster& best_cl = m_clusters[best_cl_i];
-                    best_cl.size++;
-                    for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
-                    {
-                        best_cl.valsum[ch] += *img_bp;
-                    }
-                }
+            parallelRows(img, 0, boost::bind(
+                &KMeansNode::assignRows, this, boost::cref(img), boost::ref(clusteridsMat), _1
+            ));
 
             // Find empty clusters, and assign to them the most distant point
             for (size_t i = 0; i < m_clusters.size(); i++)
@@ -247,24 +300,18 @@ class KMeansNode: public Node{
             }
 
 
+            r["labels"] = boost::make_shared<Image>(clusteridsMat);
             if (colorise) {
                 // Colorise if necessary
-
-                for(y = 0, img_rp = img.data; y < rows; y++, img_rp += row_size)
-                    for(x = 0, img_cp = img_rp; x < cols; x++, img_cp += elem_size)
-                    {
-                        cluster& cl = m_clusters[clusteridsMat.at<unsigned char>(y,x)];
-
-                        for(ch = 0, img_bp = img_cp; ch < m_channels; ch++, img_bp++)
-                        {
-                            *img_bp = cl.centre[ch];
-                        }
-                    }
+                img = inputs["image"]->mat();
+                parallelRows(img, 0, boost::bind(
+                    &KMeansNode::coloriseRows, this, boost::ref(img), boost::cref(clusteridsMat), _1
+                ));
+                r["image (not copied)"] = boost::make_shared<Image>(img);
+            }else{
+                r["image (not copied)"] = inputs["image"];
             }
             
-            r["labels"] = boost::make_shared<Image>(clusteridsMat);
-            r["image (not copied)"] = boost::make_shared<Image>(img);
-            
         }
     
     // Register this node type
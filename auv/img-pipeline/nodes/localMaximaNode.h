@@ -8,9 +8,12 @@
 #define __LOCAL_MAXIMA_NODE_H__
 
 #include <numeric>
+#include <map>
 
 #include <boost/make_shared.hpp>
 #include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -36,14 +39,11 @@ class LocalMaximaNode: public Node{
         }
 
     protected:
-        static std::vector<KeyPoint> globalMaxima(cv::Mat a, float delta) {
+        static void localMaximaRows(cv::Mat const& a, float delta, cv::Range const& band,
+                                    boost::mutex& mux, std::map<int, std::vector<KeyPoint> >& results){
             std::vector<KeyPoint> r;
-            if(a.channels() != 1)
-                throw parameter_error("image must have 1 channel");
-            if(a.type() != CV_8U)
-                throw parameter_error("image must be unsigned bytes");
-            
-            for(int row = 1; row < a.rows-1; row++)
+            const int row_end = std::min(band.end, a.rows-1);
+            for(int row = std::max(1, band.start); row < row_end; row++)
                 for(int col = 1; col < a.cols-1; col++){
                     const uint8_t v = a.at<uint8_t>(row,col);
                     uint8_t s[8];
@@ -59,6 +59,28 @@ class LocalMaximaNode: public Node{
                         r.push_back(KeyPoint(floatXY(col,row), 3, 0, v - surround_mean, 0, 0));
                     }
                 }
+            boost::lock_guard<boost::mutex> l(mux);
+            results[band.start].swap(r);
+        }
+
+        std::vector<KeyPoint> localMaxima(cv::Mat a, float delta) const{
+            if(a.channels() != 1)
+                throw parameter_error("image must have 1 channel");
+            if(a.type() != CV_8U)
+                throw parameter_error("image must be unsigned bytes");
+
+            // results from each band, keyed by the band's first row so that
+            // they can be put back together in order
+            boost::mutex mux;
+            std::map<int, std::vector<KeyPoint> > band_results;
+            parallelRows(a, 1, boost::bind(
+                localMaximaRows, boost::cref(a), delta, _1, boost::ref(mux), boost::ref(band_results)
+            ));
+
+            std::vector<KeyPoint> r;
+            typedef std::map<int, std::vector<KeyPoint> >::value_type band_result_t;
+            for (band_result_t const& b : band_results)
+                r.insert(r.end(), b.second.begin(), b.second.end());
             return r;
         };
         void doWork(in_image_map_t& inputs, out_map_t& r){
@@ -67,7 +89,7 @@ class LocalMaximaNode: public Node{
             const float delta = param<float>("delta");
             
             try{
-                r["keypoints"] = img->apply(boost::bind(globalMaxima, _1, delta));
+                r["keypoints"] = img->constApply(boost::bind(&LocalMaximaNode::localMaxima, this, _1, delta));
             }catch(cv::Exception& e){
                 error() << "LocalMaximaNode:\n\t"
                         << e.err << "\n\t"
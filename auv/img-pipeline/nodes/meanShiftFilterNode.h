@@ -61,7 +61,7 @@ class MeanShiftFilterNode: public Node{
             int maxLevel = param<int>("max level");
             
             try {
-                augmented_mat_t out = img->apply(boost::bind(meanShiftFilter, _1, sp, sr, maxLevel));
+                augmented_mat_t out = img->constApply(boost::bind(meanShiftFilter, _1, sp, sr, maxLevel));
                 r["image"] = boost::make_shared<Image>(out);
             } catch (cv::Exception& e) {
                 error() << "MeanShiftFilterNode:\n\t"
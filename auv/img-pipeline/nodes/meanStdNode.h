@@ -60,7 +60,7 @@ class MeanStdNode: public Node{
 
             image_ptr_t img = inputs["image"];
             
-            std::pair<Colour,Colour> meanStd = img->apply(boost::bind(getMeanStd, _1));
+            std::pair<Colour,Colour> meanStd = img->constApply(boost::bind(getMeanStd, _1));
 
             r["mean"] = meanStd.first;
             r["stddev"] = meanStd.second;
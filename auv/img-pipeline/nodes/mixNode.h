@@ -81,7 +81,7 @@ class MixNode: public Node{
         void doWork(in_image_map_t& inputs, out_map_t& r){
 
             augmented_mat_t img = inputs["image"]->augmentedMat();
-            augmented_mat_t mix = inputs["mix"]->augmentedMat();
+            augmented_mat_t mix = inputs["mix"]->constAugmentedMat();
             
             float img_f = param<float>("image fac");
             float mix_f = param<float>("mix fac");
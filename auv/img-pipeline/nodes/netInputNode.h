@@ -34,8 +34,8 @@ class NetInputNode: public InputNode{
         void init(){
             // registerInputID()
 
-            // need to receive ImageMessages
-            subMessage(ImageMessage());
+            // need to receive ImageMessages from the source camera
+            subMessage(ImageMessage(), CameraID::Forward);
             
             // one output:
             registerOutputID("image_out");
@@ -43,6 +43,13 @@ class NetInputNode: public InputNode{
             // one parameter: the source camera
             registerParamID<int>("camera id", CameraID::Forward);
         }
+
+        virtual void paramChanged(input_id const& p){
+            if(p == "camera id"){
+                unSubMessage(ImageMessage());
+                subMessage(ImageMessage(), param<int>("camera id"));
+            }
+        }
     
         virtual ~NetInputNode(){
             info() << "~NetInputNode statistics"
@@ -58,7 +65,7 @@ class NetInputNode: public InputNode{
          */
         void onImageMessage(boost::shared_ptr<const ImageMessage> m){
             debug(4) << "Input node received an image";
-            if(m->source() != param<int>("camera id")) {
+            if(m->view_source() != param<int>("camera id")) {
                 return;
             }
 
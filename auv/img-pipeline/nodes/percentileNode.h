@@ -136,7 +136,7 @@ class PercentileNode: public Node{
             
             float pct = param<BoundedFloat>("percentile");
             
-            r["value"] = img->apply(boost::bind(getPercentile, _1, pct));
+            r["value"] = img->constApply(boost::bind(getPercentile, _1, pct));
         }
     
     // Register this node type
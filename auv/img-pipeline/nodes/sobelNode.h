@@ -64,7 +64,7 @@ class SobelNode: public Node{
             augmented_mat_t in = img->augmentedMat();
 
             try{
-                r["image_out"] = boost::make_shared<Image>(img->apply(boost::bind(sobel, _1, xorder, yorder, size)));
+                r["image_out"] = boost::make_shared<Image>(img->constApply(boost::bind(sobel, _1, xorder, yorder, size)));
             }catch(cv::Exception& e){
                 error() << "SobelNode:\n\t"
                         << e.err << "\n\t"
@@ -0,0 +1,169 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+// Replays a pose graph one key scan at a time through GraphOptimiserV1 and
+// GraphOptimiserIncremental, as SlamCloudGraph would when adding key scans,
+// and compares the time they take and the error they leave.
+//
+// The graph is either the constraints saved by SlamCloudGraph in a map file
+// (see slamMapStore.h), or a synthetic survey of repeated loops with noisy
+// odometry.
+//
+// usage: benchmark_graphOptimiser [map file | -] [graph iters] [synthetic scans]
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <cstdlib>
+
+#include <boost/make_shared.hpp>
+
+#include <utility/foreach.h>
+#include <utility/string.h>
+#include <utility/performance.h>
+#include <debug/cauv_debug.h>
+
+#include "graphOptimiser.h"
+#include "slamCloud.h"
+#include "slamMapStore.h"
+#include "stuff.h"
+
+namespace ci = cauv::imgproc;
+
+struct SavedConstraint{
+    std::size_t parent;
+    std::size_t child;
+    ci::RelativePose b_wrt_a;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<SavedConstraint, Eigen::aligned_allocator<SavedConstraint> > saved_constraint_vec;
+
+static saved_constraint_vec loadConstraints(std::string const& fname){
+    saved_constraint_vec r;
+    ci::SlamMapStore store(fname, false);
+    foreach(ci::SlamMapStore::Constraint const& s, store.constraints()){
+        SavedConstraint c;
+        c.parent = s.parent;
+        c.child = s.child;
+        c.b_wrt_a = s.b_wrt_a;
+        r.push_back(c);
+    }
+    return r;
+}
+
+static float frand(){
+    return std::rand() / float(RAND_MAX) - 0.5f;
+}
+
+// square loops of 40 scans, constrained to the previous scan with a noisy
+// odometry-like match, and to the scan in the same place on the previous loop
+static saved_constraint_vec syntheticConstraints(std::size_t num_scans){
+    saved_constraint_vec r;
+    for(std::size_t i = 1; i < num_scans; i++){
+        SavedConstraint c;
+        c.parent = i-1;
+        c.child = i;
+        c.b_wrt_a = ci::RelativePose(1 + 0.05*frand(), 0.05*frand(), (i % 10? 0 : M_PI/2) + 0.02*frand());
+        r.push_back(c);
+        if(i >= 40){
+            c.parent = i-40;
+            c.b_wrt_a = ci::RelativePose(0.05*frand(), 0.05*frand(), 0.02*frand());
+            r.push_back(c);
+        }
+    }
+    return r;
+}
+
+struct Result{
+    Result() : total_us(0), max_us(0), final_error(0){ }
+    Timer::diff_t total_us;
+    Timer::diff_t max_us;
+    float final_error;
+};
+
+/* Add the key scans in order: each one starts where its first constraint
+ * puts it, and the graph is optimised after each one is added.
+ */
+static Result replay(saved_constraint_vec const& saved, ci::GraphOptimiser const& g){
+    std::map<std::size_t, saved_constraint_vec> by_scan;
+    foreach(SavedConstraint const& c, saved)
+        by_scan[std::max(c.parent, c.child)].push_back(c);
+
+    Result r;
+    std::map<std::size_t, ci::location_ptr> scans;
+    scans[0] = boost::make_shared<ci::SlamCloudLocation>(0, 0, 0);
+    ci::constraint_vec constraints;
+    std::map<std::size_t, saved_constraint_vec>::const_iterator i;
+    for(i = by_scan.begin(); i != by_scan.end(); i++){
+        ci::constraint_vec new_constraints;
+        foreach(SavedConstraint const& c, i->second){
+            if(!scans.count(c.parent) && !scans.count(c.child))
+                continue;
+            // place a new scan relative to the first scan it is matched to
+            if(!scans.count(c.child)){
+                const Eigen::Matrix4f m = c.b_wrt_a.applyTo(scans[c.parent]->globalTransform());
+                const Eigen::Vector3f x = cauv::xyThetaFrom4DAffine(m);
+                scans[c.child] = boost::make_shared<ci::SlamCloudLocation>(x[0], x[1], x[2]);
+            }else if(!scans.count(c.parent)){
+                const Eigen::Matrix4f m = scans[c.child]->globalTransform() * c.b_wrt_a.to4dAffine().inverse();
+                const Eigen::Vector3f x = cauv::xyThetaFrom4DAffine(m);
+                scans[c.parent] = boost::make_shared<ci::SlamCloudLocation>(x[0], x[1], x[2]);
+            }
+            new_constraints.push_back(boost::make_shared<ci::RelativePoseConstraint>(
+                c.b_wrt_a, scans[c.parent], scans[c.child]
+            ));
+        }
+        if(!new_constraints.size()){
+            warning() << "key scan" << i->first << "is not connected to the graph";
+            continue;
+        }
+        constraints.insert(constraints.end(), new_constraints.begin(), new_constraints.end());
+
+        Timer t;
+        t.start();
+        g.optimiseGraph(constraints, new_constraints);
+        const Timer::diff_t us = t.stop();
+        r.total_us += us;
+        r.max_us = std::max(r.max_us, us);
+    }
+    r.final_error = ci::sumSquaredConstraintError(constraints);
+    return r;
+}
+
+static void report(std::string const& name, saved_constraint_vec const& saved, Result const& r){
+    std::cout << name << "\t" << saved.size() << "\t" << r.total_us / 1e3 << "\t"
+              << r.max_us / 1e3 << "\t" << r.final_error << std::endl;
+}
+
+int main(int argc, char** argv){
+    debug::setLevel(0);
+
+    const std::string map_file = argc > 1? argv[1] : "-";
+    const int iters = argc > 2? std::atoi(argv[2]) : 10;
+    const std::size_t synthetic_scans = argc > 3? std::atoi(argv[3]) : 200;
+
+    saved_constraint_vec saved;
+    if(map_file != "-"){
+        saved = loadConstraints(map_file);
+        info() << saved.size() << "constraints loaded from" << map_file;
+    }else{
+        saved = syntheticConstraints(synthetic_scans);
+    }
+    if(!saved.size()){
+        error() << "no constraints to replay";
+        return 1;
+    }
+
+    ci::GraphOptimiserV1 v1(iters);
+    ci::GraphOptimiserIncremental incremental(iters);
+
+    std::cout << "optimiser\tconstraints\ttotal(ms)\tslowest key scan(ms)\tfinal squared error" << std::endl;
+    report("V1", saved, replay(saved, v1));
+    report("incremental", saved, replay(saved, incremental));
+    return 0;
+}
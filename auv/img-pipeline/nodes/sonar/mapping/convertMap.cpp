@@ -0,0 +1,219 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+// Converts a map saved by SlamCloudGraph in the old directory layout into a
+// single map file (see slamMapStore.h):
+//   <id>.keyframe     size_t index in all scans, then the cloud (in the
+//                     format written by SlamCloudPart::saveToFile)
+//   <id>.constraints  size_t child id, float dx, dy, dtheta; for each
+//                     constraint from key scan id
+//   <id>.relposes     size_t index in all scans, TimeStamp, 4x4 float
+//                     transform relative to key scan id; for each
+//                     intermediate pose
+//   <time>.nodes      size_t id, 4x4 float global transform; for each key
+//                     scan (the latest file is used)
+//
+// The old layout saved some key scans with the same index in all scans as
+// intermediate poses, so scans are renumbered in order of time.
+//
+// usage: slam-map-convert <map dir> [map file (default <map dir>/slam.map)]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+
+#include <boost/filesystem.hpp>
+
+#include <utility/foreach.h>
+#include <utility/string.h>
+#include <debug/cauv_debug.h>
+
+#include "slamMapStore.h"
+#include "stuff.h"
+
+namespace ci = cauv::imgproc;
+namespace bf = boost::filesystem;
+
+using cauv::TimeStamp;
+
+struct OldKeyScan{
+    std::size_t idx_in_all;
+    TimeStamp time;
+    ci::KeyScanIndex::Box local_box;
+    std::string cloud_bytes;
+};
+
+static std::string readFile(bf::path const& p){
+    std::ifstream f(p.string().c_str(), std::ios::in | std::ios::binary);
+    std::ostringstream r;
+    r << f.rdbuf();
+    return r.str();
+}
+
+static std::size_t idFromPath(bf::path const& p){
+    return fromStr<std::size_t>(p.stem().generic_string().c_str());
+}
+
+static bool loadKeyScan(bf::path const& p, OldKeyScan& k){
+    const std::string bytes = readFile(p);
+    const std::size_t header = sizeof(std::size_t) + sizeof(uint32_t) + sizeof(TimeStamp) + sizeof(std::size_t);
+    if(bytes.size() < header)
+        return false;
+    std::istringstream f(bytes);
+    uint32_t version = 0;
+    std::size_t num_points = 0;
+    f.read((char*)&k.idx_in_all, sizeof(k.idx_in_all));
+    f.read((char*)&version, sizeof(version));
+    f.read((char*)&k.time, sizeof(k.time));
+    f.read((char*)&num_points, sizeof(num_points));
+    if(bytes.size() != header + num_points * 3 * sizeof(float))
+        return false;
+    for(std::size_t i = 0; i < num_points; i++){
+        float xyr[3];
+        f.read((char*)xyr, sizeof(xyr));
+        k.local_box.include(xyr[0], xyr[1]);
+    }
+    k.cloud_bytes = bytes.substr(sizeof(std::size_t));
+    return true;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "usage: " << argv[0] << " <map dir> [map file]" << std::endl;
+        return 1;
+    }
+    const bf::path dir(argv[1]);
+    const std::string out_fname = argc > 2? std::string(argv[2]) : (dir / "slam.map").string();
+    if(!bf::is_directory(dir)){
+        error() << dir.string() << "is not a directory";
+        return 1;
+    }
+
+    std::vector<bf::path> paths;
+    std::copy(bf::directory_iterator(dir), bf::directory_iterator(), std::back_inserter(paths));
+    std::sort(paths.begin(), paths.end());
+
+    // - key scans and their positions
+    std::map<std::size_t, OldKeyScan> key_scans;
+    bf::path latest_nodes;
+    foreach(bf::path const& p, paths){
+        if(p.extension().string() == ".keyframe"){
+            OldKeyScan k;
+            if(loadKeyScan(p, k))
+                key_scans[idFromPath(p)] = k;
+            else
+                warning() << "ignoring malformed key scan file" << p.string();
+        }else if(p.extension().string() == ".nodes"){
+            // sorted by name == sorted by time
+            latest_nodes = p;
+        }
+    }
+    if(latest_nodes.empty()){
+        error() << "no key scan position (.nodes) files in" << dir.string();
+        return 1;
+    }
+
+    typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > mat_vec;
+    mat_vec positions;
+    std::ifstream nodes(latest_nodes.string().c_str(), std::ios::in | std::ios::binary);
+    while(nodes){
+        std::size_t id = 0;
+        Eigen::Matrix4f m;
+        nodes.read((char*)&id, sizeof(id));
+        cauv::loadMat(nodes, m);
+        if(!nodes)
+            break;
+        if(id != positions.size()){
+            error() << "key scan positions are out of order in" << latest_nodes.string();
+            return 1;
+        }
+        positions.push_back(m);
+    }
+
+    // key scans are numbered densely: stop at the first one that's missing
+    // either its cloud or its position
+    std::size_t num_key_scans = 0;
+    while(num_key_scans < positions.size() && key_scans.count(num_key_scans))
+        num_key_scans++;
+    if(num_key_scans < std::max(positions.size(), key_scans.size()))
+        warning() << "only the first" << num_key_scans << "key scans have both clouds and positions";
+
+    // - constraints and intermediate poses
+    ci::SlamMapStore::constraint_vec constraints;
+    ci::SlamMapStore::pose_vec poses;
+    for(std::size_t parent = 0; parent < num_key_scans; parent++){
+        const bf::path cfn = dir / std::string(mkStr() << parent << ".constraints");
+        std::ifstream cf(cfn.string().c_str(), std::ios::in | std::ios::binary);
+        while(cf){
+            ci::SlamMapStore::Constraint c;
+            c.parent = parent;
+            cf.read((char*)&c.child, sizeof(c.child));
+            if(cf)
+                c.b_wrt_a = ci::RelativePose::loadFromFile(cf);
+            if(cf && c.child < num_key_scans)
+                constraints.push_back(c);
+        }
+
+        const bf::path pfn = dir / std::string(mkStr() << parent << ".relposes");
+        std::ifstream pf(pfn.string().c_str(), std::ios::in | std::ios::binary);
+        while(pf){
+            ci::SlamMapStore::Pose p;
+            p.parent = parent;
+            pf.read((char*)&p.id, sizeof(p.id));
+            pf.read((char*)&p.time, sizeof(p.time));
+            cauv::loadMat(pf, p.relative_transform);
+            if(pf)
+                poses.push_back(p);
+        }
+    }
+
+    // - renumber all scans in order of time: key scans are identified by
+    // (true, key scan id), intermediate poses by (false, index in poses)
+    typedef std::pair<bool, std::size_t> scan_ref;
+    std::multimap<std::pair<int64_t, std::size_t>, scan_ref> by_time;
+    for(std::size_t i = 0; i < num_key_scans; i++){
+        TimeStamp const& t = key_scans[i].time;
+        by_time.insert(std::make_pair(std::make_pair(int64_t(t.secs) * 1000000 + t.musecs, key_scans[i].idx_in_all), scan_ref(true, i)));
+    }
+    for(std::size_t i = 0; i < poses.size(); i++){
+        TimeStamp const& t = poses[i].time;
+        by_time.insert(std::make_pair(std::make_pair(int64_t(t.secs) * 1000000 + t.musecs, poses[i].id), scan_ref(false, i)));
+    }
+    std::size_t idx_in_all = 0;
+    std::multimap<std::pair<int64_t, std::size_t>, scan_ref>::const_iterator i;
+    for(i = by_time.begin(); i != by_time.end(); i++, idx_in_all++){
+        if(i->second.first)
+            key_scans[i->second.second].idx_in_all = idx_in_all;
+        else
+            poses[i->second.second].id = idx_in_all;
+    }
+
+    // - write the map file
+    try{
+        ci::SlamMapStore store(out_fname, true);
+        store.clear();
+        for(std::size_t id = 0; id < num_key_scans; id++){
+            OldKeyScan const& k = key_scans[id];
+            store.addKeyScan(id, k.idx_in_all, k.time, positions[id], k.local_box, k.cloud_bytes);
+        }
+        foreach(ci::SlamMapStore::Constraint const& c, constraints)
+            store.addConstraint(c.parent, c.child, c.b_wrt_a);
+        foreach(ci::SlamMapStore::Pose const& p, poses)
+            store.addIntermediatePose(p.id, p.parent, p.time, p.relative_transform);
+        store.commit();
+    }catch(std::exception& e){
+        error() << "failed to write" << out_fname << ":" << e.what();
+        return 1;
+    }
+
+    info() << "converted" << num_key_scans << "key scans," << constraints.size() << "constraints and"
+           << poses.size() << "intermediate poses from" << dir.string() << "to" << out_fname;
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include "graphOptimiser.h"
 
 #include <map>
+#include <set>
 #include <vector>
 #include <cmath>
 #include <algorithm>
@@ -14,6 +15,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 
+#include <Eigen/Sparse>
+
 #include <utility/foreach.h>
 #include <utility/streamops/vector.h>
 #include <utility/streamops/set.h>
@@ -654,3 +657,323 @@ void GraphOptimiserV1::optimiseGraph(
 }
 
 
+
+
+// - Incremental Optimiser
+
+static double wrapAngle(double radians){
+    return std::atan2(std::sin(radians), std::cos(radians));
+}
+
+static Eigen::Vector3d poseOf(location_ptr const& l){
+    return xyThetaFrom4DAffine(l->globalTransform()).cast<double>();
+}
+
+/* Error of the constraint z (b relative to a) for poses xa and xb, and
+ * optionally its Jacobians with respect to xa and xb
+ */
+static Eigen::Vector3d constraintError(Eigen::Vector3d const& xa,
+                                       Eigen::Vector3d const& xb,
+                                       Eigen::Vector3d const& z,
+                                       Eigen::Matrix3d* ja = NULL,
+                                       Eigen::Matrix3d* jb = NULL){
+    const double c = std::cos(xa[2]);
+    const double s = std::sin(xa[2]);
+    const double dx = xb[0] - xa[0];
+    const double dy = xb[1] - xa[1];
+
+    Eigen::Vector3d e( c*dx + s*dy - z[0],
+                      -s*dx + c*dy - z[1],
+                       wrapAngle(xb[2] - xa[2] - z[2]));
+    if(ja){
+        *ja << -c, -s, -s*dx + c*dy,
+                s, -c, -c*dx - s*dy,
+                0,  0, -1;
+    }
+    if(jb){
+        *jb <<  c,  s,  0,
+               -s,  c,  0,
+                0,  0,  1;
+    }
+    return e;
+}
+
+float cauv::imgproc::sumSquaredConstraintError(constraint_vec const& constraints){
+    double r = 0;
+    foreach(pose_constraint_ptr const& p, constraints)
+        r += constraintError(poseOf(p->a), poseOf(p->b), p->b_wrt_a.x.cast<double>()).squaredNorm();
+    return r;
+}
+
+struct GraphOptimiserIncremental::State{
+    struct Pose{
+        location_ptr location;
+        // linearisation point, and the current solution relative to it
+        Eigen::Vector3d lin;
+        Eigen::Vector3d delta;
+        std::vector<int> constraints;
+    };
+
+    struct Constraint{
+        pose_constraint_ptr c;
+        int a;
+        int b;
+        // linearised at the poses' lin:
+        Eigen::Vector3d e;
+        Eigen::Matrix3d ja;
+        Eigen::Matrix3d jb;
+    };
+
+    typedef std::map<int, Eigen::Matrix3d> block_row_t;
+
+    State() : calls_since_batch(0), last_solved_poses(0){ }
+
+    std::vector<Pose> poses;
+    std::vector<Constraint> constraints;
+    std::map<location_ptr, int> pose_index;
+    std::map<RelativePoseConstraint const*, int> constraint_index;
+
+    // The linearised system is H * delta = -g, H = sum(J' J), g = sum(J' e),
+    // H is stored by 3x3 blocks (both halves)
+    std::vector<block_row_t> H;
+    std::vector<Eigen::Vector3d> g;
+
+    int calls_since_batch;
+    int last_solved_poses;
+
+    int poseIndex(location_ptr const& l){
+        std::map<location_ptr, int>::const_iterator i = pose_index.find(l);
+        if(i != pose_index.end())
+            return i->second;
+        assert(!l->relativeTo());
+        Pose p;
+        p.location = l;
+        p.lin = poseOf(l);
+        p.delta = Eigen::Vector3d::Zero();
+        poses.push_back(p);
+        H.push_back(block_row_t());
+        g.push_back(Eigen::Vector3d::Zero());
+        pose_index[l] = poses.size() - 1;
+        return poses.size() - 1;
+    }
+
+    void addConstraint(pose_constraint_ptr const& c){
+        Constraint k;
+        k.c = c;
+        k.a = poseIndex(c->a);
+        k.b = poseIndex(c->b);
+        constraints.push_back(k);
+        const int i = constraints.size() - 1;
+        constraint_index[c.get()] = i;
+        poses[k.a].constraints.push_back(i);
+        poses[k.b].constraints.push_back(i);
+        linearise(i);
+    }
+
+    Eigen::Matrix3d& block(int i, int j){
+        block_row_t::iterator b = H[i].find(j);
+        if(b == H[i].end())
+            b = H[i].insert(std::make_pair(j, Eigen::Matrix3d::Zero().eval())).first;
+        return b->second;
+    }
+
+    // add (sign = 1) or remove (sign = -1) constraint i's linearisation from
+    // the system
+    void accumulate(int i, double sign){
+        Constraint const& k = constraints[i];
+        const double w = sign * k.c->weight;
+        block(k.a, k.a).noalias() += w * k.ja.transpose() * k.ja;
+        block(k.b, k.b).noalias() += w * k.jb.transpose() * k.jb;
+        block(k.a, k.b).noalias() += w * k.ja.transpose() * k.jb;
+        block(k.b, k.a).noalias() += w * k.jb.transpose() * k.ja;
+        g[k.a].noalias() += w * k.ja.transpose() * k.e;
+        g[k.b].noalias() += w * k.jb.transpose() * k.e;
+    }
+
+    void linearise(int i){
+        Constraint& k = constraints[i];
+        k.e = constraintError(poses[k.a].lin, poses[k.b].lin, k.c->b_wrt_a.x.cast<double>(), &k.ja, &k.jb);
+        accumulate(i, 1);
+    }
+
+    /* all poses within depth constraints of those in seed */
+    std::set<int> neighbourhood(std::set<int> const& seed, int depth) const{
+        std::set<int> r = seed;
+        std::vector<int> frontier(seed.begin(), seed.end());
+        for(int d = 0; d < depth && frontier.size(); d++){
+            std::vector<int> next;
+            foreach(int p, frontier)
+                foreach(int i, poses[p].constraints){
+                    const int other = constraints[i].a == p? constraints[i].b : constraints[i].a;
+                    if(r.insert(other).second)
+                        next.push_back(other);
+                }
+            frontier.swap(next);
+        }
+        return r;
+    }
+
+    /* Solve for the deltas of the poses in 'solve', holding all the others
+     * fixed. Returns false if the system couldn't be solved.
+     */
+    bool solve(std::vector<int> const& solve){
+        const int n = solve.size();
+        std::map<int, int> column;
+        for(int i = 0; i < n; i++)
+            column[solve[i]] = i;
+
+        std::vector< Eigen::Triplet<double> > triplets;
+        triplets.reserve(n * 9 * 4);
+        Eigen::VectorXd rhs(3 * n);
+        for(int i = 0; i < n; i++){
+            Eigen::Vector3d r = -g[solve[i]];
+            for(block_row_t::const_iterator j = H[solve[i]].begin(); j != H[solve[i]].end(); j++){
+                std::map<int, int>::const_iterator col = column.find(j->first);
+                if(col == column.end()){
+                    // poses held fixed contribute to the right hand side
+                    r.noalias() -= j->second * poses[j->first].delta;
+                    continue;
+                }
+                for(int u = 0; u < 3; u++)
+                    for(int v = 0; v < 3; v++)
+                        if(j->second(u, v) != 0)
+                            triplets.push_back(Eigen::Triplet<double>(3*i + u, 3*col->second + v, j->second(u, v)));
+            }
+            rhs.segment<3>(3*i) = r;
+        }
+
+        Eigen::SparseMatrix<double> A(3 * n, 3 * n);
+        A.setFromTriplets(triplets.begin(), triplets.end());
+
+        Eigen::SimplicialLDLT< Eigen::SparseMatrix<double> > ldlt(A);
+        if(ldlt.info() != Eigen::Success)
+            return false;
+        const Eigen::VectorXd x = ldlt.solve(rhs);
+        if(ldlt.info() != Eigen::Success)
+            return false;
+        for(int i = 0; i < n; i++)
+            poses[solve[i]].delta = x.segment<3>(3*i);
+        return true;
+    }
+};
+
+GraphOptimiserIncremental::GraphOptimiserIncremental(int max_iters,
+                                                     float relinearise_threshold,
+                                                     int local_depth,
+                                                     int batch_interval)
+    : m_max_iters(max_iters),
+      m_relinearise_threshold(relinearise_threshold),
+      m_local_depth(local_depth),
+      m_batch_interval(batch_interval),
+      m_state(boost::make_shared<State>()){
+}
+
+void GraphOptimiserIncremental::setMaxIters(int max_iters){
+    m_max_iters = max_iters;
+}
+
+void GraphOptimiserIncremental::reset(){
+    m_state = boost::make_shared<State>();
+}
+
+int GraphOptimiserIncremental::lastSolvedPoses() const{
+    return m_state->last_solved_poses;
+}
+
+void GraphOptimiserIncremental::optimiseGraph(
+    constraint_vec& constraints,
+    constraint_vec const& new_constraints
+) const{
+    State& s = *m_state;
+
+    // Add whatever constraints haven't been seen before: normally these are
+    // exactly new_constraints, but not if the graph has just been loaded
+    std::set<int> affected;
+    if(constraints.size() < s.constraints.size()){
+        warning() << "constraints have been removed from the graph: starting again";
+        s = State();
+    }
+    const std::size_t num_known = s.constraints.size();
+    if(constraints.size() == num_known + new_constraints.size()){
+        foreach(pose_constraint_ptr const& p, new_constraints)
+            s.addConstraint(p);
+    }else{
+        foreach(pose_constraint_ptr const& p, constraints)
+            if(!s.constraint_index.count(p.get()))
+                s.addConstraint(p);
+    }
+    for(std::size_t i = num_known; i < s.constraints.size(); i++){
+        affected.insert(s.constraints[i].a);
+        affected.insert(s.constraints[i].b);
+    }
+    if(s.poses.empty())
+        return;
+
+    const bool batch = ++s.calls_since_batch >= m_batch_interval;
+    if(batch)
+        s.calls_since_batch = 0;
+
+    std::set<int> solved;
+    int relinearised = 0;
+    int iter = 0;
+    for(; iter < m_max_iters; iter++){
+        if(affected.empty() && !(batch && iter == 0))
+            break;
+        std::vector<int> solve;
+        if(batch && iter == 0){
+            for(std::size_t i = 0; i < s.poses.size(); i++)
+                solve.push_back(i);
+        }else{
+            const std::set<int> n = s.neighbourhood(affected, m_local_depth);
+            solve.assign(n.begin(), n.end());
+        }
+        // the first pose is the fixed origin of the graph
+        solve.erase(std::remove(solve.begin(), solve.end(), 0), solve.end());
+        if(solve.empty())
+            break;
+        if(!s.solve(solve)){
+            error() << "incremental graph optimisation: could not solve for" << solve.size() << "poses";
+            break;
+        }
+        solved.insert(solve.begin(), solve.end());
+
+        // re-linearise around any poses that have moved too far from their
+        // linearisation points, which affects the poses they're constrained
+        // to in the next iteration
+        affected.clear();
+        std::set<int> relinearise;
+        foreach(int p, solve){
+            State::Pose& pose = s.poses[p];
+            if(pose.delta.norm() > m_relinearise_threshold){
+                pose.lin += pose.delta;
+                pose.lin[2] = wrapAngle(pose.lin[2]);
+                pose.delta.setZero();
+                relinearise.insert(pose.constraints.begin(), pose.constraints.end());
+            }
+        }
+        foreach(int i, relinearise){
+            s.accumulate(i, -1);
+            s.linearise(i);
+            affected.insert(s.constraints[i].a);
+            affected.insert(s.constraints[i].b);
+        }
+        relinearised += relinearise.size();
+    }
+
+    // write back the poses that moved
+    foreach(int p, solved){
+        State::Pose const& pose = s.poses[p];
+        const Eigen::Vector3d x = pose.lin + pose.delta;
+        Eigen::Matrix4f m = pose.location->relativeTransform();
+        m.block<2,1>(0,3) = Eigen::Vector2f(x[0], x[1]);
+        m.block<2,2>(0,0) = Eigen::Matrix2f(Eigen::Rotation2D<float>(x[2]));
+        assert(!pose.location->relativeTo());
+        pose.location->setRelativeTransform(m);
+    }
+    s.last_solved_poses = solved.size();
+
+    info() << "incremental graph optimisation:" << (batch? "batch," : "")
+           << s.constraints.size() - num_known << "new constraints,"
+           << iter << "iters, solved for" << solved.size() << "/" << s.poses.size() << "poses,"
+           << relinearised << "re-linearised constraints";
+}
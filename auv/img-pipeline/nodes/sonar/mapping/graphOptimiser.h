@@ -9,6 +9,8 @@
 
 #include "common.h"
 
+#include <boost/shared_ptr.hpp>
+
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
@@ -184,6 +186,59 @@ class GraphOptimiserV1: public GraphOptimiser{
         int m_max_iters;
 };
 
+
+/* Incremental Gauss-Newton optimisation, in the style of iSAM (Kaess et al).
+ * The linearised system (a sparse information matrix over the (x, y, theta)
+ * of every pose) is kept between calls, and:
+ *  - constraints are linearised when they are added, and only re-linearised
+ *    when one of their poses moves more than relinearise_threshold from the
+ *    point it was linearised at,
+ *  - each call only solves for the poses touched by new or re-linearised
+ *    constraints, and their neighbours out to local_depth constraints away,
+ *    holding the rest of the graph where it is,
+ *  - every batch_interval calls the whole graph is solved (the equivalent of
+ *    iSAM's periodic batch steps).
+ *
+ * Since it keeps state, an instance must only be used with one graph, and
+ * reset() if that graph is cleared. The first pose seen stays fixed.
+ */
+class GraphOptimiserIncremental: public GraphOptimiser{
+    public:
+        GraphOptimiserIncremental(int max_iters,
+                                  float relinearise_threshold = 0.05,
+                                  int local_depth = 2,
+                                  int batch_interval = 20);
+
+        virtual void optimiseGraph(
+            constraint_vec& constraints,
+            constraint_vec const& new_constraints = constraint_vec()
+        ) const;
+
+        void setMaxIters(int max_iters);
+
+        /* forget the linearised system, the next call starts from scratch */
+        void reset();
+
+        /* number of poses solved for by the last optimiseGraph call */
+        int lastSolvedPoses() const;
+
+    private:
+        struct State;
+
+        int m_max_iters;
+        float m_relinearise_threshold;
+        int m_local_depth;
+        int m_batch_interval;
+
+        // optimiseGraph is const, but updates the linearised system
+        boost::shared_ptr<State> m_state;
+};
+
+/* Sum of the squared errors (x, y and theta in radians) of constraints at the
+ * current poses: a common measure of how well any optimiser has done
+ */
+float sumSquaredConstraintError(constraint_vec const& constraints);
+
 } // namespace imgproc
 } // namespace cauv
 
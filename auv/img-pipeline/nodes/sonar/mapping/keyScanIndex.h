@@ -0,0 +1,246 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_SONAR_SLAM_KEYSCAN_INDEX_H__
+#define __CAUV_SONAR_SLAM_KEYSCAN_INDEX_H__
+
+#include <map>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+#include <Eigen/Core>
+
+namespace cauv{
+namespace imgproc{
+
+/* Spatial index of key scans, which is updated in place as they move.
+ *
+ * Each key scan is entered with the bounding box of its convex hull (for
+ * finding which key scans a new scan might overlap), and its position in the
+ * (x, y, scaled rotation) space used to decide on the spacing of key scans
+ * (for finding the nearest key scan). Both are bucketed in a uniform grid of
+ * cell_size square cells, so adding or moving a key scan only touches the
+ * cells it was and is in.
+ *
+ * Key scans are identified by their (dense) index.
+ */
+class KeyScanIndex{
+    public:
+        struct Box{
+            Box()
+                : min_x(std::numeric_limits<float>::max()),
+                  min_y(std::numeric_limits<float>::max()),
+                  max_x(-std::numeric_limits<float>::max()),
+                  max_y(-std::numeric_limits<float>::max()){
+            }
+
+            void include(float x, float y){
+                min_x = std::min(min_x, x);
+                min_y = std::min(min_y, y);
+                max_x = std::max(max_x, x);
+                max_y = std::max(max_y, y);
+            }
+
+            bool empty() const{
+                return min_x > max_x || min_y > max_y;
+            }
+
+            bool intersects(Box const& b) const{
+                return min_x <= b.max_x && b.min_x <= max_x &&
+                       min_y <= b.max_y && b.min_y <= max_y;
+            }
+
+            float min_x;
+            float min_y;
+            float max_x;
+            float max_y;
+        };
+
+        explicit KeyScanIndex(float cell_size = 10)
+            : m_cell_size(cell_size),
+              m_entries(),
+              m_box_cells(),
+              m_point_cells(),
+              m_point_min(0, 0),
+              m_point_max(0, 0){
+        }
+
+        void clear(){
+            m_entries.clear();
+            m_box_cells.clear();
+            m_point_cells.clear();
+            m_point_min = cell_t(0, 0);
+            m_point_max = cell_t(0, 0);
+        }
+
+        std::size_t size() const{
+            return m_entries.size();
+        }
+
+        /* id must be size(): key scans are added in order */
+        void insert(std::size_t id, Box const& box, Eigen::Vector3f const& xyr){
+            assert(id == m_entries.size());
+            Entry e;
+            e.box = box;
+            e.xyr = xyr;
+            m_entries.push_back(e);
+            _addToCells(id, box);
+            _addPoint(id, _cell(xyr[0], xyr[1]));
+        }
+
+        void update(std::size_t id, Box const& box, Eigen::Vector3f const& xyr){
+            Entry& e = m_entries.at(id);
+            _removeFromCells(id, e.box);
+            _addToCells(id, box);
+            const cell_t from = _cell(e.xyr[0], e.xyr[1]);
+            const cell_t to = _cell(xyr[0], xyr[1]);
+            if(from != to){
+                _remove(m_point_cells, from, id);
+                _addPoint(id, to);
+            }
+            e.box = box;
+            e.xyr = xyr;
+        }
+
+        Eigen::Vector3f const& position(std::size_t id) const{
+            return m_entries.at(id).xyr;
+        }
+
+        /* ids of the key scans whose bounding boxes intersect box, in order */
+        std::vector<std::size_t> intersecting(Box const& box) const{
+            std::vector<std::size_t> r;
+            if(box.empty())
+                return r;
+            const cell_t lo = _cell(box.min_x, box.min_y);
+            const cell_t hi = _cell(box.max_x, box.max_y);
+            for(int x = lo.first; x <= hi.first; x++)
+                for(int y = lo.second; y <= hi.second; y++){
+                    cell_map_t::const_iterator c = m_box_cells.find(cell_t(x, y));
+                    if(c == m_box_cells.end())
+                        continue;
+                    for(std::size_t i = 0; i < c->second.size(); i++)
+                        if(m_entries[c->second[i]].box.intersects(box))
+                            r.push_back(c->second[i]);
+                }
+            // boxes spanning several cells are found once per cell
+            std::sort(r.begin(), r.end());
+            r.erase(std::unique(r.begin(), r.end()), r.end());
+            return r;
+        }
+
+        /* Squared distance from xyr to the nearest key scan position,
+         * searching outwards one ring of cells at a time until no closer key
+         * scan is possible.
+         */
+        float nearestSquaredDist(Eigen::Vector3f const& xyr) const{
+            float best = std::numeric_limits<float>::max();
+            if(m_point_cells.empty())
+                return best;
+
+            // there's no need to search beyond the extent of occupied cells
+            const cell_t centre = _cell(xyr[0], xyr[1]);
+            const int max_ring = std::max(
+                std::max(centre.first - m_point_min.first, m_point_max.first - centre.first),
+                std::max(centre.second - m_point_min.second, m_point_max.second - centre.second)
+            );
+            for(int ring = 0; ring <= max_ring; ring++){
+                // everything in this ring is at least (ring-1) cells away
+                const float bound = std::max(0, ring - 1) * m_cell_size;
+                if(bound * bound > best)
+                    break;
+                if(ring == 0){
+                    _nearestInCell(centre, xyr, best);
+                    continue;
+                }
+                for(int i = -ring; i < ring; i++){
+                    _nearestInCell(cell_t(centre.first + i, centre.second - ring), xyr, best);
+                    _nearestInCell(cell_t(centre.first + ring, centre.second + i), xyr, best);
+                    _nearestInCell(cell_t(centre.first - i, centre.second + ring), xyr, best);
+                    _nearestInCell(cell_t(centre.first - ring, centre.second - i), xyr, best);
+                }
+            }
+            return best;
+        }
+
+    private:
+        typedef std::pair<int, int> cell_t;
+        typedef std::map<cell_t, std::vector<std::size_t> > cell_map_t;
+
+        struct Entry{
+            Box box;
+            Eigen::Vector3f xyr;
+        };
+
+        cell_t _cell(float x, float y) const{
+            return cell_t(int(std::floor(x / m_cell_size)), int(std::floor(y / m_cell_size)));
+        }
+
+        // the extent of points is only ever grown, which is conservative
+        void _addPoint(std::size_t id, cell_t const& cell){
+            if(m_point_cells.empty()){
+                m_point_min = cell;
+                m_point_max = cell;
+            }
+            m_point_min = cell_t(std::min(m_point_min.first, cell.first), std::min(m_point_min.second, cell.second));
+            m_point_max = cell_t(std::max(m_point_max.first, cell.first), std::max(m_point_max.second, cell.second));
+            m_point_cells[cell].push_back(id);
+        }
+
+        void _nearestInCell(cell_t const& cell, Eigen::Vector3f const& xyr, float& best) const{
+            cell_map_t::const_iterator c = m_point_cells.find(cell);
+            if(c == m_point_cells.end())
+                return;
+            for(std::size_t i = 0; i < c->second.size(); i++)
+                best = std::min(best, (m_entries[c->second[i]].xyr - xyr).squaredNorm());
+        }
+
+        void _addToCells(std::size_t id, Box const& box){
+            if(box.empty())
+                return;
+            const cell_t lo = _cell(box.min_x, box.min_y);
+            const cell_t hi = _cell(box.max_x, box.max_y);
+            for(int x = lo.first; x <= hi.first; x++)
+                for(int y = lo.second; y <= hi.second; y++)
+                    m_box_cells[cell_t(x, y)].push_back(id);
+        }
+
+        void _removeFromCells(std::size_t id, Box const& box){
+            if(box.empty())
+                return;
+            const cell_t lo = _cell(box.min_x, box.min_y);
+            const cell_t hi = _cell(box.max_x, box.max_y);
+            for(int x = lo.first; x <= hi.first; x++)
+                for(int y = lo.second; y <= hi.second; y++)
+                    _remove(m_box_cells, cell_t(x, y), id);
+        }
+
+        static void _remove(cell_map_t& cells, cell_t const& cell, std::size_t id){
+            cell_map_t::iterator c = cells.find(cell);
+            if(c == cells.end())
+                return;
+            c->second.erase(std::remove(c->second.begin(), c->second.end(), id), c->second.end());
+            if(c->second.empty())
+                cells.erase(c);
+        }
+
+        float m_cell_size;
+
+        std::vector<Entry> m_entries;
+        // key scans by the cells their bounding boxes cover:
+        cell_map_t m_box_cells;
+        // key scans by the cell their (x, y) position is in:
+        cell_map_t m_point_cells;
+        cell_t m_point_min;
+        cell_t m_point_max;
+};
+
+} // namespace imgproc
+} // namespace cauv
+
+#endif // ndef __CAUV_SONAR_SLAM_KEYSCAN_INDEX_H__
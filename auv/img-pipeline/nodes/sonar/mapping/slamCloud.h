@@ -9,14 +9,19 @@
 
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <ios>
 #include <algorithm>
+#include <atomic>
 
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
 
 #include <pcl/point_cloud.h>
 
@@ -30,18 +35,19 @@
 #include <generated/types/floatXYZ.h>
 #include <common/msg_classes/north_east_depth.h>
 #include <utility/string.h>
+#include <utility/performance.h>
 
 #include "graphOptimiser.h"
+#include "keyScanIndex.h"
 #include "scanMatching.h"
 #include "slamCloudPart.h"
+#include "slamMapStore.h"
 #include "common.h"
 #include "stuff.h"
 
 namespace cauv{
 namespace imgproc{
 
-namespace bf = boost::filesystem;
-
 struct CloudGraphParams{
     // default constructor sets sensible defaults:
     CloudGraphParams() :
@@ -52,11 +58,13 @@ struct CloudGraphParams{
         good_keypoint_distance(0.2),
         max_speed(1.0),
         max_considered_overlaps(3),
+        max_parallel_matches(2),
         min_scan_consensus(2),
         scan_consensus_tolerance(0.3),
         rotation_scale(4),
         persistence_dir("."),
-        read_only(true){
+        read_only(true),
+        working_radius(50){
     }
 
     float overlap_threshold; // a fraction (0--1.0)
@@ -69,6 +77,9 @@ struct CloudGraphParams{
     float good_keypoint_distance;
     float max_speed;
     int max_considered_overlaps;
+    // at most this many of the pairwise matches for a scan are run at once
+    // (each one occupies a pipeline thread for tens of milliseconds)
+    int max_parallel_matches;
     
     unsigned min_scan_consensus; // n >= 1
     float scan_consensus_tolerance; // in metres
@@ -80,8 +91,38 @@ struct CloudGraphParams{
     
     std::string persistence_dir;
     bool read_only;
+    // when a map is loaded, the points of key scans further than this from
+    // the last key scan are only read when they're needed (in metres)
+    float working_radius;
+};
+
+/* Where the time went in the last SlamCloudGraph::registerScan (in
+ * milliseconds)
+ */
+struct RegisterScanTiming{
+    RegisterScanTiming()
+        : overlap_search(0), matching(0), consensus(0), key_scan_insertion(0),
+          matches(0), parallel_matches(0){
+    }
+    float overlap_search;
+    float matching;
+    float consensus;
+    float key_scan_insertion;
+    int matches;          // pairwise matches attempted
+    int parallel_matches; // how many of them were allowed to run at once
 };
 
+template<typename char_T, typename traits>
+std::basic_ostream<char_T, traits>& operator<<(
+    std::basic_ostream<char_T, traits>& os, RegisterScanTiming const& t){
+    os << "{RegisterScanTiming overlap search=" << t.overlap_search << "ms"
+       << " matching=" << t.matching << "ms (" << t.matches << " matches, "
+       << t.parallel_matches << " at once)"
+       << " consensus=" << t.consensus << "ms"
+       << " key-scan insertion=" << t.key_scan_insertion << "ms}";
+    return os;
+}
+
 template<typename PointT>
 class SlamCloudGraph{
     public:
@@ -118,6 +159,11 @@ class SlamCloudGraph{
 
         typedef typename cloud_constraint_map::const_iterator ccmap_const_iter;
 
+        /* fn(n, f) must call f(0) ... f(n-1), possibly in parallel, and
+         * return when they have all finished (e.g. Node::parallelFor)
+         */
+        typedef boost::function<void(int, boost::function<void(int)> const&)> parallel_for_fn;
+
 
     public:
         // - public methods
@@ -128,11 +174,17 @@ class SlamCloudGraph{
               m_key_scans(),
               m_key_scan_indices(),
               m_key_scan_indices_in_all(),
-              m_key_scan_locations(new KDTreeCachingCloud<PointT>()),
+              m_key_scan_index(),
+              m_key_scan_paged_out(),
+              m_store(),
               m_n_passed_good(0),
               m_n_passed_bad(0),
               m_n_failed_good(0),
-              m_n_failed_bad(0){
+              m_n_failed_bad(0),
+              m_parallel_for(),
+              m_last_timing(),
+              m_total_timing(),
+              m_timed_scans(0){
         }
 
         virtual ~SlamCloudGraph(){
@@ -145,6 +197,15 @@ class SlamCloudGraph{
             info() << "Total keypoints processed:" << total;
             info() << "Classifier Wrong Reject:" << 100*float(m_n_failed_good) / total << "%";
             info() << "Classifier Wrong Accept:" << 100*float(m_n_passed_bad) / total << "%";
+            if(m_timed_scans){
+                RegisterScanTiming mean = m_total_timing;
+                mean.overlap_search /= m_timed_scans;
+                mean.matching /= m_timed_scans;
+                mean.consensus /= m_timed_scans;
+                mean.key_scan_insertion /= m_timed_scans;
+                mean.matches /= m_timed_scans;
+                info() << "Mean time per scan (" << m_timed_scans << "scans):" << mean;
+            }
         }
 
         void reset(){
@@ -154,7 +215,8 @@ class SlamCloudGraph{
             m_all_scans.clear();
             m_key_constraints.clear();
             m_graph_optimisation_count = 0;
-            m_key_scan_locations->clear();
+            m_key_scan_index.clear();
+            m_key_scan_paged_out.clear();
             m_n_passed_good = 0;
             m_n_passed_bad = 0;
             m_n_failed_good = 0;
@@ -165,6 +227,7 @@ class SlamCloudGraph{
             reset();
             loadKeyScans();
             loadIntermediatePoses();
+            _updateKeyScanLocations();
         }
 
         int graphOptimisationsCount() const{
@@ -194,6 +257,18 @@ class SlamCloudGraph{
             m_params.max_considered_overlaps = max_considered_overlaps;
         }
 
+        /* Run the pairwise matches for each scan with fn, up to
+         * max_parallel_matches at once. Without one they're run one after
+         * another on the calling thread.
+         */
+        void setParallelFor(parallel_for_fn const& fn){
+            m_parallel_for = fn;
+        }
+
+        RegisterScanTiming const& lastRegisterScanTiming() const{
+            return m_last_timing;
+        }
+
         cloud_vec const& keyScans() const{
             return m_key_scans;
         }
@@ -314,19 +389,21 @@ class SlamCloudGraph{
                            PairwiseMatcher<PointT> const& m,
                            GraphOptimiser const& graph_optimiser,
                            Eigen::Matrix4f& transformation){
+            m_last_timing = RegisterScanTiming();
             if(!m_key_scans.size()){
                 if(cloudIsGoodEnoughForInitialisation(p)){
                     m_key_scan_indices[p] = m_key_scans.size();
                     m_key_scan_indices_in_all[p] = m_all_scans.size();
                     m_key_scans.push_back(p);
-                    saveKeyScan(p, 0);
+                    m_key_scan_paged_out.push_back(false);
                     m_all_scans.push_back(p);
                     //transformation = Eigen::Matrix4f::Identity();
                     transformation = guess;
                     p->setRelativeToNone();
                     p->setRelativeTransform(transformation);
-                    const Eigen::Vector3f xyr = xyScaledTFromMat(p->globalTransform());
-                    m_key_scan_locations->push_back(PointT(xyr[0], xyr[1], xyr[2]));
+                    m_key_scan_index.insert(0, hullBox(p), xyScaledTFromMat(p->globalTransform()));
+                    saveKeyScan(p, 0);
+                    saveKeyScanPositions();
                     return 1.0f;
                 }else{
                     transformation = Eigen::Matrix4f::Zero();
@@ -340,48 +417,63 @@ class SlamCloudGraph{
                 return 0.0f;
             }
 
+            Timer phase_timer;
+            phase_timer.start();
             const cloud_overlap_map overlaps = overlappingClouds(p, guess);
+            m_last_timing.overlap_search = phase_timer.stop() / 1e3f;
             cloud_constraint_map transformations;
 
-            Eigen::Matrix4f relative_transformation;
             float r = 0.0f;
 
             if(overlaps.size() == 0){
+                _accumulateTiming();
                 error() << "new scan falls outside map! guess was:" << guess;
                 transformation = guess;
                 return 0;
             }
             // for each overlap (up to m_params.max_considered_overlaps), in order of
             // goodness, align this new scan to the overlapping one, and save
-            // the resulting transformation:
+            // the resulting transformation. The matches are independent, so
+            // they run in parallel, but the results are collected in the same
+            // order as they would be one at a time so that the consensus
+            // doesn't depend on which match finishes first.
 
             // !!! scores from matching are are  0 (worst) -- 1 (best)
 
-            int limit = m_params.max_considered_overlaps;
+            phase_timer.start();
+            std::vector<cloud_ptr> map_clouds;
+            typename cloud_overlap_map::const_iterator i;
+            for(i = overlaps.begin(); i != overlaps.end() &&
+                int(map_clouds.size()) < m_params.max_considered_overlaps; i++)
+                map_clouds.push_back(i->second);
+
+            pairwise_match_vec matches(map_clouds.size());
+            MatchLane lane(p, guess, m, map_clouds, matches);
+            const int num_lanes = std::max(1, std::min(int(map_clouds.size()), m_params.max_parallel_matches));
+            if(m_parallel_for && num_lanes > 1)
+                m_parallel_for(num_lanes, lane);
+            else
+                lane(0);
+
             int succeeded_match = 0;
             int failed_match = 0;
-            typename cloud_overlap_map::const_iterator i;
-            for(i = overlaps.begin(); i != overlaps.end() && limit; i++, limit--){
-                try{
-                    cloud_ptr map_cloud = i->second;
-                    base_cloud_ptr transformed = boost::make_shared<base_cloud_t>();
-                    relative_transformation = Eigen::Matrix4f::Identity();
-                    float score = m.transformcloudToMatch(
-                        map_cloud, p, guess, relative_transformation, transformed
-                    );
-                    float age_penalty = 1.0 + std::log(1.0 + (p->time() - map_cloud->time()));
-                    transformations.insert(std::make_pair(
-                        score / age_penalty,
-                        mat_cloud_transformed_t(
-                            relative_transformation, map_cloud, transformed
-                        )
-                    ));
-                    succeeded_match++;
-                }catch(PairwiseMatchException& e){
+            for(std::size_t j = 0; j < matches.size(); j++){
+                if(!matches[j].succeeded){
                     failed_match++;
                     continue;
                 }
+                float age_penalty = 1.0 + std::log(1.0 + (p->time() - map_clouds[j]->time()));
+                transformations.insert(std::make_pair(
+                    matches[j].score / age_penalty,
+                    mat_cloud_transformed_t(
+                        matches[j].mat, map_clouds[j], matches[j].transformed
+                    )
+                ));
+                succeeded_match++;
             }
+            m_last_timing.matching = phase_timer.stop() / 1e3f;
+            m_last_timing.matches = map_clouds.size();
+            m_last_timing.parallel_matches = m_parallel_for? num_lanes : 1;
             debug() << succeeded_match << "matches succeeded"
                     << failed_match << "failed";
             
@@ -418,6 +510,7 @@ class SlamCloudGraph{
             transformations = transformations_speed_checked;
             */
             if(!transformations.size()){
+                _accumulateTiming();
                 error() << "no overlapping scans matched!";
                 transformation = guess;
                 return 0;
@@ -435,12 +528,15 @@ class SlamCloudGraph{
                 debug(5) << "pos=" << xyr[0] << "," << xyr[1] << ": rotation=" << xyr[2]*180/M_PI << "deg";
             }*/
 
+            phase_timer.start();
             std::vector<ccmap_const_iter> consensus_set;
             ccmap_const_iter best = findBestConsensusSet(
                 transformations.begin(), transformations.end(), consensus_set
             );
 
             if(best == transformations.end()){
+                m_last_timing.consensus = phase_timer.stop() / 1e3f;
+                _accumulateTiming();
                 warning() << "insufficient consensus";
                 best = consensus_set.back();
                 transformation = guess;                
@@ -458,6 +554,7 @@ class SlamCloudGraph{
                 consensus_transformations.insert(*c);
             
             transformations = consensus_transformations;
+            m_last_timing.consensus = phase_timer.stop() / 1e3f;
 
             // ---- best, and consensus_set content iterators now invalid ----
 
@@ -466,9 +563,11 @@ class SlamCloudGraph{
             
             // this scan is a key scan if it is more than a minimum distance
             // from other key-scans
+            phase_timer.start();
             if(shouldBeKeyScan(p)){
                 addKeyScan(p, transformations, graph_optimiser);
                 saveKeyScan(p, m_key_scans.size()-1);
+                saveKeyScanPositions();
             }else{
                 // discard all the point data for non-key scans
                 m_all_scans.push_back(boost::make_shared<SlamCloudLocation>(p));
@@ -476,6 +575,9 @@ class SlamCloudGraph{
                         << transformation.block<3,1>(0,3).transpose();
                 saveIntermediatePose(p, m_all_scans.size()-1);
             }
+            m_last_timing.key_scan_insertion = phase_timer.stop() / 1e3f;
+            _accumulateTiming();
+            debug() << m_last_timing;
             transformation = p->globalTransform();
 
             // Set keypoint goodness for training:
@@ -540,12 +642,76 @@ class SlamCloudGraph{
         }
 
     private:
+        // - private types
+        struct pairwise_match_t{
+            pairwise_match_t()
+                : succeeded(false), score(0), mat(Eigen::Matrix4f::Identity()), transformed(){
+            }
+            bool succeeded;
+            float score;
+            Eigen::Matrix4f mat;
+            base_cloud_ptr transformed;
+
+            // required for Matrix4f member
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        typedef std::vector<pairwise_match_t, Eigen::aligned_allocator<pairwise_match_t> > pairwise_match_vec;
+
+        /* Matches p against map_clouds[j], for each j not yet claimed by
+         * another lane, saving the result in matches[j]. Each lane is one
+         * match in flight at any one time.
+         *
+         * Matchers only read the clouds (and each map cloud is only used by
+         * one match), so lanes need no locking beyond claiming matches.
+         */
+        struct MatchLane{
+            MatchLane(cloud_ptr p, Eigen::Matrix4f const& guess,
+                      PairwiseMatcher<PointT> const& matcher,
+                      std::vector<cloud_ptr> const& map_clouds,
+                      pairwise_match_vec& matches)
+                : p(p), guess(guess), matcher(matcher), map_clouds(map_clouds),
+                  matches(matches), next(boost::make_shared< std::atomic<int> >(0)){
+            }
+            void operator()(int) const{
+                int j;
+                while((j = (*next)++) < int(map_clouds.size())){
+                    pairwise_match_t& r = matches[j];
+                    r.transformed = boost::make_shared<base_cloud_t>();
+                    try{
+                        r.score = matcher.transformcloudToMatch(
+                            map_clouds[j], p, guess, r.mat, r.transformed
+                        );
+                        r.succeeded = true;
+                    }catch(PairwiseMatchException& e){
+                        r.succeeded = false;
+                    }
+                }
+            }
+
+            cloud_ptr p;
+            Eigen::Matrix4f const& guess;
+            PairwiseMatcher<PointT> const& matcher;
+            std::vector<cloud_ptr> const& map_clouds;
+            pairwise_match_vec& matches;
+            // shared by the copies of this lane made by boost::function
+            boost::shared_ptr< std::atomic<int> > next;
+        };
+
         // - private methods
+        void _accumulateTiming(){
+            m_total_timing.overlap_search += m_last_timing.overlap_search;
+            m_total_timing.matching += m_last_timing.matching;
+            m_total_timing.consensus += m_last_timing.consensus;
+            m_total_timing.key_scan_insertion += m_last_timing.key_scan_insertion;
+            m_total_timing.matches += m_last_timing.matches;
+            m_total_timing.parallel_matches = m_last_timing.parallel_matches;
+            m_timed_scans++;
+        }
+
         bool shouldBeKeyScan(cloud_ptr p){
             const Eigen::Vector3f xyr = xyScaledTFromMat(p->globalTransform());
-            const PointT xyr_space_loc = PointT(xyr[0], xyr[1], xyr[2]);
             const float squared_keyframe_spacing = m_params.keyframe_spacing * m_params.keyframe_spacing;
-            if(m_key_scan_locations->nearestSquaredDist(xyr_space_loc) > squared_keyframe_spacing)
+            if(m_key_scan_index.nearestSquaredDist(xyr) > squared_keyframe_spacing)
                 return true;
             return false;
         }
@@ -554,16 +720,15 @@ class SlamCloudGraph{
                         cloud_constraint_map const& transformations,
                         GraphOptimiser const& graph_optimiser){
             const Eigen::Matrix4f transformation = p->globalTransform();
-            const Eigen::Vector3f xyr = xyScaledTFromMat(transformation);
-            const PointT xyr_space_loc = PointT(xyr[0], xyr[1], xyr[2]);
             // key scans are transformed to global coordinate
             // frame
             p->setRelativeTransform(transformation);
             p->setRelativeToNone();
             m_key_scan_indices[p] = m_key_scans.size();
-            m_key_scan_indices_in_all[p] = m_key_scans.size();
+            m_key_scan_indices_in_all[p] = m_all_scans.size();
             m_key_scans.push_back(p);
-            m_key_scan_locations->push_back(PointT(xyr_space_loc));
+            m_key_scan_paged_out.push_back(false);
+            m_key_scan_index.insert(m_key_scans.size()-1, hullBox(p), xyScaledTFromMat(transformation));
             m_all_scans.push_back(p);
             debug() << "key frame at:"
                     << Eigen::Vector3f(transformation.block<3,1>(0, 3)).transpose()
@@ -584,226 +749,167 @@ class SlamCloudGraph{
             debug() << "post-optimisation, key frame at:"
                     << Eigen::Vector3f(transformation.block<3,1>(0, 3)).transpose();
             
-            // update the spatially-sorted datastructure of key-scan locations
+            // move the key scans that the optimisation moved in the index
             _updateKeyScanLocations();
+        }
 
-            saveKeyScanPositions();
+        /* The map file in persistence_dir, which is (re)opened if the
+         * parameters have changed since it was last used.
+         */
+        SlamMapStore& store(){
+            const std::string fname = mkStr() << m_params.persistence_dir << "/slam.map";
+            if(m_store && m_store->filename() == fname && m_store->writable() != m_params.read_only)
+                return *m_store;
+            // key scans that haven't been read from the old file yet must be
+            // now
+            if(m_store && m_store->filename() != fname)
+                for(std::size_t i = 0; i < m_key_scans.size(); i++)
+                    _pageIn(i);
+            // commit before the file is re-opened
+            m_store.reset();
+            m_store = boost::make_shared<SlamMapStore>(fname, !m_params.read_only);
+            return *m_store;
         }
 
         void saveKeyScan(cloud_ptr p, std::size_t id){
             if(m_params.read_only)
                 return;
-            std::string kfn = mkStr() << m_params.persistence_dir << "/" << id << ".keyframe";
-            std::ofstream kf(kfn.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-            std::size_t idx_in_all = m_key_scan_indices_in_all[p];
-            kf.write((char*)&idx_in_all, sizeof(idx_in_all));
-            p->saveToFile(kf);
-            kf.close();
-            
-            std::string cfn = mkStr() << m_params.persistence_dir << "/" << id << ".constraints";
-            std::ofstream cf(cfn.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-            cf << std::flush;
-            cf.close();
-
-            std::string cpn = mkStr() << m_params.persistence_dir << "/" << id << ".relposes";
-            std::ofstream cp(cpn.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-            cp << std::flush;
-            cp.close();
-            
-            // !!!! FIXME: working here: p->constraints() is always empty
-            // because constraints are stored on the parent, and at this point
-            // p has no children (since it is the newest pose itself)
-            SlamCloudLocation::rel_pose_vec constraints = p->constraints();
-            location_vec constrained_to = p->constrainedTo();
-            assert(constrained_to.size() == constraints.size());
-        
-            debug() << "scan" << id << "has" << constraints.size() << "constraints";
-            for(std::size_t i = 0; i < constraints.size(); i++){
-                const std::size_t parent_id = m_key_scan_indices[constrained_to[i]];
-                std::string fname = mkStr() << m_params.persistence_dir << "/" << parent_id<< ".constraints";
-                std::ofstream f(fname.c_str(), std::ios::out | std::ios::binary | std::ios::app);
-            
-                f.write((char*)&id, sizeof(id));
-                constraints[i].saveToFile(f);
-                
-                f.close();
-            }
-        }
-        
-        cloud_ptr loadKeyScan(std::size_t id){
-            std::string kfn = mkStr() << m_params.persistence_dir << "/" << id << ".keyframe";
-            std::ifstream kf(kfn.c_str(), std::ios::in | std::ios::binary);
-            std::size_t idx_in_all;
-            kf.read((char*)&idx_in_all, sizeof(idx_in_all));
-            cloud_ptr p = cloud_t::loadFromFile(kf);
-            kf.close();
-            if(id != m_key_scans.size())
-                throw std::runtime_error("keyscan indices do not match up");
-            m_key_scans.push_back(p);
-            m_key_scan_indices[p] = id;
-            m_key_scan_indices_in_all[p] = idx_in_all;
-            
-            if(m_all_scans.size() < idx_in_all)
-                m_all_scans.resize(10+1.5*idx_in_all);
-            m_all_scans[idx_in_all] = p;
-            return p;
-        }
-        
-        // key-scans must be loaded first
-        void loadKeyScanPositions(){
-            bf::path persistence_dir(m_params.persistence_dir);
-            bf::path latest_file;
-            
-            if(bf::exists(persistence_dir) &&
-               bf::is_directory(persistence_dir)){
-                std::vector<bf::path> sorted_paths;
-                std::copy(bf::directory_iterator(persistence_dir), bf::directory_iterator(), std::back_inserter(sorted_paths));
-                std::sort(sorted_paths.begin(), sorted_paths.end());
-                // use the last one sorted by name (== sorted by time)
-                for(std::vector<bf::path>::reverse_iterator i = sorted_paths.rbegin(); i != sorted_paths.rend(); i++){
-                    if(i->extension().string() == ".nodes"){
-                        latest_file = *i;
-                        break;
-                    }
-                }
-                if(sorted_paths.size()){
-                    latest_file = sorted_paths.back();
-                }
-            }else{
-                error() << "cannot load persistent state: directory does not exist";
-            }
-
-            if(bf::exists(latest_file)){
-                std::ifstream f(latest_file.string().c_str(), std::ios::in | std::ios::binary);
-                std::size_t i;
-                for(i = 0; i < m_key_scans.size() && f; i++){
-                    std::size_t id;
-                    Eigen::Matrix4f m;
-                    f.read((char*)&id, sizeof(id));
-                    loadMat(f, m);
-                    if(id != i)
-                        throw std::runtime_error("cannot load persistent state: id mismatch!");
-                    m_key_scans[i]->setRelativeTransform(m);
-                }
-                if(!f){
-                    for(; i < m_key_scans.size(); i++){
-                        m_key_scan_indices.erase(m_key_scans.back());
-                        m_key_scans.pop_back();
-                    }
-                    warning() << "fewer key scans in position file than there are saved keyscans";
-                }
-                f.close();
-            }else{
-                error() << "cannot load persistent state: no keyframe position files";
+            SlamMapStore& s = store();
+            // a new map replaces the one in the file
+            if(id == 0)
+                s.clear();
+            if(id != s.keyScans().size()){
+                error() << "map file" << s.filename() << "has" << s.keyScans().size()
+                        << "key scans, cannot save key scan" << id;
+                return;
             }
-            
-        }
+            std::ostringstream cloud_bytes;
+            p->saveToFile(cloud_bytes);
+            s.addKeyScan(
+                id, m_key_scan_indices_in_all[p], p->time(), p->globalTransform(),
+                localBox(p), cloud_bytes.str()
+            );
 
-        void loadKeyScanConstraints(cloud_ptr parent, std::size_t parent_id){
-            std::string fname = mkStr() << m_params.persistence_dir << "/" << parent_id<< ".constraints";
-            std::ifstream f(fname.c_str(), std::ios::in | std::ios::binary);
-            
-            while(f){
-                std::size_t child_id;
-                f.read((char*)&child_id, sizeof(child_id));
-                cloud_ptr child = m_key_scans.at(child_id);
-                RelativePose r;
-                if(f){
-                    r = RelativePose::loadFromFile(f);
-                }
-                if(f){
-                    child->addConstraintTo(parent, r);
-                    boost::shared_ptr<RelativePoseConstraint> pc = boost::make_shared<RelativePoseConstraint>(r, parent, child);
-                    m_key_constraints.push_back(pc);
-                }
+            // constraints are stored on the scan they were matched from (see
+            // addConstraintsFromTransformations), save the ones to p
+            std::size_t num_constraints = 0;
+            foreach(pose_constraint_ptr const& c, m_key_constraints){
+                if(c->b != p)
+                    continue;
+                s.addConstraint(m_key_scan_indices[c->a], id, c->b_wrt_a);
+                num_constraints++;
             }
-            f.close();
+            debug() << "scan" << id << "has" << num_constraints << "constraints";
         }
 
         void saveIntermediatePose(cloud_ptr p, std::size_t id){
             if(m_params.read_only)
                 return;
-            std::size_t parent_id = m_key_scan_indices[p->relativeTo()];
-            std::string cpn = mkStr() << m_params.persistence_dir << "/" << parent_id << ".relposes";
-            std::ofstream cp(cpn.c_str(), std::ios::out | std::ios::binary | std::ios::app);
-            cp.write((char*)&id, sizeof(id));
-            TimeStamp t = p->time();
-            cp.write((char*)&t, sizeof(t));
-            saveMat(cp, p->relativeTransform());
-            cp.close();
-        }
-
-        void loadIntermediatePosesForParent(std::size_t parent_id){
-            std::string fn = mkStr() << m_params.persistence_dir << "/" << parent_id << ".relposes";
-            std::ifstream f(fn.c_str(), std::ios::in | std::ios::binary);
-            
-            cloud_ptr parent = m_key_scans.at(parent_id);
-            while(f){
-                std::size_t child_id;
-                f.read((char*)&child_id, sizeof(child_id));
-                TimeStamp t;
-                f.read((char*)&t, sizeof(t));
-                Eigen::Matrix4f tr;
-                loadMat(f, tr);
-                location_ptr l = boost::make_shared<SlamCloudLocation>(t, m_key_scans[parent_id], tr);
-                if(m_all_scans.size() < child_id)
-                    m_all_scans.resize(10+1.5*child_id);
-                m_all_scans[child_id] = l;
-            }
-            f.close();
+            SlamMapStore& s = store();
+            const std::size_t parent_id = m_key_scan_indices[p->relativeTo()];
+            if(parent_id >= s.keyScans().size())
+                return;
+            s.addIntermediatePose(id, parent_id, p->time(), p->relativeTransform());
         }
 
+        /* Save the positions of all the key scans, and commit everything
+         * saved since the last time to the map file.
+         */
         void saveKeyScanPositions(){
             if(m_params.read_only)
                 return;
-            const TimeStamp timestamp = now();
-            std::string fname = mkStr() << m_params.persistence_dir << "/" << timestamp.secs << (timestamp.musecs / 1000) << ".nodes";
-            std::ofstream f(fname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-
-            for(std::size_t i = 0; i < m_key_scans.size(); i++){
-                f.write((char*)&i, sizeof(i));
-                saveMat(f, m_key_scans[i]->globalTransform());
-            }
-
-            f.close();
+            SlamMapStore& s = store();
+            for(std::size_t i = 0; i < m_key_scans.size() && i < s.keyScans().size(); i++)
+                s.setGlobalTransform(i, m_key_scans[i]->globalTransform());
+            s.commit();
         }
-        
-        void loadKeyScans(){
-            // List directory to find all the key-scan ids:
-            
-            bf::path persistence_dir(m_params.persistence_dir);
 
-            std::set<std::size_t> keyframe_ids;
+        /* Key scans are created with only their positions: the points of
+         * those within m_params.working_radius of the last key scan are read
+         * now, and the rest only when they're needed (see _pageIn).
+         */
+        void loadKeyScans(){
+            SlamMapStore* s = NULL;
+            try{
+                s = &store();
+            }catch(std::exception& e){
+                error() << "cannot load persistent state:" << e.what();
+                return;
+            }
+            SlamMapStore::key_scan_vec const& saved = s->keyScans();
+            if(!saved.size())
+                return;
 
-            if(bf::exists(persistence_dir) &&
-               bf::is_directory(persistence_dir)){
-                bf::directory_iterator i(persistence_dir);
-                for(; i != bf::directory_iterator(); i++){
-                    if(i->path().extension().string() == ".keyframe")
-                        keyframe_ids.insert(fromStr<std::size_t>(i->path().stem().generic_string().c_str()));
+            const Eigen::Vector2f centre = saved.back().global_transform.block<2,1>(0,3);
+            std::size_t num_paged_in = 0;
+            for(std::size_t id = 0; id < saved.size(); id++){
+                SlamMapStore::KeyScan const& k = saved[id];
+                cloud_ptr p = boost::make_shared<cloud_t>(k.time);
+                p->setRelativeToNone();
+                p->setRelativeTransform(k.global_transform);
+                m_key_scans.push_back(p);
+                m_key_scan_paged_out.push_back(true);
+                m_key_scan_indices[p] = id;
+                m_key_scan_indices_in_all[p] = k.idx_in_all;
+                if(m_all_scans.size() <= k.idx_in_all)
+                    m_all_scans.resize(k.idx_in_all + 1);
+                m_all_scans[k.idx_in_all] = p;
+
+                const Eigen::Vector2f xy = k.global_transform.block<2,1>(0,3);
+                if((xy - centre).norm() <= m_params.working_radius){
+                    _pageIn(id);
+                    num_paged_in++;
                 }
-            }else{
-                error() << "cannot load persistent state: directory does not exist";
             }
-            
-            // !!! FIXME this should munge IDs if the positions file doesn't quite
-            // match up with the directory listing
-            loadKeyScanPositions();
-            
-            for(std::size_t id = 0; id < m_key_scans.size(); id++){
-                m_key_scans.push_back(loadKeyScan(id));
-                m_key_scan_indices[m_key_scans.back()] = m_key_scans.size()-1;
+
+            foreach(SlamMapStore::Constraint const& c, s->constraints()){
+                cloud_ptr parent = m_key_scans.at(c.parent);
+                cloud_ptr child = m_key_scans.at(c.child);
+                parent->addConstraintTo(child, c.b_wrt_a);
+                m_key_constraints.push_back(
+                    boost::make_shared<RelativePoseConstraint>(c.b_wrt_a, parent, child)
+                );
             }
-            
-            for(std::size_t id = 0; id < m_key_scans.size(); id++)
-                loadKeyScanConstraints(m_key_scans[id], id);
+            info() << "loaded" << m_key_scans.size() << "key scans from" << s->filename()
+                   << "(" << num_paged_in << "within" << m_params.working_radius << "m read)";
         }
 
         void loadIntermediatePoses(){
-            for(std::size_t i = 0; i < m_key_scans.size(); i++)
-                loadIntermediatePosesForParent(i);
+            if(!m_store)
+                return;
+            foreach(SlamMapStore::Pose const& p, m_store->intermediatePoses()){
+                location_ptr l = boost::make_shared<SlamCloudLocation>(
+                    p.time, m_key_scans.at(p.parent), p.relative_transform
+                );
+                if(m_all_scans.size() <= p.id)
+                    m_all_scans.resize(p.id + 1);
+                m_all_scans[p.id] = l;
+            }
+            // poses saved after the last commit are lost: stand in a copy of
+            // the previous pose for each of them
+            std::size_t num_missing = 0;
+            for(std::size_t i = 1; i < m_all_scans.size() && m_all_scans[0]; i++)
+                if(!m_all_scans[i]){
+                    m_all_scans[i] = boost::make_shared<SlamCloudLocation>(*m_all_scans[i-1]);
+                    num_missing++;
+                }
+            if(num_missing)
+                warning() << num_missing << "intermediate poses were missing from the map file";
         }
         
+        /* Read the points of key scan i from the map file, if they haven't
+         * been already.
+         */
+        void _pageIn(std::size_t i){
+            if(!m_key_scan_paged_out[i])
+                return;
+            namespace io = boost::iostreams;
+            SlamMapStore::KeyScan const& k = m_store->keyScans().at(i);
+            io::stream<io::array_source> f(m_store->cloud(i), k.cloud_size);
+            m_key_scans[i]->loadPointsFromFile(f);
+            m_key_scan_paged_out[i] = false;
+            debug(3) << "paged in key scan" << i << "(" << m_key_scans[i]->size() << "points)";
+        }
 
         /* Find the best consensus amongst a set of possible transformations
          *
@@ -862,44 +968,78 @@ class SlamCloudGraph{
         }
         
         
-        /* Re-build the key-scan location cloud after an optimisation update.
+        /* Update the index of key-scans after an optimisation update: only
+         * the key scans that have moved are re-indexed (and key scans not
+         * yet in the index are added).
          */
         void _updateKeyScanLocations(){
-            m_key_scan_locations->clear();
-            
-            Eigen::Vector3f xyr;
-            PointT xyr_space_loc;
-
-            foreach(cloud_ptr k, m_key_scans){
-                xyr = xyScaledTFromMat(k->globalTransform());
-                xyr_space_loc = PointT(xyr[0], xyr[1], xyr[2]);
-                m_key_scan_locations->push_back(PointT(xyr_space_loc));
+            for(std::size_t i = 0; i < m_key_scans.size(); i++){
+                cloud_ptr const& k = m_key_scans[i];
+                const Eigen::Vector3f xyr = xyScaledTFromMat(k->globalTransform());
+                if(i >= m_key_scan_index.size())
+                    m_key_scan_index.insert(i, _keyScanBox(i), xyr);
+                else if((m_key_scan_index.position(i) - xyr).squaredNorm() > 1e-8)
+                    m_key_scan_index.update(i, _keyScanBox(i), xyr);
             }
         }
 
-        /* Return all cloud parts in the map that overlap with p by more than
-         * m_params.overlap_threshold. The search is limited to the nearest k
-         * key-scans to p.
-         *
-         * !!! should really use a sorted datastructure based on the bounding
-         * boxes of the key scans for this search, rather than just the
-         * origins. But this gives sufficiently good algorithmic complexity.
+        /* Bounding box of key scan i in the global frame: the stored
+         * bounding box of its points is used if they haven't been read from
+         * the map file yet.
          */
-        cloud_overlap_map overlappingClouds(cloud_ptr p, unsigned k = 25) const{
-            std::vector<int> k_indices(k);
-            std::vector<float> k_sqr_distances(k);
-            const Eigen::Vector3f xyr = xyScaledTFromMat(p->globalTransform());
-            const PointT xyr_space_loc = PointT(xyr[0], xyr[1], xyr[2]);
+        KeyScanIndex::Box _keyScanBox(std::size_t i) const{
+            if(!m_key_scan_paged_out[i])
+                return hullBox(m_key_scans[i]);
+            KeyScanIndex::Box const& b = m_store->keyScans().at(i).local_box;
+            Eigen::Matrix4f const& m = m_key_scans[i]->globalTransform();
+            KeyScanIndex::Box r;
+            const float xs[2] = {b.min_x, b.max_x};
+            const float ys[2] = {b.min_y, b.max_y};
+            for(int j = 0; j < 2; j++)
+                for(int k = 0; k < 2; k++){
+                    const Eigen::Vector4f c = m * Eigen::Vector4f(xs[j], ys[k], 0, 1);
+                    r.include(c[0], c[1]);
+                }
+            return r;
+        }
 
-            const int n = m_key_scan_locations->nearestKSearch(xyr_space_loc, k, k_indices, k_sqr_distances);
+        /* Bounding box of the points of p in its own frame */
+        static KeyScanIndex::Box localBox(cloud_ptr p){
+            KeyScanIndex::Box r;
+            for(std::size_t i = 0; i < p->size(); i++)
+                r.include(p->points[i].x, p->points[i].y);
+            return r;
+        }
+
+        /* Bounding box of the convex hull of p in the global frame */
+        static KeyScanIndex::Box hullBox(cloud_ptr p){
+            std::vector<pcl::Vertices> polys;
+            base_cloud_ptr points;
+            p->getGlobalConvexHull(points, polys);
+            KeyScanIndex::Box r;
+            if(points)
+                for(std::size_t i = 0; i < points->size(); i++)
+                    r.include((*points)[i].x, (*points)[i].y);
+            return r;
+        }
+
+        /* Return all cloud parts in the map that overlap with p by more than
+         * m_params.overlap_threshold. The exact (polygon clipping) overlap
+         * is only calculated for the key scans whose bounding boxes overlap
+         * p's in the index, which are read from the map file if necessary.
+         */
+        cloud_overlap_map overlappingClouds(cloud_ptr p){
+            const std::vector<std::size_t> candidates = m_key_scan_index.intersecting(hullBox(p));
 
             cloud_overlap_map r;
-            for(int i = 0; i < n; i++){
-                cloud_ptr m = m_key_scans[k_indices[i]];
+            foreach(std::size_t i, candidates){
+                _pageIn(i);
+                cloud_ptr m = m_key_scans[i];
                 float overlap = overlapPercent(m, p);
                 if(overlap > m_params.overlap_threshold)
                     r.insert(typename cloud_overlap_map::value_type(overlap, m));
             }
+            debug(3) << r.size() << "overlaps of" << candidates.size() << "candidates from the index";
 
             return r;
         }
@@ -1082,9 +1222,14 @@ class SlamCloudGraph{
         std::map<location_ptr, std::size_t> m_key_scan_indices;
         std::map<location_ptr, std::size_t> m_key_scan_indices_in_all;
 
-        // each point in this cloud is a key scan (same order as m_key_scans):
-        // x,y,z map to x,y,m_rotation_scale*rotation 
-        boost::shared_ptr< KDTreeCachingCloud<PointT> > m_key_scan_locations;
+        // bounding boxes and x,y,m_rotation_scale*rotation of the key scans
+        // (indexed in the same order as m_key_scans)
+        KeyScanIndex m_key_scan_index;
+
+        // true for loaded key scans whose points haven't been read from
+        // m_store yet (indexed in the same order as m_key_scans)
+        std::vector<bool> m_key_scan_paged_out;
+        boost::shared_ptr<SlamMapStore> m_store;
         
         
         // similarly, this will need some thought to scale well
@@ -1099,6 +1244,12 @@ class SlamCloudGraph{
         unsigned m_n_passed_bad;
         unsigned m_n_failed_good;
         unsigned m_n_failed_bad;
+
+        parallel_for_fn m_parallel_for;
+
+        RegisterScanTiming m_last_timing;
+        RegisterScanTiming m_total_timing;
+        unsigned m_timed_scans;
 };
 
 } // namespace cauv
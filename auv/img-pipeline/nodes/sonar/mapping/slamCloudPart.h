@@ -382,7 +382,7 @@ class SlamCloudPart: public SlamCloudLocation,
         
         // note that the transformation is not saved: the transformations of
         // key frames are saved separately each time they change.
-        void saveToFile(std::ofstream& f){
+        void saveToFile(std::ostream& f){
             uint32_t x = Keyframe_Serialise_Version;        
             f.write((char*)&x, sizeof(x));
             const TimeStamp t = time();
@@ -405,16 +405,43 @@ class SlamCloudPart: public SlamCloudLocation,
         /* only load keypoints, constraints must be loaded externally, as must
          * m_relative_transformation.
          */
-        static boost::shared_ptr< SlamCloudPart<PointT> > loadFromFile(std::ifstream& f){
+        static boost::shared_ptr< SlamCloudPart<PointT> > loadFromFile(std::istream& f){
+            const TimeStamp t = _loadHeader(f);
+            boost::shared_ptr< SlamCloudPart<PointT> > r = boost::make_shared<SlamCloudPart<PointT> >(t);
+            r->_loadPoints(f);
+            return r;
+        }
+
+        /* load the keypoints saved by saveToFile into this (empty) cloud,
+         * which was created with the same time: this is used to page in key
+         * scans of a map, which are created without their points.
+         */
+        void loadPointsFromFile(std::istream& f){
+            const TimeStamp t = _loadHeader(f);
+            if(t.secs != time().secs || t.musecs != time().musecs)
+                throw std::runtime_error("loaded points are not for this cloud");
+            _loadPoints(f);
+        }
+
+        // this type derives from something with an Eigen::Matrix4f as a
+        // member:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    private:
+        static TimeStamp _loadHeader(std::istream& f){
             uint32_t x = 0;
             f.read((char*)&x, sizeof(x));
             if(x != Keyframe_Serialise_Version)
                 throw std::runtime_error("unknown map version");
             TimeStamp t;
             f.read((char*)&t, sizeof(t));
-            boost::shared_ptr< SlamCloudPart<PointT> > r = boost::make_shared<SlamCloudPart<PointT> >(t);
+            return t;
+        }
+
+        void _loadPoints(std::istream& f){
             std::size_t s = 0;
             f.read((char*)&s, sizeof(s));
+            reserve(s);
             for(std::size_t i = 0; i < s; i++){
                 float x = 0;
                 float y = 0;
@@ -426,15 +453,11 @@ class SlamCloudPart: public SlamCloudLocation,
                 // no z
                 f.read((char*)&response, sizeof(response));
                 //f.read((char*)&idx, sizeof(idx));
-                r->push_back(PointT(x, y, z), response, i);
+                push_back(PointT(x, y, z), response, i);
             }
-            return r;
+            m_meanvar_invalid = true;
         }
 
-        // this type derives from something with an Eigen::Matrix4f as a
-        // member:
-        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-
     protected:
         virtual void transformationChanged(){
             this->invalidateKDTree();
@@ -0,0 +1,523 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include "slamMapStore.h"
+
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <utility/foreach.h>
+#include <debug/cauv_debug.h>
+
+using namespace cauv;
+using namespace cauv::imgproc;
+
+namespace bi = boost::interprocess;
+namespace bf = boost::filesystem;
+
+static const char Magic[8] = {'C', 'A', 'U', 'V', 'S', 'M', 'A', 'P'};
+
+// sizes of the parts of an index record, as written by _serialiseIndexRecord
+static const uint64_t Record_Header_Size = 2*8 + 4*8;
+static const uint64_t Key_Scan_Entry_Size = 8 + 2*4 + 16*4 + 4*4 + 2*8;
+static const uint64_t Constraint_Entry_Size = 2*8 + 3*4;
+static const uint64_t Pose_Entry_Size = 2*8 + 2*4 + 16*4;
+
+static uint64_t baseRecordSize(std::size_t key_scans, std::size_t constraints, std::size_t poses){
+    return Record_Header_Size + key_scans * Key_Scan_Entry_Size +
+           constraints * Constraint_Entry_Size + poses * Pose_Entry_Size;
+}
+
+// flushing a stream only hands the data to the OS: this waits until it's on
+// the disk
+static void syncFile(std::string const& fname){
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0 || ::fsync(fd)){
+        if(fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("failed to sync map file: " + fname);
+    }
+    ::close(fd);
+}
+
+// - index (de)serialisation helpers
+template<typename T>
+static void put(std::string& s, T const& v){
+    s.append((char const*)&v, sizeof(v));
+}
+
+static void putMat(std::string& s, Eigen::Matrix4f const& m){
+    for(int i = 0; i < 4; i++)
+        for(int j = 0; j < 4; j++)
+            put(s, m(i,j));
+}
+
+namespace{
+class IndexReader{
+    public:
+        IndexReader(char const* p, std::size_t size)
+            : m_p(p), m_end(p + size){
+        }
+
+        template<typename T>
+        T get(){
+            if(std::size_t(m_end - m_p) < sizeof(T))
+                throw std::runtime_error("map index is truncated");
+            T r;
+            std::memcpy(&r, m_p, sizeof(T));
+            m_p += sizeof(T);
+            return r;
+        }
+
+        Eigen::Matrix4f getMat(){
+            Eigen::Matrix4f m;
+            for(int i = 0; i < 4; i++)
+                for(int j = 0; j < 4; j++)
+                    m(i,j) = get<float>();
+            return m;
+        }
+
+        TimeStamp getTime(){
+            const int32_t secs = get<int32_t>();
+            const int32_t musecs = get<int32_t>();
+            return TimeStamp(secs, musecs);
+        }
+
+    private:
+        char const* m_p;
+        char const* m_end;
+};
+} // anonymous namespace
+
+SlamMapStore::SlamMapStore(std::string const& fname, bool writable)
+    : m_fname(fname),
+      m_writable(writable),
+      m_file(),
+      m_mapping(),
+      m_region(),
+      m_key_scans(),
+      m_constraints(),
+      m_poses(),
+      m_committed_key_scans(0),
+      m_committed_constraints(0),
+      m_committed_poses(0),
+      m_moved(),
+      m_file_size(0),
+      m_live_size(0),
+      m_index_offset(0),
+      m_index_record_size(0),
+      m_index_size(0),
+      m_delta_size(0),
+      m_dirty(false){
+    if(m_writable){
+        if(!bf::exists(m_fname))
+            _create();
+        m_file.open(m_fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        if(!m_file)
+            throw std::runtime_error("cannot open map file for writing: " + m_fname);
+    }
+    _map();
+    _read();
+}
+
+SlamMapStore::~SlamMapStore(){
+    try{
+        commit();
+    }catch(std::exception& e){
+        error() << "failed to commit map" << m_fname << ":" << e.what();
+    }
+}
+
+char const* SlamMapStore::cloud(std::size_t id){
+    KeyScan const& k = m_key_scans.at(id);
+    // clouds added since the file was mapped need it to be re-mapped
+    if(k.cloud_offset + k.cloud_size > m_region.get_size()){
+        m_file.flush();
+        _map();
+    }
+    return static_cast<char const*>(m_region.get_address()) + k.cloud_offset;
+}
+
+void SlamMapStore::clear(){
+    _checkWritable();
+    m_key_scans.clear();
+    m_constraints.clear();
+    m_poses.clear();
+    m_file.close();
+    _create();
+    m_file.open(m_fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    _map();
+    _read();
+}
+
+void SlamMapStore::addKeyScan(std::size_t id,
+                              std::size_t idx_in_all,
+                              TimeStamp const& time,
+                              Eigen::Matrix4f const& global_transform,
+                              KeyScanIndex::Box const& local_box,
+                              std::string const& cloud_bytes){
+    _checkWritable();
+    if(id != m_key_scans.size())
+        throw std::runtime_error("key scans must be added to the map in order");
+    KeyScan k;
+    k.idx_in_all = idx_in_all;
+    k.time = time;
+    k.global_transform = global_transform;
+    k.local_box = local_box;
+    k.cloud_offset = m_file_size;
+    k.cloud_size = cloud_bytes.size();
+    m_file.seekp(m_file_size);
+    m_file.write(cloud_bytes.data(), cloud_bytes.size());
+    if(!m_file)
+        throw std::runtime_error("failed to write to map file: " + m_fname);
+    m_key_scans.push_back(k);
+    m_file_size += cloud_bytes.size();
+    m_live_size += cloud_bytes.size();
+    m_dirty = true;
+}
+
+void SlamMapStore::setGlobalTransform(std::size_t id, Eigen::Matrix4f const& m){
+    _checkWritable();
+    KeyScan& k = m_key_scans.at(id);
+    if(k.global_transform == m)
+        return;
+    k.global_transform = m;
+    if(id < m_committed_key_scans)
+        m_moved.insert(id);
+    m_dirty = true;
+}
+
+void SlamMapStore::addConstraint(std::size_t parent, std::size_t child, RelativePose const& b_wrt_a){
+    _checkWritable();
+    Constraint c;
+    c.parent = parent;
+    c.child = child;
+    c.b_wrt_a = b_wrt_a;
+    m_constraints.push_back(c);
+    m_dirty = true;
+}
+
+void SlamMapStore::addIntermediatePose(std::size_t id,
+                                       std::size_t parent,
+                                       TimeStamp const& time,
+                                       Eigen::Matrix4f const& relative_transform){
+    _checkWritable();
+    Pose p;
+    p.id = id;
+    p.parent = parent;
+    p.time = time;
+    p.relative_transform = relative_transform;
+    m_poses.push_back(p);
+    m_dirty = true;
+}
+
+void SlamMapStore::commit(){
+    if(!m_writable || !m_dirty)
+        return;
+    // the records since the base must all be read to open the map, so once
+    // they're bigger than a new base would be, write the new base instead
+    const std::string delta = _serialiseIndexRecord(
+        m_key_scans, m_committed_key_scans, m_committed_constraints, m_committed_poses,
+        m_moved, m_index_offset, m_index_record_size
+    );
+    const bool rebase = m_delta_size + delta.size() >
+                        baseRecordSize(m_key_scans.size(), m_constraints.size(), m_poses.size());
+    const std::string record = !rebase? delta : _serialiseIndexRecord(
+        m_key_scans, 0, 0, 0, std::set<std::size_t>(), 0, 0
+    );
+
+    const uint64_t record_offset = m_file_size;
+    m_file.seekp(record_offset);
+    m_file.write(record.data(), record.size());
+    m_file.flush();
+    if(!m_file)
+        throw std::runtime_error("failed to write to map file: " + m_fname);
+    // the clouds and the index must be on disk before the header refers to
+    // them
+    syncFile(m_fname);
+    m_file.seekp(0);
+    _writeHeader(m_file, record_offset, record.size());
+    m_file.flush();
+    if(!m_file)
+        throw std::runtime_error("failed to write to map file: " + m_fname);
+    syncFile(m_fname);
+
+    m_file_size += record.size();
+    m_live_size += record.size();
+    if(rebase){
+        m_live_size -= m_index_size;
+        m_index_size = record.size();
+        m_delta_size = 0;
+    }else{
+        m_index_size += record.size();
+        m_delta_size += record.size();
+    }
+    m_index_offset = record_offset;
+    m_index_record_size = record.size();
+    m_committed_key_scans = m_key_scans.size();
+    m_committed_constraints = m_constraints.size();
+    m_committed_poses = m_poses.size();
+    m_moved.clear();
+    m_dirty = false;
+
+    if(m_file_size > 2 * m_live_size)
+        _compact();
+}
+
+void SlamMapStore::_checkWritable() const{
+    if(!m_writable)
+        throw std::runtime_error("map file is read-only: " + m_fname);
+}
+
+void SlamMapStore::_create(){
+    std::ofstream f(m_fname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    const std::string index = _serialiseIndexRecord(
+        key_scan_vec(), 0, 0, 0, std::set<std::size_t>(), 0, 0
+    );
+    _writeHeader(f, Header_Size, index.size());
+    f.write(index.data(), index.size());
+    if(!f)
+        throw std::runtime_error("cannot create map file: " + m_fname);
+}
+
+void SlamMapStore::_map(){
+    bi::file_mapping(m_fname.c_str(), bi::read_only).swap(m_mapping);
+    bi::mapped_region(m_mapping, bi::read_only).swap(m_region);
+}
+
+void SlamMapStore::_read(){
+    char const* p = static_cast<char const*>(m_region.get_address());
+    m_file_size = m_region.get_size();
+
+    IndexReader header(p, m_file_size);
+    char magic[sizeof(Magic)];
+    for(std::size_t i = 0; i < sizeof(Magic); i++)
+        magic[i] = header.get<char>();
+    if(std::memcmp(magic, Magic, sizeof(Magic)))
+        throw std::runtime_error("not a map file: " + m_fname);
+    const uint32_t version = header.get<uint32_t>();
+    if(version != Version)
+        throw std::runtime_error("unknown map version");
+    header.get<uint32_t>();
+    const uint64_t index_offset = header.get<uint64_t>();
+    const uint64_t index_size = header.get<uint64_t>();
+
+    // follow the chain of records back to the base, then apply them in the
+    // order they were written
+    std::vector< std::pair<uint64_t, uint64_t> > records;
+    uint64_t offset = index_offset;
+    uint64_t size = index_size;
+    for(;;){
+        if(offset < Header_Size || offset + size > m_file_size)
+            throw std::runtime_error("map index is truncated");
+        records.push_back(std::make_pair(offset, size));
+        IndexReader previous(p + offset, size);
+        const uint64_t previous_offset = previous.get<uint64_t>();
+        const uint64_t previous_size = previous.get<uint64_t>();
+        if(!previous_offset)
+            break;
+        if(previous_offset >= offset)
+            throw std::runtime_error("map index is corrupt");
+        offset = previous_offset;
+        size = previous_size;
+    }
+
+    m_key_scans.clear();
+    m_constraints.clear();
+    m_poses.clear();
+    m_index_size = 0;
+    for(std::size_t i = records.size(); i > 0; i--){
+        _readIndexRecord(p, records[i-1].first, records[i-1].second);
+        m_index_size += records[i-1].second;
+    }
+    m_delta_size = m_index_size - records.back().second;
+
+    uint64_t cloud_bytes = 0;
+    foreach(KeyScan const& k, m_key_scans)
+        cloud_bytes += k.cloud_size;
+
+    m_committed_key_scans = m_key_scans.size();
+    m_committed_constraints = m_constraints.size();
+    m_committed_poses = m_poses.size();
+    m_moved.clear();
+    m_index_offset = index_offset;
+    m_index_record_size = index_size;
+    m_live_size = Header_Size + cloud_bytes + m_index_size;
+    m_dirty = false;
+}
+
+void SlamMapStore::_readIndexRecord(char const* p, uint64_t offset, uint64_t size){
+    IndexReader index(p + offset, size);
+    // the previous record, already read
+    index.get<uint64_t>();
+    index.get<uint64_t>();
+
+    const uint64_t num_key_scans = index.get<uint64_t>();
+    for(uint64_t i = 0; i < num_key_scans; i++){
+        KeyScan k;
+        k.idx_in_all = index.get<uint64_t>();
+        k.time = index.getTime();
+        k.global_transform = index.getMat();
+        k.local_box.min_x = index.get<float>();
+        k.local_box.min_y = index.get<float>();
+        k.local_box.max_x = index.get<float>();
+        k.local_box.max_y = index.get<float>();
+        k.cloud_offset = index.get<uint64_t>();
+        k.cloud_size = index.get<uint64_t>();
+        if(k.cloud_offset + k.cloud_size > m_file_size)
+            throw std::runtime_error("map key scan cloud is truncated");
+        m_key_scans.push_back(k);
+    }
+    const uint64_t num_moved = index.get<uint64_t>();
+    for(uint64_t i = 0; i < num_moved; i++){
+        const uint64_t id = index.get<uint64_t>();
+        const Eigen::Matrix4f m = index.getMat();
+        if(id >= m_key_scans.size())
+            throw std::runtime_error("map index is corrupt");
+        m_key_scans[id].global_transform = m;
+    }
+    const uint64_t num_constraints = index.get<uint64_t>();
+    for(uint64_t i = 0; i < num_constraints; i++){
+        Constraint c;
+        c.parent = index.get<uint64_t>();
+        c.child = index.get<uint64_t>();
+        const float dx = index.get<float>();
+        const float dy = index.get<float>();
+        const float dtheta = index.get<float>();
+        c.b_wrt_a = RelativePose(dx, dy, dtheta);
+        m_constraints.push_back(c);
+    }
+    const uint64_t num_poses = index.get<uint64_t>();
+    for(uint64_t i = 0; i < num_poses; i++){
+        Pose p;
+        p.id = index.get<uint64_t>();
+        p.parent = index.get<uint64_t>();
+        p.time = index.getTime();
+        p.relative_transform = index.getMat();
+        m_poses.push_back(p);
+    }
+}
+
+std::string SlamMapStore::_serialiseIndexRecord(key_scan_vec const& key_scans,
+                                                std::size_t first_key_scan,
+                                                std::size_t first_constraint,
+                                                std::size_t first_pose,
+                                                std::set<std::size_t> const& moved,
+                                                uint64_t previous_offset,
+                                                uint64_t previous_size) const{
+    std::string r;
+    r.reserve(Record_Header_Size +
+              (key_scans.size() - first_key_scan) * Key_Scan_Entry_Size +
+              (m_constraints.size() - first_constraint) * Constraint_Entry_Size +
+              (m_poses.size() - first_pose) * Pose_Entry_Size);
+    put(r, previous_offset);
+    put(r, previous_size);
+    put(r, uint64_t(key_scans.size() - first_key_scan));
+    for(std::size_t i = first_key_scan; i < key_scans.size(); i++){
+        KeyScan const& k = key_scans[i];
+        put(r, uint64_t(k.idx_in_all));
+        put(r, k.time.secs);
+        put(r, k.time.musecs);
+        putMat(r, k.global_transform);
+        put(r, k.local_box.min_x);
+        put(r, k.local_box.min_y);
+        put(r, k.local_box.max_x);
+        put(r, k.local_box.max_y);
+        put(r, k.cloud_offset);
+        put(r, k.cloud_size);
+    }
+    put(r, uint64_t(moved.size()));
+    foreach(std::size_t id, moved){
+        put(r, uint64_t(id));
+        putMat(r, key_scans[id].global_transform);
+    }
+    put(r, uint64_t(m_constraints.size() - first_constraint));
+    for(std::size_t i = first_constraint; i < m_constraints.size(); i++){
+        Constraint const& c = m_constraints[i];
+        put(r, uint64_t(c.parent));
+        put(r, uint64_t(c.child));
+        put(r, c.b_wrt_a.dx());
+        put(r, c.b_wrt_a.dy());
+        put(r, c.b_wrt_a.dtheta());
+    }
+    put(r, uint64_t(m_poses.size() - first_pose));
+    for(std::size_t i = first_pose; i < m_poses.size(); i++){
+        Pose const& p = m_poses[i];
+        put(r, uint64_t(p.id));
+        put(r, uint64_t(p.parent));
+        put(r, p.time.secs);
+        put(r, p.time.musecs);
+        putMat(r, p.relative_transform);
+    }
+    return r;
+}
+
+void SlamMapStore::_writeHeader(std::ostream& f, uint64_t index_offset, uint64_t index_size) const{
+    const uint32_t version = Version;
+    const uint32_t reserved = 0;
+    f.write(Magic, sizeof(Magic));
+    f.write((char const*)&version, sizeof(version));
+    f.write((char const*)&reserved, sizeof(reserved));
+    f.write((char const*)&index_offset, sizeof(index_offset));
+    f.write((char const*)&index_size, sizeof(index_size));
+}
+
+/* Copy the clouds and a new base index record to a new file, and replace
+ * the current file with it: the old file is valid until the rename, and the
+ * rename is atomic.
+ */
+void SlamMapStore::_compact(){
+    const std::string tmp_fname = m_fname + ".compacting";
+    debug() << "compacting map" << m_fname << ":" << m_live_size << "of" << m_file_size << "bytes in use";
+
+    m_file.flush();
+    _map();
+    char const* p = static_cast<char const*>(m_region.get_address());
+
+    key_scan_vec moved = m_key_scans;
+    std::ofstream f(tmp_fname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    const std::string placeholder(Header_Size, '\0');
+    f.write(placeholder.data(), placeholder.size());
+    uint64_t offset = Header_Size;
+    foreach(KeyScan& k, moved){
+        f.write(p + k.cloud_offset, k.cloud_size);
+        k.cloud_offset = offset;
+        offset += k.cloud_size;
+    }
+    const std::string index = _serialiseIndexRecord(
+        moved, 0, 0, 0, std::set<std::size_t>(), 0, 0
+    );
+    f.write(index.data(), index.size());
+    f.seekp(0);
+    _writeHeader(f, offset, index.size());
+    f.close();
+    if(!f)
+        throw std::runtime_error("failed to compact map file: " + m_fname);
+    // the new file must be complete on disk before it replaces the old one
+    syncFile(tmp_fname);
+
+    m_file.close();
+    if(std::rename(tmp_fname.c_str(), m_fname.c_str()))
+        throw std::runtime_error("failed to replace map file: " + m_fname);
+    // and the rename itself is only durable once the directory is synced
+    bf::path dir = bf::path(m_fname).parent_path();
+    syncFile(dir.empty()? "." : dir.string());
+    m_file.open(m_fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    m_key_scans.swap(moved);
+    _map();
+    m_file_size = offset + index.size();
+    m_live_size = m_file_size;
+    m_index_offset = offset;
+    m_index_record_size = index.size();
+    m_index_size = index.size();
+    m_delta_size = 0;
+}
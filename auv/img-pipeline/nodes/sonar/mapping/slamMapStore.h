@@ -0,0 +1,190 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_SONAR_SLAM_MAP_STORE_H__
+#define __CAUV_SONAR_SLAM_MAP_STORE_H__
+
+#include <set>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+
+#include <utility/time.h>
+
+#include "graphOptimiser.h"
+#include "keyScanIndex.h"
+
+namespace cauv{
+namespace imgproc{
+
+/* Single-file store for a SlamCloudGraph map: the key scan clouds, the
+ * global transforms of the key scans, the constraints between key scans,
+ * and the poses of the scans in between.
+ *
+ * File layout (native byte order, as the old per-key-scan files were):
+ *   header  "CAUVSMAP", uint32 version, uint32 0,
+ *           uint64 index offset, uint64 index size
+ *   clouds  one per key scan, in the format written by
+ *           SlamCloudPart::saveToFile, appended as key scans are added
+ *   index   a chain of index records, the header pointing at the newest.
+ *           Each record holds the offset and size of the one before it (0
+ *           for the first, the base), and what changed in between: the key
+ *           scans added (with each cloud's offset and size), the key scans
+ *           whose global transforms changed, and the constraints and
+ *           intermediate poses added.
+ *
+ * The file is memory mapped for reading, so a cloud is only read from disk
+ * when cloud() is used. Changes are made by appending: commit() appends an
+ * index record of just what changed, syncs it to disk, and then points the
+ * header at it (and syncs that), so a crash loses at most the changes since
+ * the last commit. Once the records since the base add up to more than a
+ * new base would, the next commit writes a new base instead, so the index
+ * written over the life of a map is proportional to the map's size rather
+ * than to its square. When more than half of the file is superseded index
+ * records it is compacted into a new file, which replaces the old one.
+ */
+class SlamMapStore: boost::noncopyable{
+    public:
+        enum {Version = 2};
+
+        struct KeyScan{
+            std::size_t idx_in_all;
+            TimeStamp time;
+            Eigen::Matrix4f global_transform;
+            // bounding box of the key scan's points in its own frame
+            KeyScanIndex::Box local_box;
+            uint64_t cloud_offset;
+            uint64_t cloud_size;
+
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        typedef std::vector<KeyScan, Eigen::aligned_allocator<KeyScan> > key_scan_vec;
+
+        struct Constraint{
+            std::size_t parent;
+            std::size_t child;
+            RelativePose b_wrt_a;
+
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        typedef std::vector<Constraint, Eigen::aligned_allocator<Constraint> > constraint_vec;
+
+        struct Pose{
+            std::size_t id;
+            std::size_t parent;
+            TimeStamp time;
+            Eigen::Matrix4f relative_transform;
+
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        typedef std::vector<Pose, Eigen::aligned_allocator<Pose> > pose_vec;
+
+        /* Open fname. If writable, it is created if it doesn't exist. Throws
+         * std::runtime_error if the file isn't a map of a known version.
+         */
+        SlamMapStore(std::string const& fname, bool writable);
+
+        /* Commits any uncommitted changes */
+        ~SlamMapStore();
+
+        std::string const& filename() const{ return m_fname; }
+        bool writable() const{ return m_writable; }
+
+        key_scan_vec const& keyScans() const{ return m_key_scans; }
+        constraint_vec const& constraints() const{ return m_constraints; }
+        pose_vec const& intermediatePoses() const{ return m_poses; }
+
+        /* The serialised cloud of key scan id (keyScans()[id].cloud_size
+         * bytes), in place in the mapped file: valid until the next call to a
+         * non-const method.
+         */
+        char const* cloud(std::size_t id);
+
+        // - modifications, which are only persistent once committed:
+        /* remove everything */
+        void clear();
+        /* id must be keyScans().size(): key scans are added in order */
+        void addKeyScan(std::size_t id,
+                        std::size_t idx_in_all,
+                        TimeStamp const& time,
+                        Eigen::Matrix4f const& global_transform,
+                        KeyScanIndex::Box const& local_box,
+                        std::string const& cloud_bytes);
+        void setGlobalTransform(std::size_t id, Eigen::Matrix4f const& m);
+        void addConstraint(std::size_t parent, std::size_t child, RelativePose const& b_wrt_a);
+        void addIntermediatePose(std::size_t id,
+                                 std::size_t parent,
+                                 TimeStamp const& time,
+                                 Eigen::Matrix4f const& relative_transform);
+        void commit();
+
+    private:
+        enum {Header_Size = 32};
+
+        void _checkWritable() const;
+        void _create();
+        void _read();
+        void _readIndexRecord(char const* p, uint64_t offset, uint64_t size);
+        void _map();
+        /* The changes to the map since key scans first_key_scan, constraint
+         * first_constraint and pose first_pose, and the transforms of moved.
+         * A base record is one with everything, and no previous record.
+         */
+        std::string _serialiseIndexRecord(key_scan_vec const& key_scans,
+                                          std::size_t first_key_scan,
+                                          std::size_t first_constraint,
+                                          std::size_t first_pose,
+                                          std::set<std::size_t> const& moved,
+                                          uint64_t previous_offset,
+                                          uint64_t previous_size) const;
+        void _writeHeader(std::ostream& f, uint64_t index_offset, uint64_t index_size) const;
+        void _compact();
+
+        std::string m_fname;
+        bool m_writable;
+
+        // only open if m_writable
+        std::fstream m_file;
+        boost::interprocess::file_mapping m_mapping;
+        boost::interprocess::mapped_region m_region;
+
+        key_scan_vec m_key_scans;
+        constraint_vec m_constraints;
+        pose_vec m_poses;
+
+        // what's changed since the last commit: key scans, constraints and
+        // poses from these on are new, and the key scans in m_moved (which
+        // were already committed) have new global transforms
+        std::size_t m_committed_key_scans;
+        std::size_t m_committed_constraints;
+        std::size_t m_committed_poses;
+        std::set<std::size_t> m_moved;
+
+        uint64_t m_file_size;
+        // bytes of the file that are still in use (header, clouds, index)
+        uint64_t m_live_size;
+        // of the newest index record
+        uint64_t m_index_offset;
+        uint64_t m_index_record_size;
+        // of all the index records back to (and including) the base, and of
+        // those since the base
+        uint64_t m_index_size;
+        uint64_t m_delta_size;
+        bool m_dirty;
+};
+
+} // namespace imgproc
+} // namespace cauv
+
+#endif // ndef __CAUV_SONAR_SLAM_MAP_STORE_H__
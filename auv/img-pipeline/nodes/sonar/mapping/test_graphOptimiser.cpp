@@ -166,6 +166,35 @@ void testClassicLoopClose(){
     
 }
 
+void testIncrementalLoopClose(){
+    ci::GraphOptimiserIncremental g(Num_Iters);
+    ci::constraint_vec constraints;
+
+    // square with noisy sides, added one pose at a time, then closed:
+    ci::location_ptr a = boost::make_shared<ci::SlamCloudLocation>(0,0,0);
+    ci::location_ptr b = boost::make_shared<ci::SlamCloudLocation>(1.1,0,M_PI*0.5);
+    ci::location_ptr c = boost::make_shared<ci::SlamCloudLocation>(1.1,1.1,M_PI*1.0);
+    ci::location_ptr d = boost::make_shared<ci::SlamCloudLocation>(0,1.1,M_PI*1.5);
+    ci::location_ptr locations[] = {a, b, c, d, a};
+
+    for(int i = 0; i < 4; i++){
+        ci::constraint_vec new_constraints;
+        new_constraints.push_back(boost::make_shared<RelPC>(RelP(1, 0, M_PI*0.5), locations[i], locations[i+1]));
+        constraints.insert(constraints.end(), new_constraints.begin(), new_constraints.end());
+        g.optimiseGraph(constraints, new_constraints);
+    }
+
+    std::cout << "Test Incremental Loop Close:" << std::endl;
+    std::cout << a << std::endl;
+    std::cout << b << std::endl;
+    std::cout << c << std::endl;
+    std::cout << d << std::endl;
+    std::cout << "error: " << ci::sumSquaredConstraintError(constraints) << std::endl;
+
+    assert_very_close(*a, ci::SlamCloudLocation(0,0,0));
+    assert_very_close(*c, ci::SlamCloudLocation(1,1,M_PI));
+}
+
 int main(){
     debug::setLevel(0);
 
@@ -173,5 +202,6 @@ int main(){
     testLoopEvenness();
     testRotation();
     testClassicLoopClose();
+    testIncrementalLoopClose();
 }
 
@@ -6,6 +6,8 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
  
 #include <pcl/point_types.h>
 
@@ -30,6 +32,16 @@ typedef boost::shared_ptr<ci::SlamCloudLocation> location_ptr;
 
 typedef std::vector<cauv::KeyPoint> kp_vec;
 
+// f(0) ... f(n-1) each on a thread of its own (in the pipeline the
+// scheduler's threads are used instead)
+static void threadsParallelFor(int n, boost::function<void(int)> const& f){
+    boost::thread_group threads;
+    for(int i = 1; i < n; i++)
+        threads.create_thread(boost::bind(f, i));
+    f(0);
+    threads.join_all();
+}
+
 int Graph_Iters = 10;
 float Overlap_Threshold = 0.2;
 float Keyframe_Spacing = 2;
@@ -95,6 +107,7 @@ int main(int argc, char** argv){
         Overlap_Threshold, Keyframe_Spacing, Min_Initial_Points,
         Good_Keypoint_Distance, Max_Considered_Overlaps
     );
+    g.setParallelFor(threadsParallelFor);
 
     cauv::TimeStamp t_a(0, 0);
     cauv::TimeStamp t_b(1, 0);
@@ -191,6 +204,7 @@ int main(int argc, char** argv){
         );
 
         debug() << "matched (confidence=" << confidence << ") at:\n" << global_transformation;
+        info() << g.lastRegisterScanTiming();
     }
     
     info() << "results:";
@@ -15,6 +15,7 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <sonar/sonar_accumulator.h>
+#include <sonar/line_filter.h>
 #include <utility/bash_cout.h>
 #include <utility/rounding.h>
 
@@ -93,7 +94,8 @@ class SonarInputNode: public InputNode{
         }
 
         virtual void onSonarImageMessage(boost::shared_ptr<const SonarImageMessage> m){
-            if(m_sonar_id != m->source())
+            // (view, so that images from other sonars are never deserialised)
+            if(m_sonar_id != m->view_source())
                 return;
 
             lock_t l(m_sonardata_lock);
@@ -106,13 +108,12 @@ class SonarInputNode: public InputNode{
             if(param_id == "Sonar ID"){
                 m_sonar_id = SonarID::e(param<int>("Sonar ID"));
                 // change message subs as necessary
-                if(m_sonar_id == SonarID::Seasprite){
-                    //unsubMessage(SonarImageMessage());
+                unSubMessage(SonarDataMessage());
+                unSubMessage(SonarImageMessage());
+                if(m_sonar_id == SonarID::Seasprite)
                     subMessage(SonarDataMessage());
-                }else if(m_sonar_id == SonarID::Gemini){
-                    //unsubMessage(SonarDataMessage());
-                    subMessage(SonarImageMessage());
-                }
+                else
+                    subMessage(SonarImageMessage(), m_sonar_id);
             }
         }
 
@@ -128,86 +129,16 @@ class SonarInputNode: public InputNode{
             int minRange = param<int>("min range");
             int derivative = param<int>("derivative");
 
-            std::vector<float> halfKernel;
-            float halfKernelSum = 0;
-            if (lowPassRadius != 0) {
-                float sigma = lowPassRadius/3.0f;
-                for (int i = 0; i <= lowPassRadius; ++i) {
-                    float val = std::exp(-(i*i)/(2*sigma*sigma));
-                    if (i == 0)
-                        halfKernelSum += val;
-                    else
-                        halfKernelSum += 2*val;
-                    halfKernel.push_back(val);
-                }
-            }
+            m_line_filter.setParams(lowPassRadius, derivative, nonMax, nonMaxEpsilon);
 
             cv::Mat fullImage;
             for ( boost::shared_ptr<SonarDataMessage const> m : msgs) {
                 SonarDataLine l = m->line();
-                std::vector<unsigned char>& bins = l.data;
-
-                // Cut off bins before min range
-                size_t minRangeBin = bins.size() * minRange / l.range;
-                if (minRangeBin < bins.size()) {
-                    for (size_t i = 0; i < minRangeBin && i < bins.size(); ++i)
-                        bins[i] = bins[minRangeBin];
-                } else {
-                    for (size_t i = 0; i < minRangeBin && i < bins.size(); ++i)
-                        bins[i] = 0;
-                }
-                
-                // Low-pass the data
-                if (lowPassRadius != 0) {
-                    std::vector<unsigned char> lpbins(l.data.size(), 0);
-                    for (size_t i = 0; i < bins.size(); ++i)
-                        for (int k = 0; k <= lowPassRadius; ++k) {
-                            if (k == 0)
-                                lpbins[i] += halfKernel[0] * _get(bins,i) / halfKernelSum;
-                            else
-                                lpbins[i] += halfKernel[k] * (_get(bins,i-k) + _get(bins,i+k)) / halfKernelSum;
-                        }
-                    std::swap(lpbins, bins);
-                }
-                
-                int d_sign = derivative > 0 ? 1 : -1;
-                for (int d = 0; d < std::abs(derivative); ++d) {
-                    std::vector<unsigned char> dbins(l.data.size(), 0);
-                    for (size_t i = 0; i < bins.size(); ++i)
-                        dbins[i] = clamp_cast<unsigned char>(d_sign*((int)_get(bins,i) - (int)_get(bins,i+1))+127);
-                    std::swap(dbins, bins);
-                }
 
-                // Non-maximum suppression (drop anything that's not a local/global
-                // maximum to zero)
-                switch(nonMax) {
-                    case 1: {
-                        // Find local maxima
-                        std::vector<unsigned char> lmbins(l.data.size(), 0);
-                        for (int i = 1; i < (int)bins.size() - 1; ++i) {
-                            if ((i-1 >= 0 && (bins[i-1] + nonMaxEpsilon > bins[i])) || (i+1 < (int)bins.size() && (bins[i] < bins[i+1] + nonMaxEpsilon))) {
-                                lmbins[i] = 0;
-                            } else {
-                                lmbins[i] = bins[i];
-                            }
-                        }
-                        std::swap(lmbins, bins);
-                        break;
-                    }
-                    case 2: {
-                        // Find global maximum
-                        size_t imax = 0;
-                        for (size_t i = 1; i < bins.size(); ++i) {
-                            if (bins[i] < bins[imax] + nonMaxEpsilon) {
-                                bins[i] = 0;
-                            } else {
-                                bins[imax] = 0;
-                                imax = i;
-                            }
-                        }
-                        break;
-                    }
-                }
+                // Cut off bins before min range, low-pass, derivative and
+                // non-maximum suppression, in place
+                size_t minRangeBin = l.data.size() * minRange / l.range;
+                m_line_filter.apply(l.data, minRangeBin);
 
                 if (m_accumulator.accumulateDataLine(l))
                     fullImage = m_accumulator.mat().clone();
@@ -353,11 +284,6 @@ class SonarInputNode: public InputNode{
             return ret;
         }
         
-        static unsigned int _get(std::vector<unsigned char> const& data, int i)
-        {
-            return data[clamp_cast<size_t>(0, i, (int)data.size()-1)];
-        }
-
         static std::string timeStampToString(TimeStamp const& t){
             boost::posix_time::ptime pt = boost::posix_time::from_time_t(t.secs);
             pt += boost::posix_time::time_duration(0, 0, 0, t.musecs);
@@ -369,6 +295,7 @@ class SonarInputNode: public InputNode{
 
         int m_images_displayed;
         SonarAccumulator m_accumulator;
+        SonarLineFilter m_line_filter;
     
         int processed;
         mutable boost::recursive_mutex m_counters_lock;
@@ -0,0 +1,121 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __SONAR_LINE_FILTER_NODE_H__
+#define __SONAR_LINE_FILTER_NODE_H__
+
+#include <vector>
+#include <string>
+
+#include <boost/make_shared.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <sonar/line_filter.h>
+
+#include "../../node.h"
+
+
+namespace cauv{
+namespace imgproc{
+
+// The data line preprocessing that SonarInputNode does (see
+// sonar/line_filter.h), on each line of an image: each row of an ordinary
+// image, or each bearing (column) of a polar image.
+class SonarLineFilterNode: public Node{
+    public:
+        SonarLineFilterNode(ConstructArgs const& args)
+            : Node(args), m_line_filter(){
+        }
+
+        void init(){
+            // fast node:
+            m_speed = fast;
+
+            registerInputID("image", Const);
+
+            registerOutputID("image");
+
+            registerParamID<int>("non-maximum suppression", 0, "0 for no suppression, 1 for only local maxima, 2 for only global maximum");
+            registerParamID<int>("non-maximum epsilon", 1, "minimum difference for a node to be maximal");
+            registerParamID<int>("low-pass width", 0, "radius of a 1D low pass filter applied to each line");
+            registerParamID<float>("min range", 0, "minimum range of bins kept: in metres for polar images, in bins otherwise");
+            registerParamID<int>("derivative", 0, "use the nth derivative of each line (negative values reverse the direction)");
+        }
+
+    protected:
+        struct applyFilter: boost::static_visitor<augmented_mat_t>{
+            applyFilter(SonarLineFilter& filter, float min_range)
+                : m_filter(filter), m_min_range(min_range){
+            }
+            augmented_mat_t operator()(cv::Mat a) const{
+                checkType(a);
+                cv::Mat r = pooledMat(a.size(), CV_8UC1);
+                a.copyTo(r);
+                const size_t min_range_bin = std::max(0.0f, m_min_range);
+                for(int row = 0; row < r.rows; row++)
+                    m_filter.apply(r.ptr<uint8_t>(row), r.cols, min_range_bin);
+                return r;
+            }
+            augmented_mat_t operator()(NonUniformPolarMat a) const{
+                checkType(a.mat);
+                size_t min_range_bin = 0;
+                while(min_range_bin < a.ranges->size() && (*a.ranges)[min_range_bin] < m_min_range)
+                    min_range_bin++;
+
+                // filter the bearings as rows of the transpose, then
+                // transpose back
+                cv::Mat lines = pooledMat(cv::Size(a.mat.rows, a.mat.cols), CV_8UC1);
+                cv::transpose(a.mat, lines);
+                for(int row = 0; row < lines.rows; row++)
+                    m_filter.apply(lines.ptr<uint8_t>(row), lines.cols, min_range_bin);
+
+                NonUniformPolarMat r;
+                r.bearings = a.bearings;
+                r.ranges = a.ranges;
+                r.mat = pooledMat(a.mat.size(), CV_8UC1);
+                cv::transpose(lines, r.mat);
+                return r;
+            }
+            augmented_mat_t operator()(PyramidMat) const{
+                throw parameter_error("pyramids are not supported");
+            }
+            static void checkType(cv::Mat const& m){
+                if(m.type() != CV_8UC1)
+                    throw parameter_error("only 8-bit single channel images are supported");
+            }
+            SonarLineFilter& m_filter;
+            const float m_min_range;
+        };
+        void doWork(in_image_map_t& inputs, out_map_t& r){
+            image_ptr_t img = inputs["image"];
+
+            m_line_filter.setParams(
+                param<int>("low-pass width"),
+                param<int>("derivative"),
+                param<int>("non-maximum suppression"),
+                param<int>("non-maximum epsilon")
+            );
+
+            augmented_mat_t in = img->constAugmentedMat();
+            r["image"] = boost::make_shared<Image>(
+                boost::apply_visitor(applyFilter(m_line_filter, param<float>("min range")), in)
+            );
+        }
+
+    private:
+        // working space is kept between execs, so nothing is allocated per
+        // line (exec is never concurrent for one node)
+        SonarLineFilter m_line_filter;
+
+    // Register this node type
+    DECLARE_NFR;
+};
+
+} // namespace imgproc
+} // namespace cauv
+
+#endif // ndef __SONAR_LINE_FILTER_NODE_H__
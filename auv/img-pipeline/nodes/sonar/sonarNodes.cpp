@@ -12,6 +12,7 @@
 #include "sonarImageEdgeNode.h"
 #include "learnedKeyPointsNode.h"
 #include "bearingRangeCropNode.h"
+#include "sonarLineFilterNode.h"
 
 namespace cauv{
 namespace imgproc{
@@ -23,6 +24,7 @@ DEFINE_NFR(PolarImageToXYNode, NodeType::PolarImageToXY);
 DEFINE_NFR(SonarImageEdgeNode, NodeType::SonarImageEdge);
 DEFINE_NFR(LearnedKeyPointsNode, NodeType::LearnedKeyPoints);
 DEFINE_NFR(BearingRangeCropNode, NodeType::BearingRangeCrop);
+DEFINE_NFR(SonarLineFilterNode, NodeType::SonarLineFilter);
 
 } // namespace imgproc
 } // namespace cauv
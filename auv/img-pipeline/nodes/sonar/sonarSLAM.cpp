@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <limits>
 
+#include <boost/bind.hpp>
 #include <boost/tuple/tuple.hpp> // for tie()
 #include <boost/algorithm/string.hpp> // for iequals
 
@@ -102,6 +103,7 @@ class SonarSLAMImpl{
     public:
         SonarSLAMImpl()
             : m_graph(),
+              m_incremental_optimiser(),
               m_cumulative_rotation_guess(0),
               m_vis_metres_per_px(0),
               m_vis_origin(0,0),
@@ -122,6 +124,7 @@ class SonarSLAMImpl{
 
         void reset(){
             m_graph.reset();
+            m_incremental_optimiser.reset();
             m_cumulative_rotation_guess = 0;
             initVis();
         }
@@ -137,6 +140,26 @@ class SonarSLAMImpl{
             m_graph.setParams(params);
         }
 
+        /* The incremental optimiser keeps the linearised graph between key
+         * scans, so it lives as long as the graph does
+         */
+        GraphOptimiser const& incrementalOptimiser(int max_iters){
+            if(!m_incremental_optimiser)
+                m_incremental_optimiser = boost::make_shared<GraphOptimiserIncremental>(max_iters);
+            m_incremental_optimiser->setMaxIters(max_iters);
+            return *m_incremental_optimiser;
+        }
+
+        // once another optimiser has moved the graph the incremental
+        // optimiser's state is out of date
+        void resetIncrementalOptimiser(){
+            m_incremental_optimiser.reset();
+        }
+
+        void setParallelFor(SlamCloudGraph<pt_t>::parallel_for_fn const& fn){
+            m_graph.setParallelFor(fn);
+        }
+
         float registerScan(cloud_ptr scan,
                            PairwiseMatcher<pt_t> const& scan_matcher,
                            GraphOptimiser const& graph_optimiser,
@@ -380,10 +403,12 @@ class SonarSLAMImpl{
 
         void load(){
             m_graph.load();
+            m_incremental_optimiser.reset();
         }
 
     private:
         SlamCloudGraph<pt_t> m_graph;
+        boost::shared_ptr<GraphOptimiserIncremental> m_incremental_optimiser;
         
         float m_cumulative_rotation_guess;
 
@@ -419,6 +444,8 @@ void SonarSLAMNode::init(){
     typedef std::vector<KeyPoint> kp_vec;
 
     m_impl = boost::make_shared<SonarSLAMImpl>();
+    // run pairwise scan matches on the pipeline's threads
+    m_impl->setParallelFor(boost::bind(&SonarSLAMNode::parallelFor, this, _1, _2));
 
     // slow node (don't schedule nodes providing input until we've
     // finished doing work here)
@@ -442,7 +469,8 @@ void SonarSLAMNode::init(){
     registerParamID("clear", bool(false), "true => discard accumulated point cloud");
     registerParamID("read only", bool(true), "false: save new keyframes and update the persistent state with keyframes and intermediate poses");
     registerParamID("load map", bool(false), "if set to true, the persistent map will be loaded (and current state discarded), and then the parameter will be reset to false");
-    registerParamID("map dir", std::string("/tmp/cauv/slam/persistence"), "directory for map persistent state (saving and loading)");
+    registerParamID("map dir", std::string("/tmp/cauv/slam/persistence"), "directory for map persistent state (saving and loading), which is kept in slam.map");
+    registerParamID("map working radius", float(50), "when the map is loaded, key scans further than this from the last one are only read from the map file when they're needed");
 
     ///*unused*/ registerParamID("map merge alpha", float(5), "alpha-hull parameter for map merging");
     registerParamID("score threshold", float(2), "keypoint set will be rejected if mean distance error is greater than this");
@@ -467,8 +495,10 @@ void SonarSLAMNode::init(){
     registerParamID("match algorithm", std::string("ICP"), "ICP, Non-Linear ICP, or NDT");
     
     // Graph Optimisation Parameters
+    registerParamID("graph optimiser", std::string("V1"), "V1 or incremental");
     registerParamID("graph iters", int(10), "Iterations of graph optimisation per key-scan");
     registerParamID("max matches", int(3), "Maximum number of pairwise correspondences for each scan");
+    registerParamID("max parallel matches", int(2), "Maximum number of pairwise matches to run at once (each one occupies a pipeline thread)");
     registerParamID("match consensus", int(2), "Consensus required for match");
     registerParamID("consensus tolerance", float(0.3), "Metres between matches to consider consensus");
 
@@ -529,6 +559,7 @@ void SonarSLAMNode::doWork(in_image_map_t& inputs, out_map_t& r){
     const bool load_map     = param<bool>("load map");
     const bool read_only    = param<bool>("read only");
     const std::string map_dir = param<std::string>("map dir");
+    const float map_working_radius = param<float>("map working radius");
     const int   max_iters   = param<int>("max iters");
     const float euclidean_fitness   = param<float>("euclidean fitness");
     const float transform_eps       = param<float>("transform eps");
@@ -538,8 +569,10 @@ void SonarSLAMNode::doWork(in_image_map_t& inputs, out_map_t& r){
     const int ransac_iters          = param<int>("ransac iterations");
     const float grid_step           = param<float>("grid step");
 
+    const std::string graph_algorithm = param<std::string>("graph optimiser");
     const int graph_iters = param<int>("graph iters");
     const int max_matches = param<int>("max matches");
+    const int max_parallel_matches = param<int>("max parallel matches");
     const int require_match_consensus = param<int>("match consensus");
     const float consensus_tolerance = param<float>("consensus tolerance");
 
@@ -571,10 +604,12 @@ void SonarSLAMNode::doWork(in_image_map_t& inputs, out_map_t& r){
     params.good_keypoint_distance = point_merge_distance;
     //params.max_speed = 2.0;
     params.max_considered_overlaps = max_matches;
+    params.max_parallel_matches = max_parallel_matches;
     params.min_scan_consensus = require_match_consensus;
     params.scan_consensus_tolerance = consensus_tolerance;
     params.persistence_dir = map_dir;
     params.read_only = read_only;
+    params.working_radius = map_working_radius;
     //params.rotation_scale = 4;
 
     m_impl->setGraphProperties(params);
@@ -619,7 +654,18 @@ void SonarSLAMNode::doWork(in_image_map_t& inputs, out_map_t& r){
         );
     }
 
-    GraphOptimiserV1 graph_optimiser(graph_iters);
+    GraphOptimiserV1 graph_optimiser_v1(graph_iters);
+    GraphOptimiser const* graph_optimiser = &graph_optimiser_v1;
+    if(boost::iequals(graph_algorithm, "incremental")){
+        graph_optimiser = &m_impl->incrementalOptimiser(graph_iters);
+    }else if(boost::iequals(graph_algorithm, "V1")){
+        m_impl->resetIncrementalOptimiser();
+    }else{
+        throw parameter_error(
+            "invalid graph optimiser: \""+ graph_algorithm +
+            "\": valid optimisers are V1, incremental"
+        );
+    }
     
     debug() << "external delta theta =" << delta_theta * 180 / 3.14159 << "degrees";
     /*Eigen::Matrix4f relative_rotation_guess = Eigen::Matrix4f::Identity();
@@ -633,7 +679,7 @@ void SonarSLAMNode::doWork(in_image_map_t& inputs, out_map_t& r){
     const float confidence = m_impl->registerScan(
         scan,
         *scan_matcher,
-        graph_optimiser,
+        *graph_optimiser,
         //relative_rotation_guess,
         // TODO: !!! the sign should be sorted out before this point
         -delta_theta,
@@ -12,6 +12,8 @@
 #include <string>
 
 #include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -48,8 +50,10 @@ class SonarShadowFilterNode: public Node{
 
     protected:
         struct applyFilter: boost::static_visitor<augmented_mat_t>{
-            applyFilter(float object_size, float shadow_size, float object_weight, float shadow_weight)
-                : m_object_size(object_size),
+            applyFilter(SonarShadowFilterNode const& node, float object_size, float shadow_size,
+                        float object_weight, float shadow_weight)
+                : m_node(node),
+                  m_object_size(object_size),
                   m_shadow_size(shadow_size),
                   m_object_importance(object_weight),
                   m_shadow_importance(shadow_weight){
@@ -64,11 +68,11 @@ class SonarShadowFilterNode: public Node{
                 NonUniformPolarMat r;
                 r.bearings = a.bearings;
                 r.ranges = a.ranges;
-                r.mat = cv::Mat(cv::Size(cols, rows), CV_8UC1);
+                r.mat = pooledMat(cv::Size(cols, rows), CV_8UC1);
 
                 // first create an integral image along each bearing line
                 // (column):
-                cv::Mat integral(cv::Size(cols, rows), CV_32FC1);
+                cv::Mat integral = pooledMat(cv::Size(cols, rows), CV_32FC1);
                 for(int row = 0; row < rows; row++)
                     if(row == 0){
                         for(int col = 0; col < cols; col++)
@@ -91,7 +95,20 @@ class SonarShadowFilterNode: public Node{
                 debug() << "object sz=" << m_object_size << "m =" << object_sz << "px"
                         << "shadow sz=" << m_shadow_size << "m =" << shadow_sz << "px";
 
-                for(int row = 0; row < rows; row++){
+                m_node.parallelRows(r.mat, object_sz/2 + (object_sz+1)/2 + shadow_sz, boost::bind(
+                    &applyFilter::filterRows, this, boost::cref(integral), boost::ref(r.mat),
+                    object_sz, shadow_sz, _1
+                ));
+                return r;
+            }
+            augmented_mat_t operator()(PyramidMat) const{
+                throw parameter_error("only polar images are supported");
+            }
+            void filterRows(cv::Mat const& integral, cv::Mat& out,
+                            uint32_t object_sz, uint32_t shadow_sz, cv::Range const& band) const{
+                const int rows = integral.rows;
+                const int cols = integral.cols;
+                for(int row = band.start; row < band.end; row++){
                     const int object_start_row = row - object_sz/2;
                     const int object_end_row = std::min(rows-1, int(row + (object_sz+1)/2));
                     const int shadow_end_row = std::min(rows-1, int(row + (object_sz+1)/2 + shadow_sz));
@@ -103,14 +120,11 @@ class SonarShadowFilterNode: public Node{
                             m_object_importance * (object_end_val - object_start_val) -
                             m_shadow_importance * (shadow_end_val - object_end_val)
                         );
-                        r.mat.at<uint8_t>(row,col) = clamp_cast<uint8_t>(0.0f, filter_value, 255.0f);
+                        out.at<uint8_t>(row,col) = clamp_cast<uint8_t>(0.0f, filter_value, 255.0f);
                     }
                 }
-                return r;
-            }
-            augmented_mat_t operator()(PyramidMat) const{
-                throw parameter_error("only polar images are supported");
             }
+            SonarShadowFilterNode const& m_node;
             const float m_object_size;
             const float m_shadow_size;
             const float m_object_importance;            
@@ -130,7 +144,7 @@ class SonarShadowFilterNode: public Node{
 
             try{
                 out = boost::apply_visitor(applyFilter(
-                    object_size, shadow_size, object_importance, shadow_importance
+                    *this, object_size, shadow_size, object_importance, shadow_importance
                 ), in);
                 r["polar image"] = boost::make_shared<Image>(out);
             }catch(cv::Exception& e){
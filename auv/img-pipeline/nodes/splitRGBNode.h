@@ -43,7 +43,7 @@ class SplitRGBNode: public Node{
         void doWork(in_image_map_t& inputs, out_map_t& r){
             image_ptr_t img = inputs["image"];
             
-            cv::Mat out[3];
+            cv::Mat out[3] = {pooledMat(), pooledMat(), pooledMat()};
 
             try{
                 cv::split(img->mat(), out);
@@ -59,7 +59,7 @@ class SplitYUVNode: public Node{
                         << e.func << "," << e.file << ":" << e.line << "\n\t";
             }
             
-            cv::Mat out[3];
+            cv::Mat out[3] = {pooledMat(), pooledMat(), pooledMat()};
 
             try{
                 cv::split(YUV, out);
@@ -53,7 +53,7 @@ class SumSquaredNode: public Node{
         void doWork(in_image_map_t& inputs, out_map_t& r){
 
             image_ptr_t img = inputs["image"];
-            r["sum sq"] = img->apply(boost::bind(sumsquared, _1));
+            r["sum sq"] = img->constApply(boost::bind(sumsquared, _1));
             
         }
     
@@ -63,7 +63,7 @@ class VideoFileOutputNode: public OutputNode{
 
             debug(4) << "VideoFileOutputNode::doWork()" << inputs["image"];
 
-            img->apply(boost::bind(&VideoFileOutputNode::processFrame, this, _1, param<std::string>("filename")));
+            img->constApply(boost::bind(&VideoFileOutputNode::processFrame, this, _1, param<std::string>("filename")));
         }
 
         void processFrame(cv::Mat& img, const std::string& filename)
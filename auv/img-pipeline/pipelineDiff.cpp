@@ -0,0 +1,92 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#include "pipelineDiff.h"
+
+#include <boost/make_shared.hpp>
+
+#include <generated/types/serialise.h>
+
+using namespace cauv;
+using namespace cauv::imgproc;
+
+bool cauv::imgproc::sameParamValue(ParamValue const& a, ParamValue const& b){
+    const svec_ptr a_bytes = boost::make_shared<svec_t>();
+    const svec_ptr b_bytes = boost::make_shared<svec_t>();
+    cauv::serialise(a_bytes, a);
+    cauv::serialise(b_bytes, b);
+    return *a_bytes == *b_bytes;
+}
+
+int cauv::imgproc::paramDifferences(GraphNode const& wanted, GraphNode const& existing){
+    int r = 0;
+    for(auto const& p : wanted.params){
+        auto i = existing.params.find(p.first);
+        if(i == existing.params.end() || !sameParamValue(p.second, i->second))
+            r++;
+    }
+    for(auto const& p : existing.params){
+        if(wanted.params.count(p.first) || wanted.arcs.count(p.first.input))
+            continue;
+        auto d = existing.defaults.find(p.first.input);
+        if(d != existing.defaults.end() && !sameParamValue(p.second, d->second))
+            r++;
+    }
+    return r;
+}
+
+int cauv::imgproc::sharedArcs(GraphNode const& wanted, GraphNode const& existing,
+                              std::map<node_id, node_id> const& matched, bool exact){
+    int shared = 0;
+    for(auto const& a : wanted.arcs){
+        auto from = matched.find(a.second.first);
+        auto i = existing.arcs.find(a.first);
+        if(from != matched.end() && i != existing.arcs.end() &&
+           i->second == std::make_pair(from->second, a.second.second))
+            shared++;
+    }
+    if(exact && (shared != int(wanted.arcs.size()) || wanted.arcs.size() != existing.arcs.size()))
+        return -1;
+    return shared;
+}
+
+bool cauv::imgproc::matchOne(graph_t const& wanted, graph_t const& existing,
+                             std::map<node_id, node_id>& matched, std::set<node_id>& used, bool exact){
+    for(auto const& w : wanted){
+        if(matched.count(w.first))
+            continue;
+        node_id best = 0;
+        int best_shared = exact? -1 : 0;
+        int best_differences = 0;
+        for(auto const& e : existing){
+            if(used.count(e.first) || e.second.type != w.second.type)
+                continue;
+            const int shared = sharedArcs(w.second, e.second, matched, exact);
+            if(shared < 0 || (!exact && shared == 0) || shared < best_shared)
+                continue;
+            const int differences = paramDifferences(w.second, e.second);
+            if(best && shared == best_shared && differences >= best_differences)
+                continue;
+            best = e.first;
+            best_shared = shared;
+            best_differences = differences;
+        }
+        if(best){
+            matched[w.first] = best;
+            used.insert(best);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::map<node_id, node_id> cauv::imgproc::matchNodes(graph_t const& wanted, graph_t const& existing){
+    std::map<node_id, node_id> matched;
+    std::set<node_id> used;
+    while(matchOne(wanted, existing, matched, used, true) ||
+          matchOne(wanted, existing, matched, used, false)){
+    }
+    return matched;
+}
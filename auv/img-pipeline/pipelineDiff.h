@@ -0,0 +1,69 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_IMG_PIPELINE_DIFF_H__
+#define __CAUV_IMG_PIPELINE_DIFF_H__
+
+#include <map>
+#include <set>
+#include <utility>
+
+#include <generated/types/NodeType.h>
+#include <generated/types/LocalNodeInput.h>
+#include <generated/types/ParamValue.h>
+
+#include "pipelineTypes.h"
+
+namespace cauv{
+namespace imgproc{
+
+/* Matching the nodes of a new pipeline (from a SetPipelineMessage) to those
+ * of the running one, so that ImageProcessor::onSetPipelineMessage only has
+ * to change what differs (see there).
+ */
+
+// the parts of a node that are compared when matching
+struct GraphNode{
+    typedef std::map<input_id, std::pair<node_id, output_id> > arc_map_t;
+    typedef std::map<LocalNodeInput, ParamValue> param_map_t;
+    NodeType::e type;
+    // connected inputs only
+    arc_map_t arcs;
+    // parameters not set by arcs
+    param_map_t params;
+    // the value each parameter has if it isn't set (only known for
+    // existing nodes)
+    std::map<input_id, ParamValue> defaults;
+};
+typedef std::map<node_id, GraphNode> graph_t;
+
+bool sameParamValue(ParamValue const& a, ParamValue const& b);
+
+// number of parameters that would have to change to turn existing into
+// wanted: those of wanted that existing doesn't have the same value for, and
+// those wanted doesn't set that existing doesn't have the default value for
+int paramDifferences(GraphNode const& wanted, GraphNode const& existing);
+
+// number of arcs of wanted that existing already has (arcs from nodes not yet
+// matched never count), or -1 if exact is set and the arcs aren't all the
+// same
+int sharedArcs(GraphNode const& wanted, GraphNode const& existing,
+               std::map<node_id, node_id> const& matched, bool exact);
+
+// Match one more wanted node with an existing node of the same type: if exact
+// is set, one with exactly the same arcs (from matched nodes), otherwise
+// the one sharing the most arcs with it, if it shares any. Ties go to the
+// node with the fewest parameters to change.
+bool matchOne(graph_t const& wanted, graph_t const& existing,
+              std::map<node_id, node_id>& matched, std::set<node_id>& used, bool exact);
+
+// wanted node id -> the existing node kept for it, for as many wanted nodes
+// as can be matched
+std::map<node_id, node_id> matchNodes(graph_t const& wanted, graph_t const& existing);
+
+} // namespace imgproc
+} // namespace cauv
+
+#endif // ndef __CAUV_IMG_PIPELINE_DIFF_H__
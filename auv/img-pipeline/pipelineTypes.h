@@ -37,6 +37,9 @@ typedef int32_t node_id;
 typedef std::string input_id;
 typedef std::string output_id;
 
+// subscriptions to messages from any source (camera, sonar...)
+static const int32_t Any_Source = -1;
+
 class img_pipeline_error: public std::runtime_error{
     public:
         img_pipeline_error(const std::string& str)
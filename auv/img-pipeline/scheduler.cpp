@@ -7,114 +7,414 @@
 #include "scheduler.h"
 #include "node.h"
 
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+
 #include <boost/thread.hpp>
+#include <boost/make_shared.hpp>
 
 #include <debug/cauv_debug.h>
+#include <utility/string.h>
+#include <utility/trace.h>
 
+using namespace cauv;
 using namespace cauv::imgproc;
 
-int cauv::imgproc::pthreadPriority(SchedulerPriority const& s){
-    switch(s){
-        case priority_slow: return 20;
-        case priority_fast: return 10;
-        case priority_fastest: return 0;
-    }
-    return 0;
-}
+// utilisation is measured over periods of (at least) this long
+static const std::chrono::milliseconds Utilisation_Period(1000);
+// filter constant for the per-worker queue wait
+static const float Queue_Wait_Alpha = 0.05f;
 
-ImgPipelineThread::ImgPipelineThread(Scheduler* s, SchedulerPriority p)
-    : m_sched(s), m_priority(p){
+// which worker of which scheduler (if any) the current thread is
+static __thread Scheduler const* t_scheduler = NULL;
+static __thread int t_worker = -1;
+
+ImgPipelineThread::ImgPipelineThread(Scheduler* s, int worker)
+    : m_sched(s), m_worker(worker){
 }
 
 void ImgPipelineThread::operator()(){
+    t_scheduler = m_sched;
+    t_worker = m_worker;
+    trace::setThreadName(mkStr() << "ImgPipelineThread " << m_worker);
     try {
-        info() << BashColour::Brown << "ImgPipelineThread (" << m_priority << ") started";
+        info() << BashColour::Brown << "ImgPipelineThread (" << m_worker << ") started";
 
         node_ptr_t job;
         while(true){
             job.reset();
-            job = m_sched->waitNextJob(m_priority);
+            job = m_sched->waitNextJob(m_worker);
             if(job)
                 job->exec();
             else
                 break;
         }
     } catch (boost::thread_interrupted&) {
-        info() << BashColour::Brown << "ImgPipelineThread (" << m_priority << ") interrupted";
+        info() << BashColour::Brown << "ImgPipelineThread (" << m_worker << ") interrupted";
     }
-    info() << BashColour::Brown << "ImgPipelineThread (" << m_priority << ") ended";
+    info() << BashColour::Brown << "ImgPipelineThread (" << m_worker << ") ended";
+    t_scheduler = NULL;
+    t_worker = -1;
 }
 
 
-Scheduler::Scheduler() : m_stop(true), m_queues(), m_num_threads(), m_thread_groups()
-{
-    m_num_threads[priority_slow] = Slow_Threads;
-    m_num_threads[priority_fast] = Fast_Threads;
-    m_num_threads[priority_fastest] = Fastest_Threads;
-    
-    m_thread_groups[priority_slow] = thread_group_ptr_t();
-    m_thread_groups[priority_fast] = thread_group_ptr_t();
-    m_thread_groups[priority_fastest] = thread_group_ptr_t();
+Scheduler::Worker::Worker()
+    : mux(),
+      period_start(sched_clock_t::now()),
+      job_start(),
+      busy_in_period(sched_clock_t::duration::zero()),
+      running_job(false),
+      utilisation(0),
+      queue_wait_ms(0),
+      jobs_run(0),
+      jobs_stolen(0),
+      job_node(){
+}
 
-    //m_queues[priority_slow] = boost::make_shared<node_queue_t>();
-    m_queues[priority_fast] = boost::make_shared<node_queue_t>();
-    //m_queues[priority_fastest] = boost::make_shared<node_queue_t>();
+Scheduler::TaskGroup::TaskGroup(int n, boost::function<void(int)> const& fn)
+    : n(n),
+      fn(fn),
+      next(0),
+      exhausted(false),
+      done(0),
+      exception(),
+      mux(),
+      all_done(){
+}
+
+Scheduler::Scheduler(int num_threads)
+    : m_stop(true),
+      m_num_threads(0),
+      m_pin_threads(false),
+      m_observer(),
+      m_workers(),
+      m_threads(),
+      m_pending(0),
+      m_idle(0),
+      m_next_worker(0),
+      m_task_groups(),
+      m_unclaimed_task_groups(0),
+      m_task_groups_mux(),
+      m_idle_mux(),
+      m_work_available(){
+    setNumThreads(num_threads);
 }
 
 Scheduler::~Scheduler(){
     stopWait();
 }
 
+/**
+ * Must be called before start(): changing the number of workers would strand
+ * any jobs queued on the workers that were removed
+ */
+void Scheduler::setNumThreads(int num_threads){
+    if(!m_stop)
+        throw scheduler_error("cannot change number of threads while running");
+    if(num_threads <= 0)
+        num_threads = boost::thread::hardware_concurrency();
+    if(num_threads <= 0)
+        num_threads = 2;
+    if(m_pending)
+        throw scheduler_error("cannot change number of threads with jobs queued");
+    m_num_threads = num_threads;
+    m_workers.clear();
+    for(int i = 0; i < m_num_threads; i++)
+        m_workers.push_back(boost::make_shared<Worker>());
+}
+
+int Scheduler::numThreads() const{
+    return m_num_threads;
+}
+
+void Scheduler::setPinThreads(bool pin){
+    m_pin_threads = pin;
+}
+
+void Scheduler::setObserver(boost::shared_ptr<SchedulerObserver> observer){
+    if(!m_stop)
+        throw scheduler_error("cannot change observer while running");
+    m_observer = observer;
+}
+
+/**
+ * Workers are only counted as idle while waiting for work, so a worker
+ * that's between jobs counts as busy
+ */
+bool Scheduler::idle() const{
+    return !m_pending && !m_unclaimed_task_groups && m_idle == m_num_threads;
+}
+
 /**
  * Add a job of a particular priority to the corresponding queue
  * NB: this IS threadsafe
  */
-void Scheduler::addJob(node_wkptr_t node, SchedulerPriority p) const
+void Scheduler::addJob(node_wkptr_t node, SchedulerPriority p)
 {
-    // we rely on multiple-reader thread-safety of std::map here,
-    // which is only true if we aren't creating new key-value pairs
-    // using operator[] (which we aren't, and doing so would return a
-    // NULL queue pointer anyway)
-    const priority_queue_map_t::const_iterator i = m_queues.find(p);
-    if(i != m_queues.end())
-        i->second->push(node);
-    else
+    if(p < 0 || p >= Num_Priorities)
         // default: lowest priority
-        m_queues.begin()->second->push(node);
+        p = priority_slow;
+
+    int worker = t_worker;
+    if(t_scheduler != this || worker < 0)
+        worker = m_next_worker++ % m_workers.size();
+
+    Job job = {node, sched_clock_t::now()};
+    Worker& w = *m_workers[worker];
+    {
+        boost::lock_guard<boost::mutex> l(w.mux);
+        w.jobs[p].push_back(job);
+    }
+
+    // the worker side increments m_idle and then checks m_pending, we
+    // increment m_pending then check m_idle, so at least one of us sees the
+    // other
+    m_pending++;
+    if(m_idle > 0){
+        boost::lock_guard<boost::mutex> l(m_idle_mux);
+        m_work_available.notify_one();
+    }
+}
+
+/**
+ * Take the highest priority job available to this worker: the back of its
+ * own deque, or failing that the front of another worker's deque
+ */
+bool Scheduler::_tryPop(int worker, Job& job)
+{
+    const int n = m_workers.size();
+    for(int p = Num_Priorities - 1; p >= 0; p--){
+        {
+            Worker& w = *m_workers[worker];
+            boost::lock_guard<boost::mutex> l(w.mux);
+            if(!w.jobs[p].empty()){
+                job = w.jobs[p].back();
+                w.jobs[p].pop_back();
+                return true;
+            }
+        }
+        for(int i = 1; i < n; i++){
+            Worker& victim = *m_workers[(worker + i) % n];
+            boost::lock_guard<boost::mutex> l(victim.mux);
+            if(!victim.jobs[p].empty()){
+                job = victim.jobs[p].front();
+                victim.jobs[p].pop_front();
+                m_workers[worker]->jobs_stolen++;
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
 /**
- * Wait on the next available job of priority p: if a node has been destroyed
- * (.lock() returns empty shared pointer) then continue to wait until there's a
- * job from a node that is still alive.
+ * Claim and run tasks from group until there are none left to claim, returns
+ * true if this call was the one that found the group exhausted
+ */
+bool Scheduler::_runTasks(TaskGroup& group)
+{
+    int i;
+    int ran = 0;
+    while((i = group.next++) < group.n){
+        try{
+            group.fn(i);
+        }catch(...){
+            boost::lock_guard<boost::mutex> l(group.mux);
+            if(!group.exception)
+                group.exception = std::current_exception();
+        }
+        ran++;
+    }
+    if(ran){
+        boost::lock_guard<boost::mutex> l(group.mux);
+        group.done += ran;
+        if(group.done == group.n)
+            group.all_done.notify_all();
+    }
+    return !group.exhausted.exchange(true);
+}
+
+/**
+ * Help with the tasks of any outstanding parallelFor: these take precedence
+ * over queued jobs, since they're holding up a node that is already running
+ */
+bool Scheduler::_helpTaskGroup()
+{
+    if(!m_unclaimed_task_groups)
+        return false;
+    task_group_ptr_t group;
+    {
+        boost::lock_guard<boost::mutex> l(m_task_groups_mux);
+        for(unsigned i = 0; i < m_task_groups.size(); i++)
+            if(!m_task_groups[i]->exhausted){
+                group = m_task_groups[i];
+                break;
+            }
+    }
+    if(!group)
+        return false;
+    if(_runTasks(*group))
+        m_unclaimed_task_groups--;
+    return true;
+}
+
+void Scheduler::parallelFor(int n, boost::function<void(int)> const& fn)
+{
+    if(n <= 0)
+        return;
+    if(n == 1 || m_stop || m_num_threads < 2){
+        for(int i = 0; i < n; i++)
+            fn(i);
+        return;
+    }
+
+    task_group_ptr_t group = boost::make_shared<TaskGroup>(n, fn);
+    {
+        boost::lock_guard<boost::mutex> l(m_task_groups_mux);
+        m_task_groups.push_back(group);
+    }
+    m_unclaimed_task_groups++;
+    if(m_idle > 0){
+        boost::lock_guard<boost::mutex> l(m_idle_mux);
+        m_work_available.notify_all();
+    }
+
+    // the calling thread does its share (and all of the work if nothing else
+    // is idle), then waits for any tasks still running elsewhere
+    if(_runTasks(*group))
+        m_unclaimed_task_groups--;
+    {
+        boost::unique_lock<boost::mutex> l(group->mux);
+        while(group->done < group->n)
+            group->all_done.wait(l);
+    }
+    {
+        boost::lock_guard<boost::mutex> l(m_task_groups_mux);
+        m_task_groups.erase(std::find(m_task_groups.begin(), m_task_groups.end(), group));
+    }
+
+    if(group->exception)
+        std::rethrow_exception(group->exception);
+}
+
+void Scheduler::_updateUtilisation(Worker& w, sched_clock_t::time_point const& now)
+{
+    const sched_clock_t::duration period = now - w.period_start;
+    if(period < Utilisation_Period)
+        return;
+    sched_clock_t::duration busy = w.busy_in_period;
+    if(w.running_job)
+        busy += now - w.job_start;
+    w.utilisation = float(busy.count()) / period.count();
+    w.busy_in_period = sched_clock_t::duration::zero();
+    w.period_start = now;
+    if(w.running_job)
+        w.job_start = now;
+}
+
+/**
+ * Wait on the next available job: if a node has been destroyed (.lock()
+ * returns empty shared pointer) then continue to wait until there's a job from
+ * a node that is still alive.
  * An empty shared pointer is returned if the scheduler is stopped, in this case
  * threads should return from their event loop.
  */
-node_ptr_t Scheduler::waitNextJob(SchedulerPriority p)
+node_ptr_t Scheduler::waitNextJob(int worker)
 {
-    boost::this_thread::yield();
-    node_ptr_t n;
+    Worker& w = *m_workers[worker];
+    sched_clock_t::time_point now = sched_clock_t::now();
+    if(w.running_job){
+        w.busy_in_period += now - w.job_start;
+        w.running_job = false;
+        if(m_observer){
+            node_ptr_t done = w.job_node.lock();
+            w.job_node.reset();
+            if(done)
+                m_observer->onJobEnd(done, std::chrono::duration<float, std::milli>(now - w.job_start).count());
+        }
+    }
+    _updateUtilisation(w, now);
 
+    node_ptr_t n;
+    Job job;
     while(!n && !m_stop){
-        auto q = m_queues.find(p);
-        if(q == m_queues.end())
-            // default: lowest priority
-            n = m_queues.begin()->second->popWait().lock();
-        else
-            n = q->second->popWait().lock();
+        if(m_unclaimed_task_groups){
+            const sched_clock_t::time_point help_start = sched_clock_t::now();
+            if(_helpTaskGroup()){
+                w.busy_in_period += sched_clock_t::now() - help_start;
+                continue;
+            }
+        }
+        if(_tryPop(worker, job)){
+            m_pending--;
+            n = job.node.lock();
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> l(m_idle_mux);
+        m_idle++;
+        if(!m_pending && !m_unclaimed_task_groups && !m_stop){
+            trace::Scope wait_trace("wait", "scheduler");
+            // wake up now and again even if there's nothing to do, so that
+            // utilisation drops to zero when idle
+            m_work_available.timed_wait(l, boost::posix_time::milliseconds(Utilisation_Period.count()));
+        }
+        m_idle--;
+        l.unlock();
+        _updateUtilisation(w, sched_clock_t::now());
     }
 
+    if(n){
+        w.job_start = sched_clock_t::now();
+        w.running_job = true;
+        w.jobs_run++;
+        const float wait_ms = std::chrono::duration<float, std::milli>(w.job_start - job.enqueued).count();
+        w.queue_wait_ms = (1 - Queue_Wait_Alpha) * w.queue_wait_ms + Queue_Wait_Alpha * wait_ms;
+        if(trace::enabled())
+            trace::complete("queued", "scheduler", job.enqueued, w.job_start, n->id());
+        if(m_observer){
+            w.job_node = n;
+            m_observer->onJobStart(n, wait_ms);
+        }
+    }
     return n;
 }
 
+float Scheduler::utilisation(int worker) const
+{
+    if(worker < 0 || worker >= int(m_workers.size()))
+        return 0;
+    return m_workers[worker]->utilisation;
+}
+
+float Scheduler::currentThreadUtilisation() const
+{
+    if(t_scheduler != this)
+        return 0;
+    return utilisation(t_worker);
+}
+
 /**
  * False until start() has been called
  */
 bool Scheduler::alive() const
-{   
+{
     return !m_stop;
 }
 
+void Scheduler::_logStats() const
+{
+    for(unsigned i = 0; i < m_workers.size(); i++){
+        Worker const& w = *m_workers[i];
+        info() << "ImgPipelineThread (" << i << "):"
+               << w.jobs_run << "jobs," << w.jobs_stolen << "stolen,"
+               << "utilisation" << w.utilisation
+               << "mean queue wait" << w.queue_wait_ms << "ms";
+    }
+}
+
 /**
  * Signal all threads to stop, wait for all threads to finish
  * NB: not threadsafe
@@ -123,13 +423,14 @@ void Scheduler::stopWait()
 {
     if(!m_stop){
         m_stop = true;
-        priority_thread_group_map_t::iterator i;
-        for(i = m_thread_groups.begin(); i != m_thread_groups.end(); i++)
         {
-            i->second->interrupt_all();
-            i->second->join_all();
-            i->second.reset();
+            boost::lock_guard<boost::mutex> l(m_idle_mux);
+            m_work_available.notify_all();
         }
+        m_threads->interrupt_all();
+        m_threads->join_all();
+        m_threads.reset();
+        _logStats();
     }
 }
 
@@ -143,40 +444,28 @@ void Scheduler::start()
         return;
 
     m_stop = false;
-    
-    priority_thread_group_map_t::iterator i;
-    
-    for(i = m_thread_groups.begin(); i != m_thread_groups.end(); i++)
-    {
-        i->second = boost::make_shared<boost::thread_group>();
-        for(int j = 0; j < m_num_threads[i->first]; j++)
-            i->second->add_thread(_spawnThread(i->first));
-    }
+
+    info() << "starting" << m_num_threads << "image pipeline threads";
+    m_threads = boost::make_shared<boost::thread_group>();
+    for(int i = 0; i < m_num_threads; i++)
+        m_threads->add_thread(_spawnThread(i));
 }
 
-boost::thread* Scheduler::_spawnThread(SchedulerPriority const& p)
+boost::thread* Scheduler::_spawnThread(int worker)
 {
     // new thread takes a copy of the ImgPipelineThread object
-    auto  t = new boost::thread(ImgPipelineThread(this, p));
-    
-    struct sched_param param;
-    memset(&param, 0, sizeof(struct sched_param));
-    int policy = 0;
-    int e = 0;
-    int min_p = sched_get_priority_min(SCHED_OTHER);
-    int max_p = sched_get_priority_max(SCHED_OTHER);
-    if(p < min_p)
-        warning() << "priority" << p << " < minimum (" << min_p << ")";
-    if(p > max_p)
-        warning() << "priority" << p << " > maximum (" << max_p << ")";
-    e = pthread_getschedparam(t->native_handle(), &policy, &param);
-    if(e)
-        error() << "failed to get thread schedparam: error=" << e;
-    param.sched_priority = pthreadPriority(p);
-    e = pthread_setschedparam(t->native_handle(), policy, &param); 
-    if(e)
-        error() << "failed to set thread priority: error=" << e;
-    
+    auto t = new boost::thread(ImgPipelineThread(this, worker));
+
+    if(m_pin_threads){
+        const int num_cpus = boost::thread::hardware_concurrency();
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker % std::max(num_cpus, 1), &cpus);
+        int e = pthread_setaffinity_np(t->native_handle(), sizeof(cpu_set_t), &cpus);
+        if(e)
+            error() << "failed to set thread affinity: error=" << e;
+    }
+
     return t;
 }
 
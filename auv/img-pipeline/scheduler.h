@@ -7,12 +7,17 @@
 #ifndef __CAUV_IMGPROC_SCHEDULER_H__
 #define __CAUV_IMGPROC_SCHEDULER_H__
 
-#include <map>
+#include <deque>
+#include <vector>
 #include <ostream>
+#include <atomic>
+#include <chrono>
+#include <exception>
 
 #include <boost/shared_ptr.hpp>
-
-#include <utility/blocking_queue.h>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "pipelineTypes.h"
 
@@ -25,10 +30,7 @@ class thread;
 namespace cauv{
 namespace imgproc{
 
-// NB: there must be at least one thread of each priority!
-const int Slow_Threads = 0; // Mimimum number of threads dedicated to slow processes
-const int Fast_Threads = 2; // Mimimum number of threads dedicated to fast processes
-const int Fastest_Threads = 0; // Number of fastest threads is fixed
+const int Num_Priorities = 3;
 
 template<typename charT, typename traits>
 std::basic_ostream<charT, traits>& operator<<(
@@ -38,7 +40,7 @@ std::basic_ostream<charT, traits>& operator<<(
         case priority_slow: os << "priority_slow"; break;
         case priority_fast: os << "priority_fast"; break;
         case priority_fastest: os << "priority_fastest"; break;
-        default: os << "priority:UNKNOWN"; 
+        default: os << "priority:UNKNOWN";
     }
     return os;
 }
@@ -48,49 +50,158 @@ std::basic_ostream<charT, traits>& operator<<(
 class ImgPipelineThread
 {
     public:
-        ImgPipelineThread(Scheduler* s, SchedulerPriority p);
+        ImgPipelineThread(Scheduler* s, int worker);
         void operator()();
 
     private:
         Scheduler* m_sched;
-        SchedulerPriority m_priority;
+        int m_worker;
 };
 
-int pthreadPriority(SchedulerPriority const& s);
+/* Notified by each worker thread of the jobs it runs (for profiling): both
+ * functions are called on the worker thread, so must be threadsafe
+ */
+class SchedulerObserver
+{
+    public:
+        virtual ~SchedulerObserver(){ }
+
+        /* node is about to be executed, having waited queue_wait_ms since
+         * it was queued
+         */
+        virtual void onJobStart(node_ptr_t const& node, float queue_wait_ms) = 0;
+
+        /* node has finished executing, which took exec_ms (not called if the
+         * node has since been destroyed)
+         */
+        virtual void onJobEnd(node_ptr_t const& node, float exec_ms) = 0;
+};
 
+/* Work-stealing scheduler:
+ *
+ * Each pipeline thread (worker) owns one deque of jobs per priority. Jobs
+ * added from a worker thread (which is how the children of a node that has
+ * just executed get queued) go on the back of that worker's own deque, and
+ * the worker pops from the back, so children tend to run straight after
+ * their parent on the same thread while its outputs are still in cache.
+ * Jobs added from any other thread (message handlers, asynchronous nodes)
+ * are spread round-robin over the workers.
+ *
+ * An idle worker takes the highest priority job available anywhere: its own
+ * deque first, then the front (oldest end) of the other workers' deques. So
+ * a priority_fast job is never kept waiting behind priority_slow ones while
+ * any thread is free, whichever thread it was queued on.
+ */
 class Scheduler
 {
-    typedef boost::shared_ptr<boost::thread_group> thread_group_ptr_t;
-    typedef std::map<SchedulerPriority, thread_group_ptr_t > priority_thread_group_map_t;
-    typedef BlockingQueue<node_wkptr_t> node_queue_t;
-    typedef boost::shared_ptr<node_queue_t> queue_ptr_t;
-    typedef std::map<SchedulerPriority, queue_ptr_t> priority_queue_map_t;
-    typedef std::map<SchedulerPriority, int> priority_int_map_t;
+    typedef std::chrono::steady_clock sched_clock_t;
+    struct Job{
+        node_wkptr_t node;
+        sched_clock_t::time_point enqueued;
+    };
+    struct Worker{
+        Worker();
+
+        boost::mutex mux;
+        std::deque<Job> jobs[Num_Priorities];
+
+        // utilisation over the last measurement period: all but the result
+        // are only ever touched by the worker thread itself
+        sched_clock_t::time_point period_start;
+        sched_clock_t::time_point job_start;
+        sched_clock_t::duration busy_in_period;
+        bool running_job;
+        std::atomic<float> utilisation;
+        std::atomic<float> queue_wait_ms;
+        std::atomic<uint64_t> jobs_run;
+        std::atomic<uint64_t> jobs_stolen;
+        // the running job, only kept if there's an observer
+        node_wkptr_t job_node;
+    };
+    typedef boost::shared_ptr<Worker> worker_ptr_t;
+    struct TaskGroup{
+        TaskGroup(int n, boost::function<void(int)> const& fn);
+
+        const int n;
+        const boost::function<void(int)> fn;
+        std::atomic<int> next;
+        std::atomic<bool> exhausted;
+        int done;
+        std::exception_ptr exception;
+        boost::mutex mux;
+        boost::condition_variable all_done;
+    };
+    typedef boost::shared_ptr<TaskGroup> task_group_ptr_t;
 
     public:
-        Scheduler();
+        /* num_threads = 0 means one thread per hardware thread
+         */
+        Scheduler(int num_threads = 0);
         ~Scheduler();
-        
+
+        /* Must be called before start()
+         */
+        void setNumThreads(int num_threads);
+        int numThreads() const;
+
+        /* Pin each worker thread to one CPU, so that "the same thread" really
+         * means "the same core". Off by default, since the pipeline shares
+         * the machine with everything else. Must be called before start()
+         */
+        void setPinThreads(bool pin);
+
+        /* Notify observer of every job run. Must be called before start()
+         */
+        void setObserver(boost::shared_ptr<SchedulerObserver> observer);
+
+        /**
+         * True if no jobs are queued or running, and no parallelFor is
+         * outstanding. Only a hint: any thread may queue more work at any
+         * time
+         */
+        bool idle() const;
+
         /**
          * Add a job of a particular priority to the corresponding queue
          * Can't use smart pointers because nodes have no way to convert 'this'
          * into a smart pointer.
          * NB: this IS threadsafe
          */
-        void addJob(node_wkptr_t node, SchedulerPriority p) const;
-        
+        void addJob(node_wkptr_t node, SchedulerPriority p);
+
         /**
-         * Wait on the next available job of priority p
+         * Wait on the next available job for a worker thread: the previous
+         * job returned to this worker is assumed to have finished.
          * node_ptr_t() is returned if the scheduler is stopped, in this case
          * threads should return from their event loop
          */
-        node_ptr_t waitNextJob(SchedulerPriority p);
-        
+        node_ptr_t waitNextJob(int worker);
+
+        /**
+         * Call fn(0) ... fn(n-1), using any idle pipeline threads to help the
+         * calling thread, and return when all calls have finished. The
+         * first exception thrown by any fn is rethrown here.
+         * NB: this IS threadsafe, and may be called from any thread
+         */
+        void parallelFor(int n, boost::function<void(int)> const& fn);
+
+        /**
+         * Fraction of time (0-1) that a worker spent executing nodes over the
+         * last measurement period
+         */
+        float utilisation(int worker) const;
+
+        /**
+         * utilisation() of the calling thread, 0 if it isn't a worker of this
+         * scheduler
+         */
+        float currentThreadUtilisation() const;
+
         /**
          * False until start() has been called
          */
         bool alive() const;
-        
+
         /**
          * Signal all threads to stop, wait for all threads to finish
          * NB: not threadsafe
@@ -104,14 +215,32 @@ class Scheduler
         void start();
 
     private:
-        boost::thread* _spawnThread(SchedulerPriority const& p);
-
-        // TODO: this should probably have a mutex
-        volatile bool m_stop;
-        
-        priority_queue_map_t m_queues;
-        priority_int_map_t m_num_threads;
-        priority_thread_group_map_t m_thread_groups;
+        boost::thread* _spawnThread(int worker);
+        bool _tryPop(int worker, Job& job);
+        bool _helpTaskGroup();
+        static bool _runTasks(TaskGroup& group);
+        void _updateUtilisation(Worker& w, sched_clock_t::time_point const& now);
+        void _logStats() const;
+
+        std::atomic<bool> m_stop;
+        int m_num_threads;
+        bool m_pin_threads;
+        boost::shared_ptr<SchedulerObserver> m_observer;
+
+        std::vector<worker_ptr_t> m_workers;
+        boost::shared_ptr<boost::thread_group> m_threads;
+
+        // jobs queued but not yet taken by a worker, and workers waiting
+        // for one
+        std::atomic<int> m_pending;
+        std::atomic<int> m_idle;
+        std::atomic<unsigned> m_next_worker;
+        // parallelFor calls with tasks not yet claimed by any thread
+        std::vector<task_group_ptr_t> m_task_groups;
+        std::atomic<int> m_unclaimed_task_groups;
+        boost::mutex m_task_groups_mux;
+        boost::mutex m_idle_mux;
+        boost::condition_variable m_work_available;
 };
 
 } // namespace imgproc
@@ -0,0 +1,149 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include <iostream>
+#include <cassert>
+
+#include "pipelineDiff.h"
+
+using namespace cauv;
+using namespace cauv::imgproc;
+
+static LocalNodeInput param(input_id const& input, int32_t sub_type){
+    return LocalNodeInput(input, sub_type, InputSchedType::May_Be_Old, std::vector<int32_t>());
+}
+
+static GraphNode graphNode(NodeType::e type){
+    GraphNode r;
+    r.type = type;
+    return r;
+}
+
+static void connect(graph_t& g, node_id from, output_id const& output, node_id to, input_id const& input){
+    g[to].arcs[input] = std::make_pair(from, output);
+}
+
+// input -> blur -> median -> copy, as the running pipeline, with the
+// defaults that node construction would record
+static graph_t chain(){
+    graph_t g;
+    g[1] = graphNode(NodeType::FileInput);
+    g[1].params[param("filename", 2)] = ParamValue(std::string("a.jpg"));
+    g[1].defaults["filename"] = ParamValue(std::string(""));
+    g[2] = graphNode(NodeType::GaussianBlur);
+    g[2].params[param("sigma", 1)] = ParamValue(1.0f);
+    g[2].defaults["sigma"] = ParamValue(1.0f);
+    g[3] = graphNode(NodeType::MedianFilter);
+    g[3].params[param("radius", 0)] = ParamValue(int32_t(3));
+    g[3].defaults["radius"] = ParamValue(int32_t(3));
+    g[4] = graphNode(NodeType::Copy);
+    connect(g, 1, "image", 2, "image");
+    connect(g, 2, "image", 3, "image");
+    connect(g, 3, "image", 4, "image");
+    return g;
+}
+
+// the same pipeline, with different ids, as a SetPipelineMessage would
+// describe it
+static graph_t renumbered(graph_t const& g, node_id offset){
+    graph_t r;
+    for(auto const& n : g){
+        GraphNode& w = r[n.first + offset];
+        w.type = n.second.type;
+        w.params = n.second.params;
+        for(auto const& a : n.second.arcs)
+            w.arcs[a.first] = std::make_pair(a.second.first + offset, a.second.second);
+    }
+    return r;
+}
+
+void testUnchanged(){
+    const graph_t existing = chain();
+    const graph_t wanted = renumbered(existing, 10);
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    assert(matched.size() == 4);
+    for(auto const& m : matched){
+        assert(m.first == m.second + 10);
+        assert(paramDifferences(wanted.at(m.first), existing.at(m.second)) == 0);
+    }
+}
+
+void testParamChanged(){
+    const graph_t existing = chain();
+    graph_t wanted = renumbered(existing, 10);
+    wanted[12].params[param("sigma", 1)] = ParamValue(2.5f);
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    assert(matched.size() == 4);
+    assert(matched.at(12) == 2);
+    assert(paramDifferences(wanted[12], existing.at(2)) == 1);
+    assert(paramDifferences(wanted[13], existing.at(3)) == 0);
+}
+
+void testParamOmitted(){
+    graph_t existing = chain();
+    existing[2].params[param("sigma", 1)] = ParamValue(4.0f);
+    graph_t wanted = renumbered(chain(), 10);
+    wanted[12].params.clear();
+    wanted[11].params.clear();
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    assert(matched.size() == 4);
+    // sigma has to go back to its default, and the filename to ""
+    assert(paramDifferences(wanted[12], existing.at(2)) == 1);
+    assert(paramDifferences(wanted[11], existing.at(1)) == 1);
+    // an omitted parameter that already has its default doesn't change
+    wanted[13].params.clear();
+    assert(paramDifferences(wanted[13], existing.at(3)) == 0);
+}
+
+void testArcRerouted(){
+    // a mix node taking the median filtered image and the blurred one, which
+    // now mixes in the original image instead
+    graph_t existing = chain();
+    existing[5] = graphNode(NodeType::Mix);
+    connect(existing, 3, "image", 5, "image");
+    connect(existing, 2, "image", 5, "mix");
+    graph_t wanted = renumbered(existing, 10);
+    connect(wanted, 11, "image", 15, "mix");
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    assert(matched.size() == 5);
+    // matched partially, on the arc that's the same
+    assert(matched.at(15) == 5);
+    assert(sharedArcs(wanted[15], existing.at(5), matched, true) == -1);
+    assert(sharedArcs(wanted[15], existing.at(5), matched, false) == 1);
+
+    // a node none of whose arcs are the same is rebuilt
+    connect(wanted, 11, "image", 15, "image");
+    assert(!matchNodes(wanted, existing).count(15));
+}
+
+void testNodeInserted(){
+    // a resize node between the blur and median filter
+    const graph_t existing = chain();
+    graph_t wanted = renumbered(existing, 10);
+    wanted[20] = graphNode(NodeType::Resize);
+    connect(wanted, 12, "image", 20, "image");
+    connect(wanted, 20, "image", 13, "image");
+    const std::map<node_id, node_id> matched = matchNodes(wanted, existing);
+    assert(!matched.count(20));
+    assert(matched.at(11) == 1);
+    assert(matched.at(12) == 2);
+    assert(matched.size() == 2);
+    // the median filter and copy have no arcs from matched nodes in common
+    // with the existing ones, so they are rebuilt, and the existing ones
+    // removed
+    assert(!matched.count(13));
+    assert(!matched.count(14));
+}
+
+int main(){
+    testUnchanged();
+    testParamChanged();
+    testParamOmitted();
+    testArcRerouted();
+    testNodeInserted();
+    std::cout << "PASS" << std::endl;
+    return 0;
+}
@@ -150,7 +150,8 @@ class MessageWrapper:
         const_svec_ptr toBytes() const{
             GILLock l; // GIL MUST be held during get_override!
             if(bp::override f = this->get_override("toBytes")){
-                return f();
+                svec_ptr r = f();
+                return r;
             }
             l.release();
             return Message::toBytes();
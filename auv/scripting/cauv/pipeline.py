@@ -45,6 +45,14 @@ class State:
                 new_node.outarcs = node.outarcs
                 new_node.params = node.params
                 self.nodes[node_id] = new_node
+    def toMessage(self, pipeline_name):
+        """The SetPipelineMessage that sets a pipeline to this state"""
+        nodeTypes = {node_id: messaging.NodeType(node.type) for (node_id, node) in self.nodes.iteritems()}
+        nodeArcs = {node_id: {key: messaging.NodeOutput(output[0], output[1], messaging.OutputType(0), 0) 
+                                for key, output in node.inarcs.iteritems()}
+                      for (node_id, node) in self.nodes.iteritems()}
+        nodeParams = {node_id: node.params for (node_id, node) in self.nodes.iteritems()}
+        return messaging.SetPipelineMessage(pipeline_name, nodeTypes, nodeArcs, nodeParams)
     def __repr__(self):
         return str(self.nodes)
 
@@ -196,6 +204,19 @@ class Model(messaging.MessageObserver):
             
     def play(self):
         self.send(messaging.SetPipelineStateMessage(self.pipeline_name, messaging.PipelineState.Play))
+
+    def setStandby(self, state):
+        '''Build the pipeline from 'state', but don't run it until another
+           pipeline activate()s it in its place. The pipeline must not already
+           be running.'''
+        self.pause()
+        self.set(state)
+
+    def activate(self, standby_name):
+        '''Swap the standby pipeline 'standby_name' in for this one, which
+           goes on standby under 'standby_name' (so can be swapped back).'''
+        debug("Activating pipeline %s as %s." % (standby_name, self.pipeline_name))
+        self.send(messaging.ActivatePipelineMessage(self.pipeline_name, standby_name))
     
     def get(self, timeout=3.0):
         '''Grab the state from the image pipeline, save it and return it.'''
@@ -243,12 +264,7 @@ class Model(messaging.MessageObserver):
     def set(self, state):
         '''Set the state of the image pipeline based on 'state'.'''
         debug("Setting pipeline %s." %(self.pipeline_name))
-        nodeTypes = {node_id: messaging.NodeType(node.type) for (node_id, node) in state.nodes.iteritems()}
-        nodeArcs = {node_id: {key: messaging.NodeOutput(output[0], output[1], messaging.OutputType(0), 0) 
-                                for key, output in node.inarcs.iteritems()}
-                      for (node_id, node) in state.nodes.iteritems()}
-        nodeParams = {node_id: node.params for (node_id, node) in state.nodes.iteritems()}
-        self.send(messaging.SetPipelineMessage(self.pipeline_name, nodeTypes, nodeArcs, nodeParams))
+        self.send(state.toMessage(self.pipeline_name))
    
     def send(self, msg):
         '''Send a message to the pipeline group.'''
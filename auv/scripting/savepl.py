@@ -51,6 +51,18 @@ def loadpl(node, fname, name='default', cam_input='shared'):
         saved.fixup_inputs(cam_input)
         model.set(saved)
 
+def exportpl(fname, out_fname, name='default', cam_input='shared'):
+    '''Write the SetPipelineMessage that would load a saved pipeline, for
+       img-pipeline-bench'''
+    with open(fname, 'rb') as inf:
+        if fname.endswith('.pipe'):
+            saved = cauv.picklepipe.load(inf)
+        else:
+            saved = cauv.yamlpipe.load(inf)
+    saved.fixup_inputs(cam_input)
+    with open(out_fname, 'wb') as outf:
+        outf.write(saved.toMessage(name).toBytes())
+
 def clearpl(node, name='default'):
     info('Initializing pipeline model (%s)...' % name)
     model = pipeline.Model(node, name)
@@ -64,13 +76,22 @@ if __name__ == '__main__':
     parser.add_argument("-n", "--pipeline-name", default="default")
     parser.add_argument("-t", "--timeout", type=float, default=3.0)
     parser.add_argument("-i", "--input", default = "net", choices = ["net", "shared", "direct"])
-    parser.add_argument("verb", choices=('load', 'save', 'clear'))
+    parser.add_argument("-o", "--output", help='output file (export only)')
+    parser.add_argument("verb", choices=('load', 'save', 'clear', 'export'))
     parser.add_argument("file", help='pipeline file')
 
     opts, unknown_args = parser.parse_known_args()
     fname = opts.file
     timeout = opts.timeout
     name = opts.pipeline_name
+
+    if opts.verb == 'export':
+        # no need to connect to anything
+        if opts.output is None:
+            parser.error('export needs an output file (-o)')
+        exportpl(fname, opts.output, name, opts.input)
+        info('Done.')
+        raise SystemExit(0)
     
     info('Connecting...')
     node = cauv.node.Node("py-plsave", unknown_args)
@@ -0,0 +1,85 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Compares SonarAccumulator scan conversion with and without the cached
+// lookup tables, on synthetic Seanet sweeps at a range of resolutions.
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include <opencv2/core/core.hpp>
+
+#include <utility/options.h>
+#include <utility/performance.h>
+#include <generated/types/SonarDataLine.h>
+
+#include "sonar_accumulator.h"
+
+using namespace cauv;
+
+static std::vector<SonarDataLine> makeSweep(int bearing_range, int nbins){
+    std::vector<SonarDataLine> lines;
+    for(int bearing = 0; bearing < 6400; bearing += bearing_range){
+        SonarDataLine line;
+        line.bearing = bearing;
+        line.bearingRange = bearing_range;
+        line.range = 50000;
+        line.scanWidth = 6400;
+        line.data.resize(nbins);
+        for(int b = 0; b < nbins; b++)
+            line.data[b] = std::rand() & 0xff;
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+static double timeSweeps(SonarAccumulator& acc, std::vector<SonarDataLine> const& sweep, int sweeps){
+    Timer t;
+    t.start();
+    for(int i = 0; i < sweeps; i++)
+        for(size_t j = 0; j < sweep.size(); j++)
+            acc.accumulateDataLine(sweep[j]);
+    return double(t.stop()) / (sweeps * sweep.size());
+}
+
+int main(int argc, char **argv) {
+    cauv::Options options("Benchmark sonar scan conversion");
+    namespace po = boost::program_options;
+    options.desc.add_options()
+        ("sweeps,n", po::value<int>()->default_value(20), "Number of full sweeps to time")
+        ("bins,b", po::value<int>()->default_value(400), "Bins per data line")
+        ("bearing-range,r", po::value<int>()->default_value(16), "Bearing step between lines (1/6400ths of a circle)")
+      ;
+    if (options.parseOptions(argc, argv)) {
+        return 0;
+    };
+    const int sweeps = options.vm["sweeps"].as<int>();
+    const int nbins = options.vm["bins"].as<int>();
+    const int bearing_range = options.vm["bearing-range"].as<int>();
+
+    std::vector<SonarDataLine> sweep = makeSweep(bearing_range, nbins);
+
+    const int sizes[] = {400, 800, 1600};
+    std::cout << "size\tdirect(us/line)\ttables(us/line)\tspeedup\tdiffering pixels" << std::endl;
+    for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        SonarAccumulator direct(sizes[i]);
+        SonarAccumulator tables(sizes[i]);
+        direct.setUseLookupTables(false);
+        tables.setUseLookupTables(true);
+
+        // first sweep builds the tables: don't count it
+        timeSweeps(tables, sweep, 1);
+        timeSweeps(direct, sweep, 1);
+
+        const double direct_us = timeSweeps(direct, sweep, sweeps);
+        const double tables_us = timeSweeps(tables, sweep, sweeps);
+        const int differing = cv::countNonZero(direct.mat() != tables.mat());
+
+        std::cout << sizes[i] << "\t" << direct_us << "\t" << tables_us << "\t"
+                  << direct_us / tables_us << "\t" << differing << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include "line_filter.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cauv;
+
+static inline uint8_t derivativeValue(int a, int b, bool reverse)
+{
+    const int d = (reverse? b - a : a - b) + 127;
+    return uint8_t(std::min(255, std::max(0, d)));
+}
+
+#ifdef __SSE2__
+// (a - b) or (b - a), + 127, for 8 16-bit values
+static inline __m128i derivativeValues(__m128i a, __m128i b, bool reverse)
+{
+    const __m128i d = reverse? _mm_sub_epi16(b, a) : _mm_sub_epi16(a, b);
+    return _mm_add_epi16(d, _mm_set1_epi16(127));
+}
+
+// 8 floats rounded down to 16-bit values
+static inline __m128i truncate8(float const* p)
+{
+    return _mm_packs_epi32(_mm_cvttps_epi32(_mm_loadu_ps(p)),
+                           _mm_cvttps_epi32(_mm_loadu_ps(p + 4)));
+}
+#endif
+
+// one pass of bins[i] = (bins[i] - bins[i+1]) * sign + 127, in place (the
+// line is extended by repeating its last bin)
+static void derivativePass(uint8_t* bins, size_t num_bins, bool reverse)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    // bins[i+16] is read before it is overwritten by the next iteration
+    for(; i + 17 <= num_bins; i += 16)
+    {
+        const __m128i a = _mm_loadu_si128((__m128i const*)(bins + i));
+        const __m128i b = _mm_loadu_si128((__m128i const*)(bins + i + 1));
+        const __m128i lo = derivativeValues(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), reverse);
+        const __m128i hi = derivativeValues(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), reverse);
+        _mm_storeu_si128((__m128i*)(bins + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for(; i < num_bins; i++)
+    {
+        const int next = (i + 1 < num_bins)? bins[i+1] : bins[i];
+        bins[i] = derivativeValue(bins[i], next, reverse);
+    }
+}
+
+static void suppressNonLocalMaxima(uint8_t* bins, size_t num_bins, int epsilon)
+{
+    // the ends are never maxima
+    int prev = bins[0];
+    bins[0] = 0;
+    for(size_t i = 1; i + 1 < num_bins; i++)
+    {
+        const int cur = bins[i];
+        if(prev + epsilon > cur || cur < bins[i+1] + epsilon)
+            bins[i] = 0;
+        prev = cur;
+    }
+    bins[num_bins-1] = 0;
+}
+
+static void suppressNonGlobalMaximum(uint8_t* bins, size_t num_bins, int epsilon)
+{
+    size_t imax = 0;
+    for(size_t i = 1; i < num_bins; i++)
+    {
+        if(bins[i] < bins[imax] + epsilon)
+        {
+            bins[i] = 0;
+        }
+        else
+        {
+            bins[imax] = 0;
+            imax = i;
+        }
+    }
+}
+
+SonarLineFilter::SonarLineFilter()
+    : m_low_pass_radius(0),
+      m_derivative(0),
+      m_non_max(No_Suppression),
+      m_non_max_epsilon(1),
+      m_kernel(),
+      m_padded(),
+      m_smoothed()
+{
+}
+
+void SonarLineFilter::setParams(int low_pass_radius, int derivative,
+                                int non_max_suppression, int non_max_epsilon)
+{
+    if(low_pass_radius != m_low_pass_radius)
+    {
+        m_kernel.clear();
+        if(low_pass_radius > 0)
+        {
+            const float sigma = low_pass_radius / 3.0f;
+            float sum = 0;
+            for(int i = 0; i <= low_pass_radius; i++)
+            {
+                const float w = std::exp(-(i*i) / (2*sigma*sigma));
+                sum += (i == 0)? w : 2*w;
+                m_kernel.push_back(w);
+            }
+            for(size_t i = 0; i < m_kernel.size(); i++)
+                m_kernel[i] /= sum;
+        }
+    }
+    m_low_pass_radius = low_pass_radius;
+    m_derivative = derivative;
+    m_non_max = non_max_suppression;
+    m_non_max_epsilon = non_max_epsilon;
+}
+
+void SonarLineFilter::apply(uint8_t* bins, size_t num_bins, size_t min_range_bin)
+{
+    if(!num_bins)
+        return;
+
+    if(min_range_bin >= num_bins)
+        std::fill(bins, bins + num_bins, 0);
+    else
+        std::fill(bins, bins + min_range_bin, bins[min_range_bin]);
+
+    int derivative_passes = std::abs(m_derivative);
+    if(m_low_pass_radius > 0)
+    {
+        lowPass(bins, num_bins, derivative_passes > 0);
+        if(derivative_passes > 0)
+            derivative_passes--;
+    }
+    for(; derivative_passes > 0; derivative_passes--)
+        derivativePass(bins, num_bins, m_derivative < 0);
+
+    switch(m_non_max)
+    {
+        case Local_Maxima:
+            suppressNonLocalMaxima(bins, num_bins, m_non_max_epsilon);
+            break;
+        case Global_Maximum:
+            suppressNonGlobalMaximum(bins, num_bins, m_non_max_epsilon);
+            break;
+    }
+}
+
+// The smoothed value of each bin is rounded down once (rather than after each
+// tap, as SonarInputNode used to), and if fuse_derivative is set, the first
+// derivative pass is applied to the rounded values as they are written.
+void SonarLineFilter::lowPass(uint8_t* bins, size_t num_bins, bool fuse_derivative)
+{
+    const size_t radius = m_low_pass_radius;
+    const size_t padded_size = num_bins + 2 * radius;
+    if(m_padded.size() < padded_size)
+        m_padded.resize(padded_size);
+    if(m_smoothed.size() < num_bins + 1)
+        m_smoothed.resize(num_bins + 1);
+
+    // extend the line at both ends, so that the taps don't need clamping
+    float* padded = &m_padded[0];
+    std::fill(padded, padded + radius, float(bins[0]));
+    for(size_t i = 0; i < num_bins; i++)
+        padded[radius + i] = bins[i];
+    std::fill(padded + radius + num_bins, padded + padded_size, float(bins[num_bins-1]));
+
+    float const* w = &m_kernel[0];
+    float* smoothed = &m_smoothed[0];
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= num_bins; i += 4)
+    {
+        float const* c = padded + radius + i;
+        __m128 acc = _mm_mul_ps(_mm_set1_ps(w[0]), _mm_loadu_ps(c));
+        for(size_t k = 1; k <= radius; k++)
+        {
+            const __m128 taps = _mm_add_ps(_mm_loadu_ps(c - k), _mm_loadu_ps(c + k));
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), taps));
+        }
+        _mm_storeu_ps(smoothed + i, acc);
+    }
+#endif
+    for(; i < num_bins; i++)
+    {
+        float const* c = padded + radius + i;
+        float acc = w[0] * c[0];
+        for(size_t k = 1; k <= radius; k++)
+            acc += w[k] * (c[-k] + c[k]);
+        smoothed[i] = acc;
+    }
+
+    i = 0;
+    if(fuse_derivative)
+    {
+        const bool reverse = m_derivative < 0;
+        smoothed[num_bins] = smoothed[num_bins-1];
+#ifdef __SSE2__
+        for(; i + 8 <= num_bins; i += 8)
+        {
+            const __m128i d = derivativeValues(truncate8(smoothed + i), truncate8(smoothed + i + 1), reverse);
+            _mm_storel_epi64((__m128i*)(bins + i), _mm_packus_epi16(d, d));
+        }
+#endif
+        for(; i < num_bins; i++)
+            bins[i] = derivativeValue(int(smoothed[i]), int(smoothed[i+1]), reverse);
+    }
+    else
+    {
+#ifdef __SSE2__
+        for(; i + 8 <= num_bins; i += 8)
+        {
+            const __m128i v = truncate8(smoothed + i);
+            _mm_storel_epi64((__m128i*)(bins + i), _mm_packus_epi16(v, v));
+        }
+#endif
+        for(; i < num_bins; i++)
+            bins[i] = uint8_t(std::min(255.0f, smoothed[i]));
+    }
+}
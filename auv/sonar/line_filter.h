@@ -0,0 +1,72 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_SONAR_LINE_FILTER_H__
+#define __CAUV_SONAR_LINE_FILTER_H__
+
+#include <vector>
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace cauv{
+
+// Preprocessing of single Seanet data lines, in this order:
+//  - bins before the minimum range are set to the value of the first bin
+//    at the minimum range (or to zero if that's beyond the end of the line)
+//  - a Gaussian low-pass filter of the given radius (sigma = radius/3), with
+//    the ends of the line extended
+//  - |derivative| passes of (bin[i] - bin[i+1]) * sign(derivative) + 127
+//  - non-maximum suppression: either only local maxima at least epsilon
+//    above both of their neighbours are kept, or only the global maximum
+//
+// Lines are filtered in place, and after the first line of a given length
+// nothing is allocated. The convolution and derivative kernels use SSE2
+// where it's available, and the first derivative pass is fused into the
+// low-pass filter.
+class SonarLineFilter
+{
+    public:
+        enum NonMaxSuppression{
+            No_Suppression = 0,
+            Local_Maxima = 1,
+            Global_Maximum = 2
+        };
+
+        SonarLineFilter();
+
+        void setParams(int low_pass_radius, int derivative,
+                       int non_max_suppression, int non_max_epsilon);
+
+        bool isIdentity() const{
+            return m_low_pass_radius <= 0 && m_derivative == 0 && m_non_max == No_Suppression;
+        }
+
+        // filter num_bins bins in place
+        void apply(uint8_t* bins, size_t num_bins, size_t min_range_bin = 0);
+        void apply(std::vector<uint8_t>& bins, size_t min_range_bin = 0){
+            if(!bins.empty())
+                apply(&bins[0], bins.size(), min_range_bin);
+        }
+
+    private:
+        void lowPass(uint8_t* bins, size_t num_bins, bool fuse_derivative);
+
+        int m_low_pass_radius;
+        int m_derivative;
+        int m_non_max;
+        int m_non_max_epsilon;
+
+        // normalised weights of taps 0..radius
+        std::vector<float> m_kernel;
+        // working space, only ever grown:
+        std::vector<float> m_padded;
+        std::vector<float> m_smoothed;
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_SONAR_LINE_FILTER_H__
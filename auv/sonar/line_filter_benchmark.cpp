@@ -0,0 +1,218 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Compares SonarLineFilter with the data line preprocessing that
+// SonarInputNode used to do, for a range of filter parameters, on recorded
+// lines (an 8-bit image with one data line per row, or per column with
+// --transpose, as in a saved polar image) or synthetic Seanet lines.
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <utility/options.h>
+#include <utility/performance.h>
+#include <utility/rounding.h>
+
+#include "line_filter.h"
+
+using namespace cauv;
+
+typedef std::vector<uint8_t> line_t;
+
+static unsigned int _get(line_t const& data, int i)
+{
+    return data[clamp_cast<size_t>(0, i, (int)data.size()-1)];
+}
+
+// as SonarInputNode::doWork_dataLines was
+static void reference(line_t& bins, size_t minRangeBin, int lowPassRadius,
+                      int derivative, int nonMax, int nonMaxEpsilon)
+{
+    std::vector<float> halfKernel;
+    float halfKernelSum = 0;
+    if (lowPassRadius != 0) {
+        float sigma = lowPassRadius/3.0f;
+        for (int i = 0; i <= lowPassRadius; ++i) {
+            float val = std::exp(-(i*i)/(2*sigma*sigma));
+            if (i == 0)
+                halfKernelSum += val;
+            else
+                halfKernelSum += 2*val;
+            halfKernel.push_back(val);
+        }
+    }
+
+    if (minRangeBin < bins.size()) {
+        for (size_t i = 0; i < minRangeBin && i < bins.size(); ++i)
+            bins[i] = bins[minRangeBin];
+    } else {
+        for (size_t i = 0; i < minRangeBin && i < bins.size(); ++i)
+            bins[i] = 0;
+    }
+
+    if (lowPassRadius != 0) {
+        line_t lpbins(bins.size(), 0);
+        for (size_t i = 0; i < bins.size(); ++i)
+            for (int k = 0; k <= lowPassRadius; ++k) {
+                if (k == 0)
+                    lpbins[i] += halfKernel[0] * _get(bins,i) / halfKernelSum;
+                else
+                    lpbins[i] += halfKernel[k] * (_get(bins,i-k) + _get(bins,i+k)) / halfKernelSum;
+            }
+        std::swap(lpbins, bins);
+    }
+
+    int d_sign = derivative > 0 ? 1 : -1;
+    for (int d = 0; d < std::abs(derivative); ++d) {
+        line_t dbins(bins.size(), 0);
+        for (size_t i = 0; i < bins.size(); ++i)
+            dbins[i] = clamp_cast<unsigned char>(d_sign*((int)_get(bins,i) - (int)_get(bins,i+1))+127);
+        std::swap(dbins, bins);
+    }
+
+    switch(nonMax) {
+        case 1: {
+            line_t lmbins(bins.size(), 0);
+            for (int i = 1; i < (int)bins.size() - 1; ++i) {
+                if ((i-1 >= 0 && (bins[i-1] + nonMaxEpsilon > bins[i])) || (i+1 < (int)bins.size() && (bins[i] < bins[i+1] + nonMaxEpsilon))) {
+                    lmbins[i] = 0;
+                } else {
+                    lmbins[i] = bins[i];
+                }
+            }
+            std::swap(lmbins, bins);
+            break;
+        }
+        case 2: {
+            size_t imax = 0;
+            for (size_t i = 1; i < bins.size(); ++i) {
+                if (bins[i] < bins[imax] + nonMaxEpsilon) {
+                    bins[i] = 0;
+                } else {
+                    bins[imax] = 0;
+                    imax = i;
+                }
+            }
+            break;
+        }
+    }
+}
+
+// noise, with a few echoes that fade with range
+static std::vector<line_t> syntheticLines(int num_lines, int nbins)
+{
+    std::vector<line_t> lines(num_lines, line_t(nbins));
+    for(int l = 0; l < num_lines; l++)
+    {
+        for(int b = 0; b < nbins; b++)
+            lines[l][b] = std::rand() % 24;
+        for(int e = 0; e < 3; e++)
+        {
+            const int at = std::rand() % nbins;
+            const int strength = 255 - (200 * at) / nbins;
+            for(int b = std::max(0, at - 4); b < std::min(nbins, at + 4); b++)
+                lines[l][b] = std::max<int>(lines[l][b], strength - 30 * std::abs(b - at));
+        }
+    }
+    return lines;
+}
+
+static std::vector<line_t> recordedLines(std::string const& fname, bool transpose)
+{
+    cv::Mat m = cv::imread(fname, 0);
+    if(transpose)
+        m = m.t();
+    std::vector<line_t> lines;
+    for(int r = 0; r < m.rows; r++)
+        lines.push_back(line_t(m.ptr<uint8_t>(r), m.ptr<uint8_t>(r) + m.cols));
+    return lines;
+}
+
+struct FilterParams{
+    int low_pass_radius;
+    int derivative;
+    int non_max;
+    int non_max_epsilon;
+};
+
+int main(int argc, char **argv) {
+    cauv::Options options("Benchmark Seanet data line preprocessing");
+    namespace po = boost::program_options;
+    options.desc.add_options()
+        ("lines,l", po::value<std::string>()->default_value(""), "Image of recorded data lines (one per row), instead of synthetic lines")
+        ("transpose,t", po::bool_switch(), "The recorded lines are the columns of the image")
+        ("num-lines,n", po::value<int>()->default_value(4000), "Number of synthetic lines")
+        ("bins,b", po::value<int>()->default_value(400), "Bins per synthetic line")
+        ("min-range-bin,m", po::value<int>()->default_value(10), "Bins to clip at the start of each line")
+      ;
+    if (options.parseOptions(argc, argv)) {
+        return 0;
+    };
+    const std::string fname = options.vm["lines"].as<std::string>();
+    const size_t min_range_bin = options.vm["min-range-bin"].as<int>();
+
+    const std::vector<line_t> lines = fname.size()?
+        recordedLines(fname, options.vm["transpose"].as<bool>()) :
+        syntheticLines(options.vm["num-lines"].as<int>(), options.vm["bins"].as<int>());
+    if(lines.empty())
+    {
+        std::cerr << "no lines" << std::endl;
+        return 1;
+    }
+
+    const FilterParams params[] = {
+        {0, 0, 0, 1},
+        {0, 1, 1, 1},
+        {3, 0, 0, 1},
+        {3, 1, 1, 1},
+        {6, 2, 1, 2},
+        {10, -1, 2, 1}
+    };
+
+    std::cout << "low-pass\tderivative\tnon-max\treference(us/line)\tfilter(us/line)\tspeedup\tmax difference\tdifferent bins(%)" << std::endl;
+    for(size_t p = 0; p < sizeof(params)/sizeof(params[0]); p++)
+    {
+        FilterParams const& fp = params[p];
+        std::vector<line_t> expected = lines;
+        std::vector<line_t> filtered = lines;
+
+        Timer t;
+        t.start();
+        for(size_t i = 0; i < expected.size(); i++)
+            reference(expected[i], min_range_bin, fp.low_pass_radius, fp.derivative, fp.non_max, fp.non_max_epsilon);
+        const double reference_us = double(t.stop()) / lines.size();
+
+        SonarLineFilter filter;
+        filter.setParams(fp.low_pass_radius, fp.derivative, fp.non_max, fp.non_max_epsilon);
+        t.start();
+        for(size_t i = 0; i < filtered.size(); i++)
+            filter.apply(filtered[i], min_range_bin);
+        const double filter_us = double(t.stop()) / lines.size();
+
+        // the low-pass filter used to round down after every tap, so its
+        // output is often a level or two lower, and non-maximum suppression
+        // can turn that into a peak being kept or dropped
+        int max_difference = 0;
+        size_t num_different = 0;
+        size_t num_bins = 0;
+        for(size_t i = 0; i < lines.size(); i++)
+            for(size_t j = 0; j < lines[i].size(); j++, num_bins++)
+            {
+                const int d = std::abs(int(expected[i][j]) - int(filtered[i][j]));
+                max_difference = std::max(max_difference, d);
+                num_different += (d != 0);
+            }
+
+        std::cout << fp.low_pass_radius << "\t" << fp.derivative << "\t" << fp.non_max << "\t"
+                  << reference_us << "\t" << filter_us << "\t" << reference_us / filter_us << "\t"
+                  << max_difference << "\t" << 100.0 * num_different / num_bins << std::endl;
+    }
+    return 0;
+}
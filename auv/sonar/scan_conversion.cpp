@@ -0,0 +1,142 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include "scan_conversion.h"
+
+#include <cmath>
+
+#include <debug/cauv_debug.h>
+
+using namespace std;
+using namespace cauv;
+
+cv::Rect cauv::arcBound(int radius, cv::Point2f from, cv::Point2f to)
+{
+    // Assuming maximum quarter arcs
+
+    // Check which half-axes arc crosses, by checking quadrants
+
+    // 10 | 00
+    // ___|___
+    //    |
+    // 11 | 01
+
+    int8_t fromQuad = ((from.x < 0) << 1) | (from.y < 0);
+    int8_t toQuad = ((to.x < 0) << 1) | (to.y < 0);
+    
+    int max_x, max_y, min_x, min_y;
+
+    if (fromQuad == toQuad) // Common case, same quadrant
+    {
+		min_x = floor(min(from.x, to.x));
+		min_y = floor(min(from.y, to.y));
+		max_x = ceil(max(from.x, to.x));
+		max_y = ceil(max(from.y, to.y));
+    }
+    else
+    {
+        switch (fromQuad)
+        {
+            default:
+                error() << "fromQuad out of range:" << fromQuad;
+            case 0:
+		        min_x = to.x;
+                min_y = floor(min(from.y, to.y));
+		        max_x = from.x;
+		        max_y = radius;
+                break;
+            case 1:
+                min_x = floor(min(from.x, to.x));
+                min_y = from.y;
+                max_x = radius;
+                max_y = to.y;
+                break;
+            case 2:
+                min_x = -radius;
+                min_y = to.y;
+                max_x = ceil(max(from.x, to.x));
+                max_y = from.y;
+                break;
+            case 3:
+                min_x = from.x;
+                min_y = -radius;
+                max_x = to.x;
+                max_y = ceil(max(from.y, to.y));
+                break;
+        }
+    }
+    return cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+}
+
+namespace{
+struct LabelPixel{
+    LabelPixel(cv::Mat_<int32_t>& labels, cv::Rect& touched, int radius, int32_t cell)
+        : labels(labels), touched(touched), radius(radius), cell(cell){
+    }
+    void operator()(int x, int y) const{
+        const int row = radius - y;
+        const int col = radius + x;
+        if(row < 0 || col < 0 || row >= labels.rows || col >= labels.cols)
+            return;
+        labels(row, col) = cell;
+        if(touched.area())
+            touched |= cv::Rect(col, row, 1, 1);
+        else
+            touched = cv::Rect(col, row, 1, 1);
+    }
+    cv::Mat_<int32_t>& labels;
+    cv::Rect& touched;
+    int radius;
+    int32_t cell;
+};
+} // anonymous namespace
+
+ScanConversionTable::ScanConversionTable()
+    : m_spans(), m_built(false), m_labels(), m_touched(), m_radius(0){
+}
+
+void ScanConversionTable::beginBuild(uint32_t size, int radius){
+    m_spans.clear();
+    m_built = false;
+    m_labels.create(size, size);
+    m_labels = -1;
+    m_touched = cv::Rect();
+    m_radius = radius;
+}
+
+void ScanConversionTable::addCell(uint32_t cell, float inner_radius, float outer_radius,
+                                  cv::Point2f const& dir_a, cv::Point2f const& dir_b, bool bound_a_to_b){
+    forEachPixelInSegment(
+        inner_radius, outer_radius, dir_a, dir_b, bound_a_to_b,
+        LabelPixel(m_labels, m_touched, m_radius, cell)
+    );
+}
+
+void ScanConversionTable::endBuild(){
+    // run-length encode the labels, row by row
+    for(int row = m_touched.y; row < m_touched.y + m_touched.height; row++){
+        const int32_t* l = m_labels[row];
+        int col = m_touched.x;
+        const int end = m_touched.x + m_touched.width;
+        while(col < end){
+            if(l[col] < 0){
+                col++;
+                continue;
+            }
+            Span s;
+            s.row = row;
+            s.col = col;
+            s.cell = l[col];
+            while(col < end && l[col] == int32_t(s.cell))
+                col++;
+            s.len = col - s.col;
+            m_spans.push_back(s);
+        }
+    }
+    m_labels.release();
+    m_built = true;
+    debug(4) << "scan conversion table built:" << m_spans.size() << "spans";
+}
@@ -0,0 +1,127 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_SONAR_SCAN_CONVERSION_H__
+#define __CAUV_SONAR_SCAN_CONVERSION_H__
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include <opencv2/core/core.hpp>
+
+namespace cauv{
+
+// Bounding box of the arc from -> to of a circle centred on the origin
+// (assuming arcs of at most a quarter circle)
+cv::Rect arcBound(int radius, cv::Point2f from, cv::Point2f to);
+
+template<typename T>
+inline bool ccw(T p1_x, T p1_y, T p2_x, T p2_y)
+{
+    return (p1_x * p2_y - p2_x * p1_y) > 0;
+}
+
+// Call f(x, y) for every pixel (relative to the centre, y up) in the annular
+// segment between inner_radius and outer_radius that is ccw of a and not ccw
+// of b. dir_a and dir_b are unit vectors. The bounding box of the segment is
+// found from the arcs bound_from -> bound_to, which are either a->b or b->a
+// depending on the way round the caller's bearings go.
+template<typename F>
+inline void forEachPixelInSegment(float inner_radius, float outer_radius,
+                                  cv::Point2f const& dir_a, cv::Point2f const& dir_b,
+                                  bool bound_a_to_b, F f)
+{
+    cv::Point2f pt_inner_a = inner_radius * dir_a;
+    cv::Point2f pt_inner_b = inner_radius * dir_b;
+    cv::Point2f pt_outer_a = outer_radius * dir_a;
+    cv::Point2f pt_outer_b = outer_radius * dir_b;
+
+    cv::Rect innerbb, outerbb;
+    if(bound_a_to_b){
+        innerbb = arcBound(inner_radius, pt_inner_a, pt_inner_b);
+        outerbb = arcBound(outer_radius, pt_outer_a, pt_outer_b);
+    }else{
+        innerbb = arcBound(inner_radius, pt_inner_b, pt_inner_a);
+        outerbb = arcBound(outer_radius, pt_outer_b, pt_outer_a);
+    }
+    cv::Rect bb = innerbb | outerbb;
+
+    for(int y = bb.y; y < bb.y + bb.height; y++)
+    {
+        for(int x = bb.x; x < bb.x + bb.width; x++)
+        {
+            int r2 = x*x + y*y;
+
+            // Check if we're at least within the right radius
+            if (r2 < inner_radius * inner_radius || r2 > outer_radius * outer_radius)
+                continue;
+
+            //  | P /  P is inside the segment if
+            //  |  /   it's ccw of a and cw of b.
+            //  | /
+            //  |/
+            if (!ccw<float>(pt_outer_a.x, pt_outer_a.y, x, y) ||
+                 ccw<float>(pt_outer_b.x, pt_outer_b.y, x, y))
+                continue;
+
+            f(x, y);
+        }
+    }
+}
+
+// Precomputed mapping from cells of a polar image (numbered however the
+// caller likes) to the pixels of a square Cartesian image, stored as
+// horizontal runs of pixels so that applying it is a sequence of memsets
+// instead of per-pixel geometry tests.
+class ScanConversionTable
+{
+    public:
+        struct Span{
+            uint16_t row;
+            uint16_t col;
+            uint16_t len;
+            uint32_t cell;
+        };
+
+        ScanConversionTable();
+
+        // Start building a table for a size x size image with the origin at
+        // (radius, radius)
+        void beginBuild(uint32_t size, int radius);
+        // Where cells overlap, later cells take the pixels (which matches
+        // drawing the cells one after another)
+        void addCell(uint32_t cell, float inner_radius, float outer_radius,
+                     cv::Point2f const& dir_a, cv::Point2f const& dir_b, bool bound_a_to_b);
+        void endBuild();
+
+        bool built() const{ return m_built; }
+        size_t numSpans() const{ return m_spans.size(); }
+
+        // set the pixels of each cell in the 8 bit image m to
+        // cell_values[cell]
+        void apply(cv::Mat& m, uint8_t const* cell_values) const{
+            const Span* s = m_spans.empty()? 0 : &m_spans[0];
+            const Span* end = s + m_spans.size();
+            for(; s != end; s++)
+                std::memset(m.ptr<uint8_t>(s->row) + s->col, cell_values[s->cell], s->len);
+        }
+
+    private:
+        std::vector<Span> m_spans;
+        bool m_built;
+
+        // only used while building:
+        cv::Mat_<int32_t> m_labels;
+        cv::Rect m_touched;
+        int m_radius;
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_SONAR_SCAN_CONVERSION_H__
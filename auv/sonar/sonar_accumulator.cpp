@@ -5,6 +5,7 @@
 
 
 #include "sonar_accumulator.h"
+#include "scan_conversion.h"
 
 #include <cmath>
 #include <algorithm>
@@ -23,82 +24,45 @@
 using namespace std;
 using namespace cauv;
 
-static inline cv::Rect arcBound(int radius, cv::Point2f from, cv::Point2f to)
-{
-    // Assuming maximum quarter arcs
-
-    // Check which half-axes arc crosses, by checking quadrants
-
-    // 10 | 00
-    // ___|___
-    //    |
-    // 11 | 01
-
-    int8_t fromQuad = ((from.x < 0) << 1) | (from.y < 0);
-    int8_t toQuad = ((to.x < 0) << 1) | (to.y < 0);
-    
-    int max_x, max_y, min_x, min_y;
-
-    if (fromQuad == toQuad) // Common case, same quadrant
-    {
-		min_x = floor(min(from.x, to.x));
-		min_y = floor(min(from.y, to.y));
-		max_x = ceil(max(from.x, to.x));
-		max_y = ceil(max(from.y, to.y));
-    }
-    else
-    {
-        switch (fromQuad)
-        {
-            default:
-                error() << "fromQuad out of range:" << fromQuad;
-            case 0:
-		        min_x = to.x;
-                min_y = floor(min(from.y, to.y));
-		        max_x = from.x;
-		        max_y = radius;
-                break;
-            case 1:
-                min_x = floor(min(from.x, to.x));
-                min_y = from.y;
-                max_x = radius;
-                max_y = to.y;
-                break;
-            case 2:
-                min_x = -radius;
-                min_y = to.y;
-                max_x = ceil(max(from.x, to.x));
-                max_y = from.y;
-                break;
-            case 3:
-                min_x = from.x;
-                min_y = -radius;
-                max_x = to.x;
-                max_y = ceil(max(from.y, to.y));
-                break;
-        }
-    }
-    return cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
-}
-
-template<typename T>
-inline bool ccw(T p1_x, T p1_y, T p2_x, T p2_y)
-{
-    return (p1_x * p2_y - p2_x * p1_y) > 0;
-}
-
 // converts bearing (+ve clockwise) to angle (+ve anticlockwise)
 float cauv::msgPolarAngleToRadians(int32_t bearing){
     return -M_PI * bearing / (3200.0*0x10000);
 }
 
 SonarAccumulator::SonarAccumulator(uint32_t size)
+    : m_bearingRange(0), m_range(0), m_scanWidth(0), m_nbins(0),
+      m_use_tables(true), m_line_tables_key(), m_line_tables(),
+      m_whole_image_table(), m_whole_image_key()
 {   
     m_size = size;
     reset();
     assert(m_img->mat().data);
 }
 
+SonarAccumulator::~SonarAccumulator()
+{
+}
+
+namespace{
+// draws the pixels of a segment directly into an image centred at (cx, cy)
+struct SetPixel{
+    SetPixel(cv::Mat& m, int cx, int cy, uint8_t value)
+        : m(m), cx(cx), cy(cy), value(value){
+    }
+    void operator()(int x, int y) const{
+        m.at<unsigned char>(cy - y, cx + x) = value;
+    }
+    cv::Mat& m;
+    int cx, cy;
+    uint8_t value;
+};
+} // anonymous namespace
+
+void SonarAccumulator::setUseLookupTables(bool use_tables)
+{
+    m_use_tables = use_tables;
+}
+
 void SonarAccumulator::reset() {
     m_last_line_bearing = 0;
     m_image_completed = 0;
@@ -146,45 +110,35 @@ bool SonarAccumulator::accumulateDataLine(const SonarDataLine& line)
     if (isFullImage)
         m_image_completed = 0;
 
-    for (int b = 0; b < bincount; b++) {
-        // All calculations assume centre is at (0,0)
-        
-        float inner_radius = b * bscale;
-        float outer_radius = (b+1) * bscale;
-
-        cv::Point2f pt_inner_from(inner_radius*seanet_cached.cos(from), inner_radius*seanet_cached.sin(from));
-        cv::Point2f pt_inner_to(inner_radius*seanet_cached.cos(to), inner_radius*seanet_cached.sin(to));
-        cv::Point2f pt_outer_from(outer_radius*seanet_cached.cos(from), outer_radius*seanet_cached.sin(from));
-        cv::Point2f pt_outer_to(outer_radius*seanet_cached.cos(to), outer_radius*seanet_cached.sin(to));
-        
-        cv::Rect innerbb = arcBound(inner_radius, pt_inner_from, pt_inner_to);
-        cv::Rect outerbb = arcBound(outer_radius, pt_outer_from, pt_outer_to);
-        cv::Rect bb = innerbb | outerbb;
-        
-        for(int y = bb.y; y < bb.y + bb.height; y++)
-        {
-            unsigned char* pm = &m.at<unsigned char>(cy - y, cx + bb.x);
-            for(int x = bb.x; x < bb.x + bb.width; x++, pm++)
-            {
-                int r2 = x*x + y*y;
-        
-                // Check if we're at least within the right radius
-                if (r2 < inner_radius * inner_radius || r2 > outer_radius * outer_radius)
-                    continue;
-                
-                //  | P /  For P is inside the segment if
-                //  |  /   it's ccw of from and cw of to.                 
-                //  | /
-                //  |/     
-                bool ccwFrom = ccw<float>(pt_outer_from.x, pt_outer_from.y, x, y);
-                bool ccwTo = ccw<float>(pt_outer_to.x, pt_outer_to.y, x, y);
-                
-                if (!ccwFrom || ccwTo)
-                    continue;
-
-                // If we've got to here, then this must be valid. Shift to the centre and set the value.
-                *pm = line.data[b];
-            }
+    if (m_use_tables) {
+        // scan conversion depends only on these, and on the bearing of the
+        // line:
+        LineTablesKey key(m_size, line.bearingRange, bincount);
+        if (!(key == m_line_tables_key)) {
+            m_line_tables.clear();
+            m_line_tables_key = key;
+        }
+        boost::shared_ptr<ScanConversionTable>& table = m_line_tables[mod(from, 6400)];
+        if (!table) {
+            cv::Point2f dir_from(seanet_cached.cos(from), seanet_cached.sin(from));
+            cv::Point2f dir_to(seanet_cached.cos(to), seanet_cached.sin(to));
+            table = boost::make_shared<ScanConversionTable>();
+            table->beginBuild(m_size, radius);
+            for (int b = 0; b < bincount; b++)
+                table->addCell(b, b * bscale, (b+1) * bscale, dir_from, dir_to, true);
+            table->endBuild();
+        }
+        if (bincount)
+            table->apply(m, &line.data[0]);
+    } else {
+        cv::Point2f dir_from(seanet_cached.cos(from), seanet_cached.sin(from));
+        cv::Point2f dir_to(seanet_cached.cos(to), seanet_cached.sin(to));
+        for (int b = 0; b < bincount; b++) {
+            // All calculations assume centre is at (0,0)
+            float inner_radius = b * bscale;
+            float outer_radius = (b+1) * bscale;
+            forEachPixelInSegment(inner_radius, outer_radius, dir_from, dir_to, true,
+                                  SetPixel(m, cx, cy, line.data[b]));
         }
     }
     m_img->mat(m);
@@ -211,6 +165,30 @@ bool SonarAccumulator::setWholeImage(PolarImage const& image){
 
     debug(2) << "radius =" << radius << "rows=" << m.rows << "cols=" << m.cols << "rangeEnd=" << image.rangeEnd;
 
+    if(image.data.size() < num_lines * num_bearings){
+        error() << "polar image data too short:" << image.data.size() << "<" << num_lines << "x" << num_bearings;
+        return false;
+    }
+
+    std::vector<double> key;
+    if(m_use_tables){
+        key.reserve(5 + bearing_bins.size());
+        key.push_back(0);
+        key.push_back(m_size);
+        key.push_back(image.rangeStart);
+        key.push_back(image.rangeEnd);
+        key.push_back(image.rangeConversion);
+        key.insert(key.end(), bearing_bins.begin(), bearing_bins.end());
+        if(key == m_whole_image_key && m_whole_image_table->built()){
+            if(num_lines * num_bearings)
+                m_whole_image_table->apply(m, &image.data[0]);
+            return true;
+        }
+        m_whole_image_key.swap(key);
+        m_whole_image_table = boost::make_shared<ScanConversionTable>();
+        m_whole_image_table->beginBuild(m_size, radius);
+    }
+
     gem_cached.ensureTablesFor(bearing_bins);
 
     for(uint32_t line = 0; line < num_lines; line++){
@@ -221,50 +199,23 @@ bool SonarAccumulator::setWholeImage(PolarImage const& image){
         assert(range_line != end_line);
 
         for(uint32_t i = 0; i < num_bearings; i++){
-            /*int32_t from = bearing_bins[i];
-            int32_t to   = bearing_bins[i+1];
-
-            cv::Point2f pt_inner_from(inner_radius*gem_cos_safe(from), inner_radius*gem_sin_safe(from));
-            cv::Point2f pt_inner_to(inner_radius*gem_cos_safe(to), inner_radius*gem_sin_safe(to));
-            cv::Point2f pt_outer_from(outer_radius*gem_cos_safe(from), outer_radius*gem_sin_safe(from));
-            cv::Point2f pt_outer_to(outer_radius*gem_cos_safe(to), outer_radius*gem_sin_safe(to));
-            */
-            cv::Point2f pt_inner_from(inner_radius*gem_cached.cos_idx(i), inner_radius*gem_cached.sin_idx(i));
-            cv::Point2f pt_inner_to(inner_radius*gem_cached.cos_idx(i+1), inner_radius*gem_cached.sin_idx(i+1));
-            cv::Point2f pt_outer_from(outer_radius*gem_cached.cos_idx(i), outer_radius*gem_cached.sin_idx(i));
-            cv::Point2f pt_outer_to(outer_radius*gem_cached.cos_idx(i+1), outer_radius*gem_cached.sin_idx(i+1));
-
-            cv::Rect innerbb = arcBound(inner_radius, pt_inner_to, pt_inner_from);
-            cv::Rect outerbb = arcBound(outer_radius, pt_outer_to, pt_outer_from);
-            cv::Rect bb = innerbb | outerbb;
-
-            for(int y = bb.y; y < bb.y + bb.height; y++)
-            {
-                unsigned char* pm = &m.at<unsigned char>(cy - y, cx + bb.x);
-                for(int x = bb.x; x < bb.x + bb.width; x++, pm++)
-                {
-                    int r2 = x*x + y*y;
-
-                    // Check if we're at least within the right radius
-                    if (r2 < inner_radius * inner_radius || r2 > outer_radius * outer_radius)
-                        continue;
-
-                    //  | P /  For P is inside the segment if
-                    //  |  /   it's cw of from and ccw of to.
-                    //  | /
-                    //  |/
-                    bool ccwFrom = ccw<float>(pt_outer_from.x, pt_outer_from.y, x, y);
-                    bool ccwTo = ccw<float>(pt_outer_to.x, pt_outer_to.y, x, y);
-
-                    if (ccwFrom || !ccwTo)
-                        continue;
-
-                    // If we've got to here, then this must be valid. Shift to the centre and set the value.
-                    *pm = image.data[line * num_bearings + i];
-                }
-            }
+            // bearings run clockwise, so the segment is ccw of bin edge i+1
+            // and cw of bin edge i
+            cv::Point2f dir_from(gem_cached.cos_idx(i), gem_cached.sin_idx(i));
+            cv::Point2f dir_to(gem_cached.cos_idx(i+1), gem_cached.sin_idx(i+1));
+            const uint32_t cell = line * num_bearings + i;
+            if(m_use_tables)
+                m_whole_image_table->addCell(cell, inner_radius, outer_radius, dir_to, dir_from, true);
+            else
+                forEachPixelInSegment(inner_radius, outer_radius, dir_to, dir_from, true,
+                                      SetPixel(m, cx, cy, image.data[cell]));
         }
     }
+    if(m_use_tables){
+        m_whole_image_table->endBuild();
+        if(num_lines * num_bearings)
+            m_whole_image_table->apply(m, &image.data[0]);
+    }
     return true;
 }
 
@@ -287,10 +238,27 @@ bool SonarAccumulator::setWholeImage(NonUniformPolarMat image){
     const float max_radius_m = image.ranges->back() + (image.ranges->back() - image.ranges->at(num_lines-2))/2;
     const float rscale = radius / max_radius_m;
 
+    // cells are numbered by position in a continuous copy of the data
+    cv::Mat data = image.mat.isContinuous()? image.mat : image.mat.clone();
+
+    std::vector<double> key;
+    if(m_use_tables){
+        key.reserve(2 + num_lines + num_bearings);
+        key.push_back(1);
+        key.push_back(m_size);
+        key.insert(key.end(), image.ranges->begin(), image.ranges->end());
+        key.insert(key.end(), image.bearings->begin(), image.bearings->end());
+        if(key == m_whole_image_key && m_whole_image_table->built()){
+            m_whole_image_table->apply(m, data.ptr<uint8_t>());
+            return true;
+        }
+        m_whole_image_key.swap(key);
+        m_whole_image_table = boost::make_shared<ScanConversionTable>();
+        m_whole_image_table->beginBuild(m_size, radius);
+    }
+
     // convert centre-of-bin values to edge-of-bin values, and set-up the
-    // sin-cos cache: if this proves a bottleneck we should avoid calculating
-    // bearing_bins if the cache is already up to data (cache hangs of the
-    // number of bins and the first angle)
+    // sin-cos cache
     {
         std::vector<float> bearing_bins;
         bearing_bins.reserve(num_bearings+1);
@@ -323,42 +291,20 @@ bool SonarAccumulator::setWholeImage(NonUniformPolarMat image){
         }
 
         for(uint32_t i = 0; i < num_bearings; i++){
-            cv::Point2f pt_inner_from(inner_radius*cached_trig.cos_idx(i), inner_radius*cached_trig.sin_idx(i));
-            cv::Point2f pt_inner_to(inner_radius*cached_trig.cos_idx(i+1), inner_radius*cached_trig.sin_idx(i+1));
-            cv::Point2f pt_outer_from(outer_radius*cached_trig.cos_idx(i), outer_radius*cached_trig.sin_idx(i));
-            cv::Point2f pt_outer_to(outer_radius*cached_trig.cos_idx(i+1), outer_radius*cached_trig.sin_idx(i+1));
-
-            cv::Rect innerbb = arcBound(inner_radius, pt_inner_from, pt_inner_to);
-            cv::Rect outerbb = arcBound(outer_radius, pt_outer_from, pt_outer_to);
-            cv::Rect bb = innerbb | outerbb;
-
-            for(int y = bb.y; y < bb.y + bb.height; y++)
-            {
-                unsigned char* pm = &m.at<unsigned char>(cy - y, cx + bb.x);
-                for(int x = bb.x; x < bb.x + bb.width; x++, pm++)
-                {
-                    int r2 = x*x + y*y;
-
-                    // Check if we're at least within the right radius
-                    if (r2 < inner_radius * inner_radius || r2 > outer_radius * outer_radius)
-                        continue;
-
-                    //  | P /  For P is inside the segment if
-                    //  |  /   it's cw of from and ccw of to.
-                    //  | /
-                    //  |/
-                    bool ccwFrom = ccw<float>(pt_outer_from.x, pt_outer_from.y, x, y);
-                    bool ccwTo = ccw<float>(pt_outer_to.x, pt_outer_to.y, x, y);
-
-                    if (ccwFrom || !ccwTo)
-                        continue;
-
-                    // If we've got to here, then this must be valid. Shift to the centre and set the value.
-                    *pm = image.mat.at<uint8_t>(line, i);
-                }
-            }
+            cv::Point2f dir_from(cached_trig.cos_idx(i), cached_trig.sin_idx(i));
+            cv::Point2f dir_to(cached_trig.cos_idx(i+1), cached_trig.sin_idx(i+1));
+            const uint32_t cell = line * num_bearings + i;
+            if(m_use_tables)
+                m_whole_image_table->addCell(cell, inner_radius, outer_radius, dir_to, dir_from, false);
+            else
+                forEachPixelInSegment(inner_radius, outer_radius, dir_to, dir_from, false,
+                                      SetPixel(m, cx, cy, data.ptr<uint8_t>()[cell]));
         }
     }
+    if(m_use_tables){
+        m_whole_image_table->endBuild();
+        m_whole_image_table->apply(m, data.ptr<uint8_t>());
+    }
     return true;
 }
 
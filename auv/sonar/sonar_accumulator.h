@@ -7,6 +7,9 @@
 #ifndef __CAUV_SONAR_ACCUMULATOR_H__
 #define __CAUV_SONAR_ACCUMULATOR_H__
 
+#include <map>
+#include <vector>
+
 #include <boost/shared_ptr.hpp>
 
 #include <stdint.h>
@@ -23,6 +26,7 @@ struct SonarDataLine;
 struct PolarImage;
 struct NonUniformPolarMat;
 class Image;
+class ScanConversionTable;
 
 float msgPolarAngleToRadians(int32_t angle);
 
@@ -30,6 +34,7 @@ class SonarAccumulator
 {
     public: 
         SonarAccumulator(uint32_t size=400);
+        ~SonarAccumulator();
         
         bool accumulateDataLine(const SonarDataLine& data);
         bool setWholeImage(PolarImage const& image);
@@ -37,6 +42,12 @@ class SonarAccumulator
 
         void setSize(uint32_t size);
 
+        // Scan conversion normally uses cached lookup tables of which output
+        // pixels belong to each polar cell, rebuilt when the geometry
+        // changes. Turning this off computes the geometry for every pixel of
+        // every cell each time (which is only useful for comparison).
+        void setUseLookupTables(bool use_tables);
+
         boost::shared_ptr<Image> img() const;
         cv::Mat mat() const;
 
@@ -53,6 +64,28 @@ class SonarAccumulator
         // cos/sin caches:
         GemCachedTrig gem_cached;
         CachedTrig cached_trig;
+
+        bool m_use_tables;
+
+        // data line tables, indexed by the start bearing of the line, valid
+        // for one (size, bearingRange, nbins)
+        struct LineTablesKey{
+            LineTablesKey() : size(0), bearingRange(0), nbins(0){ }
+            LineTablesKey(uint32_t size, int bearingRange, int nbins)
+                : size(size), bearingRange(bearingRange), nbins(nbins){ }
+            bool operator==(LineTablesKey const& o) const{
+                return size == o.size && bearingRange == o.bearingRange && nbins == o.nbins;
+            }
+            uint32_t size;
+            int bearingRange;
+            int nbins;
+        };
+        LineTablesKey m_line_tables_key;
+        std::map<int, boost::shared_ptr<ScanConversionTable> > m_line_tables;
+
+        // whole image table, valid for the size and image geometry in the key
+        boost::shared_ptr<ScanConversionTable> m_whole_image_table;
+        std::vector<double> m_whole_image_key;
         
         void reset();
 };
@@ -55,7 +55,7 @@ const static class SeanetCachedTrig{
 class GemCachedTrig{
     public:
         GemCachedTrig()
-            : sins(), coss(), sins_start_from(0){
+            : sins(), coss(), bearings_cached(){
         }
 
         static float sin_nocache(int32_t bearing){
@@ -67,15 +67,15 @@ class GemCachedTrig{
         float sin_idx(uint32_t bearing_idx) const{ return sins[bearing_idx]; }
         float cos_idx(uint32_t bearing_idx) const{ return coss[bearing_idx]; }
 
-        void ensureTablesFor(std::vector<int32_t> bearings){
-            if(bearings[0] == sins_start_from &&
-               bearings.size() == sins.size()){
+        // the tables are rebuilt whenever any bearing changes, not just the
+        // first: comparing the whole table is still far cheaper than the trig
+        void ensureTablesFor(std::vector<int32_t> const& bearings){
+            if(bearings == bearings_cached){
                 return;
             }
-            sins.clear();
-            coss.clear();
-            sins.reserve(bearings.size());
-            coss.reserve(bearings.size());
+            sins.resize(bearings.size());
+            coss.resize(bearings.size());
+            bearings_cached = bearings;
             for(uint32_t i = 0; i < bearings.size(); i++){
                 sins[i] = sin_nocache(bearings[i]);
                 coss[i] = cos_nocache(bearings[i]);
@@ -85,27 +85,25 @@ class GemCachedTrig{
     private:
         std::vector<float> sins;
         std::vector<float> coss;
-        int32_t sins_start_from;
+        std::vector<int32_t> bearings_cached;
 };
 
 class CachedTrig{
     public:
         CachedTrig()
-            : sins(), coss(), sins_start_from(0){
+            : sins(), coss(), angles_cached(){
         }
 
         float sin_idx(uint32_t angle_idx) const{ return sins[angle_idx]; }
         float cos_idx(uint32_t angle_idx) const{ return coss[angle_idx]; }
 
-        void ensureTablesFor(std::vector<float> angles){
-            if(angles[0] == sins_start_from &&
-               angles.size() == sins.size()){
+        void ensureTablesFor(std::vector<float> const& angles){
+            if(angles == angles_cached){
                 return;
             }
-            sins.clear();
-            coss.clear();
-            sins.reserve(angles.size());
-            coss.reserve(angles.size());
+            sins.resize(angles.size());
+            coss.resize(angles.size());
+            angles_cached = angles;
             for(uint32_t i = 0; i < angles.size(); i++){
                 sins[i] = std::sin(angles[i]);
                 coss[i] = std::cos(angles[i]);
@@ -115,7 +113,7 @@ class CachedTrig{
     private:
         std::vector<float> sins;
         std::vector<float> coss;
-        float sins_start_from;
+        std::vector<float> angles_cached;
 };
 
 /*
@@ -89,6 +89,13 @@ void CauvNode::addOptions(boost::program_options::options_description& desc,
                           boost::program_options::positional_options_description& /*pos*/)
 {
     namespace po = boost::program_options;
+    desc.add_options()
+        ("batch-window", po::value<unsigned int>()->default_value(0),
+         "coalesce small messages of the same type sent within this many microseconds into one frame (0 to disable)")
+        ("batch-bytes", po::value<unsigned int>()->default_value(8192),
+         "maximum size of a coalesced frame")
+        ("debug-level", po::value<int>(),
+         "print debug statements up to this level (1 by default, higher is more verbose)");
 }
 int CauvNode::useOptionsMap(boost::program_options::variables_map& vm, boost::program_options::options_description& desc)
 {
@@ -102,6 +109,15 @@ int CauvNode::useOptionsMap(boost::program_options::variables_map& vm, boost::pr
         std::cout << Version_Information << std::flush;
         return 1;
     }
+    if(vm.count("batch-window"))
+    {
+        m_zeromq_mailbox->setBatching(vm["batch-window"].as<unsigned int>(),
+                                      vm["batch-bytes"].as<unsigned int>());
+    }
+    if(vm.count("debug-level"))
+    {
+        debug::setLevel(vm["debug-level"].as<int>());
+    }
     return 0;
 }
 
@@ -0,0 +1,456 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#include "message_log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+
+#include <debug/cauv_debug.h>
+
+using namespace cauv;
+
+namespace {
+
+const char File_Magic[8] = {'C', 'A', 'U', 'V', 'M', 'L', 'O', 'G'};
+const uint32_t File_Version = 1;
+const uint32_t Chunk_Magic = 0x4b4e4843; // "CHNK"
+
+struct FileHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct ChunkHeader{
+    uint32_t magic;
+    uint32_t num_messages;
+    uint64_t bytes;
+    int64_t first_us;
+    int64_t last_us;
+    uint32_t num_ids;
+    uint32_t reserved;
+};
+
+struct IdCount{
+    uint32_t msg_id;
+    uint32_t count;
+};
+
+struct MessageHeader{
+    int64_t time_us;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+const byte Padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+inline uint64_t padded(uint64_t len){
+    return (len + 7) & ~uint64_t(7);
+}
+
+inline uint32_t messageId(const_svec_ptr const& bytes){
+    uint32_t id = 0;
+    if(bytes.size() >= sizeof(id))
+        std::memcpy(&id, bytes.data(), sizeof(id));
+    return id;
+}
+
+std::string errorString(std::string const& what){
+    return what + ": " + std::strerror(errno);
+}
+
+void writeAll(int fd, std::vector<iovec>& iov){
+    std::size_t i = 0;
+    while(i < iov.size()){
+        ssize_t n = ::writev(fd, &iov[i], std::min<std::size_t>(iov.size() - i, IOV_MAX));
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            throw message_log_error(errorString("write failed"));
+        }
+        // skip what was written, which may end part way through an iovec
+        while(i < iov.size() && std::size_t(n) >= iov[i].iov_len){
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if(n){
+            iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+        }
+    }
+}
+
+iovec iovecFor(void const* data, std::size_t len){
+    iovec r;
+    r.iov_base = const_cast<void*>(data);
+    r.iov_len = len;
+    return r;
+}
+
+struct Unmapper{
+    Unmapper(std::size_t size) : size(size){ }
+    void operator()(void const* p) const{
+        ::munmap(const_cast<void*>(p), size);
+    }
+    std::size_t size;
+};
+
+} // anonymous namespace
+
+// - MessageLogWriter
+
+MessageLogWriter::MessageLogWriter(std::string const& fname,
+                                   std::size_t chunk_bytes,
+                                   int64_t chunk_us,
+                                   std::size_t max_queued_bytes)
+    : m_fd(-1),
+      m_chunk_bytes(chunk_bytes),
+      m_chunk_us(chunk_us),
+      m_max_queued_bytes(max_queued_bytes),
+      m_lock(),
+      m_chunk_ready(),
+      m_chunk_written(),
+      m_current(),
+      m_full(),
+      m_queued_bytes(0),
+      m_queue_full(false),
+      m_writing(false),
+      m_closing(false),
+      m_messages_written(0),
+      m_bytes_written(0),
+      m_messages_dropped(0),
+      m_write_thread(){
+    // (the writer thread waits for chunk_us at a time)
+    if(chunk_us <= 0)
+        throw message_log_error("chunk time must be positive");
+    m_fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(m_fd < 0)
+        throw message_log_error(errorString("could not open " + fname));
+    FileHeader h;
+    std::memcpy(h.magic, File_Magic, sizeof(h.magic));
+    h.version = File_Version;
+    h.reserved = 0;
+    try{
+        _write(&h, sizeof(h));
+    }catch(message_log_error&){
+        ::close(m_fd);
+        m_fd = -1;
+        throw;
+    }
+    m_write_thread = boost::thread(boost::bind(&MessageLogWriter::_writeLoop, this));
+}
+
+MessageLogWriter::~MessageLogWriter(){
+    close();
+}
+
+void MessageLogWriter::append(int64_t time_us, const_svec_ptr const& bytes){
+    boost::lock_guard<boost::mutex> l(m_lock);
+    if(m_closing){
+        warning() << "message appended to closed log";
+        return;
+    }
+    if(!m_current){
+        m_current = boost::make_shared<Chunk>();
+        m_current->first_us = time_us;
+        m_current->last_us = time_us;
+    }
+    Chunk& c = *m_current;
+    c.messages.push_back(std::make_pair(time_us, bytes));
+    c.bytes += sizeof(MessageHeader) + padded(bytes.size());
+    c.first_us = std::min(c.first_us, time_us);
+    c.last_us = std::max(c.last_us, time_us);
+    c.counts[messageId(bytes)]++;
+    if(c.bytes >= m_chunk_bytes || c.last_us - c.first_us >= m_chunk_us)
+        _finishChunk();
+}
+
+void MessageLogWriter::close(){
+    boost::unique_lock<boost::mutex> l(m_lock);
+    if(m_fd < 0)
+        return;
+    if(m_current)
+        _finishChunk();
+    m_closing = true;
+    m_chunk_ready.notify_all();
+    l.unlock();
+
+    m_write_thread.join();
+
+    l.lock();
+    if(::close(m_fd) != 0)
+        error() << errorString("closing message log failed");
+    m_fd = -1;
+}
+
+uint64_t MessageLogWriter::messagesWritten() const{
+    boost::lock_guard<boost::mutex> l(m_lock);
+    return m_messages_written;
+}
+
+uint64_t MessageLogWriter::bytesWritten() const{
+    boost::lock_guard<boost::mutex> l(m_lock);
+    return m_bytes_written;
+}
+
+uint64_t MessageLogWriter::messagesDropped() const{
+    boost::lock_guard<boost::mutex> l(m_lock);
+    return m_messages_dropped;
+}
+
+// call with m_lock held
+void MessageLogWriter::_finishChunk(){
+    // (a chunk is always accepted if nothing is queued, however big it is)
+    if(!m_full.empty() && m_queued_bytes + m_current->bytes > m_max_queued_bytes){
+        if(!m_queue_full)
+            warning() << "message log writes are falling behind: dropping messages";
+        m_queue_full = true;
+        m_messages_dropped += m_current->messages.size();
+        m_current.reset();
+        return;
+    }
+    m_queue_full = false;
+    m_queued_bytes += m_current->bytes;
+    m_full.push_back(m_current);
+    m_current.reset();
+    m_chunk_ready.notify_one();
+}
+
+void MessageLogWriter::_writeLoop(){
+    boost::unique_lock<boost::mutex> l(m_lock);
+    while(true){
+        if(m_full.empty() && !m_closing){
+            // (so that a quiet log doesn't hold on to its last few messages
+            // indefinitely)
+            const bool woken = m_chunk_ready.timed_wait(
+                l, boost::posix_time::microseconds(m_chunk_us)
+            );
+            if(!woken && m_current)
+                _finishChunk();
+            continue;
+        }
+        if(m_full.empty())
+            break;
+        boost::shared_ptr<Chunk> c = m_full.front();
+        m_full.pop_front();
+        m_queued_bytes -= c->bytes;
+        l.unlock();
+        bool written = true;
+        try{
+            _writeChunk(*c);
+        }catch(message_log_error& e){
+            error() << e.what() << "(" << c->messages.size() << "messages lost)";
+            written = false;
+        }
+        l.lock();
+        if(written){
+            m_messages_written += c->messages.size();
+            m_bytes_written += c->bytes;
+        }else{
+            m_messages_dropped += c->messages.size();
+        }
+    }
+}
+
+void MessageLogWriter::_writeChunk(Chunk const& c){
+    ChunkHeader h;
+    h.magic = Chunk_Magic;
+    h.num_messages = c.messages.size();
+    h.bytes = c.bytes;
+    h.first_us = c.first_us;
+    h.last_us = c.last_us;
+    h.num_ids = c.counts.size();
+    h.reserved = 0;
+
+    std::vector<IdCount> counts;
+    counts.reserve(c.counts.size());
+    for(std::map<uint32_t, uint32_t>::const_iterator i = c.counts.begin(); i != c.counts.end(); i++){
+        IdCount ic = {i->first, i->second};
+        counts.push_back(ic);
+    }
+
+    std::vector<MessageHeader> headers(c.messages.size());
+    std::vector<iovec> iov;
+    iov.reserve(2 + 3 * c.messages.size());
+    iov.push_back(iovecFor(&h, sizeof(h)));
+    if(!counts.empty())
+        iov.push_back(iovecFor(&counts[0], counts.size() * sizeof(IdCount)));
+    for(std::size_t i = 0; i < c.messages.size(); i++){
+        const_svec_ptr const& bytes = c.messages[i].second;
+        headers[i].time_us = c.messages[i].first;
+        headers[i].length = bytes.size();
+        headers[i].reserved = 0;
+        iov.push_back(iovecFor(&headers[i], sizeof(MessageHeader)));
+        if(bytes.size())
+            iov.push_back(iovecFor(bytes.data(), bytes.size()));
+        if(padded(bytes.size()) != bytes.size())
+            iov.push_back(iovecFor(Padding, padded(bytes.size()) - bytes.size()));
+    }
+    writeAll(m_fd, iov);
+}
+
+void MessageLogWriter::_write(void const* data, std::size_t len){
+    std::vector<iovec> iov(1, iovecFor(data, len));
+    writeAll(m_fd, iov);
+}
+
+// - MessageLogReader
+
+MessageLogReader::MessageLogReader(std::string const& fname)
+    : m_mapping(),
+      m_data(NULL),
+      m_size(0),
+      m_complete(true),
+      m_chunks(),
+      m_filter(),
+      m_chunk(0),
+      m_offset(0){
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw message_log_error(errorString("could not open " + fname));
+    struct stat st;
+    if(::fstat(fd, &st) != 0){
+        ::close(fd);
+        throw message_log_error(errorString("could not stat " + fname));
+    }
+    m_size = st.st_size;
+    if(m_size < sizeof(FileHeader)){
+        ::close(fd);
+        throw message_log_error(fname + " is not a message log");
+    }
+    void* p = ::mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED)
+        throw message_log_error(errorString("could not map " + fname));
+    m_mapping = boost::shared_ptr<const void>(p, Unmapper(m_size));
+    m_data = static_cast<byte const*>(p);
+
+    FileHeader fh;
+    std::memcpy(&fh, m_data, sizeof(fh));
+    if(std::memcmp(fh.magic, File_Magic, sizeof(fh.magic)) != 0)
+        throw message_log_error(fname + " is not a message log");
+    if(fh.version != File_Version)
+        throw message_log_error(fname + " is an unsupported version");
+
+    // the index is in the chunk headers
+    uint64_t offset = sizeof(FileHeader);
+    while(offset + sizeof(ChunkHeader) <= m_size){
+        ChunkHeader h;
+        std::memcpy(&h, m_data + offset, sizeof(h));
+        const uint64_t counts_end = offset + sizeof(h) + uint64_t(h.num_ids) * sizeof(IdCount);
+        if(h.magic != Chunk_Magic || counts_end > m_size || h.bytes > m_size - counts_end)
+            break;
+        ChunkInfo c;
+        c.offset = counts_end;
+        c.bytes = h.bytes;
+        c.first_us = h.first_us;
+        c.last_us = h.last_us;
+        c.num_messages = h.num_messages;
+        for(uint32_t i = 0; i < h.num_ids; i++){
+            IdCount ic;
+            std::memcpy(&ic, m_data + offset + sizeof(h) + i * sizeof(IdCount), sizeof(ic));
+            c.counts[ic.msg_id] = ic.count;
+        }
+        m_chunks.push_back(c);
+        offset = counts_end + h.bytes;
+    }
+    if(offset != m_size){
+        m_complete = false;
+        warning() << fname << "ends with" << m_size - offset << "bytes of incomplete or corrupt data";
+    }
+    if(!m_chunks.empty())
+        m_offset = m_chunks[0].offset;
+}
+
+int64_t MessageLogReader::startTime() const{
+    int64_t r = m_chunks.empty()? 0 : m_chunks[0].first_us;
+    for(std::size_t i = 0; i < m_chunks.size(); i++)
+        r = std::min(r, m_chunks[i].first_us);
+    return r;
+}
+
+int64_t MessageLogReader::endTime() const{
+    int64_t r = m_chunks.empty()? 0 : m_chunks[0].last_us;
+    for(std::size_t i = 0; i < m_chunks.size(); i++)
+        r = std::max(r, m_chunks[i].last_us);
+    return r;
+}
+
+void MessageLogReader::setFilter(std::set<uint32_t> const& msg_ids){
+    m_filter = msg_ids;
+}
+
+void MessageLogReader::seek(int64_t time_us){
+    m_chunk = 0;
+    while(m_chunk < m_chunks.size() && m_chunks[m_chunk].last_us < time_us)
+        m_chunk++;
+    if(m_chunk == m_chunks.size())
+        return;
+    // only the message headers in this chunk need reading
+    ChunkInfo const& c = m_chunks[m_chunk];
+    m_offset = c.offset;
+    Record r;
+    uint64_t next_offset = 0;
+    while(m_offset < c.offset + c.bytes){
+        _readMessage(m_offset, r, next_offset);
+        if(r.time_us >= time_us)
+            break;
+        m_offset = next_offset;
+    }
+}
+
+bool MessageLogReader::next(Record& r){
+    while(m_chunk < m_chunks.size()){
+        ChunkInfo const& c = m_chunks[m_chunk];
+        if(m_offset >= c.offset + c.bytes || !_chunkPassesFilter(c)){
+            m_chunk++;
+            if(m_chunk < m_chunks.size())
+                m_offset = m_chunks[m_chunk].offset;
+            continue;
+        }
+        uint64_t next_offset = 0;
+        _readMessage(m_offset, r, next_offset);
+        m_offset = next_offset;
+        if(m_filter.empty() || m_filter.count(r.msg_id))
+            return true;
+    }
+    return false;
+}
+
+bool MessageLogReader::_chunkPassesFilter(ChunkInfo const& c) const{
+    if(m_filter.empty())
+        return true;
+    for(std::set<uint32_t>::const_iterator i = m_filter.begin(); i != m_filter.end(); i++)
+        if(c.counts.count(*i))
+            return true;
+    return false;
+}
+
+void MessageLogReader::_readMessage(uint64_t offset, Record& r, uint64_t& next_offset) const{
+    ChunkInfo const& c = m_chunks[m_chunk];
+    const uint64_t chunk_end = c.offset + c.bytes;
+    MessageHeader h;
+    if(offset + sizeof(h) > chunk_end)
+        throw message_log_error("corrupt chunk");
+    std::memcpy(&h, m_data + offset, sizeof(h));
+    if(h.length > chunk_end - offset - sizeof(h))
+        throw message_log_error("corrupt chunk");
+    r.time_us = h.time_us;
+    r.bytes = const_svec_ptr(m_data + offset + sizeof(h), h.length, m_mapping);
+    r.msg_id = messageId(r.bytes);
+    next_offset = offset + sizeof(h) + padded(h.length);
+}
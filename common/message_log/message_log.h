@@ -0,0 +1,184 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_MESSAGE_LOG_H__
+#define __CAUV_MESSAGE_LOG_H__
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <deque>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <utility/serialisation-types.h>
+
+namespace cauv {
+
+/* Binary message logs: the serialised bytes of each message (exactly what
+ * was sent, from Message::toBytes()) and the time it was received, so that
+ * nothing is encoded or decoded to record or replay them.
+ *
+ * A log is a file header followed by chunks, appended one at a time. Each
+ * chunk starts with a header giving its length, the time range of its
+ * messages, and how many of each message id it holds, which together are
+ * the index: opening a log reads only the chunk headers, and seeking or
+ * filtering by message type skips whole chunks. A chunk is written only once
+ * it's complete, so a log cut short by a crash loses at most the last
+ * chunk's messages, and is otherwise readable.
+ *
+ * Fields are in native byte order, as in the messages themselves. Every
+ * message starts 8-byte aligned, so messages can be deserialised in place
+ * from a memory-mapped log.
+ *
+ *   file header: "CAUVMLOG", uint32 version, uint32 0
+ *   chunk header: uint32 "CHNK", uint32 number of messages,
+ *                 uint64 bytes of messages (after the id counts),
+ *                 int64 first time, int64 last time,
+ *                 uint32 number of ids, uint32 0,
+ *                 then (uint32 id, uint32 count) for each id
+ *   message: int64 time, uint32 length, uint32 0,
+ *            then length bytes, padded to a multiple of 8
+ *
+ * Times are microseconds since the epoch.
+ */
+
+class message_log_error: public std::runtime_error{
+    public:
+        message_log_error(std::string const& str)
+            : std::runtime_error("message log: " + str){
+        }
+};
+
+/* Appends messages to a new log. Messages are collected into a chunk in
+ * memory (keeping a reference to their bytes, not copying them) and the
+ * chunk is written by a thread of the writer's own, so append() never waits
+ * for the disk. If the disk falls so far behind that the chunks waiting to
+ * be written would take more than max_queued_bytes, new chunks are dropped
+ * (and counted) instead.
+ */
+class MessageLogWriter: boost::noncopyable{
+    public:
+        // chunks are written when they reach chunk_bytes, or when their
+        // first message is more than chunk_us (> 0) old
+        MessageLogWriter(std::string const& fname,
+                         std::size_t chunk_bytes = 4 << 20,
+                         int64_t chunk_us = 1000000,
+                         std::size_t max_queued_bytes = 64 << 20);
+        ~MessageLogWriter();
+
+        // thread-safe
+        void append(int64_t time_us, const_svec_ptr const& bytes);
+
+        // write anything still in memory, and wait for it to be written
+        void close();
+
+        uint64_t messagesWritten() const;
+        uint64_t bytesWritten() const;
+        // messages in chunks dropped because too many were waiting to be
+        // written, or because writing them failed
+        uint64_t messagesDropped() const;
+
+    private:
+        struct Chunk{
+            Chunk() : messages(), bytes(0), first_us(0), last_us(0), counts(){ }
+            std::vector< std::pair<int64_t, const_svec_ptr> > messages;
+            uint64_t bytes;
+            int64_t first_us;
+            int64_t last_us;
+            std::map<uint32_t, uint32_t> counts;
+        };
+        void _finishChunk();
+        void _writeChunk(Chunk const& c);
+        void _writeLoop();
+        void _write(void const* data, std::size_t len);
+
+        int m_fd;
+        const std::size_t m_chunk_bytes;
+        const int64_t m_chunk_us;
+        const std::size_t m_max_queued_bytes;
+
+        mutable boost::mutex m_lock;
+        boost::condition_variable m_chunk_ready;
+        boost::condition_variable m_chunk_written;
+        boost::shared_ptr<Chunk> m_current;
+        std::deque< boost::shared_ptr<Chunk> > m_full;
+        // bytes of messages in m_full
+        uint64_t m_queued_bytes;
+        // the last chunk finished was dropped because m_full was full
+        bool m_queue_full;
+        bool m_writing;
+        bool m_closing;
+        uint64_t m_messages_written;
+        uint64_t m_bytes_written;
+        uint64_t m_messages_dropped;
+
+        boost::thread m_write_thread;
+};
+
+/* Reads a log through a read-only memory mapping: messages returned
+ * reference the mapping (which stays mapped for as long as they do), rather
+ * than being copied.
+ */
+class MessageLogReader: boost::noncopyable{
+    public:
+        struct ChunkInfo{
+            uint64_t offset;        // of the first message
+            uint64_t bytes;         // of messages
+            int64_t first_us;
+            int64_t last_us;
+            uint32_t num_messages;
+            std::map<uint32_t, uint32_t> counts;
+        };
+
+        struct Record{
+            int64_t time_us;
+            uint32_t msg_id;
+            const_svec_ptr bytes;
+        };
+
+        explicit MessageLogReader(std::string const& fname);
+
+        std::vector<ChunkInfo> const& chunks() const{ return m_chunks; }
+        int64_t startTime() const;
+        int64_t endTime() const;
+        // false if the end of the log was cut short
+        bool complete() const{ return m_complete; }
+
+        // only return messages with these ids (all messages if empty)
+        void setFilter(std::set<uint32_t> const& msg_ids);
+
+        // position before the first message received at or after time_us
+        void seek(int64_t time_us);
+
+        // the next message (that passes the filter), if there is one
+        bool next(Record& r);
+
+    private:
+        bool _chunkPassesFilter(ChunkInfo const& c) const;
+        // the header of the message at offset (in the current chunk)
+        void _readMessage(uint64_t offset, Record& r, uint64_t& next_offset) const;
+
+        boost::shared_ptr<const void> m_mapping;
+        byte const* m_data;
+        uint64_t m_size;
+        bool m_complete;
+
+        std::vector<ChunkInfo> m_chunks;
+        std::set<uint32_t> m_filter;
+
+        std::size_t m_chunk;
+        uint64_t m_offset;
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_MESSAGE_LOG_H__
@@ -0,0 +1,128 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Replays a binary message log (see message_log.h), or lists what's in it.
+//
+// usage: play_messages [-r RATE] [-s SECONDS] [-g GROUP...] mission.mlog
+//        play_messages --list mission.mlog
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <chrono>
+#include <thread>
+
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include <debug/cauv_debug.h>
+#include <common/zeromq/zeromq_mailbox.h>
+#include <generated/groupmap.h>
+#include <generated/types/message_type.h>
+
+#include "message_log.h"
+
+using namespace cauv;
+namespace po = boost::program_options;
+
+typedef std::chrono::steady_clock play_clock_t;
+
+static void list(MessageLogReader const& log){
+    std::map<uint32_t, uint64_t> counts;
+    uint64_t bytes = 0;
+    for(std::size_t i = 0; i < log.chunks().size(); i++){
+        MessageLogReader::ChunkInfo const& c = log.chunks()[i];
+        bytes += c.bytes;
+        for(std::map<uint32_t, uint32_t>::const_iterator j = c.counts.begin(); j != c.counts.end(); j++)
+            counts[j->first] += j->second;
+    }
+    std::cout << log.chunks().size() << " chunks, " << bytes << " bytes, "
+              << (log.endTime() - log.startTime()) / 1e6 << " seconds"
+              << (log.complete()? "" : " (incomplete)") << "\n";
+    for(std::map<uint32_t, uint64_t>::const_iterator i = counts.begin(); i != counts.end(); i++)
+        std::cout << "  " << MessageType::e(i->first) << " (" << i->first << "): " << i->second << "\n";
+    std::cout << std::flush;
+}
+
+int main(int argc, char** argv){
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "print this help message")
+        ("log", po::value<std::string>(), "log file to play")
+        ("list,l", "list what's in the log, instead of playing it")
+        ("rate,r", po::value<float>()->default_value(1),
+            "playback speed relative to real time (0 to send messages as fast as possible)")
+        ("start,s", po::value<float>()->default_value(0), "seconds into the log to start from")
+        ("group,g", po::value< std::vector<std::string> >(),
+            "only play messages in this group (repeat for more)")
+        ("wait,w", po::value<float>()->default_value(1),
+            "seconds to wait for subscriptions from other nodes before playing")
+    ;
+    po::positional_options_description pos;
+    pos.add("log", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+    po::notify(vm);
+
+    if(vm.count("help") || !vm.count("log")){
+        std::cout << "usage: play_messages [options] LOG_FILE\n" << desc << std::flush;
+        return 1;
+    }
+
+    try{
+        MessageLogReader log(vm["log"].as<std::string>());
+        if(vm.count("list")){
+            list(log);
+            return 0;
+        }
+
+        if(vm.count("group")){
+            const std::vector<std::string> groups = vm["group"].as< std::vector<std::string> >();
+            std::set<uint32_t> ids;
+            for(std::size_t i = 0; i < groups.size(); i++){
+                const std::vector<uint32_t> group_ids = get_ids_for_group(groups[i]);
+                if(group_ids.empty()){
+                    error() << "unknown message group" << groups[i];
+                    return 1;
+                }
+                ids.insert(group_ids.begin(), group_ids.end());
+            }
+            log.setFilter(ids);
+        }
+        const float rate = vm["rate"].as<float>();
+        log.seek(log.startTime() + int64_t(vm["start"].as<float>() * 1e6));
+
+        ZeroMQMailbox mb("play_messages");
+        mb.startMonitoringAsync();
+        boost::this_thread::sleep(boost::posix_time::milliseconds(int(vm["wait"].as<float>() * 1000)));
+
+        MessageLogReader::Record r;
+        uint64_t sent = 0;
+        bool first = true;
+        int64_t log_start_us = 0;
+        play_clock_t::time_point play_start;
+        while(log.next(r)){
+            if(first){
+                log_start_us = r.time_us;
+                play_start = play_clock_t::now();
+                first = false;
+            }else if(rate > 0){
+                const std::chrono::microseconds due((int64_t)((r.time_us - log_start_us) / rate));
+                std::this_thread::sleep_until(play_start + due);
+            }
+            mb.sendBytes(r.bytes, RELIABLE_MSG);
+            sent++;
+        }
+        info() << "played" << sent << "messages";
+        mb.stopMonitoring();
+    }catch(std::exception& e){
+        error() << e.what();
+        return 1;
+    }
+    return 0;
+}
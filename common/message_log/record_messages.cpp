@@ -0,0 +1,107 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Records the messages in some groups to a binary message log (see
+// message_log.h), until interrupted.
+//
+// usage: record_messages -g image -g sonarout -g telemetry mission.mlog
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <signal.h>
+#include <pthread.h>
+
+#include <boost/program_options.hpp>
+
+#include <debug/cauv_debug.h>
+#include <common/zeromq/zeromq_mailbox.h>
+#include <generated/groupmap.h>
+
+#include "message_log.h"
+
+using namespace cauv;
+namespace po = boost::program_options;
+
+struct Recorder{
+    Recorder(MessageLogWriter& log) : log(log){ }
+    void operator()(const_svec_ptr const& bytes) const{
+        const int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+        log.append(now_us, bytes);
+    }
+    MessageLogWriter& log;
+};
+
+int main(int argc, char** argv){
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "print this help message")
+        ("output,o", po::value<std::string>(), "log file to write")
+        ("group,g", po::value< std::vector<std::string> >(), "message group to record (repeat for more)")
+        ("chunk-mb", po::value<float>()->default_value(4),
+            "size of the chunks written at once (the smallest unit the log can be indexed by)")
+        ("chunk-seconds", po::value<float>()->default_value(1),
+            "longest time messages are kept in memory before being written (at most this much "
+            "is lost if the recorder is killed)")
+    ;
+    po::positional_options_description pos;
+    pos.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+    po::notify(vm);
+
+    if(vm.count("help") || !vm.count("output") || !vm.count("group")){
+        std::cout << "usage: record_messages -g GROUP [-g GROUP...] LOG_FILE\n" << desc << std::flush;
+        return 1;
+    }
+    const std::vector<std::string> groups = vm["group"].as< std::vector<std::string> >();
+    for(std::size_t i = 0; i < groups.size(); i++){
+        if(get_ids_for_group(groups[i]).empty()){
+            error() << "unknown message group" << groups[i];
+            return 1;
+        }
+    }
+
+    // the mailbox's threads inherit this, so the signals are only seen by
+    // sigwait, and the log is always closed cleanly
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    try{
+        MessageLogWriter log(
+            vm["output"].as<std::string>(),
+            vm["chunk-mb"].as<float>() * (1 << 20),
+            vm["chunk-seconds"].as<float>() * 1e6
+        );
+        ZeroMQMailbox mb("record_messages");
+        mb.setRawObserver(Recorder(log));
+        for(std::size_t i = 0; i < groups.size(); i++)
+            mb.joinGroup(groups[i]);
+        mb.startMonitoringAsync();
+        info() << "recording to" << vm["output"].as<std::string>();
+
+        int sig = 0;
+        sigwait(&sigs, &sig);
+
+        mb.stopMonitoring();
+        log.close();
+        info() << "recorded" << log.messagesWritten() << "messages,"
+               << log.bytesWritten() << "bytes";
+        if(log.messagesDropped())
+            warning() << log.messagesDropped() << "messages dropped (see above)";
+    }catch(std::exception& e){
+        error() << e.what();
+        return 1;
+    }
+    return 0;
+}
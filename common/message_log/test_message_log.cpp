@@ -0,0 +1,211 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/make_shared.hpp>
+
+#include "message_log.h"
+
+using namespace cauv;
+
+static const char Log_Name[] = "test_message_log.mlog";
+
+// message i: the id, then i, then (i % 13) bytes of i, so that messages have
+// every length mod 8
+static uint32_t messageId(int i){
+    return (i >= 200 && i < 220)? 7 : 9;
+}
+static int64_t messageTime(int i){
+    return 1000 + i * 10;
+}
+static svec_ptr message(int i){
+    svec_ptr b = boost::make_shared<svec_t>(8 + i % 13, byte(i));
+    const uint32_t id = messageId(i);
+    const int32_t n = i;
+    std::memcpy(&(*b)[0], &id, sizeof(id));
+    std::memcpy(&(*b)[4], &n, sizeof(n));
+    return b;
+}
+
+static void checkMessage(MessageLogReader::Record const& r, int i){
+    assert(r.time_us == messageTime(i));
+    assert(r.msg_id == messageId(i));
+    assert(r.bytes.size() == 8u + i % 13);
+    // in place in the mapping, and aligned so that it could be deserialised
+    // in place
+    assert((reinterpret_cast<uintptr_t>(r.bytes.data()) & 7) == 0);
+    int32_t n = 0;
+    std::memcpy(&n, r.bytes.data() + 4, sizeof(n));
+    assert(n == i);
+    for(std::size_t j = 8; j < r.bytes.size(); j++)
+        assert(r.bytes[j] == byte(i));
+}
+
+static void writeLog(int messages){
+    // small chunks, so that there are plenty of them
+    MessageLogWriter w(Log_Name, 1000, 1000000);
+    for(int i = 0; i < messages; i++)
+        w.append(messageTime(i), message(i));
+    w.close();
+    assert(w.messagesWritten() == uint64_t(messages));
+    assert(w.messagesDropped() == 0);
+}
+
+void testRoundTrip(){
+    writeLog(500);
+    MessageLogReader r(Log_Name);
+    assert(r.complete());
+    assert(r.chunks().size() > 10);
+    assert(r.startTime() == messageTime(0));
+    assert(r.endTime() == messageTime(499));
+    MessageLogReader::Record rec;
+    int i = 0;
+    while(r.next(rec))
+        checkMessage(rec, i++);
+    assert(i == 500);
+}
+
+void testSeek(){
+    writeLog(500);
+    MessageLogReader r(Log_Name);
+    // a message part way through a chunk, and a time between messages
+    MessageLogReader::ChunkInfo const& c = r.chunks()[3];
+    assert(c.num_messages > 2);
+    const int i = (c.first_us - messageTime(0)) / 10 + 2;
+    MessageLogReader::Record rec;
+    r.seek(messageTime(i));
+    assert(r.next(rec));
+    checkMessage(rec, i);
+    r.seek(messageTime(i) - 5);
+    assert(r.next(rec));
+    checkMessage(rec, i);
+    // back to the start
+    r.seek(0);
+    assert(r.next(rec));
+    checkMessage(rec, 0);
+    // past the end
+    r.seek(messageTime(500));
+    assert(!r.next(rec));
+}
+
+void testFilter(){
+    writeLog(500);
+    MessageLogReader r(Log_Name);
+    // id 7 is only in a few chunks: the others are skipped by their index
+    int chunks_with_id = 0;
+    for(std::size_t i = 0; i < r.chunks().size(); i++)
+        chunks_with_id += r.chunks()[i].counts.count(7);
+    assert(chunks_with_id > 0 && chunks_with_id < int(r.chunks().size()) / 2);
+
+    std::set<uint32_t> ids;
+    ids.insert(7);
+    r.setFilter(ids);
+    MessageLogReader::Record rec;
+    int i = 200;
+    while(r.next(rec))
+        checkMessage(rec, i++);
+    assert(i == 220);
+
+    // seeking into the middle of them
+    r.seek(messageTime(210));
+    assert(r.next(rec));
+    checkMessage(rec, 210);
+}
+
+void testTruncated(){
+    writeLog(500);
+    MessageLogReader whole(Log_Name);
+    const MessageLogReader::ChunkInfo last = whole.chunks().back();
+    const std::size_t chunks = whole.chunks().size();
+    // cut the last chunk short
+    assert(::truncate(Log_Name, last.offset + last.bytes / 2) == 0);
+
+    MessageLogReader r(Log_Name);
+    assert(!r.complete());
+    assert(r.chunks().size() == chunks - 1);
+    MessageLogReader::Record rec;
+    int i = 0;
+    while(r.next(rec))
+        checkMessage(rec, i++);
+    assert(i == 500 - int(last.num_messages));
+}
+
+// However far behind the disk is, every message is either written or counted
+// as dropped
+void testBoundedQueue(){
+    const int Messages = 20000;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    {
+        MessageLogWriter w(Log_Name, 1000, 1000000, 2000);
+        for(int i = 0; i < Messages; i++)
+            w.append(messageTime(i), message(i));
+        w.close();
+        written = w.messagesWritten();
+        dropped = w.messagesDropped();
+    }
+    assert(written + dropped == uint64_t(Messages));
+    MessageLogReader r(Log_Name);
+    assert(r.complete());
+    MessageLogReader::Record rec;
+    uint64_t read = 0;
+    int64_t last_us = 0;
+    while(r.next(rec)){
+        assert(rec.time_us > last_us);
+        last_us = rec.time_us;
+        read++;
+    }
+    assert(read == written);
+}
+
+static int openFds(){
+    int n = 0;
+    for(int fd = 0; fd < 1024; fd++)
+        if(::fcntl(fd, F_GETFD) != -1)
+            n++;
+    return n;
+}
+
+// Writers that can't be created throw, without leaking the file
+void testBadWriters(){
+    bool thrown = false;
+    try{
+        MessageLogWriter w(Log_Name, 1000, 0);
+    }catch(message_log_error&){
+        thrown = true;
+    }
+    assert(thrown);
+
+    // (writing the file header fails)
+    const int fds = openFds();
+    thrown = false;
+    try{
+        MessageLogWriter w("/dev/full");
+    }catch(message_log_error&){
+        thrown = true;
+    }
+    assert(thrown);
+    assert(openFds() == fds);
+}
+
+int main(){
+    testRoundTrip();
+    testSeek();
+    testFilter();
+    testTruncated();
+    testBoundedQueue();
+    testBadWriters();
+    std::remove(Log_Name);
+    std::cout << "PASS" << std::endl;
+    return 0;
+}
@@ -104,6 +104,16 @@ void cauv::serialise(svec_ptr p, BaseImage const& v) {
     serialise(p, v.id());
 }
 
+uint32_t cauv::serialisedSize(BaseImage const& v) {
+    return serialisedSize(v.m_compress_fmt) +
+           serialisedSize(v.serializeQuality()) +
+           serialisedSize(v.channels()) +
+           serialisedSize(v.encodedBytes()) +
+           serialisedSize(v.private_bytes()) +
+           serialisedSize(v.ts()) +
+           serialisedSize(v.id());
+}
+
 //do nothing
 std::string cauv::chil(BaseImage const& v) {
     svec_ptr p = boost::make_shared<svec_t>();
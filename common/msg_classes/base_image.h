@@ -17,6 +17,7 @@ namespace cauv {
 class BaseImage {
     friend void serialise(svec_ptr, BaseImage const&);
     friend int32_t deserialise(const_svec_ptr, uint32_t i, BaseImage&);
+    friend uint32_t serialisedSize(BaseImage const&);
     public:
     BaseImage(void);
     BaseImage(svec_t const &bytes);
@@ -66,6 +67,9 @@ class BaseImage {
 /* image serialisation */
 void serialise(svec_ptr p, BaseImage const& v);
 int32_t deserialise(const_svec_ptr p, uint32_t i, BaseImage& v);
+/* NB: derived classes may only encode their image data when serialised, in
+ * which case this doesn't include it */
+uint32_t serialisedSize(BaseImage const& v);
 std::string chil(BaseImage const&);
 
 template<typename charT, typename traits>
@@ -69,6 +69,46 @@ struct clone: boost::static_visitor<cauv::augmented_mat_t>{
         return r.clone();
     }
 };
+struct cloneIntoPool: boost::static_visitor<cauv::augmented_mat_t>{
+    cloneIntoPool(ImageBufferPool& pool) : pool(pool){ }
+    cauv::augmented_mat_t operator()(cv::Mat const& a) const{
+        return pool.clone(a);
+    }
+    cauv::augmented_mat_t operator()(NonUniformPolarMat const& a) const{
+        NonUniformPolarMat r;
+        r.mat = pool.clone(a.mat);
+        r.ranges = boost::make_shared< std::vector<float> >(*a.ranges);
+        r.bearings = boost::make_shared< std::vector<float> >(*a.bearings);
+        return r;
+    }
+    cauv::augmented_mat_t operator()(PyramidMat const& a) const{
+        PyramidMat r;
+        r.levels.reserve(a.levels.size());
+        for(cv::Mat const& m : a.levels)
+            r.levels.push_back(pool.clone(m));
+        return r;
+    }
+    ImageBufferPool& pool;
+};
+struct isUnique: boost::static_visitor<bool>{
+    bool operator()(cv::Mat const& a) const{
+        // a cv::Mat wrapping data it doesn't own (e.g. camera shared memory)
+        // has no refcount, and whatever does own the data might still be
+        // using it, so it's never unique (unless it has no data at all)
+        if(!a.refcount)
+            return !a.data;
+        return *a.refcount <= 1;
+    }
+    bool operator()(NonUniformPolarMat const& a) const{
+        return operator()(a.mat);
+    }
+    bool operator()(PyramidMat const& a) const{
+        for(cv::Mat const& m : a.levels)
+            if(!operator()(m))
+                return false;
+        return true;
+    }
+};
 // used for serialising
 // !!! TODO: serialise everything
 struct getPrincipalMat: boost::static_visitor<cv::Mat>{
@@ -102,22 +142,22 @@ struct getImageSizeInBits: boost::static_visitor<float>{
 } // namespace cauv
 
 cauv::Image::Image()
-    : m_img() 
+    : m_img(), m_copy_on_write(false)
 {
 }
 
 cauv::Image::Image(augmented_mat_t const& img)
-    : m_img(img)
+    : m_img(img), m_copy_on_write(false)
 {
 }
 
 cauv::Image::Image(augmented_mat_t const& img, TimeStamp const& ts)
-    : BaseImage(svec_t(), ts), m_img(img) 
+    : BaseImage(svec_t(), ts), m_img(img), m_copy_on_write(false)
 {
 }
 
 cauv::Image::Image(augmented_mat_t const& img, TimeStamp const& ts, UID const& id)
-    : BaseImage(svec_t(), ts, id), m_img(img) 
+    : BaseImage(svec_t(), ts, id), m_img(img), m_copy_on_write(false)
 {
 }
 
@@ -125,13 +165,32 @@ cauv::Image::Image(augmented_mat_t const& img, TimeStamp const& ts, UID const& i
 // UID too.
 cauv::Image::Image(Image const& other)
     : BaseImage(svec_t(), other.ts(), other.id()), 
-      m_img(boost::apply_visitor(cauv::clone(), other.m_img))
+      m_img(boost::apply_visitor(cauv::clone(), other.constAugmentedMat())),
+      m_copy_on_write(false)
+{
+}
+
+cauv::Image::Image(Image const& other, ImageBufferPool& pool)
+    : BaseImage(svec_t(), other.ts(), other.id()), 
+      m_img(boost::apply_visitor(cauv::cloneIntoPool(pool), other.constAugmentedMat())),
+      m_copy_on_write(false)
+{
+}
+
+cauv::Image::Image(Image const& other, CopyOnWrite, image_copy_counter_ptr counter)
+    : BaseImage(svec_t(), other.ts(), other.id()), 
+      m_img(other.constAugmentedMat()),
+      m_copy_on_write(true),
+      m_copy_counter(counter)
 {
 }
 
 // deep copy
 cauv::Image& cauv::Image::operator=(Image const& other) {
-    m_img = boost::apply_visitor(cauv::clone(), other.m_img);
+    augmented_mat_t img = boost::apply_visitor(cauv::clone(), other.constAugmentedMat());
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
+    m_img = img;
+    m_copy_on_write = false;
     m_ts = other.m_ts;
     m_compress_fmt = other.m_compress_fmt;
     return *this;
@@ -140,24 +199,68 @@ cauv::Image& cauv::Image::operator=(Image const& other) {
 cauv::Image::~Image(){
 }
 
+void cauv::Image::_ensureWritable() const{
+    if(!m_copy_on_write)
+        return;
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
+    if(!m_copy_on_write)
+        return;
+    // if everything else sharing the data has gone away since this image
+    // was created, then there's no need to copy it
+    if(!boost::apply_visitor(isUnique(), m_img)){
+        m_img = boost::apply_visitor(cauv::cloneIntoPool(ImageBufferPool::get()), m_img);
+        if(m_copy_counter){
+            m_copy_counter->copies++;
+            m_copy_counter->bytes += uint64_t(boost::apply_visitor(getImageSizeInBits(), m_img)) / 8;
+        }
+    }
+    m_copy_on_write = false;
+}
 
 cv::Mat cauv::Image::mat() const {
+    _ensureWritable();
     // will throw if this isn't the right type
     return boost::get<cv::Mat>(m_img);
 }
 
 void cauv::Image::mat(cv::Mat const& mat) {
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
     // will wipe out any augmented stuff
     m_img = mat;
+    m_copy_on_write = false;
 }
 
 
 cauv::augmented_mat_t cauv::Image::augmentedMat() const{
+    _ensureWritable();
     return m_img;
 }
 
 void cauv::Image::augmentedMat(augmented_mat_t const& m){
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
     m_img = m;
+    m_copy_on_write = false;
+}
+
+cv::Mat cauv::Image::constMat() const{
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
+    // will throw if this isn't the right type
+    return boost::get<cv::Mat>(m_img);
+}
+
+cauv::augmented_mat_t cauv::Image::constAugmentedMat() const{
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
+    return m_img;
+}
+
+bool cauv::Image::unique() const{
+    // (not via constAugmentedMat(): the copy it returns would be counted)
+    boost::lock_guard<boost::mutex> l(m_cow_lock);
+    return boost::apply_visitor(isUnique(), m_img);
+}
+
+bool cauv::Image::copyOnWrite() const{
+    return m_copy_on_write;
 }
 
 float cauv::Image::bits() const{
@@ -7,15 +7,19 @@
 #ifndef __CAUV_IMAGE_H__
 #define __CAUV_IMAGE_H__
 
+#include <atomic>
+
 #include <boost/cstdint.hpp>
 #include <boost/variant.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <opencv2/core/core.hpp>
 
 #include <debug/cauv_debug.h>
 
 #include "base_image.h"
+#include "image_pool.h"
 
 namespace cauv{
 
@@ -132,18 +136,37 @@ struct FuncVisitor<Func,cv::Mat> : boost::static_visitor<augmented_mat_t>{
         Func func;
 };
 
+// Counts the deep copies made when copy-on-write images are written to
+struct ImageCopyCounter{
+    ImageCopyCounter() : copies(0), bytes(0){ }
+    std::atomic<uint64_t> copies;
+    std::atomic<uint64_t> bytes;
+};
+typedef boost::shared_ptr<ImageCopyCounter> image_copy_counter_ptr;
+
 class Image : public BaseImage {
     public:
+        struct CopyOnWrite{ };
+
         Image();
         Image(augmented_mat_t const& augmented_image);
         Image(augmented_mat_t const& augmented_image, TimeStamp const& ts);
         Image(augmented_mat_t const& augmented_image, TimeStamp const& ts, UID const& id);
         Image(Image const& other);
+        // deep copy, with the image data copied into buffers from pool
+        Image(Image const& other, ImageBufferPool& pool);
+        // shallow copy sharing the image data of other: the data is deep
+        // copied (into buffers from the ImageBufferPool) the first time that
+        // it might be written to, if it is still shared at that point. The
+        // size and number of copies made are added to counter, if provided.
+        Image(Image const& other, CopyOnWrite, image_copy_counter_ptr counter = image_copy_counter_ptr());
         Image& operator=(Image const& other);
         ~Image();
 
         // Nodes that wish to support pyramid images (not implemented yet), or
         // polar images should use only the augmentedMat functions
+        // NB: the data returned by these may be written to: for
+        // copy-on-write images they make the copy.
         cv::Mat mat() const;
         void mat(cv::Mat const& mat);
         
@@ -152,6 +175,16 @@ class Image : public BaseImage {
         // fact
         augmented_mat_t augmentedMat() const;
         void augmentedMat(augmented_mat_t const& mat);
+
+        // Read-only access: the returned data must not be written to, but
+        // this never triggers a copy of a copy-on-write image
+        cv::Mat constMat() const;
+        augmented_mat_t constAugmentedMat() const;
+
+        // true if nothing else refers to this image's data
+        bool unique() const;
+        // true if this image's data is still shared copy-on-write
+        bool copyOnWrite() const;
         
         // return by value: the compiler will optimise this to a move
         virtual svec_t encodeBytes() const;
@@ -165,23 +198,50 @@ class Image : public BaseImage {
         template<typename Func>
         typename FuncVisitor<Func, typename Func::result_type>::result_type apply(const Func& func)
         {
+            _ensureWritable();
             return boost::apply_visitor(FuncVisitor<Func, typename Func::result_type>(func), m_img);
         }
 
         template<typename TRet, typename Func>
         TRet apply(const Func& func)
         {
+            _ensureWritable();
             return boost::apply_visitor(FuncVisitor<Func, TRet>(func), m_img);
         }
 
         template<typename Visitor>
         typename Visitor::result_type apply_visitor(const Visitor& visitor)
         {
+            _ensureWritable();
             return boost::apply_visitor(visitor, m_img);
         }
 
+        // As apply(), for functions that only read the image data
+        template<typename Func>
+        typename FuncVisitor<Func, typename Func::result_type>::result_type constApply(const Func& func) const
+        {
+            augmented_mat_t img = constAugmentedMat();
+            return boost::apply_visitor(FuncVisitor<Func, typename Func::result_type>(func), img);
+        }
+
+        // As apply_visitor(), for visitors that only read the image data
+        template<typename Visitor>
+        typename Visitor::result_type constApplyVisitor(const Visitor& visitor) const
+        {
+            augmented_mat_t img = constAugmentedMat();
+            return boost::apply_visitor(visitor, img);
+        }
+
     private:
-        augmented_mat_t m_img;
+        void _ensureWritable() const;
+
+        mutable augmented_mat_t m_img;
+
+        // copy-on-write state: m_copy_on_write is only ever cleared, and only
+        // with m_cow_lock held
+        mutable std::atomic<bool> m_copy_on_write;
+        image_copy_counter_ptr m_copy_counter;
+        mutable boost::mutex m_cow_lock;
 };
 
 } // namespace cauv
@@ -0,0 +1,219 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include "image_pool.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace cauv;
+
+// buffers are laid out as [header][padding][data], with the data aligned to
+// a cache line
+static const size_t Data_Offset = 64;
+static const size_t Default_Max_Idle_Bytes = 256 * 1024 * 1024;
+
+// stats that allocations from this thread are currently attributed to
+static __thread ImageBufferPool::Stats* t_stats = NULL;
+
+struct ImageBufferPool::BufferHeader{
+    size_t size;
+    int refcount;
+};
+
+ImageBufferPool::Stats::Stats()
+    : hits(0), misses(0), bytes_allocated(0){
+}
+
+void ImageBufferPool::Stats::clear(){
+    hits = 0;
+    misses = 0;
+    bytes_allocated = 0;
+}
+
+ImageBufferPool::StatsScope::StatsScope(Stats& stats)
+    : m_previous(t_stats){
+    t_stats = &stats;
+}
+
+ImageBufferPool::StatsScope::~StatsScope(){
+    t_stats = m_previous;
+}
+
+ImageBufferPool& ImageBufferPool::get(){
+    // deliberately leaked: cv::Mats in static objects may be destroyed
+    // after any static pool would have been
+    static ImageBufferPool* the_pool = new ImageBufferPool();
+    return *the_pool;
+}
+
+ImageBufferPool::ImageBufferPool()
+    : m_enabled(true),
+      m_max_idle_bytes(Default_Max_Idle_Bytes),
+      m_free(),
+      m_idle_bytes(0),
+      m_outstanding_bytes(0),
+      m_mux(),
+      m_stats(){
+}
+
+ImageBufferPool::~ImageBufferPool(){
+    trim();
+}
+
+cv::Mat ImageBufferPool::mat(){
+    cv::Mat r;
+    if(m_enabled)
+        r.allocator = this;
+    return r;
+}
+
+cv::Mat ImageBufferPool::mat(cv::Size const& size, int type){
+    cv::Mat r = mat();
+    r.create(size, type);
+    return r;
+}
+
+cv::Mat ImageBufferPool::mat(int rows, int cols, int type){
+    return mat(cv::Size(cols, rows), type);
+}
+
+cv::Mat ImageBufferPool::clone(cv::Mat const& m){
+    cv::Mat r = mat();
+    m.copyTo(r);
+    return r;
+}
+
+void ImageBufferPool::setEnabled(bool enabled){
+    boost::lock_guard<boost::mutex> l(m_mux);
+    m_enabled = enabled;
+    if(!enabled)
+        _trimTo(0);
+}
+
+bool ImageBufferPool::enabled() const{
+    return m_enabled;
+}
+
+void ImageBufferPool::setMaxIdleBytes(size_t bytes){
+    boost::lock_guard<boost::mutex> l(m_mux);
+    m_max_idle_bytes = bytes;
+    _trimTo(bytes);
+}
+
+void ImageBufferPool::trim(){
+    boost::lock_guard<boost::mutex> l(m_mux);
+    _trimTo(0);
+}
+
+ImageBufferPool::Stats const& ImageBufferPool::stats() const{
+    return m_stats;
+}
+
+size_t ImageBufferPool::idleBytes() const{
+    boost::lock_guard<boost::mutex> l(m_mux);
+    return m_idle_bytes;
+}
+
+size_t ImageBufferPool::outstandingBytes() const{
+    return m_outstanding_bytes;
+}
+
+ImageBufferPool::BufferHeader* ImageBufferPool::header(uchar* datastart){
+    return reinterpret_cast<BufferHeader*>(datastart - Data_Offset);
+}
+
+// must be called with m_mux held
+void ImageBufferPool::_trimTo(size_t max_idle_bytes){
+    free_list_map_t::iterator i = m_free.begin();
+    while(m_idle_bytes > max_idle_bytes && i != m_free.end()){
+        while(m_idle_bytes > max_idle_bytes && i->second.size()){
+            m_idle_bytes -= i->first;
+            std::free(i->second.back());
+            i->second.pop_back();
+        }
+        if(i->second.empty())
+            m_free.erase(i++);
+        else
+            ++i;
+    }
+}
+
+void ImageBufferPool::allocate(int dims, const int* sizes, int type, int*& refcount,
+                               uchar*& datastart, uchar*& data, size_t* step){
+    size_t total = CV_ELEM_SIZE(type);
+    for(int i = dims-1; i >= 0; i--){
+        step[i] = total;
+        total *= sizes[i];
+    }
+
+    BufferHeader* h = NULL;
+    if(m_enabled){
+        boost::lock_guard<boost::mutex> l(m_mux);
+        free_list_map_t::iterator i = m_free.find(total);
+        if(i != m_free.end() && i->second.size()){
+            h = i->second.back();
+            i->second.pop_back();
+            m_idle_bytes -= total;
+        }
+    }
+
+    if(h){
+        m_stats.hits++;
+        if(t_stats)
+            t_stats->hits++;
+    }else{
+        void* p = NULL;
+        if(posix_memalign(&p, Data_Offset, Data_Offset + total))
+            throw std::bad_alloc();
+        h = static_cast<BufferHeader*>(p);
+        h->size = total;
+        m_stats.misses++;
+        m_stats.bytes_allocated += total;
+        if(t_stats){
+            t_stats->misses++;
+            t_stats->bytes_allocated += total;
+        }
+    }
+    m_outstanding_bytes += total;
+
+    h->refcount = 1;
+    refcount = &h->refcount;
+    datastart = data = reinterpret_cast<uchar*>(h) + Data_Offset;
+}
+
+void ImageBufferPool::deallocate(int*, uchar* datastart, uchar*){
+    BufferHeader* h = header(datastart);
+    m_outstanding_bytes -= h->size;
+
+    if(m_enabled && h->size <= m_max_idle_bytes){
+        boost::lock_guard<boost::mutex> l(m_mux);
+        const size_t max_idle_bytes = m_max_idle_bytes;
+        if(m_enabled && h->size <= max_idle_bytes){
+            // make room by dropping idle buffers of other sizes first: those
+            // are the ones least likely to be wanted again
+            if(m_idle_bytes + h->size > max_idle_bytes){
+                free_list_map_t::iterator same_size = m_free.find(h->size);
+                std::vector<BufferHeader*> keep;
+                if(same_size != m_free.end())
+                    keep.swap(same_size->second);
+                const size_t keep_bytes = keep.size() * h->size;
+                m_idle_bytes -= keep_bytes;
+                _trimTo(max_idle_bytes > keep_bytes + h->size?
+                        max_idle_bytes - keep_bytes - h->size : 0);
+                m_idle_bytes += keep_bytes;
+                if(keep.size())
+                    m_free[h->size].swap(keep);
+            }
+            if(m_idle_bytes + h->size <= max_idle_bytes){
+                m_free[h->size].push_back(h);
+                m_idle_bytes += h->size;
+                return;
+            }
+        }
+    }
+    std::free(h);
+}
@@ -0,0 +1,130 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_IMAGE_POOL_H__
+#define __CAUV_IMAGE_POOL_H__
+
+#include <map>
+#include <vector>
+#include <atomic>
+#include <ostream>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/utility.hpp>
+
+#include <opencv2/core/core.hpp>
+
+namespace cauv{
+
+/* Recycles the data buffers of cv::Mats.
+ *
+ * The pool is a cv::MatAllocator: any cv::Mat with its allocator set to the
+ * pool (see ImageBufferPool::mat()) takes its buffer from the pool whenever
+ * it's create()d, either directly or as the output of an OpenCV function,
+ * and the buffer goes back to the pool when the last cv::Mat (and so the
+ * last Image) referring to it is released. Buffers are recycled by exact
+ * size in bytes, which for images of a given size and type is what's
+ * wanted.
+ *
+ * Hits and misses are counted globally, and also against whichever
+ * ImageBufferPool::Stats has been bound to the calling thread with a
+ * StatsScope (the image pipeline binds each node's stats while it executes).
+ */
+class ImageBufferPool: public cv::MatAllocator, boost::noncopyable{
+    public:
+        struct Stats{
+            Stats();
+            void clear();
+
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> bytes_allocated;
+        };
+
+        /* Attribute allocations made by this thread to stats while in scope
+         */
+        class StatsScope: boost::noncopyable{
+            public:
+                StatsScope(Stats& stats);
+                ~StatsScope();
+            private:
+                Stats* m_previous;
+        };
+
+        /* The process-wide pool: never destroyed, so that it outlives any
+         * cv::Mat that might still refer to it
+         */
+        static ImageBufferPool& get();
+
+        /* An empty cv::Mat that will allocate from this pool (or with
+         * OpenCV's own allocator, if the pool is disabled) */
+        cv::Mat mat();
+        /* A cv::Mat of the given size and type, allocated from this pool */
+        cv::Mat mat(cv::Size const& size, int type);
+        cv::Mat mat(int rows, int cols, int type);
+        /* Deep copy of m into a buffer from this pool */
+        cv::Mat clone(cv::Mat const& m);
+
+        /* When disabled, new cv::Mats don't use the pool at all, and buffers
+         * that were already allocated from it are freed rather than kept,
+         * for comparison. Enabled by default.
+         */
+        void setEnabled(bool enabled);
+        bool enabled() const;
+
+        /* Upper limit on the total size of idle buffers kept for reuse */
+        void setMaxIdleBytes(size_t bytes);
+
+        /* Free all idle buffers */
+        void trim();
+
+        Stats const& stats() const;
+        size_t idleBytes() const;
+        size_t outstandingBytes() const;
+
+        // cv::MatAllocator
+        virtual void allocate(int dims, const int* sizes, int type, int*& refcount,
+                              uchar*& datastart, uchar*& data, size_t* step);
+        virtual void deallocate(int* refcount, uchar* datastart, uchar* data);
+
+    private:
+        ImageBufferPool();
+        ~ImageBufferPool();
+
+        struct BufferHeader;
+        static BufferHeader* header(uchar* datastart);
+        void _trimTo(size_t max_idle_bytes);
+
+        // both also read without m_mux, as a hint, but only acted on after
+        // being re-read under it
+        std::atomic<bool> m_enabled;
+        std::atomic<size_t> m_max_idle_bytes;
+
+        typedef std::map<size_t, std::vector<BufferHeader*> > free_list_map_t;
+        free_list_map_t m_free;
+        size_t m_idle_bytes;
+        std::atomic<size_t> m_outstanding_bytes;
+        mutable boost::mutex m_mux;
+
+        Stats m_stats;
+};
+
+template<typename char_T, typename traits>
+std::basic_ostream<char_T, traits>& operator<<(
+    std::basic_ostream<char_T, traits>& os, ImageBufferPool::Stats const& s){
+    const uint64_t total = s.hits + s.misses;
+    os << "{ImageBufferPool::Stats hits=" << s.hits
+       << " misses=" << s.misses
+       << " hit rate=" << (total? 100.0 * s.hits / total : 0.0) << "%"
+       << " allocated=" << s.bytes_allocated << " bytes}";
+    return os;
+}
+
+} // namespace cauv
+
+#endif // ndef __CAUV_IMAGE_POOL_H__
+
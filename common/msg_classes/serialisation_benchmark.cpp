@@ -0,0 +1,205 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Times serialisation of the largest messages, reading single fields of
+// them in place, and compares the bulk copy used for arrays of plain data
+// with serialising the same arrays one element at a time.
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/make_shared.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <utility/options.h>
+#include <utility/performance.h>
+#include <utility/serialisation.h>
+#include <generated/types/SonarImageMessage.h>
+#include <generated/types/SetPipelineMessage.h>
+#include <generated/types/GuiImageMessage.h>
+#include <generated/types/LinesMessage.h>
+#include <generated/types/KeyPointsMessage.h>
+
+#include "image.h"
+
+using namespace cauv;
+
+static float frand(){
+    return std::rand() / float(RAND_MAX);
+}
+
+static boost::shared_ptr<SonarImageMessage> makeSonarImage(int beams, int bins){
+    PolarImage img;
+    img.data.resize(beams * bins);
+    for(size_t i = 0; i < img.data.size(); i++)
+        img.data[i] = std::rand() & 0xff;
+    img.encoding = ImageEncodingType::RAW_uint8_1;
+    for(int i = 0; i <= beams; i++)
+        img.bearing_bins.push_back((i - beams/2) * 0x10000);
+    img.rangeStart = 0;
+    img.rangeEnd = 50;
+    img.rangeConversion = 50.0f / bins;
+    return boost::make_shared<SonarImageMessage>(SonarID::Gemini, img);
+}
+
+static boost::shared_ptr<SetPipelineMessage> makeSetPipeline(int nodes){
+    std::map<int32_t, NodeType::e> types;
+    std::map<int32_t, std::map<LocalNodeInput, NodeOutput> > connections;
+    std::map<int32_t, std::map<LocalNodeInput, ParamValue> > params;
+    for(int i = 0; i < nodes; i++){
+        types[i] = NodeType::Copy;
+        LocalNodeInput in("image", -1, InputSchedType::Must_Be_New, std::vector<int32_t>());
+        connections[i][in] = NodeOutput(i-1, "image", OutputType::Image, -1);
+        for(int j = 0; j < 4; j++){
+            LocalNodeInput p(mkStr() << "param " << j, -1, InputSchedType::May_Be_Old, std::vector<int32_t>(3, j));
+            params[i][p] = ParamValue(frand());
+        }
+    }
+    return boost::make_shared<SetPipelineMessage>("benchmark", types, connections, params);
+}
+
+static boost::shared_ptr<GuiImageMessage> makeGuiImage(int w, int h){
+    cv::Mat m(h, w, CV_8UC3);
+    cv::randu(m, cv::Scalar::all(0), cv::Scalar::all(255));
+    return boost::make_shared<GuiImageMessage>(
+        "benchmark", 1, boost::make_shared<Image>(m)
+    );
+}
+
+static boost::shared_ptr<LinesMessage> makeLines(int n){
+    std::vector<Line> lines;
+    for(int i = 0; i < n; i++)
+        lines.push_back(Line(floatXY(frand(), frand()), frand(), frand(), frand()));
+    return boost::make_shared<LinesMessage>("benchmark", "benchmark", lines);
+}
+
+static boost::shared_ptr<KeyPointsMessage> makeKeyPoints(int n){
+    std::vector<KeyPoint> kps;
+    for(int i = 0; i < n; i++)
+        kps.push_back(KeyPoint(floatXY(frand(), frand()), frand(), frand(), frand(), frand(), frand()));
+    return boost::make_shared<KeyPointsMessage>("benchmark", "benchmark", kps);
+}
+
+template<typename M>
+static void timeMessage(std::string const& name, boost::shared_ptr<M> m, int reps){
+    Timer t;
+    size_t bytes = 0;
+    bool exact = true;
+    t.start();
+    for(int i = 0; i < reps; i++){
+        const_svec_ptr b = m->toBytes();
+        bytes = b->size();
+        exact = exact && (m->serialisedSize() == bytes);
+    }
+    const double encode_us = double(t.stop()) / reps;
+
+    const_svec_ptr b = m->toBytes();
+    t.start();
+    for(int i = 0; i < reps; i++){
+        boost::shared_ptr<M> d = M::fromBytes(b);
+        // force deserialisation of every field
+        d->chil();
+    }
+    const double decode_us = double(t.stop()) / reps;
+
+    std::cout << name << "\t" << bytes << "\t" << encode_us << "\t" << decode_us << "\t"
+              << (exact? "yes" : "NO") << std::endl;
+}
+
+// reading a single field of a received message, with the normal accessor
+// (which deserialises the whole message) and with a view
+template<typename M, typename F, typename V>
+static void timeFieldRead(std::string const& name, boost::shared_ptr<M> m, F get, V view, int reps){
+    const_svec_ptr b = m->toBytes();
+    Timer t;
+    t.start();
+    for(int i = 0; i < reps; i++)
+        get(*M::fromBytes(b));
+    const double get_us = double(t.stop()) / reps;
+    t.start();
+    for(int i = 0; i < reps; i++)
+        view(*M::fromBytes(b));
+    const double view_us = double(t.stop()) / reps;
+
+    std::cout << name << "\t" << get_us << "\t" << view_us << "\t" << get_us / view_us << std::endl;
+}
+
+template<typename T>
+static void timeArray(std::string const& name, std::vector<T> const& v, int reps){
+    Timer t;
+    t.start();
+    for(int i = 0; i < reps; i++){
+        svec_ptr p = boost::make_shared<svec_t>();
+        p->reserve(serialisedSize(v));
+        impl::serialiseElements(p, v, std::false_type());
+    }
+    const double elementwise_us = double(t.stop()) / reps;
+    t.start();
+    for(int i = 0; i < reps; i++){
+        svec_ptr p = boost::make_shared<svec_t>();
+        p->reserve(serialisedSize(v));
+        impl::serialiseElements(p, v, is_bulk_serialisable<T>());
+    }
+    const double bulk_us = double(t.stop()) / reps;
+
+    svec_ptr p = boost::make_shared<svec_t>();
+    serialise(p, v);
+    t.start();
+    for(int i = 0; i < reps; i++){
+        std::vector<T> d;
+        deserialise(const_svec_ptr(p), 0, d);
+    }
+    const double decode_us = double(t.stop()) / reps;
+
+    std::cout << name << "\t" << v.size() << "\t" << elementwise_us << "\t" << bulk_us << "\t"
+              << elementwise_us / bulk_us << "\t" << decode_us << std::endl;
+}
+
+int main(int argc, char **argv) {
+    cauv::Options options("Benchmark message serialisation");
+    namespace po = boost::program_options;
+    options.desc.add_options()
+        ("reps,n", po::value<int>()->default_value(200), "Repetitions of each measurement")
+      ;
+    if (options.parseOptions(argc, argv)) {
+        return 0;
+    };
+    const int reps = options.vm["reps"].as<int>();
+
+    std::cout << "message\tbytes\ttoBytes(us)\tfromBytes+read(us)\tsize exact" << std::endl;
+    timeMessage("SonarImage", makeSonarImage(256, 1000), reps);
+    timeMessage("SetPipeline", makeSetPipeline(50), reps);
+    timeMessage("GuiImage", makeGuiImage(640, 480), reps);
+    timeMessage("Lines", makeLines(5000), reps);
+    timeMessage("KeyPoints", makeKeyPoints(5000), reps);
+    std::cout << std::endl;
+
+    boost::shared_ptr<SonarImageMessage> sonar = makeSonarImage(256, 1000);
+    boost::shared_ptr<GuiImageMessage> gui = makeGuiImage(640, 480);
+    std::cout << "field\taccessor(us)\tview(us)\tspeedup" << std::endl;
+    timeFieldRead("SonarImage.source", sonar,
+                  [](SonarImageMessage const& m){ return m.source(); },
+                  [](SonarImageMessage const& m){ return m.view_source(); }, reps);
+    timeFieldRead("SonarImage.image.rangeEnd", sonar,
+                  [](SonarImageMessage const& m){ return m.image().rangeEnd; },
+                  [](SonarImageMessage const& m){ return m.view_image().rangeEnd(); }, reps);
+    timeFieldRead("SonarImage.image.data[0]", sonar,
+                  [](SonarImageMessage const& m){ return m.image().data[0]; },
+                  [](SonarImageMessage const& m){ return m.view_image().data()[0]; }, reps);
+    timeFieldRead("GuiImage.nodeId", gui,
+                  [](GuiImageMessage const& m){ return m.nodeId(); },
+                  [](GuiImageMessage const& m){ return m.view_nodeId(); }, reps);
+    std::cout << std::endl;
+
+    std::cout << "array\tlength\telementwise(us)\tbulk(us)\tspeedup\tdeserialise(us)" << std::endl;
+    timeArray("byte", makeSonarImage(256, 1000)->image().data, reps);
+    timeArray("int32", makeSonarImage(4096, 1)->image().bearing_bins, reps);
+    timeArray("float", std::vector<float>(100000, 1.0f), reps);
+    timeArray("Line", makeLines(5000)->lines(), reps);
+    timeArray("KeyPoint", makeKeyPoints(5000)->keypoints(), reps);
+    return 0;
+}
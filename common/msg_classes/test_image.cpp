@@ -0,0 +1,77 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include <iostream>
+#include <cassert>
+#include <cstring>
+
+#include <boost/make_shared.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include "image.h"
+
+using namespace cauv;
+
+// Two copy-on-write siblings of an image wrapping memory it doesn't own (as
+// the camera server's shared memory is): writing through one must not be
+// seen by the other, or by the owner of the memory
+void testExternalDataIsCopied(){
+    unsigned char data[16*16];
+    std::memset(data, 7, sizeof(data));
+    const Image source(cv::Mat(16, 16, CV_8UC1, data));
+
+    image_copy_counter_ptr counter = boost::make_shared<ImageCopyCounter>();
+    Image a(source, Image::CopyOnWrite(), counter);
+    Image b(source, Image::CopyOnWrite(), counter);
+    assert(!a.unique());
+
+    a.mat().setTo(1);
+    assert(!a.copyOnWrite());
+    assert(counter->copies == 1);
+    assert(counter->bytes == sizeof(data));
+    assert(a.constMat().at<unsigned char>(0, 0) == 1);
+    assert(data[0] == 7);
+    assert(b.constMat().at<unsigned char>(0, 0) == 7);
+    assert(b.copyOnWrite());
+
+    b.mat().setTo(2);
+    assert(counter->copies == 2);
+    assert(data[0] == 7);
+    assert(a.constMat().at<unsigned char>(0, 0) == 1);
+    assert(b.constMat().at<unsigned char>(0, 0) == 2);
+}
+
+// Data shared with other images is copied on the first write, but once
+// nothing else refers to it, writing doesn't need to copy it
+void testRefcountedData(){
+    image_copy_counter_ptr counter = boost::make_shared<ImageCopyCounter>();
+    boost::shared_ptr<Image> source = boost::make_shared<Image>(cv::Mat(16, 16, CV_8UC1, cv::Scalar(7)));
+    Image a(*source, Image::CopyOnWrite(), counter);
+    Image b(*source, Image::CopyOnWrite(), counter);
+
+    // reading never copies
+    assert(a.constMat().at<unsigned char>(0, 0) == 7);
+    assert(counter->copies == 0);
+
+    a.mat().setTo(1);
+    assert(counter->copies == 1);
+    assert(source->constMat().at<unsigned char>(0, 0) == 7);
+    assert(b.constMat().at<unsigned char>(0, 0) == 7);
+
+    source.reset();
+    assert(b.unique());
+    b.mat().setTo(2);
+    assert(counter->copies == 1);
+    assert(b.constMat().at<unsigned char>(0, 0) == 2);
+}
+
+int main(){
+    testExternalDataIsCopied();
+    testRefcountedData();
+    std::cout << "PASS" << std::endl;
+    return 0;
+}
@@ -10,11 +10,14 @@
 #include <dirent.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <time.h>
 
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <cerrno>
 
 #include <boost/make_shared.hpp>
 #include <boost/thread/locks.hpp>
@@ -25,6 +28,8 @@
 #include <debug/cauv_debug.h>
 #include <utility/time.h>
 #include <utility/files.h>
+#include <utility/serialisation.h>
+#include <utility/trace.h>
 
 #include <generated/types/message_type.h>
 #include <generated/types/message.h>
@@ -34,26 +39,45 @@
 
 namespace cauv {
 
+//number of outgoing messages that can be waiting for the monitoring thread
+static const size_t Send_Queue_Capacity = 4096;
+
+//takes the place of the message hash in a frame containing a batch of
+//messages (see ZeroMQMailbox::add_to_batch)
+static const uint32_t Batch_Marker = 0xba7c4ed0;
+
+static inline size_t padded_length(size_t len) {
+    return (len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+}
+
 ZeroMQMailbox::ZeroMQMailbox(const std::string& name) :
     name(name),
     zm_context(),
     pub(zm_context, XS_XPUB),
     sub(zm_context, XS_SUB),
-    send_queue_push(zm_context, XS_PUSH),
-    send_queue_pull(zm_context, XS_PULL),
     sub_queue_push(zm_context, XS_PUSH),
     sub_queue_pull(zm_context, XS_PULL),
     daemon_control(zm_context, XS_REQ),
+    send_queue(Send_Queue_Capacity),
+    send_eventfd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    send_wakeup_pending(false),
+    send_space_mutex(),
+    send_space(),
+    send_space_waiters(0),
+    batch_window_us(0),
+    batch_max_bytes(0),
+    batch_max_message_bytes(0),
     m_monitoring(false),
     m_interrupted(false),
     daemon_connected(false),
     id(boost::uuids::random_generator()()),
     starting_up(true) {
 
-    //internal message queues
-    send_queue_pull.bind("inproc://send_queue");
-    send_queue_push.connect("inproc://send_queue");
+    if (send_eventfd < 0) {
+        error() << "failed to create send queue eventfd:" << strerror(errno);
+    }
 
+    //internal subscription queue
     sub_queue_pull.bind("inproc://sub_queue");
     sub_queue_push.connect("inproc://sub_queue");
 
@@ -104,6 +128,12 @@ ZeroMQMailbox::ZeroMQMailbox(const std::string& name) :
     umask(old_umask);
 }
 
+ZeroMQMailbox::~ZeroMQMailbox() {
+    if (send_eventfd >= 0) {
+        close(send_eventfd);
+    }
+}
+
 static void delete_message_bytes(void *, void *hint) {
 #ifdef CAUV_DEBUG_MESSAGE
     debug(9) << "deleting message bytes shared pointer";
@@ -113,12 +143,12 @@ static void delete_message_bytes(void *, void *hint) {
 }
 
 int ZeroMQMailbox::sendMessage(boost::shared_ptr<const Message> message,
-                                       MessageReliability) {
+                                       MessageReliability reliability) {
     if(m_interrupted) {
         warning() << "Message send to interrupted messagebox!";
         return 0;
     }
-    boost::unique_lock<boost::mutex> pub_lock(m_pub_map_mutex);
+    boost::shared_lock<boost::shared_mutex> pub_lock(m_pub_map_mutex);
     if (!publications.count(message->id()) && !starting_up) {
 #ifdef CAUV_DEBUG_MESSAGE
         debug(6) << "Not sending message because no subscriptions for" << message->id();
@@ -126,16 +156,71 @@ int ZeroMQMailbox::sendMessage(boost::shared_ptr<const Message> message,
         return 0;
     }
     pub_lock.unlock();
-    const_svec_ptr bytes = message->toBytes();
-    void *bytes_shared = reinterpret_cast<void*> (new const_svec_ptr(bytes));
+    trace::Scope send_trace("send", "mailbox");
+    QueuedSend queued;
+    {
+        trace::Scope serialise_trace("serialise", "mailbox");
+        queued.bytes = message->toBytes();
+    }
+    queued.enqueued = send_clock_t::now();
+    return queue_send(queued, reliability);
+}
 
-    //!!! ugly cast to remove constness
-    xs::message_t msg(const_cast<void*>(reinterpret_cast<const void*>(bytes->data())),
-                       bytes->size(), delete_message_bytes, bytes_shared);
+int ZeroMQMailbox::sendBytes(const const_svec_ptr& bytes, MessageReliability reliability) {
+    if(m_interrupted) {
+        warning() << "Message send to interrupted messagebox!";
+        return 0;
+    }
+    if (bytes.size() < sizeof(uint32_t)) {
+        warning() << "Not sending message of" << bytes.size() << "bytes: too short for an id";
+        return 0;
+    }
+    uint32_t msg_id;
+    memcpy(&msg_id, bytes.data(), sizeof(msg_id));
+    boost::shared_lock<boost::shared_mutex> pub_lock(m_pub_map_mutex);
+    if (!publications.count(msg_id) && !starting_up) {
+        return 0;
+    }
+    pub_lock.unlock();
+    trace::Scope send_trace("send", "mailbox");
+    QueuedSend queued;
+    queued.bytes = bytes;
+    queued.enqueued = send_clock_t::now();
+    return queue_send(queued, reliability);
+}
 
-    boost::lock_guard<boost::mutex> lock(m_send_mutex);
-    send_queue_push.send(msg);
-    return bytes->size();
+int ZeroMQMailbox::queue_send(const QueuedSend& queued, MessageReliability reliability) {
+    //queue full: unreliable messages are dropped, reliable ones sleep until
+    //the monitoring thread has made space
+    if (!send_queue.tryPush(queued)) {
+        bool queued_ok = false;
+        if (reliability == RELIABLE_MSG) {
+            boost::unique_lock<boost::mutex> lock(send_space_mutex);
+            send_space_waiters.fetch_add(1);
+            //(pairs with the fence in handle_send_messages: either this
+            //push sees the space made, or the monitoring thread sees this
+            //waiter and notifies)
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!(queued_ok = send_queue.tryPush(queued)) && !m_interrupted) {
+                send_space.timed_wait(lock, boost::posix_time::milliseconds(100));
+            }
+            send_space_waiters.fetch_sub(1);
+        }
+        if (!queued_ok) {
+            boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+            send_stats.dropped++;
+            return 0;
+        }
+    }
+    //only the first sender since the last drain needs to wake the monitoring
+    //thread
+    if (!send_wakeup_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(send_eventfd, &one, sizeof(one)) != sizeof(one)) {
+            error() << "failed to wake mailbox monitoring thread:" << strerror(errno);
+        }
+    }
+    return queued.bytes->size();
 }
 
 int ZeroMQMailbox::sendMessage(boost::shared_ptr<const Message> message,
@@ -298,15 +383,15 @@ void ZeroMQMailbox::send_subscribed_message (const boost::uuids::uuid& node_uuid
     pub.send(buf.c_str(),buf.size());
 }
 
-void ZeroMQMailbox::handle_pub_message (void) {
+bool ZeroMQMailbox::handle_pub_message (void) {
     xs::message_t pub_message;
     if (!pub.recv(&pub_message, XS_DONTWAIT)) {
-        return;
+        return false;
     }
     subscription_vec_t s_vec = parse_subscription_message(
                               std::string(reinterpret_cast<char*>(pub_message.data()), pub_message.size()));
     if (!s_vec.second.size()) {
-        return;
+        return true;
     }
 
     bool is_sub = s_vec.first;
@@ -362,7 +447,7 @@ void ZeroMQMailbox::handle_pub_message (void) {
             break;
         }
         default: {
-            boost::lock_guard<boost::mutex> lock(m_pub_map_mutex);
+            boost::unique_lock<boost::shared_mutex> lock(m_pub_map_mutex);
             if (is_sub) {
                 debug(5) << "remote subscribed to message id" << sub_id;
                 publications.insert(sub_id);
@@ -373,17 +458,21 @@ void ZeroMQMailbox::handle_pub_message (void) {
             break;
         }
     }
+    return true;
 }
 
-void ZeroMQMailbox::handle_sub_message(void) {
-    xs::message_t inc_message;
+bool ZeroMQMailbox::handle_sub_message(void) {
+    //heap allocated so that the received buffer can be handed on to the
+    //message observers without copying it
+    boost::shared_ptr<xs::message_t> inc_msg_ptr = boost::make_shared<xs::message_t>();
+    xs::message_t &inc_message = *inc_msg_ptr;
     if (!sub.recv(&inc_message, XS_DONTWAIT)) {
-        return;
+        return false;
     }
     char *data = reinterpret_cast<char*>(inc_message.data());
     unsigned int len = inc_message.size();
     if (len < sizeof(uint32_t)) {
-        return;
+        return true;
     }
 
     uint32_t msg_id = *reinterpret_cast<uint32_t*>(data);
@@ -394,7 +483,7 @@ void ZeroMQMailbox::handle_sub_message(void) {
             if (pid != (uint32_t)getpid()) {
                 error() << "received connect message not intended for this pid!";
                 error() << "message intended for pid" << pid;
-                return;
+                return true;
             }
             std::string connect_str(data + sizeof(uint32_t) * 2, inc_message.size() - sizeof(uint32_t) * 2);
             debug(3) << "connecting to" << connect_str;
@@ -413,27 +502,247 @@ void ZeroMQMailbox::handle_sub_message(void) {
             break;
         }
         default: {
-            byte *dataptr = reinterpret_cast<byte*>(inc_message.data());
-            //!!! Seems like the copy involved here could be avoided somehow...
-            notifyObservers(boost::make_shared<const svec_t>(dataptr,dataptr + inc_message.size()));
+            const byte *dataptr = reinterpret_cast<const byte*>(data);
+            uint32_t marker = 0;
+            if (len >= 2 * sizeof(uint32_t)) {
+                memcpy(&marker, dataptr + sizeof(uint32_t), sizeof(marker));
+            }
+            if (marker == Batch_Marker) {
+                unpack_batch(msg_id, dataptr, len, inc_msg_ptr);
+            } else {
+                deliver_message(msg_id, dataptr, len, inc_msg_ptr);
+            }
             break;
         }
     }
+    return true;
+}
+
+void ZeroMQMailbox::deliver_message(uint32_t msg_id, const byte *data, uint32_t len,
+                                    const boost::shared_ptr<xs::message_t>& owner) {
+    //the deserialisers read fields in place, so only messages whose
+    //data isn't suitably aligned (very small messages are stored
+    //inline in the xs message) need to be copied out
+    bool copy = reinterpret_cast<uintptr_t>(data) % sizeof(uint32_t) != 0;
+    {
+        boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+        ReceiveStats &stats = receive_stats[msg_id];
+        stats.messages++;
+        stats.bytes += len;
+        if (copy) {
+            stats.bytes_copied += len;
+        }
+    }
+    trace::Scope receive_trace("receive", "mailbox");
+    const_svec_ptr bytes;
+    if (copy) {
+        bytes = boost::make_shared<const svec_t>(data, data + len);
+    } else {
+        bytes = const_svec_ptr(data, len, owner);
+    }
+    if (raw_observer) {
+        raw_observer(bytes);
+    }
+    notifyObservers(bytes);
+}
+
+void ZeroMQMailbox::setRawObserver(const raw_observer_t& observer) {
+    raw_observer = observer;
+}
+
+void ZeroMQMailbox::unpack_batch(uint32_t msg_id, const byte *data, uint32_t len,
+                                 const boost::shared_ptr<xs::message_t>& owner) {
+    uint32_t offset = 2 * sizeof(uint32_t);
+    while (offset + sizeof(uint32_t) <= len) {
+        uint32_t msg_len;
+        memcpy(&msg_len, data + offset, sizeof(msg_len));
+        offset += sizeof(uint32_t);
+        if (msg_len > len - offset) {
+            warning() << "truncated message batch for id" << msg_id;
+            return;
+        }
+        deliver_message(msg_id, data + offset, msg_len, owner);
+        offset += padded_length(msg_len);
+    }
+}
+
+ZeroMQMailbox::receive_stats_t ZeroMQMailbox::receiveStats(void) const {
+    boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+    return receive_stats;
+}
 
+ZeroMQMailbox::SendStats ZeroMQMailbox::sendStats(void) const {
+    boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+    return send_stats;
 }
 
-void ZeroMQMailbox::handle_send_message(void) {
-    xs::message_t ptr_message;
-    send_queue_pull.recv(&ptr_message);
+void ZeroMQMailbox::log_receive_stats(void) {
+    boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+    BOOST_FOREACH(const receive_stats_t::value_type &s, receive_stats) {
+        debug(2) << "message id" << s.first << ":"
+                 << s.second.messages << "messages,"
+                 << s.second.bytes << "bytes received,"
+                 << s.second.bytes_copied << "bytes copied";
+    }
+}
+
+void ZeroMQMailbox::handle_send_messages(void) {
+    uint64_t wakeups;
+    if (read(send_eventfd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        error() << "failed to read send queue eventfd:" << strerror(errno);
+    }
+    //cleared before draining, so a message queued after this point will
+    //always cause another wakeup
+    send_wakeup_pending = false;
+    {
+        boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+        send_stats.queue_depth.add(send_queue.size());
+    }
+    QueuedSend queued;
+    while (send_queue.tryPop(queued)) {
+        uint32_t msg_id = 0;
+        if (queued.bytes->size() >= sizeof(uint32_t)) {
+            memcpy(&msg_id, queued.bytes->data(), sizeof(msg_id));
+        }
+        if (!batch_window_us || queued.bytes->size() > batch_max_message_bytes ||
+                queued.bytes->size() < sizeof(uint32_t)) {
+            if (batch_window_us) {
+                //keep messages of the same type in order
+                flush_batch(msg_id);
+            }
+            send_frame(queued.bytes);
+            record_send_latency(queued.enqueued);
+        } else {
+            add_to_batch(msg_id, queued);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (send_space_waiters.load()) {
+        boost::lock_guard<boost::mutex> lock(send_space_mutex);
+        send_space.notify_all();
+    }
+}
+
+void ZeroMQMailbox::send_frame(const const_svec_ptr& bytes) {
 #ifdef CAUV_DEBUG_MESSAGES
     debug(6) << "sending message";
 #endif
-    pub.send(ptr_message);
+    trace::Scope publish_trace("publish", "mailbox");
+    void *bytes_shared = reinterpret_cast<void*> (new const_svec_ptr(bytes));
+    //!!! ugly cast to remove constness
+    xs::message_t msg(const_cast<void*>(reinterpret_cast<const void*>(bytes->data())),
+                      bytes->size(), delete_message_bytes, bytes_shared);
+    pub.send(msg);
+}
+
+void ZeroMQMailbox::record_send_latency(send_clock_t::time_point enqueued) {
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            send_clock_t::now() - enqueued).count();
+    boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+    send_stats.latency_us.add(latency);
+}
+
+void ZeroMQMailbox::setBatching(unsigned int window_us, size_t max_batch_bytes,
+                                size_t max_message_bytes) {
+    if (m_monitoring) {
+        error() << "message batching must be configured before monitoring starts";
+        return;
+    }
+    batch_window_us = window_us;
+    batch_max_bytes = max_batch_bytes;
+    batch_max_message_bytes = max_message_bytes;
+    if (batch_window_us) {
+        debug() << "batching messages up to" << max_message_bytes << "bytes within"
+                << window_us << "us into frames of up to" << max_batch_bytes << "bytes";
+    }
+}
+
+//batch frames are laid out as:
+// message id (so that subscription filtering still works)
+// Batch_Marker (in place of the message hash)
+// for each message: length, message bytes, padding to a 4 byte boundary
+void ZeroMQMailbox::add_to_batch(uint32_t msg_id, const QueuedSend& queued) {
+    const size_t added = sizeof(uint32_t) + padded_length(queued.bytes->size());
+    std::map<uint32_t, PendingBatch>::iterator i = pending_batches.find(msg_id);
+    if (i != pending_batches.end() && batch_size(i->second) + added > batch_max_bytes) {
+        flush_batch(msg_id);
+    }
+    PendingBatch &batch = pending_batches[msg_id];
+    if (batch.enqueued.empty()) {
+        //sent as-is if nothing joins it before the window closes
+        batch.first = queued.bytes;
+    } else {
+        if (!batch.frame) {
+            batch.frame = boost::make_shared<svec_t>();
+            batch.frame->reserve(batch_max_bytes);
+            serialise(batch.frame, msg_id);
+            serialise(batch.frame, Batch_Marker);
+            append_to_frame(batch.frame, batch.first);
+            batch.first.reset();
+        }
+        append_to_frame(batch.frame, queued.bytes);
+    }
+    batch.enqueued.push_back(queued.enqueued);
+}
+
+void ZeroMQMailbox::append_to_frame(const svec_ptr& frame, const const_svec_ptr& bytes) {
+    serialise(frame, uint32_t(bytes->size()));
+    frame->insert(frame->end(), bytes->begin(), bytes->end());
+    frame->resize(frame->size() + padded_length(bytes->size()) - bytes->size(), 0);
+}
+
+size_t ZeroMQMailbox::batch_size(const PendingBatch& batch) {
+    if (batch.frame) {
+        return batch.frame->size();
+    }
+    return 2 * sizeof(uint32_t) + sizeof(uint32_t) + padded_length(batch.first->size());
+}
+
+void ZeroMQMailbox::flush_batch(uint32_t msg_id) {
+    std::map<uint32_t, PendingBatch>::iterator i = pending_batches.find(msg_id);
+    if (i == pending_batches.end()) {
+        return;
+    }
+    PendingBatch &batch = i->second;
+    if (batch.frame) {
+        send_frame(batch.frame);
+    } else if (batch.first) {
+        send_frame(batch.first);
+    }
+    BOOST_FOREACH(const send_clock_t::time_point &t, batch.enqueued) {
+        record_send_latency(t);
+    }
+    pending_batches.erase(i);
+}
+
+int ZeroMQMailbox::flush_due_batches(bool flush_all) {
+    //returns the time in ms until the next batch is due, or -1 if there are
+    //none pending
+    int next_due_ms = -1;
+    const send_clock_t::time_point now = send_clock_t::now();
+    std::map<uint32_t, PendingBatch>::iterator i = pending_batches.begin();
+    while (i != pending_batches.end()) {
+        uint32_t msg_id = i->first;
+        int64_t age_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                now - i->second.enqueued.front()).count();
+        ++i;
+        if (flush_all || age_us >= batch_window_us) {
+            flush_batch(msg_id);
+        } else {
+            int due_ms = (batch_window_us - age_us + 999) / 1000;
+            if (next_due_ms < 0 || due_ms < next_due_ms) {
+                next_due_ms = due_ms;
+            }
+        }
+    }
+    return next_due_ms;
 }
 
-void ZeroMQMailbox::handle_subscription_message(void) {
+bool ZeroMQMailbox::handle_subscription_message(void) {
     SubscriptionMessage sub_msg;
-    sub_queue_pull.recv(&sub_msg, sizeof(sub_msg));
+    if (!sub_queue_pull.recv(&sub_msg, sizeof(sub_msg), XS_DONTWAIT)) {
+        return false;
+    }
     if (sub_msg.subscribe) {
         debug(2) << "subscribing to message id" << sub_msg.msg_id;
         if (subscriptions[sub_msg.msg_id] == 0) {
@@ -460,6 +769,7 @@ void ZeroMQMailbox::handle_subscription_message(void) {
             sub.setsockopt(XS_UNSUBSCRIBE,&sub_msg.msg_id, sizeof(sub_msg.msg_id));
         }
     }
+    return true;
 }
 
 void ZeroMQMailbox::handle_daemon_message(void) {
@@ -482,8 +792,8 @@ void ZeroMQMailbox::doMonitoring(void) {
         { sub,
           0, XS_POLLIN, 0
         },
-        { send_queue_pull,
-          0, 0, 0
+        { NULL,
+          send_eventfd, 0, 0
         },
         { daemon_control,
           0, XS_POLLIN, 0
@@ -493,8 +803,14 @@ void ZeroMQMailbox::doMonitoring(void) {
     int timeout = 50;
     const TimeStamp start_time = now();
     while (!m_interrupted || starting_up) {
+        //wake up in time to send any pending message batches
+        int poll_timeout = timeout;
+        int batch_due_ms = flush_due_batches(false);
+        if (batch_due_ms >= 0 && batch_due_ms < poll_timeout) {
+            poll_timeout = batch_due_ms;
+        }
         //use C API for this part because it's simpler
-        int rc = xs_poll(sockets, sizeof(sockets)/sizeof(xs::pollitem_t), timeout);
+        int rc = xs_poll(sockets, sizeof(sockets)/sizeof(xs::pollitem_t), poll_timeout);
         if (starting_up) {
             if ((send_connect_pids.empty() && daemon_connected) || millisecondsSince(start_time) > 200) {
                 if (!send_connect_pids.empty()) {
@@ -532,15 +848,18 @@ void ZeroMQMailbox::doMonitoring(void) {
         // sending messages
         //
         //This gives the greatest chance that all is in order before sending
-        //messages
+        //messages. Everything that is ready is handled on each wakeup.
         if (sockets[0].revents & XS_POLLIN) {
-            handle_pub_message();
-        } else if (sockets[1].revents & XS_POLLIN) {
-            handle_subscription_message();
-        } else if (sockets[2].revents & XS_POLLIN) {
-            handle_sub_message();
-        } else if (sockets[3].revents & XS_POLLIN) {
-            handle_send_message();
+            while (handle_pub_message());
+        }
+        if (sockets[1].revents & XS_POLLIN) {
+            while (handle_subscription_message());
+        }
+        if (sockets[2].revents & XS_POLLIN) {
+            while (handle_sub_message());
+        }
+        if (sockets[3].revents & XS_POLLIN) {
+            handle_send_messages();
         }
 
         if (sockets[4].revents & XS_POLLIN) {
@@ -549,17 +868,26 @@ void ZeroMQMailbox::doMonitoring(void) {
     }
     debug() << "Finishing sending messages";
     xs::pollitem_t send_poll = {
-        send_queue_pull,
-        0, XS_POLLIN, 0 };
+        NULL,
+        send_eventfd, XS_POLLIN, 0 };
+    handle_send_messages();
     while (true) {
         int rc = xs_poll(&send_poll,1,100);
         if (rc <= 0) {
             break;
         } else {
-            handle_send_message();
+            handle_send_messages();
         }
     }
+    flush_due_batches(true);
     m_monitoring = false;
+    log_receive_stats();
+    {
+        boost::lock_guard<boost::mutex> lock(m_stats_mutex);
+        debug(2) << "send queue depth:" << send_stats.queue_depth;
+        debug(2) << "send latency (us):" << send_stats.latency_us;
+        debug(2) << "messages dropped from full send queue:" << send_stats.dropped;
+    }
     debug() << "Mailbox stopped monitoring";
 }
 
@@ -10,11 +10,15 @@
 #include <map>
 #include <vector>
 #include <set>
+#include <atomic>
+#include <chrono>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/uuid/uuid.hpp>
 
 #include <xs.hpp>
@@ -24,12 +28,15 @@
 #include <generated/types/message_type.h>
 #include <generated/message_observers.h>
 #include <utility/threadsafe-observable.h>
+#include <utility/mpsc_queue.h>
+#include <utility/histogram.h>
 
 namespace cauv {
 
 class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public MessageSource, public Observable<SubscribeObserver>,  boost::noncopyable {
     public:
     ZeroMQMailbox(const std::string& name = "unknown");
+    virtual ~ZeroMQMailbox();
     /**
      * @return The number of bytes sent
      */
@@ -41,6 +48,11 @@ class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public Message
     virtual int sendMessage(boost::shared_ptr<const Message> message, MessageReliability,
                     const std::string &destinationGroup);
 
+    //send the serialised bytes of a message (from Message::toBytes()) as
+    //sendMessage would, for replaying recorded messages without
+    //deserialising them
+    int sendBytes(const const_svec_ptr& bytes, MessageReliability);
+
     virtual void joinGroup(const std::string& groupName);
     virtual void leaveGroup(const std::string& groupName);
     virtual void subMessage(const Message &message);
@@ -59,6 +71,44 @@ class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public Message
     virtual void removeSubscribeObserver(boost::shared_ptr<SubscribeObserver>);
     virtual void clearSubscribeObservers();
 
+    //per message type counts of what has been received, and how much of it
+    //had to be copied rather than being deserialised in place
+    struct ReceiveStats {
+        ReceiveStats() : messages(0), bytes(0), bytes_copied(0) { }
+        uint64_t messages;
+        uint64_t bytes;
+        uint64_t bytes_copied;
+    };
+    typedef std::map<uint32_t, ReceiveStats> receive_stats_t;
+    receive_stats_t receiveStats() const;
+
+    //depth of the send queue at each drain, and time in microseconds from
+    //sendMessage() to the message being handed to the pub socket
+    struct SendStats {
+        SendStats() : dropped(0) { }
+        Log2Histogram queue_depth;
+        Log2Histogram latency_us;
+        uint64_t dropped;
+    };
+    SendStats sendStats() const;
+
+    //Opt-in coalescing of small messages: messages of up to
+    //max_message_bytes sent within window_us of the first one of the same
+    //type are packed into a single frame of at most max_batch_bytes.
+    //Receivers always unpack batches, so this only needs enabling on the
+    //sending side. Batching changes the relative order of messages of
+    //different types. window_us = 0 (the default) disables batching.
+    //Must be called before monitoring starts.
+    void setBatching(unsigned int window_us, size_t max_batch_bytes = 8192,
+                     size_t max_message_bytes = 1024);
+
+    //called on the monitoring thread with the bytes of every message
+    //received, before they're passed to message observers, so that they can
+    //be recorded without being reserialised. Must be set before monitoring
+    //starts.
+    typedef boost::function<void (const const_svec_ptr&)> raw_observer_t;
+    void setRawObserver(const raw_observer_t& observer);
+
     private:
     //most internal variables are *not* threadsafe and should only be accessed
     //by the thread calling doMonitoring
@@ -67,15 +117,42 @@ class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public Message
     xs::context_t zm_context;       //main zm_context
     xs::socket_t pub;               //the main message publication socket
     xs::socket_t sub;               //the main message subscription socket
-    xs::socket_t send_queue_push;   //inproc queue for messages (passed by pointer)
-    xs::socket_t send_queue_pull;
     xs::socket_t sub_queue_push;    //inproc queue for subscriptions
     xs::socket_t sub_queue_pull;
     xs::socket_t daemon_control;    //used to communicate with vehicle_daemon
 
-    boost::mutex m_send_mutex;      //guards send_queue_push socket
     boost::mutex m_sub_mutex;       //guards send_sub_push socket
-    boost::mutex m_pub_map_mutex;   //guards publications map
+    boost::shared_mutex m_pub_map_mutex; //guards publications map
+    mutable boost::mutex m_stats_mutex; //guards receive_stats and send_stats
+
+    //outgoing messages, queued by any thread and sent by the monitoring
+    //thread, which is woken through send_eventfd
+    typedef std::chrono::steady_clock send_clock_t;
+    struct QueuedSend {
+        const_svec_ptr bytes;
+        send_clock_t::time_point enqueued;
+    };
+    BoundedMPSCQueue<QueuedSend> send_queue;
+    int send_eventfd;
+    std::atomic<bool> send_wakeup_pending;
+    //reliable senders wait on this while the queue is full
+    boost::mutex send_space_mutex;
+    boost::condition_variable send_space;
+    std::atomic<int> send_space_waiters;
+    int queue_send(const QueuedSend& queued, MessageReliability reliability);
+
+    raw_observer_t raw_observer;
+
+    //message batching, only used by the monitoring thread
+    unsigned int batch_window_us;
+    size_t batch_max_bytes;
+    size_t batch_max_message_bytes;
+    struct PendingBatch {
+        svec_ptr frame;         //built once a second message joins the batch
+        const_svec_ptr first;   //sent unwrapped if nothing else joins it
+        std::vector<send_clock_t::time_point> enqueued;
+    };
+    std::map<uint32_t, PendingBatch> pending_batches;
 
     //message ids that have been subscribed to by other nodes
     typedef std::set<uint32_t> pubs_t;
@@ -85,6 +162,9 @@ class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public Message
     typedef std::map<uint32_t,unsigned int> subs_count_t;
     subs_count_t subscriptions;
 
+    receive_stats_t receive_stats;
+    SendStats send_stats;
+
     typedef std::set<uint32_t> pids_t;
     typedef std::set<std::string> connections_t;
 
@@ -98,11 +178,23 @@ class ZeroMQMailbox : public Mailbox, public MailboxEventMonitor, public Message
 
     void send_connect_message(uint32_t pid);
     void send_subscribed_message (const boost::uuids::uuid& node_uuid, uint32_t type);
-    void handle_pub_message(void);
-    void handle_sub_message(void);
-    void handle_send_message(void);
-    void handle_subscription_message(void);
+    bool handle_pub_message(void);
+    bool handle_sub_message(void);
+    void handle_send_messages(void);
+    void send_frame(const const_svec_ptr& bytes);
+    void record_send_latency(send_clock_t::time_point enqueued);
+    void add_to_batch(uint32_t msg_id, const QueuedSend& queued);
+    static void append_to_frame(const svec_ptr& frame, const const_svec_ptr& bytes);
+    static size_t batch_size(const PendingBatch& batch);
+    void flush_batch(uint32_t msg_id);
+    int flush_due_batches(bool flush_all);
+    void deliver_message(uint32_t msg_id, const byte *data, uint32_t len,
+                         const boost::shared_ptr<xs::message_t>& owner);
+    void unpack_batch(uint32_t msg_id, const byte *data, uint32_t len,
+                      const boost::shared_ptr<xs::message_t>& owner);
+    bool handle_subscription_message(void);
     void handle_daemon_message(void);
+    void log_receive_stats(void);
     void doMonitoring();
 
     bool m_monitoring;
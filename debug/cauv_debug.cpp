@@ -6,13 +6,24 @@
 #include <debug/cauv_debug.h>
 
 #include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <chrono>
 
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
 
 #include <ros/console.h>
 
 using namespace cauv;
 
+std::atomic<int> cauv::debug::g_level(1);
+
 class LogInitializer {
     public:
     LogInitializer() {
@@ -22,6 +33,265 @@ class LogInitializer {
     ros::console::LogLocation location;
 };
 
+static LogInitializer& logLocation() {
+    static LogInitializer log;
+    return log;
+}
+
+static ros::console::Level rosLevel(int level) {
+    if (level >= 0) {
+        return ros::console::levels::Debug;
+    } else if (level == -1) {
+        return ros::console::levels::Info;
+    } else if (level == -2) {
+        return ros::console::levels::Warn;
+    } else if (level == -3) {
+        return ros::console::levels::Error;
+    } else {
+        return ros::console::levels::Fatal;
+    }
+}
+
+static void print(int level, std::stringstream& stream,
+                  const char *filename, int line_number, const char *func_name) {
+    ros::console::print(NULL, logLocation().location.logger_, rosLevel(level), stream,
+                        filename, line_number, func_name);
+}
+
+namespace {
+
+struct Statement {
+    Statement() : time(), text(), filename(NULL), line_number(0), func_name(NULL), level(0) { }
+    // when it was logged: it's printed later, by another thread
+    std::chrono::system_clock::time_point time;
+    std::string text;
+    const char *filename;
+    int line_number;
+    const char *func_name;
+    int level;
+};
+
+// Single producer (the thread that owns it), single consumer (whoever holds
+// AsyncLog::drain_lock)
+struct Queue {
+    Queue() : statements(debug::Async_Statements_Per_Thread), head(0), tail(0), in_use(true) { }
+    std::vector<Statement> statements;
+    // number of statements ever pushed / popped
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    // set while a thread owns this queue: queues of threads that have
+    // exited are kept (and drained) and reused by new threads
+    std::atomic<bool> in_use;
+};
+
+void releaseQueue(Queue* q) {
+    q->in_use = false;
+}
+
+struct AsyncLog : boost::noncopyable {
+    AsyncLog() : enabled(false), stopping(false), dropped(0), reported_dropped(0),
+                 queues_lock(), queues(), drain_lock(), writer() { }
+
+    std::atomic<bool> enabled;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> dropped;
+    uint64_t reported_dropped;
+
+    boost::mutex queues_lock;
+    std::vector< boost::shared_ptr<Queue> > queues;
+
+    boost::mutex drain_lock;
+    boost::shared_ptr<boost::thread> writer;
+
+    Queue* threadQueue();
+    void push(std::stringstream& stream, const char *filename,
+              int line_number, const char *func_name, int level);
+    // returns the number of statements printed
+    std::size_t drain();
+    void run();
+};
+
+// never destroyed: threads may log during static destruction
+AsyncLog& asyncLog() {
+    static AsyncLog* a = new AsyncLog();
+    return *a;
+}
+
+boost::thread_specific_ptr<Queue> t_queue_owner(releaseQueue);
+__thread Queue* t_queue = NULL;
+
+Queue* AsyncLog::threadQueue() {
+    if (t_queue) {
+        return t_queue;
+    }
+    boost::lock_guard<boost::mutex> l(queues_lock);
+    for (std::size_t i = 0; i < queues.size() && !t_queue; i++) {
+        bool in_use = false;
+        if (queues[i]->in_use.compare_exchange_strong(in_use, true)) {
+            t_queue = queues[i].get();
+        }
+    }
+    if (!t_queue) {
+        queues.push_back(boost::make_shared<Queue>());
+        t_queue = queues.back().get();
+    }
+    t_queue_owner.reset(t_queue);
+    return t_queue;
+}
+
+void AsyncLog::push(std::stringstream& stream, const char *filename,
+                    int line_number, const char *func_name, int level) {
+    Queue* q = threadQueue();
+    const uint64_t head = q->head.load(std::memory_order_relaxed);
+    if (head - q->tail.load(std::memory_order_acquire) >= debug::Async_Statements_Per_Thread) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Statement& s = q->statements[head % debug::Async_Statements_Per_Thread];
+    s.time = std::chrono::system_clock::now();
+    // (reuses the capacity of whatever was in this slot before)
+    s.text.assign(stream.str());
+    s.filename = filename;
+    s.line_number = line_number;
+    s.func_name = func_name;
+    s.level = level;
+    q->head.store(head + 1, std::memory_order_release);
+}
+
+// seconds to add to UTC for local time, now
+int64_t utcOffset() {
+    const std::time_t now = std::time(NULL);
+    std::tm local;
+    localtime_r(&now, &local);
+    return local.tm_gmtoff;
+}
+
+// HH:MM:SS.ffffff (local time), without going through localtime and
+// iostreams for each statement
+void formatTimeOfDay(char (&buf)[16], std::chrono::system_clock::time_point t, int64_t utc_offset) {
+    const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count()
+                       + utc_offset * 1000000;
+    const int64_t Day_us = int64_t(86400) * 1000000;
+    const int64_t tod = ((us % Day_us) + Day_us) % Day_us;
+    std::snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%06d",
+                  int(tod / 3600000000LL), int(tod / 60000000 % 60),
+                  int(tod / 1000000 % 60), int(tod % 1000000));
+}
+
+std::size_t AsyncLog::drain() {
+    boost::lock_guard<boost::mutex> l(drain_lock);
+    std::vector<Queue*> qs;
+    {
+        boost::lock_guard<boost::mutex> ql(queues_lock);
+        for (std::size_t i = 0; i < queues.size(); i++) {
+            qs.push_back(queues[i].get());
+        }
+    }
+    // statements are printed in the order they were logged, across all
+    // threads, with the time they were logged
+    std::vector<uint64_t> heads(qs.size());
+    for (std::size_t i = 0; i < qs.size(); i++) {
+        heads[i] = qs[i]->head.load(std::memory_order_acquire);
+    }
+    const int64_t utc_offset = utcOffset();
+    char time_of_day[16];
+    std::size_t printed = 0;
+    std::stringstream stream;
+    for (;;) {
+        Queue* next = NULL;
+        uint64_t next_tail = 0;
+        for (std::size_t i = 0; i < qs.size(); i++) {
+            const uint64_t tail = qs[i]->tail.load(std::memory_order_relaxed);
+            if (tail != heads[i] && (!next ||
+                qs[i]->statements[tail % debug::Async_Statements_Per_Thread].time <
+                next->statements[next_tail % debug::Async_Statements_Per_Thread].time)) {
+                next = qs[i];
+                next_tail = tail;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        Statement const& s = next->statements[next_tail % debug::Async_Statements_Per_Thread];
+        formatTimeOfDay(time_of_day, s.time, utc_offset);
+        stream.str(std::string());
+        stream.clear();
+        stream << "[" << time_of_day << "] " << s.text;
+        print(s.level, stream, s.filename, s.line_number, s.func_name);
+        next->tail.store(next_tail + 1, std::memory_order_release);
+        printed++;
+    }
+    const uint64_t now_dropped = dropped.load(std::memory_order_relaxed);
+    if (now_dropped != reported_dropped) {
+        stream.str(std::string());
+        stream.clear();
+        stream << now_dropped - reported_dropped
+               << " log statements dropped (" << now_dropped << " in total)";
+        print(-2, stream, __FILE__, __LINE__, __PRETTY_FUNCTION__);
+        reported_dropped = now_dropped;
+    }
+    return printed;
+}
+
+void AsyncLog::run() {
+    while (!stopping) {
+        if (!drain()) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+        }
+    }
+}
+
+// statements logged after this (during static destruction...) are printed
+// synchronously
+void stopAtExit() {
+    AsyncLog& a = asyncLog();
+    a.enabled = false;
+    a.stopping = true;
+    a.writer->join();
+    debug::flush();
+}
+
+} // anonymous namespace
+
+void cauv::debug::setLevel(int level) {
+    g_level = level;
+    // rosconsole has its own level too: make sure statements that pass ours
+    // aren't then filtered out by it
+    logLocation();
+    if (level >= 0 && ros::console::set_logger_level("ros.cauv_debug", ros::console::levels::Debug)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+}
+
+int cauv::debug::level() {
+    return g_level;
+}
+
+void cauv::debug::setAsync(bool async) {
+    AsyncLog& a = asyncLog();
+    if (async) {
+        boost::lock_guard<boost::mutex> l(a.drain_lock);
+        if (!a.writer) {
+            a.writer = boost::make_shared<boost::thread>(&AsyncLog::run, &a);
+            std::atexit(stopAtExit);
+        }
+    }
+    a.enabled = async;
+    if (!async) {
+        // anything still queued would otherwise be printed out of order with
+        // what follows
+        flush();
+    }
+}
+
+void cauv::debug::flush() {
+    while (asyncLog().drain());
+}
+
+uint64_t cauv::debug::dropped() {
+    return asyncLog().dropped;
+}
+
 Log::Log(const char *filename_,
          const int line_number_,
          const char *func_name_,
@@ -35,25 +305,26 @@ Log::Log(const char *filename_,
 };
 
 Log& Log::operator<<(const char *t) {
-    if (can_add_space && can_add_space_before(t)) {
+    const std::size_t len = std::strlen(t);
+    if (can_add_space && can_add_space_before(t, len)) {
         stream << " ";
     }
     stream << t;
-    can_add_space = can_add_space_after(t);
+    can_add_space = can_add_space_after(t, len);
     return *this;
 };
 
-Log& Log::operator<<(std::string t) {
-    if (can_add_space && can_add_space_before(t)) {
+Log& Log::operator<<(std::string const& t) {
+    if (can_add_space && can_add_space_before(t.data(), t.size())) {
         stream << " ";
     }
     stream << t;
-    can_add_space = can_add_space_after(t);
+    can_add_space = can_add_space_after(t.data(), t.size());
     return *this;
 };
 
-bool Log::can_add_space_before(std::string t) {
-    if (t.empty()) {
+bool Log::can_add_space_before(const char* t, std::size_t len) {
+    if (!len) {
         return false;
     }
     switch(t[0]) {
@@ -66,11 +337,11 @@ bool Log::can_add_space_before(std::string t) {
     }
 }
 
-bool Log::can_add_space_after(std::string t) {
-    if (t.empty()) {
+bool Log::can_add_space_after(const char* t, std::size_t len) {
+    if (!len) {
         return false;
     }
-    switch(*t.rbegin()) {
+    switch(t[len-1]) {
         case ' ':
         case '=': case '(': case '[': case '{': case '\'':
         case '"':
@@ -81,18 +352,15 @@ bool Log::can_add_space_after(std::string t) {
 }
 
 Log::~Log() {
-    static LogInitializer log;
-    ros::console::Level l;
-    if (level >= 0) {
-        l = ros::console::levels::Debug;
-    } else if (level == -1) {
-        l = ros::console::levels::Info;
-    } else if (level == -2) {
-        l = ros::console::levels::Warn;
-    } else if (level == -3) {
-        l = ros::console::levels::Error;
+    AsyncLog& a = asyncLog();
+    if (!a.enabled.load(std::memory_order_relaxed)) {
+        print(level, stream, filename, line_number, func_name);
+    } else if (level <= -3) {
+        // errors are printed straight away (after everything before them),
+        // in case the program is about to crash
+        debug::flush();
+        print(level, stream, filename, line_number, func_name);
     } else {
-        l = ros::console::levels::Fatal;
+        a.push(stream, filename, line_number, func_name, level);
     }
-    ros::console::print(NULL, log.location.logger_, l, stream, filename, line_number, func_name);
 };
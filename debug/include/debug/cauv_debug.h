@@ -7,6 +7,9 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <atomic>
+
+#include <stdint.h>
 
 #include <boost/noncopyable.hpp>
 
@@ -33,6 +36,20 @@
  * is possible - above that all log statements should be completely optimised
  * away by the compiler.
  *
+ * Below that, the current debug level is checked at runtime before anything
+ * is formatted, so a statement above the current level costs one relaxed
+ * atomic load and a comparison:
+ *   debug::setLevel(3);
+ *
+ * Statements are normally passed to rosconsole synchronously, by the thread
+ * that logs them. With debug::setAsync() they're queued instead, in a
+ * fixed-size buffer for each thread that nothing else writes to, and printed
+ * by a background thread, in the order they were logged and prefixed with the
+ * time they were logged (rosconsole's own timestamp is the time they're
+ * printed). Statements that don't fit (because a thread logs
+ * faster than they can be printed) are counted and dropped rather than
+ * blocking: the number dropped is reported in the log.
+ *
  * if CAUV_DEBUG_PRINT_THREAD is defined, the timestamp has the thread id appended:
  *   [HH:MM:SS.fffffff T=0x123456]
  *
@@ -51,6 +68,27 @@
 
 namespace cauv {
 
+namespace debug {
+
+extern std::atomic<int> g_level;
+
+inline bool enabled(int level){
+    return level <= g_level.load(std::memory_order_relaxed);
+}
+void setLevel(int level);
+int level();
+
+// log statements queued by each thread before any more are dropped
+static const unsigned Async_Statements_Per_Thread = 1 << 12;
+
+void setAsync(bool async = true);
+// wait until every queued statement has been printed
+void flush();
+// the number of statements dropped because a thread's queue was full
+uint64_t dropped();
+
+} // namespace debug
+
 class Log : public boost::noncopyable {
     public:
     Log(const char *filename,
@@ -58,7 +96,7 @@ class Log : public boost::noncopyable {
         const char *func_name,
         const int log_level = 0);
     template <typename T>
-    Log& operator<<(T t) {
+    Log& operator<<(T const& t) {
         if (can_add_space) {
             stream << " ";
         } 
@@ -67,11 +105,11 @@ class Log : public boost::noncopyable {
         return *this;
     };
     Log& operator<<(const char* t); 
-    Log& operator<<(std::string t);
+    Log& operator<<(std::string const& t);
     ~Log();
     private:
-    static bool can_add_space_after(std::string s);
-    static bool can_add_space_before(std::string s);
+    static bool can_add_space_after(const char* s, std::size_t len);
+    static bool can_add_space_before(const char* s, std::size_t len);
     bool can_add_space;
     std::stringstream stream;
     const char * const filename;
@@ -80,7 +118,7 @@ class Log : public boost::noncopyable {
     const int level;
 };
 
-#define CAUV_LOG_DEBUG(level, values) if (level < CAUV_SILENCE_DEBUG_LEVEL) cauv::Log(__FILE__, __LINE__, __PRETTY_FUNCTION__, level) << values
+#define CAUV_LOG_DEBUG(level, values) if (level < CAUV_SILENCE_DEBUG_LEVEL && cauv::debug::enabled(level)) cauv::Log(__FILE__, __LINE__, __PRETTY_FUNCTION__, level) << values
 #define CAUV_LOG_INFO(values)    CAUV_LOG_DEBUG(-1, values)
 #define CAUV_LOG_WARNING(values) CAUV_LOG_DEBUG(-2, values)
 #define CAUV_LOG_ERROR(values)   CAUV_LOG_DEBUG(-3, values)
@@ -89,7 +127,7 @@ class Log : public boost::noncopyable {
 //Needs this since now the loggers are macros they will conflict all over the
 //place
 #ifdef CAUV_DEBUG_COMPAT
-    #define debug(...) if (__VA_ARGS__ -0 < CAUV_SILENCE_DEBUG_LEVEL) cauv::Log(__FILE__, __LINE__, __PRETTY_FUNCTION__, (__VA_ARGS__ - 0))
+    #define debug(...) if (__VA_ARGS__ -0 < CAUV_SILENCE_DEBUG_LEVEL && cauv::debug::enabled(__VA_ARGS__ -0)) cauv::Log(__FILE__, __LINE__, __PRETTY_FUNCTION__, (__VA_ARGS__ - 0))
     #define info() debug(-1)
     #define warning() debug(-2)
     #define error() debug(-3)
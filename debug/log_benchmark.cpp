@@ -0,0 +1,91 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+// Measures what a typical log statement costs the thread that logs it: when
+// its level is disabled at runtime, and when it's enabled and printed
+// synchronously or queued for the asynchronous writer.
+//
+// Enabled statements really are printed (to stdout), and the results go to
+// stderr, so run with stdout redirected:
+//
+// usage: log_benchmark [statements per thread] [threads] > /dev/null
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+#include <debug/cauv_debug.h>
+
+using namespace cauv;
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+struct LogLoop {
+    LogLoop(int n) : n(n) { }
+    void operator()() const {
+        const std::string node_type = "GaussianBlurNode";
+        for (int i = 0; i < n; i++) {
+            CAUV_LOG_DEBUG(2, "exec node" << i << "(" << node_type << ") took" << 0.25f * i << "ms");
+        }
+    }
+    int n;
+};
+
+// mean nanoseconds per statement, for each thread
+static double run(int n, int threads) {
+    const bench_clock_t::time_point start = bench_clock_t::now();
+    if (threads == 1) {
+        LogLoop loop(n);
+        loop();
+    } else {
+        std::vector< boost::shared_ptr<boost::thread> > ts;
+        for (int i = 0; i < threads; i++) {
+            ts.push_back(boost::make_shared<boost::thread>(LogLoop(n)));
+        }
+        for (int i = 0; i < threads; i++) {
+            ts[i]->join();
+        }
+    }
+    const bench_clock_t::duration d = bench_clock_t::now() - start;
+    return std::chrono::duration<double, std::nano>(d).count() / n;
+}
+
+static void report(const char* name, int n, int threads) {
+    const uint64_t dropped_before = debug::dropped();
+    const double ns = run(n, threads);
+    std::cerr << name << ": " << ns << " ns per statement";
+    if (debug::dropped() != dropped_before) {
+        std::cerr << ", " << debug::dropped() - dropped_before << " of "
+                  << uint64_t(n) * threads << " dropped";
+    }
+    std::cerr << std::endl;
+    debug::flush();
+}
+
+int main(int argc, char** argv) {
+    const int n = argc > 1 ? std::atoi(argv[1]) : 100000;
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    std::cerr << n << " statements per thread, 1 and " << threads << " threads" << std::endl;
+
+    debug::setLevel(1);
+    report("disabled", n, 1);
+    report("disabled, threaded", n, threads);
+
+    debug::setLevel(2);
+    report("synchronous", n, 1);
+    report("synchronous, threaded", n, threads);
+
+    debug::setAsync();
+    report("asynchronous", n, 1);
+    report("asynchronous, threaded", n, threads);
+
+    return 0;
+}
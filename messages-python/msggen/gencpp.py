@@ -80,6 +80,15 @@ def getIncludes(types, includestring='"%s.h"', fwddeclstring='"%s_fwd.h"'):
             fwddecls = fwddecls | newfwddecls
     return includes,fwddecls
 
+def getViewIncludes(types):
+    # generated struct views, needed to view fields of these types in place
+    # (other types are viewed as spans or copies: see serialised_view.h)
+    includes = set()
+    for t in types:
+        if isinstance(t, msggenyacc.StructType):
+            includes.add('"%s_view.h"' % t.struct.name)
+    return includes
+
 def get_output_files(tree):
     OutputFile = collections.namedtuple("OutputFile", ["template_file", "output_file", "search_list"])
 
@@ -103,7 +112,8 @@ def get_output_files(tree):
                                            {"m": message,
                                             "g": group,
                                             "includes": includes,
-                                            "fwddecls": fwddecls}))
+                                            "fwddecls": fwddecls,
+                                            "view_includes": getViewIncludes([f.type for f in message.fields])}))
             output_types.append(OutputFile("cppmess-xmessage.template.cpp",
                                            message.name + "Message.cpp",
                                            {"m": message,
@@ -119,6 +129,10 @@ def get_output_files(tree):
         output_types.append(OutputFile("cppmess-xstruct_fwd.template.h",
                                        struct.name + "_fwd.h",
                                        {"s": struct}))
+        output_types.append(OutputFile("cppmess-xstruct_view.template.h",
+                                       struct.name + "_view.h",
+                                       {"s": struct,
+                                        "view_includes": getViewIncludes([f.type for f in struct.fields])}))
     for enum in tree["enums"]:
         output_types.append(OutputFile("cppmess-xenum.template.h",
                                        enum.name + ".h",
@@ -34,6 +34,14 @@ int32_t cauv::deserialise(const_svec_ptr p, uint32_t i, $e.name::e& e){
     return r;
 }
 
+uint32_t cauv::serialisedSize($e.name::e const&){
+    return sizeof($toCPPType($e.type));
+}
+
+uint32_t cauv::serialisedLength(const_svec_ptr, uint32_t, $e.name::e const*){
+    return sizeof($toCPPType($e.type));
+}
+
 #end for
 
 
@@ -52,6 +60,34 @@ int32_t cauv::deserialise(const_svec_ptr p, uint32_t i, $s.name& v){
     return b - i;
 }
 
+#if len($s.fields) > 0
+uint32_t cauv::serialisedSize($s.name const& v){
+    uint32_t r = 0;
+    #for f in $s.fields
+    r += serialisedSize(v.$f.name);
+    #end for
+    return r;
+}
+#else
+uint32_t cauv::serialisedSize($s.name const&){
+    return 0;
+}
+#end if
+
+#if len($s.fields) > 0
+uint32_t cauv::serialisedLength(const_svec_ptr p, uint32_t i, $s.name const*){
+    uint32_t b = i;
+    #for f in $s.fields
+    b += serialisedLength(p, b, ($toCPPType($f.type) const*)0);
+    #end for
+    return b - i;
+}
+#else
+uint32_t cauv::serialisedLength(const_svec_ptr, uint32_t, $s.name const*){
+    return 0;
+}
+#end if
+
 #end for
 
 #for $v in $variants
@@ -85,6 +121,34 @@ int32_t cauv::deserialise(const_svec_ptr p, uint32_t i, $v.name& v){
     }
     return b - i;
 }
+
+uint32_t cauv::serialisedSize($v.name const& v){
+    uint32_t r = sizeof(uint32_t);
+    switch(v.which()){
+        default:
+        #for $i, $t in $enumerate($v.types)
+        case $i:
+            r += serialisedSize(boost::get< $toCPPType($t) >(v));
+            break;
+        #end for
+    }
+    return r;
+}
+
+uint32_t cauv::serialisedLength(const_svec_ptr p, uint32_t i, $v.name const*){
+    uint32_t discriminant = 0;
+    uint32_t b = i;
+    b += deserialise(p, b, discriminant);
+    switch(discriminant){
+        default:
+        #for $i, $t in $enumerate($v.types)
+        case $i:
+            b += serialisedLength(p, b, ($toCPPType($t) const*)0);
+            break;
+        #end for
+    }
+    return b - i;
+}
 #end for
 
 
@@ -29,22 +29,29 @@ $t.type $t.name;
 #for $s in $structs
 void serialise(svec_ptr, $s.name const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $s.name&);
+uint32_t serialisedSize($s.name const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $s.name const*);
 #end for
 
 #for $e in $enums
 void serialise(svec_ptr, $e.name::e const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $e.name::e&);
+uint32_t serialisedSize($e.name::e const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $e.name::e const*);
 #end for
 
 #for $v in $variants
 void serialise(svec_ptr, $v.name const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $v.name&);
+uint32_t serialisedSize($v.name const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $v.name const*);
 #end for
 
 #for $t in $included_types
 #if $t.superclass is None
 void serialise(svec_ptr, $t.name const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $t.name&);
+uint32_t serialisedSize($t.name const&);
 #end if
 #end for
 
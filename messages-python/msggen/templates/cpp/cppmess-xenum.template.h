@@ -27,6 +27,8 @@ namespace $e.name
 
 void serialise(svec_ptr, $e.name::e const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $e.name::e&);
+uint32_t serialisedSize($e.name::e const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $e.name::e const*);
 
 } // namespace cauv
 
@@ -34,7 +34,9 @@ cauv::${className}::${className}()
       m_${f.name}(),
       #end if
       #end for
-      m_bytes(){
+      m_bytes(),
+      m_field_offsets(),
+      m_field_offsets_valid(false){
 }
 cauv::${className}::${className}(#slurp
                            #for i, f in $enumerate($m.fields)
@@ -53,7 +55,9 @@ cauv::${className}::${className}(#slurp
       m_${f.name}($f.name),
       #end if
       #end for
-      m_bytes(){
+      m_bytes(),
+      m_field_offsets(),
+      m_field_offsets_valid(false){
 }
 #else
 cauv::${className}::${className}() : Message($m.id, "$g.name") { }
@@ -79,7 +83,9 @@ cauv::${className}::${className}(#slurp
       m_${f.name}($f.name),
       #end if
       #end for
-      m_bytes(){
+      m_bytes(),
+      m_field_offsets(),
+      m_field_offsets_valid(false){
 }
 #end if
 
@@ -120,7 +126,46 @@ void cauv::$className::get_${f.name}_inplace($toCPPType($f.type) &$f.name) const
 
 #end for
 
+#for i, f in $enumerate($m.fields)
+#set $viewType = "SerialisedView< %s >" % $toCPPType($f.type)
+cauv::${viewType}::type cauv::$className::view_${f.name}() const{
+    #if $f.lazy
+    if(m_bytes && (!m_deserialised || !m_lazy_fields_deserialised.count($i)))
+        return ${viewType}::fromBytes(m_bytes, fieldOffsets()[$i]);
+    return ${viewType}::fromValue(*m_${f.name});
+    #else
+    if(!m_deserialised)
+        return ${viewType}::fromBytes(m_bytes, fieldOffsets()[$i]);
+    return ${viewType}::fromValue(m_${f.name});
+    #end if
+}
+#end for
+
 #if $len($m.fields) > 0
+uint32_t const* cauv::$className::fieldOffsets() const{
+    if(!m_field_offsets_valid){
+        ## message ID + hash comes first
+        uint32_t offset = 8;
+        #if $m.numLazyFields() > 0
+        uint32_t skip = 0;
+        #end if
+        #for i, f in $enumerate($m.fields)
+        #if $f.lazy
+        ## lazy fields are prefixed with their size, including the prefix
+        m_field_offsets[$i] = offset + cauv::deserialise(m_bytes, offset, skip);
+        offset += skip;
+        #else
+        m_field_offsets[$i] = offset;
+        #if $i < $len($m.fields) - 1
+        offset += cauv::serialisedLength(m_bytes, offset, ($toCPPType($f.type) const*)0);
+        #end if
+        #end if
+        #end for
+        m_field_offsets_valid = true;
+    }
+    return m_field_offsets;
+}
+
 boost::shared_ptr<$className> cauv::$className::fromBytes(const_svec_ptr bytes){
     boost::shared_ptr<$className> ret = boost::make_shared<$className>();
     ret->m_bytes = bytes;
@@ -135,9 +180,13 @@ boost::shared_ptr<$className> cauv::$className::fromBytes(const_svec_ptr){
 #end if
 const_svec_ptr cauv::$className::toBytes() const{
     svec_ptr r = boost::make_shared<svec_t>();
+    // (serialise reserves exactly the space needed)
     serialise(r, *this);
     return r;
 }
+uint32_t cauv::$className::serialisedSize() const{
+    return cauv::serialisedSize(*this);
+}
 std::string cauv::$className::chil() const{
     #if $len($m.fields)
     checkDeserialised();
@@ -172,12 +221,25 @@ static void serialiseLazyField(cauv::svec_ptr p, T const& v){
 }
 #end if
 #if len($m.fields) > 0
-void cauv::serialise(svec_ptr p, $className const& v){
+uint32_t cauv::serialisedSize($className const& v){
 #else
-void cauv::serialise(svec_ptr p, $className const&){
+uint32_t cauv::serialisedSize($className const&){
 #end if
-    ## reserve estimated minimum message size
-    p->reserve(#echo 4 *(1 + len($m.fields))#);
+    ## message type and hash
+    uint32_t r = 2 * sizeof(uint32_t);
+    #for f in $m.fields
+    #if $f.lazy
+    ## lazy fields are prefixed with their size
+    r += sizeof(uint32_t) + cauv::serialisedSize(*v.m_$f.name);
+    #else
+    r += cauv::serialisedSize(v.m_$f.name);
+    #end if
+    #end for
+    return r;
+}
+void cauv::serialise(svec_ptr p, $className const& v){
+    ## reserve the whole message, so that the buffer is only allocated once
+    p->reserve(p->size() + cauv::serialisedSize(v));
     ## message type
     cauv::serialise(p, uint32_t($m.id));
     cauv::serialise(p, uint32_t($hex($m.check_hash)));
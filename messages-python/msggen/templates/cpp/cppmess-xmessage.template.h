@@ -16,9 +16,14 @@
 
 \#include <boost/shared_ptr.hpp>
 
+\#include <utility/serialised_view.h>
+
 #for $i in $includes
 \#include ${i}
 #end for
+#for $i in $view_includes
+\#include ${i}
+#end for
 
 namespace cauv{
 
@@ -55,8 +60,20 @@ class $className : public Message
         
         #end for
 
+        /* Read-only views of fields, read in place from the serialised
+         * message unless it has already been deserialised, so they don't
+         * deserialise any other fields: arrays of plain data are spans of
+         * the received bytes and structs are views (see
+         * utility/serialised_view.h).
+         */
+        #for $f in $m.fields
+        SerialisedView< $toCPPType($f.type) >::type view_${f.name}() const;
+        #end for
+
         static boost::shared_ptr<${className}> fromBytes(const_svec_ptr bytes);
         virtual const_svec_ptr toBytes() const;
+        // the size of toBytes(), without serialising
+        uint32_t serialisedSize() const;
         virtual std::string chil() const;
 
     protected:
@@ -87,11 +104,20 @@ class $className : public Message
 
         mutable const_svec_ptr m_bytes;
 
+    #if $len($m.fields) > 0
+        // offset of each field in m_bytes, found when first needed by a view
+        uint32_t const* fieldOffsets() const;
+        mutable uint32_t m_field_offsets[$len($m.fields)];
+        mutable bool m_field_offsets_valid;
+    #end if
+
     friend void serialise(svec_ptr, $className const&);
+    friend uint32_t serialisedSize($className const&);
     friend std::string chil($className const&);
 };
 
 void serialise(svec_ptr p, $className const&);
+uint32_t serialisedSize($className const&);
 std::string chil($className const&);
 
 } // namespace cauv
@@ -49,8 +49,25 @@ struct $s.name
 #end if
 void serialise(svec_ptr, $s.name const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $s.name&);
+uint32_t serialisedSize($s.name const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $s.name const*);
 std::string chil($s.name const&);
 
+#if $s.include is None and len($s.fields) > 0
+// arrays of $s.name can be serialised with a single copy if all of its fields
+// can, and it has no padding
+template<> struct is_bulk_serialisable<$s.name>: std::integral_constant<bool,
+    #for $f in $s.fields
+    is_bulk_serialisable< $toCPPType($f.type) >::value &&
+    #end for
+    sizeof($s.name) == (#slurp
+    #for i, f in $enumerate($s.fields)
+#*  *#sizeof($toCPPType($f.type))#if $i < $len($s.fields) - 1# + #end if##slurp
+    #end for
+#*  *#)
+>{ };
+#end if
+
 template<typename char_T, typename traits>
 std::basic_ostream<char_T, traits>& operator<<(
     std::basic_ostream<char_T, traits>& os, $s.name const& s)
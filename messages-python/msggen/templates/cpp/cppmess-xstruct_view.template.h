@@ -0,0 +1,87 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+/***  This is a generated file, do not edit ***/
+\#ifndef __CAUV_${s.name.upper()}_VIEW_H__
+\#define __CAUV_${s.name.upper()}_VIEW_H__
+
+\#include <utility/serialised_view.h>
+
+\#include "${s.name}.h"
+#for $i in $view_includes
+\#include ${i}
+#end for
+
+namespace cauv{
+
+#if len($s.fields) > 0
+/* Read-only view of a $s.name, either in place in serialised bytes or of a
+ * $s.name in memory. Fields are only deserialised when they're read, and
+ * arrays of plain data aren't copied at all (see utility/serialised_view.h).
+ */
+class ${s.name}View
+{
+    public:
+        ${s.name}View(const_svec_ptr_cref bytes, uint32_t offset);
+        ${s.name}View($s.name const& value);
+
+        #for $f in $s.fields
+        SerialisedView< $toCPPType($f.type) >::type ${f.name}() const;
+        #end for
+
+        // deserialise the whole $s.name
+        $s.name get() const;
+
+    private:
+        $s.name const* m_value;
+        const_svec_ptr m_bytes;
+        uint32_t m_offsets[$len($s.fields)];
+};
+
+template<> struct SerialisedView<$s.name>{
+    typedef ${s.name}View type;
+    static type fromBytes(const_svec_ptr_cref p, uint32_t i){
+        return type(p, i);
+    }
+    static type fromValue($s.name const& v){
+        return type(v);
+    }
+};
+
+inline ${s.name}View::${s.name}View(const_svec_ptr_cref bytes, uint32_t offset)
+    : m_value(0), m_bytes(bytes){
+    #for i, f in $enumerate($s.fields)
+    m_offsets[$i] = offset;
+    #if $i < $len($s.fields) - 1
+    offset += serialisedLength(bytes, offset, ($toCPPType($f.type) const*)0);
+    #end if
+    #end for
+}
+
+inline ${s.name}View::${s.name}View($s.name const& value)
+    : m_value(&value), m_bytes(), m_offsets(){
+}
+
+#for i, f in $enumerate($s.fields)
+inline SerialisedView< $toCPPType($f.type) >::type ${s.name}View::${f.name}() const{
+    if(m_value)
+        return SerialisedView< $toCPPType($f.type) >::fromValue(m_value->$f.name);
+    return SerialisedView< $toCPPType($f.type) >::fromBytes(m_bytes, m_offsets[$i]);
+}
+#end for
+
+inline $s.name ${s.name}View::get() const{
+    if(m_value)
+        return *m_value;
+    $s.name r;
+    deserialise(m_bytes, m_offsets[0], r);
+    return r;
+}
+#end if
+
+} // namespace cauv
+
+\#endif//__CAUV_${s.name.upper()}_VIEW_H__
@@ -29,6 +29,8 @@ typedef boost::variant<
 
 void serialise(svec_ptr, $v.name const&);
 int32_t deserialise(const_svec_ptr, uint32_t, $v.name&);
+uint32_t serialisedSize($v.name const&);
+uint32_t serialisedLength(const_svec_ptr, uint32_t, $v.name const*);
 std::string chil($v.name const&);
 
 
@@ -0,0 +1,77 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_HISTOGRAM_H__
+#define __CAUV_HISTOGRAM_H__
+
+#include <ostream>
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+
+namespace cauv {
+
+/* Histogram of non-negative integer samples (latencies in microseconds,
+ * queue depths...) with power-of-two bucket widths: bucket 0 counts zeros,
+ * bucket i counts values in [2^(i-1), 2^i). Cheap enough to update on hot
+ * paths. Not thread-safe: guard it, or keep one per thread.
+ */
+class Log2Histogram
+{
+    public:
+        static const unsigned Num_Buckets = 40;
+
+        Log2Histogram()
+            : m_count(0), m_sum(0), m_max(0){
+            m_buckets.assign(0);
+        }
+
+        void add(uint64_t v){
+            unsigned b = 0;
+            while(b + 1 < Num_Buckets && (v >> b))
+                b++;
+            m_buckets[b]++;
+            m_count++;
+            m_sum += v;
+            if(v > m_max)
+                m_max = v;
+        }
+
+        void clear(){
+            *this = Log2Histogram();
+        }
+
+        uint64_t count() const{ return m_count; }
+        uint64_t max() const{ return m_max; }
+        double mean() const{ return m_count? double(m_sum) / m_count : 0; }
+        uint64_t bucket(unsigned i) const{ return m_buckets[i]; }
+
+        // upper bound of the bucket containing the p-th percentile (0-100)
+        uint64_t percentile(double p) const{
+            uint64_t target = uint64_t(m_count * p / 100.0 + 0.5);
+            uint64_t seen = 0;
+            for(unsigned i = 0; i < Num_Buckets; i++){
+                seen += m_buckets[i];
+                if(seen >= target && seen)
+                    return i? (uint64_t(1) << i) - 1 : 0;
+            }
+            return m_max;
+        }
+
+    private:
+        boost::array<uint64_t, Num_Buckets> m_buckets;
+        uint64_t m_count;
+        uint64_t m_sum;
+        uint64_t m_max;
+};
+
+inline std::ostream& operator<<(std::ostream& os, Log2Histogram const& h){
+    return os << "n=" << h.count() << " mean=" << h.mean()
+              << " p50<=" << h.percentile(50) << " p90<=" << h.percentile(90)
+              << " p99<=" << h.percentile(99) << " max=" << h.max();
+}
+
+} // namespace cauv
+
+#endif // ndef __CAUV_HISTOGRAM_H__
@@ -0,0 +1,116 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_MPSC_QUEUE_H__
+#define __CAUV_MPSC_QUEUE_H__
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+#include <boost/utility.hpp>
+
+namespace cauv {
+
+/* Bounded lock-free queue for many producers and a single consumer.
+ *
+ * Each slot carries a sequence number saying whether it is ready to be
+ * written or read (D. Vyukov's bounded queue), so producers only contend on
+ * a single compare-and-swap of the enqueue position and never block each
+ * other. tryPush fails rather than waiting when the queue is full, so the
+ * caller decides whether to drop or to retry.
+ *
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class BoundedMPSCQueue : boost::noncopyable
+{
+    public:
+        typedef size_t size_type;
+
+        BoundedMPSCQueue(size_type min_capacity)
+            : m_mask(roundUpPow2(min_capacity) - 1),
+              m_slots(m_mask + 1),
+              m_enqueue_pos(0),
+              m_dequeue_pos(0){
+            for(size_type i = 0; i < m_slots.size(); i++)
+                m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        // safe to call from any thread
+        bool tryPush(T const& x){
+            Slot *slot;
+            size_type pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            while(true){
+                slot = &m_slots[pos & m_mask];
+                size_type seq = slot->seq.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+                if(diff == 0){
+                    if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }else if(diff < 0){
+                    return false;
+                }else{
+                    pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            slot->value = x;
+            slot->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // must only be called from the single consumer thread
+        bool tryPop(T& x){
+            size_type pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            Slot& slot = m_slots[pos & m_mask];
+            size_type seq = slot.seq.load(std::memory_order_acquire);
+            if(std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1) < 0)
+                return false;
+            x = slot.value;
+            slot.value = T();
+            m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+            slot.seq.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        // approximate when called concurrently with push/pop
+        size_type size() const{
+            size_type e = m_enqueue_pos.load(std::memory_order_relaxed);
+            size_type d = m_dequeue_pos.load(std::memory_order_relaxed);
+            return e > d? e - d : 0;
+        }
+
+        size_type capacity() const{
+            return m_mask + 1;
+        }
+
+    private:
+        struct Slot{
+            Slot() : seq(0), value(){ }
+            Slot(Slot const& other) : seq(other.seq.load()), value(other.value){ }
+            std::atomic<size_type> seq;
+            T value;
+        };
+
+        static size_type roundUpPow2(size_type n){
+            size_type r = 1;
+            while(r < n)
+                r <<= 1;
+            return r;
+        }
+
+        const size_type m_mask;
+        std::vector<Slot> m_slots;
+        // on separate cache lines so that producers and the consumer don't
+        // fight over them
+        char m_pad0[64];
+        std::atomic<size_type> m_enqueue_pos;
+        char m_pad1[64];
+        std::atomic<size_type> m_dequeue_pos;
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_MPSC_QUEUE_H__
@@ -0,0 +1,107 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_RCU_H__
+#define __CAUV_RCU_H__
+
+#include <atomic>
+#include <vector>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace cauv {
+
+/* Read-copy-update pointer to an immutable T.
+ *
+ * Readers never block or retry: a Reader counts itself in, loads the
+ * current version, and counts itself out again when it goes out of scope.
+ * Writers build a new version and publish() it; the version it replaces is
+ * deleted once no readers are counted in: by publish() if there are none,
+ * otherwise by the last reader to count out, so neither publish() nor
+ * readers ever wait for each other. Readers may therefore publish, and
+ * readers that hold on to versions only delay reclamation.
+ *
+ * Any reader counted in when a version is replaced may still be using it.
+ * Readers that count in after that see the new version, so if the count is
+ * ever zero after a replacement, nothing refers to the replaced versions.
+ */
+template <typename T>
+class RCUPointer : boost::noncopyable
+{
+    public:
+        RCUPointer(T* initial = new T())
+            : m_current(initial), m_readers(0), m_retired_pending(false),
+              m_write_lock(), m_retired(){
+        }
+        ~RCUPointer(){
+            delete m_current.load();
+            for(std::size_t i = 0; i < m_retired.size(); i++)
+                delete m_retired[i];
+        }
+
+        class Reader : boost::noncopyable
+        {
+            public:
+                Reader(RCUPointer const& p)
+                    : m_p(p){
+                    m_p.m_readers.fetch_add(1);
+                    m_version = m_p.m_current.load();
+                }
+                ~Reader(){
+                    if(m_p.m_readers.fetch_sub(1) == 1)
+                        m_p._reclaim();
+                }
+                T const* operator->() const{ return m_version; }
+                T const& operator*() const{ return *m_version; }
+
+            private:
+                RCUPointer const& m_p;
+                T const* m_version;
+        };
+
+        // takes ownership of next
+        void publish(T* next){
+            {
+                boost::lock_guard<boost::mutex> l(m_write_lock);
+                m_retired.push_back(m_current.exchange(next));
+                m_retired_pending = true;
+            }
+            _reclaim();
+        }
+
+    private:
+        // Delete the retired versions if no readers are counted in. This
+        // doesn't wait for the write lock: whoever holds it checks again
+        // after releasing it, so a reader counting out while it's held
+        // can't leave versions unreclaimed.
+        void _reclaim() const{
+            while(m_retired_pending.load() && m_readers.load() == 0){
+                boost::unique_lock<boost::mutex> l(m_write_lock, boost::try_to_lock);
+                if(!l.owns_lock())
+                    return;
+                if(m_readers.load() != 0)
+                    continue;
+                for(std::size_t i = 0; i < m_retired.size(); i++)
+                    delete m_retired[i];
+                m_retired.clear();
+                m_retired_pending = false;
+            }
+        }
+
+        std::atomic<T*> m_current;
+        mutable std::atomic<int> m_readers;
+        // m_retired isn't empty
+        mutable std::atomic<bool> m_retired_pending;
+
+        mutable boost::mutex m_write_lock;
+        // replaced versions that readers may still be using
+        mutable std::vector<T*> m_retired;
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_RCU_H__
@@ -8,6 +8,8 @@
 #define __CAUV_SERIALISATION_TYPES_H__
 
 #include <vector>
+#include <cstddef>
+#include <type_traits>
 #include <boost/shared_ptr.hpp>
 
 namespace cauv{
@@ -15,7 +17,83 @@ namespace cauv{
 typedef unsigned char byte;
 typedef std::vector<byte> svec_t;
 typedef boost::shared_ptr<svec_t> svec_ptr;
-typedef boost::shared_ptr<const svec_t> const_svec_ptr;
+
+/* Read-only handle to a block of serialised bytes.
+ *
+ * The bytes are either an svec_t (for messages serialised locally), or
+ * storage owned by some other object, such as a received xs message, which is
+ * kept alive for as long as any handle refers to it. This lets received
+ * messages be deserialised in place instead of being copied into an svec_t
+ * first.
+ *
+ * It deliberately has the same pointer-like syntax as the
+ * boost::shared_ptr<const svec_t> it replaced: p->size(), (*p)[i],
+ * &p->front(), if(p), p.reset() all work as before.
+ */
+class ByteBuffer{
+    public:
+        typedef byte value_type;
+        typedef std::size_t size_type;
+        typedef byte const* const_iterator;
+
+        ByteBuffer()
+            : m_data(0), m_size(0), m_owner(){
+        }
+        ByteBuffer(boost::shared_ptr<const svec_t> const& v)
+            : m_data(v && v->size()? &v->front() : 0),
+              m_size(v? v->size() : 0),
+              m_owner(v){
+        }
+        ByteBuffer(svec_ptr const& v)
+            : m_data(v && v->size()? &v->front() : 0),
+              m_size(v? v->size() : 0),
+              m_owner(v){
+        }
+        /* data must remain valid and unmodified for as long as owner is
+         * alive */
+        ByteBuffer(byte const* data, size_type size, boost::shared_ptr<const void> const& owner)
+            : m_data(data), m_size(size), m_owner(owner){
+        }
+
+        ByteBuffer const* operator->() const{ return this; }
+        ByteBuffer const& operator*() const{ return *this; }
+        explicit operator bool() const{ return bool(m_owner); }
+        void reset(){
+            m_data = 0;
+            m_size = 0;
+            m_owner.reset();
+        }
+
+        size_type size() const{ return m_size; }
+        bool empty() const{ return m_size == 0; }
+        byte const* data() const{ return m_data; }
+        byte const& front() const{ return m_data[0]; }
+        byte const& operator[](size_type i) const{ return m_data[i]; }
+        const_iterator begin() const{ return m_data; }
+        const_iterator end() const{ return m_data + m_size; }
+
+        /* size bytes from offset, keeping the same storage alive */
+        ByteBuffer slice(size_type offset, size_type size) const{
+            return ByteBuffer(m_data + offset, size, m_owner);
+        }
+
+    private:
+        byte const* m_data;
+        size_type m_size;
+        boost::shared_ptr<const void> m_owner;
+};
+
+typedef ByteBuffer const_svec_ptr;
+
+/* True for types whose serialised bytes are exactly their in-memory bytes,
+ * so that arrays of them can be (de)serialised with a single memcpy. bool is
+ * serialised as an int32, so isn't. Generated structs with no padding whose
+ * fields are all bulk serialisable specialise this to be true too.
+ */
+template<typename T>
+struct is_bulk_serialisable: std::integral_constant<bool,
+    std::is_arithmetic<T>::value && !std::is_same<T, bool>::value
+>{ };
 
 } // namespace cauv
 
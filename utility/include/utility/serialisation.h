@@ -12,6 +12,8 @@
 #include <utility>
 #include <string>
 #include <iomanip>
+#include <cstring>
+#include <cassert>
 
 #include <boost/array.hpp>
 #include <boost/cstdint.hpp>
@@ -30,6 +32,17 @@ namespace cauv{
   * deserialise from specified position, don't remove any bytes
  *
  * int32_t deserialise(const_svec_ptr, uint32_t, T&);
+ *
+ * the number of bytes that serialise will add (so that buffers can be
+ * allocated once, up front):
+ *
+ * uint32_t serialisedSize(T const&);
+ *
+ * the number of bytes occupied by the T serialised at a specified position,
+ * found without deserialising it where possible (so that later values can be
+ * read in place, see serialised_view.h):
+ *
+ * uint32_t serialisedLength(const_svec_ptr, uint32_t, T const*);
  */
 
 /* Note that the svec_ptr (a shared pointer) is passed in by const reference as
@@ -53,7 +66,6 @@ int32_t unCopyBytes(const_svec_ptr_cref p, uint32_t i, T& CAUV_RESTRICT v){
     v = reinterpret_cast<T const&>((*p)[i]);
     return sizeof(T);
 }
-
 const static char* B16_LUT[] = {
     "00","01","02","03","04","05","06","07","08","09","0A","0B","0C","0D","0E","0F",
     "10","11","12","13","14","15","16","17","18","19","1A","1B","1C","1D","1E","1F",
@@ -82,6 +94,9 @@ inline void serialise(svec_ptr_cref p, int8_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i , int8_t& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(int8_t const&){
+    return sizeof(int8_t);
+}
 inline std::string chil(int8_t const& v){
     return mkStr() << int32_t(v);
 }
@@ -92,6 +107,9 @@ inline void serialise(svec_ptr_cref p, int16_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, int16_t& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(int16_t const&){
+    return sizeof(int16_t);
+}
 inline std::string chil(int16_t const& v){
     return mkStr() << v;
 }
@@ -102,6 +120,9 @@ inline void serialise(svec_ptr_cref p, int32_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, int32_t& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(int32_t const&){
+    return sizeof(int32_t);
+}
 inline std::string chil(int32_t const& v){
     return mkStr() << v;
 }
@@ -112,6 +133,9 @@ inline void serialise(svec_ptr_cref p, uint8_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, uint8_t& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(uint8_t const&){
+    return sizeof(uint8_t);
+}
 inline std::string chil(uint8_t const& v){
     return mkStr() << uint32_t(v);
 }
@@ -122,6 +146,9 @@ inline void serialise(svec_ptr_cref p, uint16_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, uint16_t& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(uint16_t const&){
+    return sizeof(uint16_t);
+}
 inline std::string chil(uint16_t const& v){
     return mkStr() << v;
 }
@@ -132,6 +159,9 @@ inline void serialise(svec_ptr_cref p, uint32_t const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, uint32_t& CAUV_RESTRICT v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(uint32_t const&){
+    return sizeof(uint32_t);
+}
 inline std::string chil(uint32_t const& v){
     return mkStr() << v;
 }
@@ -142,6 +172,9 @@ inline void serialise(svec_ptr_cref p, char const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, char& v){
     return impl::unCopyBytes(p, i, v);
 } 
+inline uint32_t serialisedSize(char const&){
+    return sizeof(char);
+}
 
 inline void serialise(svec_ptr_cref p, float const& v){
     impl::copyBytes(p, v);
@@ -149,6 +182,9 @@ inline void serialise(svec_ptr_cref p, float const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, float& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(float const&){
+    return sizeof(float);
+}
 inline std::string chil(float const& v){
     return mkStr() << std::setprecision(8) << v;
 }
@@ -159,6 +195,9 @@ inline void serialise(svec_ptr_cref p, double const& v){
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, double& v){
     return impl::unCopyBytes(p, i, v);
 }
+inline uint32_t serialisedSize(double const&){
+    return sizeof(double);
+}
 inline std::string chil(double const& v){
     return mkStr() << std::setprecision(16) << v;
 }
@@ -172,6 +211,9 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, bool& v){
     v = t;
     return r;
 }
+inline uint32_t serialisedSize(bool const&){
+    return sizeof(int32_t);
+}
 inline std::string chil(bool const& v){
     return mkStr() << std::noboolalpha << v;
 }
@@ -186,6 +228,9 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::string& v){
     v.assign((char*)&(p->operator[](i)), n);
     return n + 4;
 }
+inline uint32_t serialisedSize(const std::string& v){
+    return sizeof(uint32_t) + v.size();
+}
 inline std::string chil(const std::string& v){
     std::string r;
     r.reserve(v.size()*2);
@@ -194,6 +239,11 @@ inline std::string chil(const std::string& v){
         r += impl::B16_LUT[unsigned(*i)];
     return r;
 }
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::string const*){
+    uint32_t n = 0;
+    deserialise(p, i, n);
+    return n + 4;
+}
 
 /* Define overloads for supported template types:
  */
@@ -203,23 +253,111 @@ template<typename T>
 inline void serialise(svec_ptr_cref p, std::vector<T> const& CAUV_RESTRICT v);
 template<typename T>
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::vector<T>& v);
+template<typename T>
+inline uint32_t serialisedSize(std::vector<T> const& v);
 
 template<typename S, typename T>
 inline void serialise(svec_ptr_cref p, std::pair<S,T> const& v);
 template<typename S, typename T>
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::pair<S,T>& v);
+template<typename S, typename T>
+inline uint32_t serialisedSize(std::pair<S,T> const& v);
 
 template<typename S, typename T>
 inline void serialise(svec_ptr_cref p, std::map<S,T> const& v);
 template<typename S, typename T>
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::map<S,T>& v);
+template<typename S, typename T>
+inline uint32_t serialisedSize(std::map<S,T> const& v);
 
 template<typename T, size_t Size>
 inline void serialise(svec_ptr_cref p, boost::array<T,Size> const& CAUV_RESTRICT v);
 template<typename T, size_t Size>
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, boost::array<T,Size>& v);
+template<typename T, size_t Size>
+inline uint32_t serialisedSize(boost::array<T,Size> const& v);
+
+template<typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, T const*);
+template<typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::vector<T> const*);
+template<typename S, typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::pair<S,T> const*);
+template<typename S, typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::map<S,T> const*);
+template<typename T, size_t Size>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, boost::array<T,Size> const*);
 
 
+namespace impl{
+/* helpers: serialise the elements of a contiguous container (std::vector or
+ * boost::array), by copying all of their bytes at once if possible */
+template<typename C>
+inline void serialiseElements(svec_ptr_cref p, C const& v, std::true_type){
+    if(v.size())
+        p->insert(
+            p->end(),
+            reinterpret_cast<byte const*>(&v[0]),
+            reinterpret_cast<byte const*>(&v[0] + v.size())
+        );
+}
+template<typename C>
+inline void serialiseElements(svec_ptr_cref p, C const& v, std::false_type){
+    typename C::const_iterator i;
+    for(i = v.begin(); i != v.end(); i++)
+        serialise(p, *i);
+}
+/* append num elements to v */
+template<typename T>
+inline int32_t deserialiseElements(const_svec_ptr_cref p, uint32_t i, uint32_t num,
+                                   std::vector<T>& v, std::true_type){
+    if(num){
+        const std::size_t start = v.size();
+        v.resize(start + num);
+        std::memcpy(&v[start], &((*p)[i]), num * sizeof(T));
+    }
+    return num * sizeof(T);
+}
+template<typename T>
+inline int32_t deserialiseElements(const_svec_ptr_cref p, uint32_t i, uint32_t num,
+                                   std::vector<T>& v, std::false_type){
+    int32_t b = i;
+    v.reserve(v.size() + num);
+    for(uint32_t j = 0; j < num; j++){
+        T t;
+        b += deserialise(p, b, t);
+        v.push_back(t);
+    }
+    return b - i;
+}
+/* length of num serialised elements of type T starting at i */
+template<typename T>
+inline uint32_t serialisedElementsLength(const_svec_ptr_cref, uint32_t, uint32_t num,
+                                         T const*, std::true_type){
+    return num * sizeof(T);
+}
+template<typename T>
+inline uint32_t serialisedElementsLength(const_svec_ptr_cref p, uint32_t i, uint32_t num,
+                                         T const*, std::false_type){
+    uint32_t b = i;
+    for(uint32_t j = 0; j < num; j++)
+        b += serialisedLength(p, b, (T const*)0);
+    return b - i;
+}
+template<typename C>
+inline uint32_t serialisedElementsSize(C const& v, std::true_type){
+    return v.size() * sizeof(typename C::value_type);
+}
+template<typename C>
+inline uint32_t serialisedElementsSize(C const& v, std::false_type){
+    uint32_t r = 0;
+    typename C::const_iterator i;
+    for(i = v.begin(); i != v.end(); i++)
+        r += serialisedSize(*i);
+    return r;
+}
+} // namespace cauv::impl
+
 template<typename T>
 inline void serialise(svec_ptr_cref p, std::vector<T> const& CAUV_RESTRICT v){
     assert(v.size() < 0x80000000);
@@ -231,9 +369,7 @@ inline void serialise(svec_ptr_cref p, std::vector<T> const& CAUV_RESTRICT v){
         p->reserve(2*p->size() + add_length);
     serialise(p, num);
     
-    typename std::vector<T>::const_iterator i;
-    for(i = v.begin(); i != v.end(); i++)
-        serialise(p, *i);
+    impl::serialiseElements(p, v, is_bulk_serialisable<T>());
 }
 
 template<typename T>
@@ -242,16 +378,25 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::vector<T>& CA
     uint32_t num = 0;
     b += deserialise(p, b, num);
     
-    v.reserve(num);
     /* NB: assuming v is already clear */
-    for(uint32_t j = 0; j < num; j++){
-        T t;
-        b += deserialise(p, b, t);
-        v.push_back(t);
-    }
+    b += impl::deserialiseElements(p, b, num, v, is_bulk_serialisable<T>());
     return b - i;
 }
 
+template<typename T>
+inline uint32_t serialisedSize(std::vector<T> const& v){
+    return sizeof(uint32_t) + impl::serialisedElementsSize(v, is_bulk_serialisable<T>());
+}
+
+template<typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::vector<T> const*){
+    uint32_t num = 0;
+    deserialise(p, i, num);
+    return sizeof(uint32_t) + impl::serialisedElementsLength(
+        p, i + sizeof(uint32_t), num, (T const*)0, is_bulk_serialisable<T>()
+    );
+}
+
 template<typename T>
 inline std::string chil(std::vector<T> const& V){
     mkStr r;
@@ -288,6 +433,15 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::pair<S,T>& v)
     return b - i;
 }
 template<typename S, typename T>
+inline uint32_t serialisedSize(std::pair<S,T> const& v){
+    return serialisedSize(v.first) + serialisedSize(v.second);
+}
+template<typename S, typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::pair<S,T> const*){
+    const uint32_t first = serialisedLength(p, i, (S const*)0);
+    return first + serialisedLength(p, i + first, (T const*)0);
+}
+template<typename S, typename T>
 inline std::string chil(std::pair<S,T> const& v){
     return mkStr() << "(" << chil(v.first) << "," << chil(v.second) << ")";
 }
@@ -326,6 +480,25 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, std::map<S,T>& v){
     return b - i;
 }
 
+template<typename S, typename T>
+inline uint32_t serialisedSize(std::map<S,T> const& v){
+    uint32_t r = sizeof(int32_t);
+    typename std::map<S,T>::const_iterator i;
+    for(i = v.begin(); i != v.end(); i++)
+        r += serialisedSize(*i);
+    return r;
+}
+
+template<typename S, typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, std::map<S,T> const*){
+    int32_t num = 0;
+    uint32_t b = i;
+    b += deserialise(p, b, num);
+    for(int32_t j = 0; j < num; j++)
+        b += serialisedLength(p, b, (std::pair<S,T> const*)0);
+    return b - i;
+}
+
 template<typename S, typename T>
 inline std::string chil(std::map<S,T> const& V){
     mkStr r;
@@ -341,12 +514,15 @@ inline std::string chil(std::map<S,T> const& V){
 
 template<typename T, size_t Size>
 inline void serialise(svec_ptr_cref p, boost::array<T,Size> const& CAUV_RESTRICT v){
-    for(size_t i = 0; i < Size; i++)
-        serialise(p, v[i]);
+    impl::serialiseElements(p, v, is_bulk_serialisable<T>());
 }
 
 template<typename T, size_t Size>
 inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, boost::array<T,Size>& CAUV_RESTRICT v){
+    if(is_bulk_serialisable<T>::value){
+        std::memcpy(static_cast<void*>(v.data()), &((*p)[i]), Size * sizeof(T));
+        return Size * sizeof(T);
+    }
     int32_t b = i;
     for(size_t j = 0; j < Size; j++){
         b += deserialise(p, b, v[j]);
@@ -354,6 +530,16 @@ inline int32_t deserialise(const_svec_ptr_cref p, uint32_t i, boost::array<T,Siz
     return b - i;
 }
 
+template<typename T, size_t Size>
+inline uint32_t serialisedSize(boost::array<T,Size> const& v){
+    return impl::serialisedElementsSize(v, is_bulk_serialisable<T>());
+}
+
+template<typename T, size_t Size>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, boost::array<T,Size> const*){
+    return impl::serialisedElementsLength(p, i, Size, (T const*)0, is_bulk_serialisable<T>());
+}
+
 template<typename T, size_t Size>
 inline std::string chil(boost::array<T,Size> const& V){
     mkStr r;
@@ -366,6 +552,14 @@ inline std::string chil(boost::array<T,Size> const& V){
     return r << ")";
 }
 
+/* Types without a cheaper way of finding their length (the primitives,
+ * and included types) are just deserialised
+ */
+template<typename T>
+inline uint32_t serialisedLength(const_svec_ptr_cref p, uint32_t i, T const*){
+    T t;
+    return deserialise(p, i, t);
+}
 
 } // namespace cauv
 
@@ -0,0 +1,177 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#ifndef __CAUV_SERIALISED_VIEW_H__
+#define __CAUV_SERIALISED_VIEW_H__
+
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+
+#include <boost/array.hpp>
+
+#include "serialisation.h"
+
+namespace cauv{
+
+/* Read-only array of plain data elements (see is_bulk_serialisable), either
+ * in place in serialised bytes, or in a std::vector or boost::array.
+ *
+ * Serialised elements aren't necessarily aligned, so they're read with
+ * memcpy (which is a plain load wherever unaligned loads are allowed), and
+ * data() is only available if they happen to be aligned.
+ *
+ * A span of serialised bytes keeps those bytes alive, a span of a vector or
+ * array is only valid for as long as it is alive and unmodified.
+ */
+template<typename T>
+class SerialisedSpan{
+    static_assert(is_bulk_serialisable<T>::value, "SerialisedSpan of non-plain-data type");
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        class const_iterator{
+            public:
+                typedef std::random_access_iterator_tag iterator_category;
+                typedef T value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef T const* pointer;
+                typedef T reference;
+
+                const_iterator() : m_p(0){ }
+                explicit const_iterator(byte const* p) : m_p(p){ }
+
+                T operator*() const{ return load(m_p); }
+                T operator[](difference_type n) const{ return load(m_p + n * sizeof(T)); }
+                const_iterator& operator++(){ m_p += sizeof(T); return *this; }
+                const_iterator& operator--(){ m_p -= sizeof(T); return *this; }
+                const_iterator operator++(int){ const_iterator r(*this); ++*this; return r; }
+                const_iterator operator--(int){ const_iterator r(*this); --*this; return r; }
+                const_iterator& operator+=(difference_type n){ m_p += n * sizeof(T); return *this; }
+                const_iterator& operator-=(difference_type n){ m_p -= n * sizeof(T); return *this; }
+                const_iterator operator+(difference_type n) const{ return const_iterator(m_p + n * sizeof(T)); }
+                const_iterator operator-(difference_type n) const{ return const_iterator(m_p - n * sizeof(T)); }
+                difference_type operator-(const_iterator const& o) const{ return (m_p - o.m_p) / difference_type(sizeof(T)); }
+                bool operator==(const_iterator const& o) const{ return m_p == o.m_p; }
+                bool operator!=(const_iterator const& o) const{ return m_p != o.m_p; }
+                bool operator<(const_iterator const& o) const{ return m_p < o.m_p; }
+                bool operator>(const_iterator const& o) const{ return m_p > o.m_p; }
+                bool operator<=(const_iterator const& o) const{ return m_p <= o.m_p; }
+                bool operator>=(const_iterator const& o) const{ return m_p >= o.m_p; }
+
+            private:
+                byte const* m_p;
+        };
+
+        SerialisedSpan()
+            : m_bytes(), m_data(0), m_size(0){
+        }
+        /* num elements serialised at position i of p */
+        SerialisedSpan(const_svec_ptr_cref p, uint32_t i, uint32_t num)
+            : m_bytes(p->slice(i, num * sizeof(T))),
+              m_data(m_bytes.data()),
+              m_size(num){
+        }
+        SerialisedSpan(std::vector<T> const& v)
+            : m_bytes(),
+              m_data(v.empty()? 0 : reinterpret_cast<byte const*>(&v[0])),
+              m_size(v.size()){
+        }
+        template<size_t Size>
+        SerialisedSpan(boost::array<T, Size> const& v)
+            : m_bytes(),
+              m_data(reinterpret_cast<byte const*>(v.data())),
+              m_size(Size){
+        }
+
+        size_type size() const{ return m_size; }
+        bool empty() const{ return m_size == 0; }
+        T operator[](size_type i) const{ return load(m_data + i * sizeof(T)); }
+        T front() const{ return (*this)[0]; }
+        T back() const{ return (*this)[m_size-1]; }
+        const_iterator begin() const{ return const_iterator(m_data); }
+        const_iterator end() const{ return const_iterator(m_data + m_size * sizeof(T)); }
+
+        /* the elements' bytes, which are always safe to access */
+        byte const* bytes() const{ return m_data; }
+        size_type sizeInBytes() const{ return m_size * sizeof(T); }
+        /* NULL if the elements aren't suitably aligned to be accessed as Ts */
+        T const* data() const{
+            if(reinterpret_cast<std::size_t>(m_data) % alignof(T))
+                return 0;
+            return reinterpret_cast<T const*>(m_data);
+        }
+
+        std::vector<T> vec() const{
+            std::vector<T> r(m_size);
+            if(m_size)
+                std::memcpy(&r[0], m_data, sizeInBytes());
+            return r;
+        }
+
+    private:
+        static T load(byte const* p){
+            T r;
+            std::memcpy(&r, p, sizeof(T));
+            return r;
+        }
+
+        const_svec_ptr m_bytes;
+        byte const* m_data;
+        size_type m_size;
+};
+
+/* How a T is viewed in place: the generated view_* accessors of messages, and
+ * the generated <struct>View classes return SerialisedView<T>::type.
+ *
+ * By default a view is just a deserialised copy, arrays of plain data are
+ * SerialisedSpans, and generated structs specialise this to be viewed as
+ * their generated <struct>View, so that their fields are also read in place.
+ */
+template<typename T, typename Enable = void>
+struct SerialisedView{
+    typedef T type;
+    static type fromBytes(const_svec_ptr_cref p, uint32_t i){
+        T r;
+        deserialise(p, i, r);
+        return r;
+    }
+    static type fromValue(T const& v){
+        return v;
+    }
+};
+
+template<typename T>
+struct SerialisedView<std::vector<T>, typename std::enable_if<is_bulk_serialisable<T>::value>::type>{
+    typedef SerialisedSpan<T> type;
+    static type fromBytes(const_svec_ptr_cref p, uint32_t i){
+        uint32_t num = 0;
+        deserialise(p, i, num);
+        return type(p, i + sizeof(uint32_t), num);
+    }
+    static type fromValue(std::vector<T> const& v){
+        return type(v);
+    }
+};
+
+template<typename T, size_t Size>
+struct SerialisedView<boost::array<T, Size>, typename std::enable_if<is_bulk_serialisable<T>::value>::type>{
+    typedef SerialisedSpan<T> type;
+    static type fromBytes(const_svec_ptr_cref p, uint32_t i){
+        return type(p, i, Size);
+    }
+    static type fromValue(boost::array<T, Size> const& v){
+        return type(v);
+    }
+};
+
+} // namespace cauv
+
+#endif // ndef __CAUV_SERIALISED_VIEW_H__
+
@@ -79,6 +79,10 @@ T fromStr(const char* v){
 
 namespace cauv {
 std::string implode( const std::string& glue, const std::set<std::string>& pieces );
+
+// s as a quoted JSON string, with quotes, backslashes and control
+// characters escaped
+std::string jsonQuote( const std::string& s );
 }
 
 #endif // ndef __CAUV_UTILITY_STRING_H__
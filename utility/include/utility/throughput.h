@@ -23,12 +23,29 @@ class ThroughputCounter{
               m_time_ratio(0),
               m_data_rate(0),
               m_frequency(0),
+              m_queue_wait(0),
+              m_queued(false),
               m_mux(){
         }
+
+        // the work has been queued to start later: the time between this
+        // and start() is recorded as queue wait
+        void queued() {
+            lock_t l(m_mux);
+            m_last_queued_time = _now();
+            m_queued = true;
+        }
         
         void start() {
             lock_t l(m_mux);
             m_last_start_time = _now();
+            if(m_queued){
+                const boost::posix_time::time_duration diff = m_last_start_time - m_last_queued_time;
+                const float queue_wait = diff.total_seconds() + diff.fractional_seconds() / 1e6;
+                m_queue_wait = (1 - m_filter_alpha) * m_queue_wait +
+                                    m_filter_alpha  * queue_wait;
+                m_queued = false;
+            }
         }
         void success(float num_bits) {
             end(num_bits); 
@@ -82,6 +99,11 @@ class ThroughputCounter{
             return m_time_ratio;
         }
 
+        // in ms
+        float queue_wait() const{
+            return m_queue_wait * 1e3;
+        }
+
     private:
         static boost::posix_time::ptime _now(){
             return boost::posix_time::microsec_clock::universal_time();
@@ -92,10 +114,13 @@ class ThroughputCounter{
 
         boost::posix_time::ptime m_last_start_time;
         boost::posix_time::ptime m_last_end_time;
+        boost::posix_time::ptime m_last_queued_time;
         float m_time_taken;
         float m_time_ratio;
         float m_data_rate;
         float m_frequency;
+        float m_queue_wait;
+        bool m_queued;
 
         mutable mutex_t m_mux;
 };
@@ -0,0 +1,96 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#ifndef __CAUV_UTILITY_TRACE_H__
+#define __CAUV_UTILITY_TRACE_H__
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+
+#include <stdint.h>
+
+namespace cauv {
+namespace trace {
+
+/* Low-overhead tracing of short events (node execution, message sends...),
+ * for explaining latency spikes.
+ *
+ * Each thread records into its own fixed-size ring of events, which only
+ * that thread writes to, so recording takes no locks and never allocates
+ * (after a thread's first event). Old events are overwritten. When tracing
+ * is disabled (the default) a Scope costs one relaxed atomic load.
+ *
+ * dump() writes the events from every thread (including threads that have
+ * since exited) in the Chrome trace event format, which chrome://tracing and
+ * Perfetto (ui.perfetto.dev) can open.
+ *
+ * Names and categories must be string literals (or otherwise live forever):
+ * only the pointers are stored.
+ */
+
+typedef std::chrono::steady_clock trace_clock_t;
+
+extern std::atomic<bool> g_enabled;
+
+inline bool enabled(){
+    return g_enabled.load(std::memory_order_relaxed);
+}
+void enable(bool enable = true);
+
+// events recorded by each thread before older ones are overwritten
+static const unsigned Events_Per_Thread = 1 << 14;
+
+// record an event that's already finished; node < 0 for no node, frame 0
+// for no frame
+void complete(const char* name, const char* category,
+              trace_clock_t::time_point begin, trace_clock_t::time_point end,
+              int32_t node = -1, uint64_t frame = 0);
+
+// name the calling thread in dumped traces
+void setThreadName(std::string const& name);
+
+void dump(std::ostream& os);
+bool dump(std::string const& fname);
+
+// 64-bit frame identifier for the sequence numbers of a UID
+inline uint64_t frameId(int32_t seq1, int32_t seq2){
+    return (uint64_t(uint32_t(seq1)) << 32) | uint32_t(seq2);
+}
+
+// records an event covering its own lifetime
+class Scope{
+    public:
+        Scope(const char* name, const char* category, int32_t node = -1, uint64_t frame = 0)
+            : m_name(name), m_category(category), m_node(node), m_frame(frame),
+              m_active(enabled()), m_begin(){
+            if(m_active)
+                m_begin = trace_clock_t::now();
+        }
+        ~Scope(){
+            if(m_active)
+                complete(m_name, m_category, m_begin, trace_clock_t::now(), m_node, m_frame);
+        }
+
+        // for when the frame is only known after the event has started
+        void frame(uint64_t frame){ m_frame = frame; }
+
+    private:
+        Scope(Scope const&);
+        Scope& operator=(Scope const&);
+
+        const char* m_name;
+        const char* m_category;
+        int32_t m_node;
+        uint64_t m_frame;
+        bool m_active;
+        trace_clock_t::time_point m_begin;
+};
+
+} // namespace trace
+} // namespace cauv
+
+#endif // ndef __CAUV_UTILITY_TRACE_H__
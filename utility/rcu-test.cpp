@@ -0,0 +1,89 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+
+#include <iostream>
+#include <cassert>
+#include <atomic>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <utility/rcu.h>
+
+using namespace cauv;
+
+static std::atomic<int> deleted(0);
+
+struct Version{
+    Version(int value) : value(value), alive(true){ }
+    ~Version(){ alive = false; deleted++; }
+    int value;
+    std::atomic<bool> alive;
+};
+
+// With no readers, the replaced version is deleted straight away
+void testPublishReclaims(){
+    deleted = 0;
+    RCUPointer<Version> p(new Version(0));
+    p.publish(new Version(1));
+    assert(deleted == 1);
+    RCUPointer<Version>::Reader r(p);
+    assert(r->value == 1);
+}
+
+// A version replaced while a reader is using it stays valid until the reader
+// is done with it, and is then deleted without waiting for another publish
+void testLastReaderReclaims(){
+    deleted = 0;
+    RCUPointer<Version> p(new Version(0));
+    {
+        RCUPointer<Version>::Reader old_reader(p);
+        p.publish(new Version(1));
+        assert(deleted == 0);
+        {
+            RCUPointer<Version>::Reader new_reader(p);
+            assert(new_reader->value == 1);
+        }
+        assert(deleted == 0);
+        assert(old_reader->value == 0 && old_reader->alive);
+    }
+    assert(deleted == 1);
+}
+
+static void readLoop(RCUPointer<Version> const* p, std::atomic<bool>* stop){
+    int last = 0;
+    while(!*stop){
+        RCUPointer<Version>::Reader r(*p);
+        assert(r->alive);
+        assert(r->value >= last);
+        last = r->value;
+    }
+}
+
+// Readers never see deleted versions, and once they're all done only the
+// current version is left
+void testConcurrentReaders(){
+    const int Publishes = 20000;
+    deleted = 0;
+    RCUPointer<Version> p(new Version(0));
+    std::atomic<bool> stop(false);
+    boost::thread_group readers;
+    for(int i = 0; i < 4; i++)
+        readers.create_thread(boost::bind(readLoop, &p, &stop));
+    for(int i = 1; i <= Publishes; i++)
+        p.publish(new Version(i));
+    stop = true;
+    readers.join_all();
+    assert(deleted == Publishes);
+}
+
+int main(){
+    testPublishReclaims();
+    testLastReaderReclaims();
+    testConcurrentReaders();
+    std::cout << "PASS" << std::endl;
+    return 0;
+}
@@ -6,6 +6,8 @@
 
 #include <utility/string.h>
 
+#include <cstdio>
+
 std::string cauv::implode( const std::string& glue, const std::set<std::string>& pieces )
 {
     std::string a;
@@ -20,3 +22,23 @@ std::string cauv::implode( const std::string& glue, const std::set<std::string>&
     return a;
 }
 
+std::string cauv::jsonQuote( const std::string& s )
+{
+    std::string r;
+    r.reserve(s.size() + 2);
+    r += '"';
+    for (std::string::const_iterator i = s.begin(); i != s.end(); i++){
+        if (*i == '"' || *i == '\\'){
+            r += '\\';
+            r += *i;
+        }else if (uint8_t(*i) < 0x20){
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(uint8_t(*i)));
+            r += escaped;
+        }else{
+            r += *i;
+        }
+    }
+    r += '"';
+    return r;
+}
@@ -0,0 +1,189 @@
+/* Copyright 2013 Cambridge Hydronautics Ltd.
+ *
+ * See license.txt for details.
+ */
+
+#include <utility/trace.h>
+#include <utility/string.h>
+
+#include <map>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+using namespace cauv::trace;
+
+std::atomic<bool> cauv::trace::g_enabled(false);
+
+namespace {
+
+struct Event{
+    const char* name;
+    const char* category;
+    trace_clock_t::time_point begin;
+    trace_clock_t::duration duration;
+    int32_t node;
+    int32_t tid;
+    uint64_t frame;
+};
+
+// Written only by the thread that owns it. Readers copy events out and then
+// check that the writer hasn't lapped them while they were copying, so may
+// see (and will discard) torn events but never block the writer.
+struct Ring{
+    Ring() : events(Events_Per_Thread), head(0), in_use(true){ }
+    std::vector<Event> events;
+    // number of events ever written
+    std::atomic<uint64_t> head;
+    // set while a thread owns this ring: rings of threads that have exited
+    // are kept (with their events) and reused by new threads
+    std::atomic<bool> in_use;
+};
+
+struct Registry{
+    boost::mutex lock;
+    std::vector< boost::shared_ptr<Ring> > rings;
+    std::map<int32_t, std::string> thread_names;
+};
+
+Registry& registry(){
+    static Registry r;
+    return r;
+}
+
+void releaseRing(Ring* r){
+    r->in_use = false;
+}
+
+boost::thread_specific_ptr<Ring> t_ring_owner(releaseRing);
+__thread Ring* t_ring = NULL;
+__thread int32_t t_tid = 0;
+
+Ring* threadRing(){
+    if(t_ring)
+        return t_ring;
+    Registry& reg = registry();
+    boost::lock_guard<boost::mutex> l(reg.lock);
+    for(std::size_t i = 0; i < reg.rings.size() && !t_ring; i++){
+        bool in_use = false;
+        if(reg.rings[i]->in_use.compare_exchange_strong(in_use, true))
+            t_ring = reg.rings[i].get();
+    }
+    if(!t_ring){
+        reg.rings.push_back(boost::make_shared<Ring>());
+        t_ring = reg.rings.back().get();
+    }
+    t_ring_owner.reset(t_ring);
+    t_tid = syscall(SYS_gettid);
+    return t_ring;
+}
+
+bool beginsBefore(Event const& a, Event const& b){
+    return a.begin < b.begin;
+}
+
+double microseconds(trace_clock_t::duration d){
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+} // anonymous namespace
+
+void cauv::trace::enable(bool enable){
+    g_enabled = enable;
+}
+
+void cauv::trace::complete(const char* name, const char* category,
+                           trace_clock_t::time_point begin, trace_clock_t::time_point end,
+                           int32_t node, uint64_t frame){
+    Ring* r = threadRing();
+    const uint64_t head = r->head.load(std::memory_order_relaxed);
+    Event& e = r->events[head % Events_Per_Thread];
+    e.name = name;
+    e.category = category;
+    e.begin = begin;
+    e.duration = end - begin;
+    e.node = node;
+    e.tid = t_tid;
+    e.frame = frame;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+void cauv::trace::setThreadName(std::string const& name){
+    threadRing();
+    Registry& reg = registry();
+    boost::lock_guard<boost::mutex> l(reg.lock);
+    reg.thread_names[t_tid] = name;
+}
+
+void cauv::trace::dump(std::ostream& os){
+    std::vector<Event> events;
+    std::map<int32_t, std::string> thread_names;
+    {
+        Registry& reg = registry();
+        boost::lock_guard<boost::mutex> l(reg.lock);
+        thread_names = reg.thread_names;
+        for(std::size_t i = 0; i < reg.rings.size(); i++){
+            Ring const& r = *reg.rings[i];
+            const uint64_t head = r.head.load(std::memory_order_acquire);
+            uint64_t first = head > Events_Per_Thread? head - Events_Per_Thread : 0;
+            const std::size_t copied_from = events.size();
+            for(uint64_t j = first; j < head; j++)
+                events.push_back(r.events[j % Events_Per_Thread]);
+            // anything the writer may have overwritten while it was being
+            // copied (including the slot it's writing now) is dropped
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t head_after = r.head.load(std::memory_order_relaxed);
+            if(head_after + 1 > first + Events_Per_Thread){
+                const uint64_t lapped = std::min(head - first, head_after + 1 - Events_Per_Thread - first);
+                events.erase(events.begin() + copied_from, events.begin() + copied_from + lapped);
+            }
+        }
+    }
+
+    const trace_clock_t::time_point epoch = events.empty()? trace_clock_t::now() :
+        std::min_element(events.begin(), events.end(), beginsBefore)->begin;
+    const int pid = getpid();
+
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for(std::map<int32_t, std::string>::const_iterator i = thread_names.begin(); i != thread_names.end(); i++){
+        os << (first? "\n" : ",\n")
+           << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << i->first
+           << ",\"args\":{\"name\":";
+        os << jsonQuote(i->second);
+        os << "}}";
+        first = false;
+    }
+    os.precision(3);
+    os << std::fixed;
+    for(std::size_t i = 0; i < events.size(); i++){
+        Event const& e = events[i];
+        os << (first? "\n" : ",\n") << "{\"name\":";
+        os << jsonQuote(e.name) << ",\"cat\":" << jsonQuote(e.category)
+           << ",\"ph\":\"X\",\"ts\":" << microseconds(e.begin - epoch)
+           << ",\"dur\":" << microseconds(e.duration)
+           << ",\"pid\":" << pid << ",\"tid\":" << e.tid << ",\"args\":{";
+        if(e.node >= 0)
+            os << "\"node\":" << e.node << (e.frame? "," : "");
+        if(e.frame)
+            os << "\"frame\":\"" << std::hex << e.frame << std::dec << "\"";
+        os << "}}";
+        first = false;
+    }
+    os << "\n]}\n";
+}
+
+bool cauv::trace::dump(std::string const& fname){
+    std::ofstream f(fname.c_str());
+    if(!f)
+        return false;
+    dump(f);
+    return bool(f);
+}